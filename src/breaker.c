@@ -0,0 +1,129 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <hal/linux_log.h>
+
+#include "breaker.h"
+
+static void breaker_open(struct breaker *breaker, uint64_t now)
+{
+	if (breaker->state == BREAKER_CLOSED) {
+		hal_log_info("breaker: open, %u of %u operations failed",
+				breaker->failures, breaker->calls);
+		breaker->opens++;
+	}
+
+	breaker->state = BREAKER_OPEN;
+	breaker->opened = now;
+}
+
+static void breaker_close(struct breaker *breaker, uint64_t now)
+{
+	hal_log_info("breaker: closed");
+
+	breaker->state = BREAKER_CLOSED;
+	breaker->window_start = now;
+	breaker->calls = 0;
+	breaker->failures = 0;
+}
+
+void breaker_init(struct breaker *breaker, unsigned int threshold,
+					unsigned int open_time, uint64_t now)
+{
+	memset(breaker, 0, sizeof(*breaker));
+	breaker->threshold = threshold;
+	breaker->open_time = open_time;
+	breaker->window_start = now;
+}
+
+bool breaker_allow(struct breaker *breaker, uint64_t now, bool *probe)
+{
+	*probe = false;
+
+	switch (breaker->state) {
+	case BREAKER_CLOSED:
+		return true;
+	case BREAKER_OPEN:
+		if (now - breaker->opened < breaker->open_time)
+			break;
+
+		breaker->state = BREAKER_HALF_OPEN;
+		breaker->probes++;
+		*probe = true;
+		return true;
+	case BREAKER_HALF_OPEN:
+		break;
+	}
+
+	breaker->rejected++;
+
+	return false;
+}
+
+bool breaker_allow_connect(struct breaker *breaker, uint64_t now)
+{
+	if (breaker->state == BREAKER_CLOSED ||
+			(breaker->state == BREAKER_OPEN &&
+			now - breaker->opened >= breaker->open_time))
+		return true;
+
+	breaker->rejected++;
+
+	return false;
+}
+
+void breaker_record(struct breaker *breaker, uint64_t now, bool probe,
+								bool failed)
+{
+	if (probe) {
+		if (failed)
+			breaker_open(breaker, now);
+		else
+			breaker_close(breaker, now);
+		return;
+	}
+
+	/* Completed after the breaker opened: not accounted */
+	if (breaker->state != BREAKER_CLOSED)
+		return;
+
+	if (now - breaker->window_start >= BREAKER_WINDOW) {
+		breaker->window_start = now;
+		breaker->calls = 0;
+		breaker->failures = 0;
+	}
+
+	breaker->calls++;
+	if (failed)
+		breaker->failures++;
+
+	if (breaker->calls >= BREAKER_MIN_CALLS &&
+		breaker->failures * 100 >= breaker->threshold * breaker->calls)
+		breaker_open(breaker, now);
+}
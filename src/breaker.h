@@ -0,0 +1,63 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Circuit breaker of the upstream: opens when too many operations fail
+ * or are too slow, then lets a single probe through once 'open_time'
+ * elapsed before closing again. Times are in milliseconds, from a
+ * monotonic clock of the caller.
+ */
+
+/* Error rate measured over BREAKER_WINDOW, from BREAKER_MIN_CALLS */
+#define BREAKER_WINDOW		10000
+#define BREAKER_MIN_CALLS	10
+
+enum breaker_state {
+	BREAKER_CLOSED,			/* Operations issued */
+	BREAKER_OPEN,			/* Operations fail fast */
+	BREAKER_HALF_OPEN,		/* One probe issued, others fail fast */
+};
+
+struct breaker {
+	enum breaker_state state;
+	unsigned int threshold;		/* Failed operations, in percent */
+	unsigned int open_time;
+	uint64_t window_start;
+	unsigned int calls;
+	unsigned int failures;
+	uint64_t opened;
+
+	uint64_t opens;			/* Statistics */
+	uint64_t rejected;
+	uint64_t probes;
+};
+
+void breaker_init(struct breaker *breaker, unsigned int threshold,
+					unsigned int open_time, uint64_t now);
+
+/* False if the operation must fail fast, '*probe' set if it is the probe */
+bool breaker_allow(struct breaker *breaker, uint64_t now, bool *probe);
+/* Connecting is never the probe: the operation issued next is */
+bool breaker_allow_connect(struct breaker *breaker, uint64_t now);
+
+/* Outcome of an operation allowed, 'probe' as set by breaker_allow() */
+void breaker_record(struct breaker *breaker, uint64_t now, bool probe,
+								bool failed);
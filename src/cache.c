@@ -0,0 +1,477 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <ell/ell.h>
+
+#include <knot_types.h>
+#include <knot_protocol.h>
+#include <hal/linux_log.h>
+
+#include "stats.h"
+#include "cache.h"
+
+/*
+ * One file per device, named by its UUID and replaced as a whole: written
+ * to a temporary file first, then renamed. Tokens are never written: only
+ * a SHA-256 digest of the UUID and token.
+ */
+#define CACHE_MAGIC		"KNOTCRD1"
+#define DIGEST_LEN		32
+#define TMP_SUFFIX		".tmp"
+
+struct cache_header {
+	char magic[8];
+	uint32_t check;			/* FNV-1a of the fields after it */
+	uint16_t nschema;
+	uint16_t nconfig;
+	uint8_t digest[DIGEST_LEN];
+} __attribute__((packed));
+
+struct cache_entry {
+	uint8_t digest[DIGEST_LEN];
+	unsigned int nschema;
+	unsigned int nconfig;
+	knot_msg_schema *schema;
+	knot_msg_config *config;
+};
+
+static char *cache_path;
+static struct l_checksum *checksum;
+static struct l_hashmap *entries;	/* UUID: cache_entry */
+
+static uint64_t hits;
+static uint64_t misses;
+static uint64_t stored;
+static uint64_t invalidated;
+
+static uint32_t fnv(uint32_t hash, const void *data, size_t len)
+{
+	const uint8_t *byte = data;
+
+	for (; len; len--, byte++) {
+		hash ^= *byte;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static uint32_t entry_check(const struct cache_header *hdr,
+					const void *payload, size_t len)
+{
+	uint32_t hash = 2166136261U;
+
+	hash = fnv(hash, &hdr->nschema, sizeof(*hdr) -
+				offsetof(struct cache_header, nschema));
+
+	return fnv(hash, payload, len);
+}
+
+static size_t entry_payload_len(unsigned int nschema, unsigned int nconfig)
+{
+	return nschema * sizeof(knot_msg_schema) +
+				nconfig * sizeof(knot_msg_config);
+}
+
+static void entry_free(void *data)
+{
+	struct cache_entry *entry = data;
+
+	l_free(entry->schema);
+	l_free(entry->config);
+	l_free(entry);
+}
+
+static bool entry_equal(const struct cache_entry *a,
+					const struct cache_entry *b)
+{
+	return !memcmp(a->digest, b->digest, DIGEST_LEN) &&
+		a->nschema == b->nschema && a->nconfig == b->nconfig &&
+		!memcmp(a->schema, b->schema,
+				a->nschema * sizeof(*a->schema)) &&
+		!memcmp(a->config, b->config,
+				a->nconfig * sizeof(*a->config));
+}
+
+static int token_digest(const char *uuid, const char *token,
+							uint8_t *digest)
+{
+	l_checksum_reset(checksum);
+
+	if (!l_checksum_update(checksum, uuid, strlen(uuid)) ||
+			!l_checksum_update(checksum, token, strlen(token)) ||
+			l_checksum_get_digest(checksum, digest,
+						DIGEST_LEN) != DIGEST_LEN)
+		return -EIO;
+
+	return 0;
+}
+
+static char *entry_name(const char *uuid, const char *suffix)
+{
+	return l_strdup_printf("%s/%s%s", cache_path, uuid, suffix);
+}
+
+struct array_cursor {
+	uint8_t *pos;
+	size_t len;			/* Of each element */
+};
+
+static void copy_element(void *data, void *user_data)
+{
+	struct array_cursor *cursor = user_data;
+
+	memcpy(cursor->pos, data, cursor->len);
+	cursor->pos += cursor->len;
+}
+
+static void *array_from_queue(struct l_queue *queue, size_t len,
+							unsigned int *count)
+{
+	struct array_cursor cursor;
+	void *array;
+
+	*count = l_queue_length(queue);
+	if (!*count)
+		return NULL;
+
+	array = l_malloc(*count * len);
+	cursor.pos = array;
+	cursor.len = len;
+	l_queue_foreach(queue, copy_element, &cursor);
+
+	return array;
+}
+
+static struct l_queue *array_to_queue(const void *array, size_t len,
+							unsigned int count)
+{
+	struct l_queue *queue = l_queue_new();
+	const uint8_t *pos = array;
+
+	for (; count; count--, pos += len)
+		l_queue_push_tail(queue, l_memdup(pos, len));
+
+	return queue;
+}
+
+static int entry_write(const char *uuid, const struct cache_entry *entry)
+{
+	struct cache_header *hdr;
+	char *tmp, *name;
+	size_t payload_len, len;
+	uint8_t *buf;
+	ssize_t written;
+	int fd, err = 0;
+
+	payload_len = entry_payload_len(entry->nschema, entry->nconfig);
+	len = sizeof(*hdr) + payload_len;
+	buf = l_malloc(len);
+
+	hdr = (struct cache_header *) buf;
+	memcpy(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic));
+	hdr->nschema = entry->nschema;
+	hdr->nconfig = entry->nconfig;
+	memcpy(hdr->digest, entry->digest, DIGEST_LEN);
+	memcpy(hdr + 1, entry->schema,
+			entry->nschema * sizeof(*entry->schema));
+	memcpy(buf + sizeof(*hdr) + entry->nschema * sizeof(*entry->schema),
+			entry->config, entry->nconfig * sizeof(*entry->config));
+	hdr->check = entry_check(hdr, hdr + 1, payload_len);
+
+	tmp = entry_name(uuid, TMP_SUFFIX);
+	name = entry_name(uuid, "");
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		err = -errno;
+		goto done;
+	}
+
+	written = write(fd, buf, len);
+	if (written < 0)
+		err = -errno;
+	else if ((size_t) written != len)
+		err = -ENOSPC;
+	else if (fdatasync(fd) < 0)
+		err = -errno;
+
+	close(fd);
+
+	if (!err && rename(tmp, name) < 0)
+		err = -errno;
+
+	if (err < 0)
+		unlink(tmp);
+
+done:
+	if (err < 0)
+		hal_log_error("cache %s: %s(%d)", name, strerror(-err), -err);
+
+	l_free(tmp);
+	l_free(name);
+	l_free(buf);
+
+	return err;
+}
+
+static struct cache_entry *entry_read(const char *name)
+{
+	struct cache_header *hdr;
+	struct cache_entry *entry = NULL;
+	struct stat st;
+	uint8_t *buf = NULL;
+	size_t payload_len;
+	ssize_t len;
+	int fd;
+
+	fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(*hdr))
+		goto done;
+
+	buf = l_malloc(st.st_size);
+	len = read(fd, buf, st.st_size);
+	if (len != st.st_size)
+		goto done;
+
+	hdr = (struct cache_header *) buf;
+	payload_len = entry_payload_len(hdr->nschema, hdr->nconfig);
+	if (memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) ||
+			sizeof(*hdr) + payload_len != (size_t) len ||
+			hdr->check != entry_check(hdr, hdr + 1, payload_len))
+		goto done;
+
+	entry = l_new(struct cache_entry, 1);
+	memcpy(entry->digest, hdr->digest, DIGEST_LEN);
+	entry->nschema = hdr->nschema;
+	entry->nconfig = hdr->nconfig;
+	if (entry->nschema)
+		entry->schema = l_memdup(hdr + 1,
+				entry->nschema * sizeof(*entry->schema));
+	if (entry->nconfig)
+		entry->config = l_memdup(buf + sizeof(*hdr) +
+				entry->nschema * sizeof(*entry->schema),
+				entry->nconfig * sizeof(*entry->config));
+
+done:
+	close(fd);
+	l_free(buf);
+
+	return entry;
+}
+
+/* Loads the entries written before: damaged files are removed */
+static void load(void)
+{
+	struct cache_entry *entry;
+	struct dirent *dirent;
+	size_t len;
+	char *name;
+	DIR *dir;
+
+	dir = opendir(cache_path);
+	if (!dir)
+		return;
+
+	while ((dirent = readdir(dir)) != NULL) {
+		len = strlen(dirent->d_name);
+		if (len != KNOT_PROTOCOL_UUID_LEN &&
+			len != KNOT_PROTOCOL_UUID_LEN + strlen(TMP_SUFFIX))
+			continue;
+
+		name = l_strdup_printf("%s/%s", cache_path, dirent->d_name);
+
+		/* Interrupted write: the previous entry is still there */
+		entry = len == KNOT_PROTOCOL_UUID_LEN ? entry_read(name) : NULL;
+		if (entry)
+			l_hashmap_insert(entries, dirent->d_name, entry);
+		else
+			unlink(name);
+
+		l_free(name);
+	}
+
+	closedir(dir);
+
+	hal_log_info("cache: %u devices", l_hashmap_size(entries));
+}
+
+int cache_open(const char *path)
+{
+	int err;
+
+	if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+		err = -errno;
+		hal_log_error("cache %s: %s(%d)", path, strerror(-err), -err);
+		return err;
+	}
+
+	checksum = l_checksum_new(L_CHECKSUM_SHA256);
+	if (!checksum) {
+		hal_log_error("cache: SHA-256 not supported");
+		return -ENOTSUP;
+	}
+
+	cache_path = l_strdup(path);
+	entries = l_hashmap_string_new();
+
+	load();
+
+	stats_register("cache.hits", &hits);
+	stats_register("cache.misses", &misses);
+	stats_register("cache.stored", &stored);
+	stats_register("cache.invalidated", &invalidated);
+
+	return 0;
+}
+
+void cache_close(void)
+{
+	if (!entries)
+		return;
+
+	stats_unregister(&hits);
+	stats_unregister(&misses);
+	stats_unregister(&stored);
+	stats_unregister(&invalidated);
+
+	l_hashmap_destroy(entries, entry_free);
+	entries = NULL;
+	l_checksum_free(checksum);
+	checksum = NULL;
+	l_free(cache_path);
+	cache_path = NULL;
+}
+
+int cache_lookup(const char *uuid, const char *token,
+		struct l_queue **schema, struct l_queue **config)
+{
+	struct cache_entry *entry;
+	uint8_t digest[DIGEST_LEN];
+
+	if (!entries)
+		return -ENOENT;
+
+	entry = l_hashmap_lookup(entries, uuid);
+	if (!entry) {
+		misses++;
+		return -ENOENT;
+	}
+
+	if (token_digest(uuid, token, digest) < 0 ||
+			memcmp(digest, entry->digest, DIGEST_LEN)) {
+		misses++;
+		return -EACCES;
+	}
+
+	*schema = array_to_queue(entry->schema, sizeof(*entry->schema),
+							entry->nschema);
+	*config = array_to_queue(entry->config, sizeof(*entry->config),
+							entry->nconfig);
+	hits++;
+
+	return 0;
+}
+
+int cache_store(const char *uuid, const char *token,
+		struct l_queue *schema, struct l_queue *config)
+{
+	struct cache_entry *entry, *old;
+	int err;
+
+	if (!entries)
+		return 0;
+
+	entry = l_new(struct cache_entry, 1);
+	err = token_digest(uuid, token, entry->digest);
+	if (err < 0) {
+		entry_free(entry);
+		return err;
+	}
+
+	entry->schema = array_from_queue(schema, sizeof(*entry->schema),
+							&entry->nschema);
+	entry->config = array_from_queue(config, sizeof(*entry->config),
+							&entry->nconfig);
+
+	/* Nothing changed: the file is not written again */
+	old = l_hashmap_lookup(entries, uuid);
+	if (old && entry_equal(old, entry)) {
+		entry_free(entry);
+		return 0;
+	}
+
+	err = entry_write(uuid, entry);
+	if (err < 0) {
+		entry_free(entry);
+		cache_invalidate(uuid);
+		return err;
+	}
+
+	old = l_hashmap_remove(entries, uuid);
+	if (old)
+		entry_free(old);
+
+	l_hashmap_insert(entries, uuid, entry);
+	stored++;
+
+	return 0;
+}
+
+void cache_invalidate(const char *uuid)
+{
+	struct cache_entry *entry;
+	char *name;
+
+	if (!entries)
+		return;
+
+	entry = l_hashmap_remove(entries, uuid);
+	if (!entry)
+		return;
+
+	name = entry_name(uuid, "");
+	if (unlink(name) < 0 && errno != ENOENT)
+		hal_log_error("unlink(%s): %s(%d)", name, strerror(errno),
+									errno);
+	l_free(name);
+
+	entry_free(entry);
+	invalidated++;
+}
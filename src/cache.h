@@ -0,0 +1,40 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Credential cache: per device UUID, a digest of the token, the schema
+ * accepted by the cloud and the config confirmed by the device, kept on
+ * disk so that devices can be authenticated without the cloud.
+ */
+
+int cache_open(const char *path);
+void cache_close(void);
+
+/*
+ * Copies of the schema (knot_msg_schema) and config (knot_msg_config) of
+ * a device: -ENOENT if unknown, -EACCES if the token doesn't match.
+ */
+int cache_lookup(const char *uuid, const char *token,
+		struct l_queue **schema, struct l_queue **config);
+/* Replaces the entry of a device: 'config' holds confirmed config only */
+int cache_store(const char *uuid, const char *token,
+		struct l_queue *schema, struct l_queue *config);
+void cache_invalidate(const char *uuid);
@@ -0,0 +1,114 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ell/ell.h>
+
+#include <knot_protocol.h>
+
+#include "credfile.h"
+
+void credfile_write(FILE *fp, const char *uuid, const char *token)
+{
+	fprintf(fp, "%s %s\n", uuid, token);
+}
+
+int credfile_save(const char *path, credfile_write_cb write_cb,
+							void *user_data)
+{
+	char *tmp;
+	FILE *fp;
+	int fd;
+	int err = 0;
+
+	tmp = l_strdup_printf("%s.tmp", path);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		err = -errno;
+		goto done;
+	}
+
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		err = -errno;
+		close(fd);
+		unlink(tmp);
+		goto done;
+	}
+
+	write_cb(fp, user_data);
+
+	if (fflush(fp) || fdatasync(fileno(fp)) < 0)
+		err = -errno;
+
+	if (fclose(fp) && !err)
+		err = -errno;
+
+	if (!err && rename(tmp, path) < 0)
+		err = -errno;
+
+	if (err < 0)
+		unlink(tmp);
+
+done:
+	l_free(tmp);
+
+	return err;
+}
+
+int credfile_load(const char *path, credfile_read_cb read_cb,
+							void *user_data)
+{
+	char uuid[KNOT_PROTOCOL_UUID_LEN + 1];
+	char token[KNOT_PROTOCOL_TOKEN_LEN + 1];
+	char line[128];
+	FILE *fp;
+	int count = 0;
+
+	fp = fopen(path, "re");
+	if (!fp)
+		return errno == ENOENT ? 0 : -errno;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%36s %40s", uuid, token) != 2 ||
+				strlen(uuid) != KNOT_PROTOCOL_UUID_LEN ||
+				strlen(token) != KNOT_PROTOCOL_TOKEN_LEN)
+			continue;
+
+		read_cb(uuid, token, user_data);
+		count++;
+	}
+
+	fclose(fp);
+
+	return count;
+}
@@ -0,0 +1,44 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Device credentials kept on disk, one "uuid token" per line. The file is
+ * replaced as a whole and readable by its owner only: tokens are secrets.
+ */
+
+typedef void (*credfile_write_cb) (FILE *fp, void *user_data);
+typedef void (*credfile_read_cb) (const char *uuid, const char *token,
+							void *user_data);
+
+/* Writes a line: for 'write_cb' */
+void credfile_write(FILE *fp, const char *uuid, const char *token);
+
+/* Replaces 'path' with the lines of 'write_cb': 0 or a negative errno */
+int credfile_save(const char *path, credfile_write_cb write_cb,
+							void *user_data);
+
+/*
+ * Calls 'read_cb' for each valid line: returns the number of lines read, 0
+ * if 'path' doesn't exist, or a negative errno.
+ */
+int credfile_load(const char *path, credfile_read_cb read_cb,
+							void *user_data);
@@ -0,0 +1,362 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ell/ell.h>
+#include <json-c/json.h>
+
+#include <knot_protocol.h>
+#include <hal/linux_log.h>
+
+#include "settings.h"
+#include "proto.h"
+#include "stats.h"
+#include "json-writer.h"
+#include "credfile.h"
+#include "identity.h"
+
+/* Devices created at once: the pool is refilled gradually */
+#define CREATE_MAX		4
+#define CREATE_RETRY		30	/* Seconds */
+#define DEVICE_JSON_LEN		256
+
+struct identity {
+	char *uuid;
+	char *token;
+};
+
+static struct proto_ops *proto;
+static int proto_socket = -1;		/* Own connection to the cloud */
+static char *owner_uuid;
+static char *pool_path;
+static unsigned int pool_size;
+static struct l_queue *pool;		/* Oldest first */
+static unsigned int creating;
+static struct l_timeout *retry_timeout;
+
+static uint64_t created;
+static uint64_t claimed;
+static uint64_t failed;
+
+static void refill(void);
+
+static void identity_free(void *data)
+{
+	struct identity *identity = data;
+
+	l_free(identity->uuid);
+	l_free(identity->token);
+	l_free(identity);
+}
+
+static void write_identity(void *data, void *user_data)
+{
+	struct identity *identity = data;
+	FILE *fp = user_data;
+
+	credfile_write(fp, identity->uuid, identity->token);
+}
+
+static void write_pool(FILE *fp, void *user_data)
+{
+	l_queue_foreach(pool, write_identity, fp);
+}
+
+/* One identity per line: replaced as a whole */
+static int save(void)
+{
+	int err;
+
+	if (!pool_path)
+		return 0;
+
+	err = credfile_save(pool_path, write_pool, NULL);
+	if (err < 0)
+		hal_log_error("identity %s: %s(%d)", pool_path,
+						strerror(-err), -err);
+
+	return err;
+}
+
+static void read_identity(const char *uuid, const char *token,
+							void *user_data)
+{
+	struct identity *identity;
+
+	identity = l_new(struct identity, 1);
+	identity->uuid = l_strdup(uuid);
+	identity->token = l_strdup(token);
+	l_queue_push_tail(pool, identity);
+}
+
+static int load(void)
+{
+	int err;
+
+	err = credfile_load(pool_path, read_identity, NULL);
+	if (err < 0) {
+		hal_log_error("identity %s: %s(%d)", pool_path,
+						strerror(-err), -err);
+		return err;
+	}
+
+	hal_log_info("identity: %u in the pool", l_queue_length(pool));
+
+	return 0;
+}
+
+/* {"uuid": ..., "token": ...}: NULL if not a device */
+static struct identity *parse_identity(const char *json_str)
+{
+	json_object *jobj, *juuid, *jtoken;
+	struct identity *identity = NULL;
+	const char *uuid, *token;
+
+	jobj = json_tokener_parse(json_str);
+	if (!jobj)
+		return NULL;
+
+	if (!json_object_object_get_ex(jobj, "uuid", &juuid) ||
+			!json_object_object_get_ex(jobj, "token", &jtoken))
+		goto done;
+
+	uuid = json_object_get_string(juuid);
+	token = json_object_get_string(jtoken);
+	if (!uuid || !token || strlen(uuid) != KNOT_PROTOCOL_UUID_LEN ||
+			strlen(token) != KNOT_PROTOCOL_TOKEN_LEN)
+		goto done;
+
+	identity = l_new(struct identity, 1);
+	identity->uuid = l_strdup(uuid);
+	identity->token = l_strdup(token);
+
+done:
+	json_object_put(jobj);
+
+	return identity;
+}
+
+static void on_retry_timeout(struct l_timeout *timeout, void *user_data)
+{
+	l_timeout_remove(retry_timeout);
+	retry_timeout = NULL;
+
+	refill();
+}
+
+/* The connection is dropped: a new one is used by the next attempt */
+static void retry_later(void)
+{
+	if (proto_socket >= 0) {
+		proto->close(proto_socket);
+		proto_socket = -1;
+	}
+
+	if (!retry_timeout)
+		retry_timeout = l_timeout_create(CREATE_RETRY,
+					on_retry_timeout, NULL, NULL);
+}
+
+static void on_created(int err, const json_raw_t *json, void *user_data)
+{
+	struct identity *identity = NULL;
+
+	creating--;
+
+	/* Stopped meanwhile */
+	if (!pool)
+		return;
+
+	if (err == 0 && json->data)
+		identity = parse_identity(json->data);
+
+	if (!identity) {
+		hal_log_error("identity mknode: %s(%d)", strerror(-err), -err);
+		failed++;
+		retry_later();
+		return;
+	}
+
+	l_queue_push_tail(pool, identity);
+	save();
+	created++;
+
+	refill();
+}
+
+/* Unclaimed devices: owned by the gateway, patched once claimed */
+static char *create_device_string(void)
+{
+	struct json_writer w;
+
+	json_writer_init_alloc(&w, DEVICE_JSON_LEN);
+	json_writer_begin_object(&w);
+	json_writer_key(&w, "type");
+	json_writer_string(&w, "KNOTDevice");
+	json_writer_key(&w, "name");
+	json_writer_string(&w, "");
+	json_writer_key(&w, "id");
+	json_writer_int(&w, 0);
+	json_writer_key(&w, "owner");
+	json_writer_string(&w, owner_uuid);
+	json_writer_end_object(&w);
+
+	return json_writer_finish(&w);
+}
+
+static void refill(void)
+{
+	char *jstr;
+	int err;
+
+	if (retry_timeout)
+		return;
+
+	while (l_queue_length(pool) + creating < pool_size &&
+						creating < CREATE_MAX) {
+		if (proto_socket < 0) {
+			proto_socket = proto->connect();
+			if (proto_socket < 0) {
+				retry_later();
+				return;
+			}
+		}
+
+		jstr = create_device_string();
+		if (!jstr)
+			return;
+
+		err = proto->mknode(proto_socket, jstr, on_created, NULL);
+		l_free(jstr);
+		if (err < 0) {
+			hal_log_error("identity mknode: %s(%d)",
+						strerror(-err), -err);
+			failed++;
+			retry_later();
+			return;
+		}
+
+		creating++;
+	}
+}
+
+int identity_start(const struct settings *settings,
+					struct proto_ops *proto_ops)
+{
+	int err = 0;
+
+	proto = proto_ops;
+	pool_size = settings->identity_pool;
+	owner_uuid = l_strdup(settings->uuid);
+	pool = l_queue_new();
+
+	/* Written back at once: unusable files are found at startup */
+	if (settings->identity_path[0]) {
+		pool_path = l_strdup(settings->identity_path);
+		err = load();
+		if (!err)
+			err = save();
+	}
+
+	if (err < 0 && settings->identity_configured) {
+		l_queue_destroy(pool, identity_free);
+		pool = NULL;
+		l_free(pool_path);
+		pool_path = NULL;
+		l_free(owner_uuid);
+		owner_uuid = NULL;
+		return err;
+	}
+
+	/* Identities of the pool are lost on restart */
+	if (err < 0) {
+		l_free(pool_path);
+		pool_path = NULL;
+	}
+
+	stats_register("identity.created", &created);
+	stats_register("identity.claimed", &claimed);
+	stats_register("identity.failed", &failed);
+
+	refill();
+
+	return 0;
+}
+
+void identity_stop(void)
+{
+	if (!pool)
+		return;
+
+	stats_unregister(&created);
+	stats_unregister(&claimed);
+	stats_unregister(&failed);
+
+	l_timeout_remove(retry_timeout);
+	retry_timeout = NULL;
+
+	if (proto_socket >= 0) {
+		proto->close(proto_socket);
+		proto_socket = -1;
+	}
+
+	/* Kept on disk: claimed after a restart */
+	l_queue_destroy(pool, identity_free);
+	pool = NULL;
+	l_free(pool_path);
+	pool_path = NULL;
+	l_free(owner_uuid);
+	owner_uuid = NULL;
+}
+
+bool identity_claim(char **uuid, char **token)
+{
+	struct identity *identity;
+
+	if (!pool)
+		return false;
+
+	identity = l_queue_pop_head(pool);
+	if (!identity)
+		return false;
+
+	/* Never handed out twice: removed from disk first */
+	save();
+	claimed++;
+
+	*uuid = identity->uuid;
+	*token = identity->token;
+	l_free(identity);
+
+	refill();
+
+	return true;
+}
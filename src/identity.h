@@ -0,0 +1,32 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Pool of cloud devices created in advance, owned by the gateway and kept
+ * on disk until claimed by a registering device. Claimed identities are
+ * replaced in the background.
+ */
+int identity_start(const struct settings *settings,
+					struct proto_ops *proto_ops);
+void identity_stop(void);
+
+/* Takes an identity of the pool: 'uuid' and 'token' are owned by caller */
+bool identity_claim(char **uuid, char **token);
@@ -0,0 +1,351 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <ctype.h>
+#include <math.h>
+#include <string.h>
+
+#include <ell/ell.h>
+
+#include "json-writer.h"
+
+#define NUMBER_LEN		32	/* Common numbers: formatted once */
+
+/* Room for 'len' bytes and the terminating NUL */
+static bool reserve(struct json_writer *w, size_t len)
+{
+	size_t size;
+
+	if (w->err)
+		return false;
+
+	if (w->len + len < w->size)
+		return true;
+
+	if (!w->grow) {
+		w->err = -EMSGSIZE;
+		return false;
+	}
+
+	size = w->size ? w->size : 64;
+	while (w->len + len >= size)
+		size *= 2;
+
+	w->buf = l_realloc(w->buf, size);
+	w->size = size;
+
+	return true;
+}
+
+static void put(struct json_writer *w, const char *data, size_t len)
+{
+	if (!reserve(w, len))
+		return;
+
+	memcpy(w->buf + w->len, data, len);
+	w->len += len;
+}
+
+static void put_char(struct json_writer *w, char c)
+{
+	if (!reserve(w, 1))
+		return;
+
+	w->buf[w->len++] = c;
+}
+
+/* Comma between values, unless the value follows its key */
+static void separator(struct json_writer *w)
+{
+	uint32_t bit;
+
+	if (w->key) {
+		w->key = false;
+		return;
+	}
+
+	if (!w->depth)
+		return;
+
+	bit = 1U << (w->depth - 1);
+	if (w->nonempty & bit)
+		put_char(w, ',');
+
+	w->nonempty |= bit;
+}
+
+static void put_escaped(struct json_writer *w, const char *str, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	char esc[6] = { '\\', 'u', '0', '0' };
+	size_t i, start = 0;
+	unsigned char c;
+
+	put_char(w, '"');
+
+	for (i = 0; i < len; i++) {
+		c = str[i];
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+
+		put(w, str + start, i - start);
+		start = i + 1;
+
+		switch (c) {
+		case '"':
+			put(w, "\\\"", 2);
+			break;
+		case '\\':
+			put(w, "\\\\", 2);
+			break;
+		case '\b':
+			put(w, "\\b", 2);
+			break;
+		case '\f':
+			put(w, "\\f", 2);
+			break;
+		case '\n':
+			put(w, "\\n", 2);
+			break;
+		case '\r':
+			put(w, "\\r", 2);
+			break;
+		case '\t':
+			put(w, "\\t", 2);
+			break;
+		default:
+			esc[4] = hex[c >> 4];
+			esc[5] = hex[c & 0x0f];
+			put(w, esc, sizeof(esc));
+			break;
+		}
+	}
+
+	put(w, str + start, len - start);
+	put_char(w, '"');
+}
+
+void json_writer_init(struct json_writer *w, char *buf, size_t size)
+{
+	memset(w, 0, sizeof(*w));
+	w->buf = buf;
+	w->size = size;
+}
+
+void json_writer_init_alloc(struct json_writer *w, size_t hint)
+{
+	memset(w, 0, sizeof(*w));
+	w->grow = true;
+	reserve(w, hint);
+}
+
+static void begin(struct json_writer *w, char c)
+{
+	separator(w);
+
+	if (w->depth == JSON_WRITER_MAX_DEPTH) {
+		w->err = -EINVAL;
+		return;
+	}
+
+	put_char(w, c);
+	w->depth++;
+	w->nonempty &= ~(1U << (w->depth - 1));
+}
+
+static void end(struct json_writer *w, char c)
+{
+	if (!w->depth || w->key) {
+		w->err = -EINVAL;
+		return;
+	}
+
+	w->depth--;
+	put_char(w, c);
+}
+
+void json_writer_begin_object(struct json_writer *w)
+{
+	begin(w, '{');
+}
+
+void json_writer_end_object(struct json_writer *w)
+{
+	end(w, '}');
+}
+
+void json_writer_begin_array(struct json_writer *w)
+{
+	begin(w, '[');
+}
+
+void json_writer_end_array(struct json_writer *w)
+{
+	end(w, ']');
+}
+
+void json_writer_key(struct json_writer *w, const char *key)
+{
+	if (w->key || !w->depth) {
+		w->err = -EINVAL;
+		return;
+	}
+
+	separator(w);
+	put_escaped(w, key, strlen(key));
+	put_char(w, ':');
+	w->key = true;
+}
+
+void json_writer_string(struct json_writer *w, const char *str)
+{
+	separator(w);
+	put_escaped(w, str, strlen(str));
+}
+
+void json_writer_stringn(struct json_writer *w, const char *str, size_t len)
+{
+	separator(w);
+	put_escaped(w, str, strnlen(str, len));
+}
+
+void json_writer_int(struct json_writer *w, int64_t value)
+{
+	char number[NUMBER_LEN];
+	int len;
+
+	separator(w);
+	len = snprintf(number, sizeof(number), "%" PRId64, value);
+	put(w, number, len);
+}
+
+void json_writer_fixed(struct json_writer *w, double value,
+							unsigned int decimals)
+{
+	char number[NUMBER_LEN];
+	int len;
+
+	separator(w);
+
+	/* Not representable in JSON */
+	if (!isfinite(value)) {
+		put(w, "null", 4);
+		return;
+	}
+
+	if (decimals > 17)
+		decimals = 17;
+
+	len = snprintf(number, sizeof(number), "%.*f", decimals, value);
+	if (len < (int) sizeof(number)) {
+		put(w, number, len);
+		return;
+	}
+
+	/* Large magnitudes: formatted in place */
+	if (!reserve(w, len))
+		return;
+
+	snprintf(w->buf + w->len, len + 1, "%.*f", decimals, value);
+	w->len += len;
+}
+
+void json_writer_bool(struct json_writer *w, bool value)
+{
+	separator(w);
+
+	if (value)
+		put(w, "true", 4);
+	else
+		put(w, "false", 5);
+}
+
+void json_writer_raw(struct json_writer *w, const char *json)
+{
+	separator(w);
+	put(w, json, strlen(json));
+}
+
+void json_writer_merge(struct json_writer *w, const char *json)
+{
+	const char *first, *last;
+
+	if (!w->depth || w->key) {
+		w->err = -EINVAL;
+		return;
+	}
+
+	first = json;
+	last = json + strlen(json);
+
+	while (first < last && isspace((unsigned char) *first))
+		first++;
+	while (last > first && isspace((unsigned char) last[-1]))
+		last--;
+
+	if (last - first < 2 || *first != '{' || last[-1] != '}') {
+		w->err = -EINVAL;
+		return;
+	}
+
+	/* Members only */
+	first++;
+	last--;
+
+	while (first < last && isspace((unsigned char) *first))
+		first++;
+	while (last > first && isspace((unsigned char) last[-1]))
+		last--;
+
+	if (first == last)
+		return;
+
+	separator(w);
+	put(w, first, last - first);
+}
+
+char *json_writer_finish(struct json_writer *w)
+{
+	if (!w->err && (w->depth || w->key))
+		w->err = -EINVAL;
+
+	if (!reserve(w, 0)) {
+		if (w->grow) {
+			l_free(w->buf);
+			w->buf = NULL;
+		}
+
+		return NULL;
+	}
+
+	w->buf[w->len] = '\0';
+
+	return w->buf;
+}
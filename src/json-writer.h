@@ -0,0 +1,70 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Append-only JSON writer: values are serialized straight into a buffer,
+ * without building a tree. Separators are written by the writer. Errors
+ * are sticky and reported by json_writer_finish().
+ */
+
+#define JSON_WRITER_MAX_DEPTH	16
+
+struct json_writer {
+	char *buf;
+	size_t size;
+	size_t len;
+	bool grow;			/* 'buf' is reallocated as needed */
+	bool key;			/* Value of a member expected */
+	int err;			/* 0 or a negative errno */
+	unsigned int depth;
+	uint32_t nonempty;		/* Bit per depth: separator needed */
+};
+
+/* Writes into 'buf': fails with -EMSGSIZE if 'size' is not enough */
+void json_writer_init(struct json_writer *w, char *buf, size_t size);
+/* Writes into a growing buffer: released with l_free() */
+void json_writer_init_alloc(struct json_writer *w, size_t hint);
+
+void json_writer_begin_object(struct json_writer *w);
+void json_writer_end_object(struct json_writer *w);
+void json_writer_begin_array(struct json_writer *w);
+void json_writer_end_array(struct json_writer *w);
+void json_writer_key(struct json_writer *w, const char *key);
+
+void json_writer_string(struct json_writer *w, const char *str);
+/* At most 'len' bytes of 'str': for fixed size fields of the protocol */
+void json_writer_stringn(struct json_writer *w, const char *str, size_t len);
+void json_writer_int(struct json_writer *w, int64_t value);
+/* Fixed-point notation with 'decimals' digits after the point */
+void json_writer_fixed(struct json_writer *w, double value,
+							unsigned int decimals);
+void json_writer_bool(struct json_writer *w, bool value);
+/* Value already serialized */
+void json_writer_raw(struct json_writer *w, const char *json);
+/* Members of a serialized object, into the object being written */
+void json_writer_merge(struct json_writer *w, const char *json);
+
+/*
+ * Returns the NUL-terminated document, or NULL if any call failed or an
+ * object or array was left open: 'err' holds the reason. A growing buffer
+ * is released on failure.
+ */
+char *json_writer_finish(struct json_writer *w);
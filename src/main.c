@@ -28,6 +28,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include <glib.h>
 
@@ -121,13 +122,27 @@ static void _g_main_loop_run()
 	g_main_loop_unref(main_loop);
 }
 
+#define NOBODY			65534
+
 static int run_as_nobody()
 {
-	if (setuid(65534))
+	if (setuid(NOBODY))
 		return -errno;
 	return 0;
 }
 
+/* Default location of the files kept by knotd: owned by nobody */
+static int create_state_dir(const char *path, int nobody)
+{
+	if (mkdir(path, 0700) < 0 && errno != EEXIST)
+		return -errno;
+
+	if (nobody && chown(path, NOBODY, NOBODY) < 0)
+		return -errno;
+
+	return 0;
+}
+
 static int detach()
 {
 	if (daemon(0, 0))
@@ -146,6 +161,12 @@ int main(int argc, char *argv[])
 	hal_log_init("knotd", settings->detach);
 	hal_log_info("KNOT Gateway");
 
+	/* Features using it are disabled if it fails */
+	err = create_state_dir(settings->state_dir, settings->run_as_nobody);
+	if (err)
+		hal_log_error("Failed to create %s. %s (%d)",
+				settings->state_dir, strerror(-err), -err);
+
 	/* Set user id to nobody */
 	if (settings->run_as_nobody) {
 		err = run_as_nobody();
@@ -28,6 +28,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -46,19 +47,26 @@
 #include "msg.h"
 #include "dbus.h"
 #include "proxy.h"
+#include "stats.h"
+#include "provision.h"
 #include "manager.h"
 
 static struct proto_ops *selected_protocol;
+static size_t rx_buffer_size;
+
+/* RegisterDevices or UnregisterDevices waiting for its reply */
+static struct l_dbus_message *provision_msg;
+static const char *provision_name;
 
 static bool on_accepted_cb(struct node_ops *node_ops, int client_socket)
 {
 	int err;
 
-	err = session_create(node_ops, selected_protocol, client_socket, msg_process);
-	if (err < 0) {
-		/* FIXME: Stop knotd if cloud if not available */
+	/* Doesn't depend on the cloud: connected on the first request */
+	err = session_create(node_ops, selected_protocol, client_socket,
+				rx_buffer_size, msg_process, msg_node_closed);
+	if (err < 0)
 		close(client_socket);
-	}
 
 	return true;
 }
@@ -115,8 +123,230 @@ static bool property_get_token(struct l_dbus *dbus,
 	return true;
 }
 
+static void append_counter(const char *name, uint64_t value,
+							void *user_data)
+{
+	struct l_dbus_message_builder *builder = user_data;
+
+	l_dbus_message_builder_enter_dict(builder, "st");
+	l_dbus_message_builder_append_basic(builder, 's', name);
+	l_dbus_message_builder_append_basic(builder, 't', &value);
+	l_dbus_message_builder_leave_dict(builder);
+}
+
+static bool property_get_statistics(struct l_dbus *dbus,
+				  struct l_dbus_message *msg,
+				  struct l_dbus_message_builder *builder,
+				  void *user_data)
+{
+	l_dbus_message_builder_enter_array(builder, "{st}");
+	stats_foreach(append_counter, builder);
+	l_dbus_message_builder_leave_array(builder);
+
+	return true;
+}
+
+static struct l_dbus_message *error_invalid_args(struct l_dbus_message *msg)
+{
+	return l_dbus_message_new_error(msg, KNOT_SERVICE ".InvalidArguments",
+					"Invalid arguments in method call");
+}
+
+static void on_provision_progress(unsigned int done, unsigned int total,
+							void *user_data)
+{
+	struct l_dbus_message_builder *builder;
+	struct l_dbus_message *signal;
+
+	signal = l_dbus_message_new_signal(dbus_get_bus(), "/",
+					   SETTINGS_INTERFACE,
+					   "ProvisionProgress");
+	builder = l_dbus_message_builder_new(signal);
+	l_dbus_message_builder_append_basic(builder, 's', provision_name);
+	l_dbus_message_builder_append_basic(builder, 'u', &done);
+	l_dbus_message_builder_append_basic(builder, 'u', &total);
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	l_dbus_send(dbus_get_bus(), signal);
+}
+
+static void on_registered(struct provision_device *devices,
+				unsigned int count, void *user_data)
+{
+	struct l_dbus_message_builder *builder;
+	struct l_dbus_message *reply;
+	const char *uuid, *token;
+	unsigned int i;
+
+	reply = l_dbus_message_new_method_return(provision_msg);
+	builder = l_dbus_message_builder_new(reply);
+	l_dbus_message_builder_enter_array(builder, "(tss)");
+
+	/* Failed devices have no credentials */
+	for (i = 0; i < count; i++) {
+		uuid = devices[i].err ? "" : devices[i].uuid;
+		token = devices[i].err ? "" : devices[i].token;
+
+		l_dbus_message_builder_enter_struct(builder, "tss");
+		l_dbus_message_builder_append_basic(builder, 't',
+							&devices[i].id);
+		l_dbus_message_builder_append_basic(builder, 's', uuid);
+		l_dbus_message_builder_append_basic(builder, 's', token);
+		l_dbus_message_builder_leave_struct(builder);
+	}
+
+	l_dbus_message_builder_leave_array(builder);
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	l_dbus_send(dbus_get_bus(), reply);
+	l_dbus_message_unref(provision_msg);
+	provision_msg = NULL;
+
+	provision_devices_free(devices, count);
+}
+
+static void on_unregistered(struct provision_device *devices,
+				unsigned int count, void *user_data)
+{
+	struct l_dbus_message_builder *builder;
+	struct l_dbus_message *reply;
+	unsigned int i;
+	bool removed;
+
+	reply = l_dbus_message_new_method_return(provision_msg);
+	builder = l_dbus_message_builder_new(reply);
+	l_dbus_message_builder_enter_array(builder, "(sb)");
+
+	for (i = 0; i < count; i++) {
+		removed = devices[i].err == 0;
+
+		l_dbus_message_builder_enter_struct(builder, "sb");
+		l_dbus_message_builder_append_basic(builder, 's',
+							devices[i].uuid);
+		l_dbus_message_builder_append_basic(builder, 'b', &removed);
+		l_dbus_message_builder_leave_struct(builder);
+	}
+
+	l_dbus_message_builder_leave_array(builder);
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	l_dbus_send(dbus_get_bus(), reply);
+	l_dbus_message_unref(provision_msg);
+	provision_msg = NULL;
+
+	provision_devices_free(devices, count);
+}
+
+static struct provision_device *device_append(
+				struct provision_device *devices,
+				unsigned int *count)
+{
+	/* Doubled when a power of two is reached */
+	if (*count >= 8 && !(*count & (*count - 1)))
+		devices = l_realloc(devices,
+			*count * 2 * sizeof(struct provision_device));
+	else if (!*count)
+		devices = l_new(struct provision_device, 8);
+
+	memset(&devices[*count], 0, sizeof(struct provision_device));
+	(*count)++;
+
+	return devices;
+}
+
+static struct l_dbus_message *method_register_devices(struct l_dbus *dbus,
+						struct l_dbus_message *msg,
+						void *user_data)
+{
+	struct provision_device *devices = NULL;
+	struct l_dbus_message_iter iter;
+	unsigned int count = 0;
+	const char *name;
+	uint64_t id;
+	int err;
+
+	if (provision_msg)
+		return dbus_error_busy(msg);
+
+	if (!l_dbus_message_get_arguments(msg, "a(ts)", &iter))
+		return error_invalid_args(msg);
+
+	while (l_dbus_message_iter_next_entry(&iter, &id, &name)) {
+		devices = device_append(devices, &count);
+		devices[count - 1].id = id;
+		devices[count - 1].name = l_strdup(name);
+	}
+
+	err = provision_register(devices, count, on_provision_progress,
+							on_registered, NULL);
+	if (err < 0) {
+		provision_devices_free(devices, count);
+		return err == -EBUSY ? dbus_error_busy(msg) :
+						error_invalid_args(msg);
+	}
+
+	hal_log_info("RegisterDevices(%u)", count);
+
+	provision_msg = l_dbus_message_ref(msg);
+	provision_name = "register";
+
+	return NULL;
+}
+
+static struct l_dbus_message *method_unregister_devices(struct l_dbus *dbus,
+						struct l_dbus_message *msg,
+						void *user_data)
+{
+	struct provision_device *devices = NULL;
+	struct l_dbus_message_iter iter;
+	const char *uuid, *token;
+	unsigned int count = 0;
+	int err;
+
+	if (provision_msg)
+		return dbus_error_busy(msg);
+
+	if (!l_dbus_message_get_arguments(msg, "a(ss)", &iter))
+		return error_invalid_args(msg);
+
+	while (l_dbus_message_iter_next_entry(&iter, &uuid, &token)) {
+		devices = device_append(devices, &count);
+		devices[count - 1].uuid = l_strdup(uuid);
+		devices[count - 1].token = l_strdup(token);
+	}
+
+	err = provision_unregister(devices, count, on_provision_progress,
+							on_unregistered, NULL);
+	if (err < 0) {
+		provision_devices_free(devices, count);
+		return err == -EBUSY ? dbus_error_busy(msg) :
+						error_invalid_args(msg);
+	}
+
+	hal_log_info("UnregisterDevices(%u)", count);
+
+	provision_msg = l_dbus_message_ref(msg);
+	provision_name = "unregister";
+
+	return NULL;
+}
+
 static void setup_interface(struct l_dbus_interface *interface)
 {
+	l_dbus_interface_method(interface, "RegisterDevices", 0,
+				method_register_devices, "a(tss)", "a(ts)",
+				"credentials", "devices");
+
+	l_dbus_interface_method(interface, "UnregisterDevices", 0,
+				method_unregister_devices, "a(sb)", "a(ss)",
+				"removed", "devices");
+
+	l_dbus_interface_signal(interface, "ProvisionProgress", 0, "suu",
+				"operation", "done", "total");
+
 	if (!l_dbus_interface_property(interface, "Port", 0, "q",
 				       property_get_port,
 				       NULL))
@@ -136,6 +366,11 @@ static void setup_interface(struct l_dbus_interface *interface)
 				       property_get_token,
 				       NULL))
 		hal_log_error("Can't add 'URL' property");
+
+	if (!l_dbus_interface_property(interface, "Statistics", 0, "a{st}",
+				       property_get_statistics,
+				       NULL))
+		hal_log_error("Can't add 'Statistics' property");
 }
 
 
@@ -144,6 +379,8 @@ int manager_start(const struct settings *settings)
 	const char *path = "/";
 	int err;
 
+	rx_buffer_size = settings->rx_buffer_size;
+
 	err = proto_start(settings, &selected_protocol);
 	if (err < 0)
 		return err;
@@ -152,10 +389,15 @@ int manager_start(const struct settings *settings)
 	if (err < 0)
 		goto fail_node;
 
-	err = msg_start(settings->uuid, selected_protocol);
+	err = msg_start(settings, selected_protocol, session_send,
+							session_close);
 	if (err < 0)
 		goto fail_msg;
 
+	err = provision_start(settings, selected_protocol);
+	if (err < 0)
+		goto fail_provision;
+
 	err = dbus_start();
 	if (err)
 		goto fail_dbus;
@@ -185,6 +427,8 @@ int manager_start(const struct settings *settings)
 	return proxy_start();
 
 fail_dbus:
+	provision_stop();
+fail_provision:
 	msg_stop();
 fail_msg:
 	node_stop();
@@ -198,10 +442,17 @@ void manager_stop(void)
 {
 	proxy_stop();
 
+	/* Not answered: knotd is leaving the bus */
+	if (provision_msg) {
+		l_dbus_message_unref(provision_msg);
+		provision_msg = NULL;
+	}
+
 	l_dbus_unregister_interface(dbus_get_bus(),
 				    SETTINGS_INTERFACE);
 	dbus_stop();
 	session_destroy_all();
+	provision_stop();
 	msg_stop();
 	node_stop();
 	proto_stop();
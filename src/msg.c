@@ -35,6 +35,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/socket.h>
 
 #include <ell/ell.h>
@@ -47,32 +48,75 @@
 
 #include "settings.h"
 #include "proto.h"
+#include "stats.h"
+#include "store.h"
+#include "json-writer.h"
+#include "cache.h"
+#include "identity.h"
+#include "reaper.h"
 #include "msg.h"
 
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 
+/* Initial size of the outbound documents, per entry */
+#define DATA_JSON_LEN		96
+#define SCHEMA_JSON_LEN		128
+#define DEVICE_JSON_LEN		256
+
 struct config {
 	knot_msg_config kmcfg;		/* knot_message_config from cloud */
-	char *hash;			/* Checksum of kmcfg */
 	bool confirmed;
 };
 
 struct proto_watch;
 
+/* Samples of a device waiting to be forwarded to the cloud */
+struct data_batch {
+	struct store_sample *samples;	/* Up to 'batch_samples' */
+	unsigned int count;
+	uint64_t since;			/* First sample: milliseconds */
+	struct l_timeout *timeout;
+};
+
+/* Schema of a sensor, validated once when the schema is accepted */
+struct trust_sensor {
+	const knot_msg_schema *schema;	/* NULL: unknown sensor */
+	bool valid;			/* Type, value type and unit match */
+	uint8_t value_type;
+	bool cached;			/* Set once a value is forwarded */
+	knot_data last;			/* Last value forwarded */
+	uint64_t last_time;		/* When 'last' was forwarded: ms */
+};
+
 struct trust {
 	int refs;
 	pid_t	pid;			/* Peer PID */
 	uint64_t id;			/* Session identification */
 	bool rollback;		/* Remove from cloud if true */
+	int node_socket;
 	char *uuid;			/* Device UUID */
 	char *token;			/* Device token */
 	struct l_queue *schema;			/* knot_schema accepted by cloud */
+	struct trust_sensor *sensors;		/* 'schema' by sensor_id */
+	unsigned int nsensors;
+	uint64_t schema_digest;			/* Of 'schema': canonical */
 	struct l_queue *schema_tmp;		/*
 					* knot_schema to be submitted to cloud
 					*/
+	struct l_timeout *schema_timeout;	/* Transfer of 'schema_tmp' */
 	struct l_queue *config;			/* knot_config accepted from cloud */
+	/*
+	 * Shadow of the "get_data" and "set_data" lists of the device, fed
+	 * by sign-in and the watch: NULL if unknown.
+	 */
+	json_object *get_data;
+	json_object *set_data;
+	struct data_batch batch;	/* Acknowledged, not sent yet */
+	struct l_timeout *replay_timeout;	/* Store: retry to send */
+	unsigned int replay_attempts;		/* Of the oldest samples */
+	struct l_timeout *revalidate_timeout;	/* Cache: retry sign-in */
 	const struct proto_ops *proto_ops; /* Cloud driver */
-	struct l_io *proto_io;		/* Cloud IO channel */
+	int proto_socket;		/* Cloud handle: owned by session */
 	struct proto_watch *proto_watch;
 };
 
@@ -82,34 +126,133 @@ struct proto_watch {
 	struct trust *trust;
 };
 
+struct batch_flush;
+
+/* Sample of a batch sent as its own data document */
+struct flush_sample {
+	struct batch_flush *flush;
+	unsigned int index;
+};
+
+/* Batch sent to the cloud, waiting for the response */
+struct batch_flush {
+	struct trust *trust;
+	struct store_sample *samples;
+	unsigned int count;
+	uint64_t since;
+	bool replay;			/* Samples read from the store */
+	int *errs;			/* Result of each sample */
+	struct flush_sample *slots;	/* Sent one by one */
+	unsigned int pending;		/* Samples not answered yet */
+};
+
+/* No response PDU is transmitted to the node */
+#define RESPONSE_NONE		0x00
+
+/*
+ * State of a request received from a node: processing a PDU may span
+ * several cloud operations, chained by their completion callbacks.
+ */
+struct msg_request {
+	int node_socket;
+	int proto_socket;
+	bool replied;			/* Response delivered */
+	bool closed;			/* Node socket closed meanwhile */
+	knot_msg krsp;			/* Response PDU */
+	msg_reply_cb reply_cb;
+	void *user_data;
+	struct trust *trust;		/* Trust referenced by the request */
+	char *uuid;			/* Credentials being verified */
+	char *token;
+	uint64_t device_id;
+	pid_t pid;
+	uint8_t sensor_id;
+	uint8_t value_type;
+	knot_data value;
+	const char *list_key;		/* "get_data" or "set_data" */
+	json_object *list;		/* Written: shadow once accepted */
+	void (*list_updated) (struct msg_request *req);
+	char *patch;			/* Device fields set once signed in */
+};
+
 /* Maps sockets to sessions: online devices only.  */
 static struct l_hashmap *trust_map;
 
+/* Requests not freed yet: marked when their node socket is closed */
+static struct l_queue *requests;
+
 /* IoT protocol: http or ws */
 static struct proto_ops *proto;
+static msg_push_cb push;
+static msg_close_cb close_node;
 
 static char owner_uuid[KNOT_PROTOCOL_UUID_LEN + 1];
 
+/* Telemetry batching: disabled if 'batch_samples' is 0 */
+static unsigned int batch_samples;
+static unsigned int batch_interval;		/* Milliseconds */
+static bool batch_document;			/* One document per batch */
+static uint64_t batch_flushes;
+static uint64_t batch_flushed;			/* Samples sent */
+static uint64_t batch_dropped;			/* Samples not sent */
+static uint64_t data_rejected;			/* Refused by the cloud */
+static uint64_t replay_dropped;			/* Stored, never accepted */
+static uint64_t batch_latency;			/* Sum, in milliseconds */
+
+/* Samples filtered by the config of the sensor */
+static uint64_t data_forwarded;
+static uint64_t data_suppressed;
+
+/* Store-and-forward: samples replayed per request, retry in seconds */
+#define REPLAY_BATCH		32
+#define REPLAY_RETRY		30
+#define REPLAY_ATTEMPTS		120	/* Dropped after about an hour */
+
+/* Replay in progress by device UUID */
+static struct l_hashmap *replays;
+
+/* Schema fragments are dropped if the transfer doesn't end in time */
+#define SCHEMA_TIMEOUT		10
+static uint64_t schema_unchanged;
+static uint64_t schema_timeouts;
+
+/*
+ * Cloud operations in flight, shared by the requests for the same device
+ * received from different sockets (e.g. retransmits after a reconnect).
+ */
+struct inflight {
+	const struct msg_request *leader;	/* Started the operation */
+	struct l_queue *waiters;		/* Answered as the leader */
+};
+
+static struct l_hashmap *auths;		/* Device UUID: inflight */
+static struct l_hashmap *registers;	/* Device id: inflight */
+static uint64_t auth_coalesced;
+static uint64_t register_coalesced;
+static uint64_t identity_unpatched;
+
+/* Devices authenticated from the cache: signed in to the cloud afterwards */
+#define REVALIDATE_RETRY	30
+static uint64_t auth_revoked;
+
 /* Message processing */
-static int8_t msg_register(int sock, int proto_sock,
-	const knot_msg_register *kreq, size_t ilen,
-	knot_msg_credential *krsp);
-static int8_t msg_unregister(int sock, int proto_sock);
-static int8_t msg_data(int sock, int proto_sock,
-	const knot_msg_data *kmdata);
-static int8_t msg_auth(int sock, int proto_sock,
-	const knot_msg_authentication *kmauth);
-static int8_t msg_schema(int sock, int proto_sock,
-	const knot_msg_schema *kmsch, bool eof);
-static struct l_queue *msg_config(int sock, json_raw_t json, ssize_t *result);
-static int8_t msg_config_resp(int sock, const knot_msg_item *rsp);
-static struct l_queue *msg_setdata(int sock, json_raw_t json, ssize_t *result);
-static int8_t msg_setdata_resp(int sock, int proto_sock,
-	const knot_msg_data *kmdata);
-static struct l_queue *msg_getdata(int sock, json_raw_t json, ssize_t *result);
+static struct l_queue *msg_config(int sock, json_object *device,
+							ssize_t *result);
+static struct l_queue *msg_setdata(int sock, json_object *device,
+							ssize_t *result);
+static struct l_queue *msg_getdata(int sock, json_object *device,
+							ssize_t *result);
 static int fw_push(int sock, knot_msg *kmsg);
 static struct trust *trust_ref(struct trust *trust);
 static void trust_unref(struct trust *trust);
+static void trust_lists_update(struct trust *trust, json_object *device);
+static void msg_unregister(struct msg_request *req);
+static void trust_batch_flush(struct trust *trust);
+static void trust_replay(struct trust *trust);
+static void trust_cache_update(struct trust *trust);
+static void msg_request_free(struct msg_request *req);
+static void msg_request_complete(struct msg_request *req, int8_t result);
+static uint64_t schema_digest(struct l_queue *schema);
 
 static void queue_concat(struct l_queue *queue, struct l_queue *with)
 {
@@ -139,26 +282,79 @@ done:
 	return clone;
 }
 
-static char *compute_checksum_for_string(enum l_checksum_type type,
-	const char *string, size_t length)
+/* Deep copy: 'size' bytes of each entry */
+static struct l_queue *queue_dup(struct l_queue *queue, size_t size)
 {
-	char *result = NULL;
-	struct l_checksum *checksum;
+	const struct l_queue_entry *entry;
+	struct l_queue *dup;
+
+	if (!queue)
+		return NULL;
+
+	dup = l_queue_new();
+	for (entry = l_queue_get_entries(queue); entry; entry = entry->next)
+		l_queue_push_tail(dup, l_memdup(entry->data, size));
 
-	checksum = l_checksum_new(type);
-	if (!checksum)
-		goto fail_create;
+	return dup;
+}
 
-	if (!l_checksum_update(checksum, string, length)) {
-		goto fail_update;
+/*
+ * Joins the operation in flight for the same device: returns false if
+ * 'req' has to start it, and is the leader then.
+ */
+static bool inflight_join(struct l_hashmap *table, const char *key,
+						struct msg_request *req)
+{
+	struct inflight *inflight;
+
+	inflight = l_hashmap_lookup(table, key);
+	if (!inflight) {
+		inflight = l_new(struct inflight, 1);
+		inflight->leader = req;
+		inflight->waiters = l_queue_new();
+		l_hashmap_insert(table, key, inflight);
+		return false;
 	}
 
-	result = l_checksum_get_string(checksum);
+	/* Other credentials: the answer could be different */
+	if (req->token && strcmp(req->token, inflight->leader->token))
+		return false;
+
+	l_queue_push_tail(inflight->waiters, req);
+
+	return true;
+}
+
+/* Ends the operation of 'req': returns the requests that joined it */
+static struct l_queue *inflight_leave(struct l_hashmap *table,
+				const char *key, const struct msg_request *req)
+{
+	struct inflight *inflight;
+	struct l_queue *waiters;
+
+	inflight = l_hashmap_lookup(table, key);
+	if (!inflight || inflight->leader != req)
+		return NULL;
+
+	l_hashmap_remove(table, key);
+	waiters = inflight->waiters;
+	l_free(inflight);
+
+	return waiters;
+}
+
+static void inflight_free(void *data)
+{
+	struct inflight *inflight = data;
+
+	l_queue_destroy(inflight->waiters,
+			(l_queue_destroy_func_t) msg_request_free);
+	l_free(inflight);
+}
 
-fail_update:
-	l_checksum_free(checksum);
-fail_create:
-	return result;
+static void device_id_key(uint64_t device_id, char *key)
+{
+	sprintf(key, "%016" PRIx64, device_id);
 }
 
 static void send_message(void *data, void *user_data)
@@ -173,22 +369,22 @@ static void send_message(void *data, void *user_data)
 }
 
 /*
- * Callback that parses the JSON for config (and in the future, send data)
- * messages. It is called from the protocol that is used to communicate with
- * the cloud (e.g. http, websocket).
+ * Callback that gets the config, set_data and get_data messages from the
+ * device document, parsed once by the protocol that is used to communicate
+ * with the cloud (e.g. http, websocket).
  */
-static void on_device_changed(json_raw_t device_message, void *user_data)
+static void device_changed(struct trust *trust, int node_socket,
+							json_object *device)
 {
-	const struct proto_watch *watch = user_data;
-	int node_socket;
 	ssize_t result;
 	struct l_queue *config_messages, *setdata_messages, *getdata_messages;
 	struct l_queue *messages = NULL;
 
-	node_socket = l_io_get_fd(watch->node_io);
-	config_messages = msg_config(node_socket, device_message, &result);
-	setdata_messages = msg_setdata(node_socket, device_message, &result);
-	getdata_messages = msg_getdata(node_socket, device_message, &result);
+	trust_lists_update(trust, device);
+
+	config_messages = msg_config(node_socket, device, &result);
+	setdata_messages = msg_setdata(node_socket, device, &result);
+	getdata_messages = msg_getdata(node_socket, device, &result);
 
 	messages = l_queue_new();
 	queue_concat(messages, config_messages);
@@ -206,6 +402,16 @@ static void on_device_changed(json_raw_t device_message, void *user_data)
 	l_queue_destroy(setdata_messages, NULL);
 	l_queue_destroy(getdata_messages, NULL);
 	l_queue_destroy(messages, l_free);
+
+	/* Config replaced: confirmed config only is kept in the cache */
+	trust_cache_update(trust);
+}
+
+static void on_device_changed(json_object *device, void *user_data)
+{
+	const struct proto_watch *watch = user_data;
+
+	device_changed(watch->trust, l_io_get_fd(watch->node_io), device);
 }
 
 static void on_device_watch_destroyed(void *user_data)
@@ -222,7 +428,7 @@ static struct proto_watch *create_device_watch(struct trust *trust,
 	struct proto_watch *proto_watch;
 	int proto_socket;
 
-	proto_socket = l_io_get_fd(trust->proto_io);
+	proto_socket = trust->proto_socket;
 
 	proto_watch = l_new(struct proto_watch, 1);
 	proto_watch->id = proto->async(proto_socket,
@@ -245,7 +451,7 @@ static void remove_device_watch(struct proto_watch *proto_watch)
 {
 	int proto_socket;
 
-	proto_socket = l_io_get_fd(proto_watch->trust->proto_io);
+	proto_socket = proto_watch->trust->proto_socket;
 	proto->async_stop(proto_socket, proto_watch->id);
 }
 
@@ -253,7 +459,6 @@ static void config_free(void *data)
 {
 	struct config *cfg = data;
 
-	l_free(cfg->hash);
 	l_free(cfg);
 }
 
@@ -309,19 +514,113 @@ static void trust_unref(struct trust *trust)
 	if (atomic_fetch_sub(&trust->refs, 1) > 1)
 		return;
 
-	l_io_destroy(trust->proto_io);
 	l_free(trust->uuid);
 	l_free(trust->token);
+	l_free(trust->sensors);
+	json_object_put(trust->get_data);
+	json_object_put(trust->set_data);
+	l_timeout_remove(trust->batch.timeout);
+	l_timeout_remove(trust->replay_timeout);
+	l_timeout_remove(trust->revalidate_timeout);
+	l_timeout_remove(trust->schema_timeout);
+	l_free(trust->batch.samples);
+	batch_dropped += trust->batch.count;
 	l_queue_destroy(trust->schema, l_free);
 	l_queue_destroy(trust->schema_tmp, l_free);
 	l_queue_destroy(trust->config, config_free);
 	l_free(trust);
 }
 
+static struct msg_request *msg_request_new(int node_socket,
+	int proto_socket, uint8_t rtype, msg_reply_cb reply_cb,
+	void *user_data)
+{
+	struct msg_request *req;
+
+	req = l_new(struct msg_request, 1);
+	req->node_socket = node_socket;
+	req->proto_socket = proto_socket;
+	req->reply_cb = reply_cb;
+	req->user_data = user_data;
+	req->krsp.hdr.type = rtype;
+	/* Default payload length: result only */
+	req->krsp.hdr.payload_len = sizeof(req->krsp.action.result);
+
+	l_queue_push_tail(requests, req);
+
+	return req;
+}
+
+static void msg_request_free(struct msg_request *req)
+{
+	l_queue_remove(requests, req);
+
+	if (req->trust)
+		trust_unref(req->trust);
+
+	l_free(req->uuid);
+	l_free(req->token);
+	l_free(req->patch);
+	json_object_put(req->list);
+	l_free(req);
+}
+
+/* Response is delivered once: the request may outlive it */
+static void msg_request_reply(struct msg_request *req, int8_t result)
+{
+	size_t olen = 0;
+
+	if (req->replied)
+		return;
+
+	req->replied = true;
+
+	if (!req->reply_cb)
+		return;
+
+	if (req->krsp.hdr.type != RESPONSE_NONE) {
+		req->krsp.action.result = result;
+		olen = sizeof(req->krsp.hdr) + req->krsp.hdr.payload_len;
+	}
+
+	req->reply_cb(&req->krsp, olen, req->user_data);
+}
+
+static void msg_request_complete(struct msg_request *req, int8_t result)
+{
+	msg_request_reply(req, result);
+	msg_request_free(req);
+}
+
+struct uuid_lookup {
+	const struct trust *trust;
+	bool found;
+};
+
+static void find_uuid(const void *key, void *value, void *user_data)
+{
+	const struct trust *trust = value;
+	struct uuid_lookup *lookup = user_data;
+
+	if (trust != lookup->trust &&
+			!strcmp(trust->uuid, lookup->trust->uuid))
+		lookup->found = true;
+}
+
+/* Another socket of the same device is online */
+static bool trust_is_shared(const struct trust *trust)
+{
+	struct uuid_lookup lookup = { .trust = trust, .found = false };
+
+	l_hashmap_foreach(trust_map, find_uuid, &lookup);
+
+	return lookup.found;
+}
+
 static void on_node_channel_disconnected(struct l_io *channel, void *used_data)
 {
 	struct trust *trust;
-	int node_socket, proto_socket;
+	int node_socket;
 
 	node_socket = l_io_get_fd(channel);
 
@@ -329,18 +628,23 @@ static void on_node_channel_disconnected(struct l_io *channel, void *used_data)
 	if (!trust)
 		return;
 
-	/* Zombie device: registration not complete */
-	if (trust->rollback) {
-		proto_socket = l_io_get_fd(trust->proto_io);
-		if (msg_unregister(node_socket, proto_socket) != KNOT_SUCCESS) {
-			hal_log_info("Rollback failed UUID: %s", trust->uuid);
-		}
+	/*
+	 * Zombie device: registration not complete. Registrations joined
+	 * from other sockets share the same cloud device. Removed in the
+	 * background: nobody is waiting for the response.
+	 */
+	if (trust->rollback && !trust_is_shared(trust)) {
+		hal_log_info("Rollback UUID: %s", trust->uuid);
+		reaper_add(trust->uuid, trust->token);
 	}
 
 	if (trust->proto_watch) {
 		remove_device_watch(trust->proto_watch);
 	}
 
+	/* Acknowledged samples: last chance to send them */
+	trust_batch_flush(trust);
+
 	trust_map_remove(node_socket);
 }
 
@@ -362,8 +666,89 @@ static struct l_io *create_node_channel(int node_socket, struct trust *trust)
 	return channel;
 }
 
-static void trust_create(int node_socket, int proto_socket, char *uuid,
-	char *token, uint64_t device_id, pid_t pid, bool rollback,
+static void max_sensor_id(void *data, void *user_data)
+{
+	const knot_msg_schema *schema = data;
+	unsigned int *nsensors = user_data;
+
+	if (schema->sensor_id >= *nsensors)
+		*nsensors = schema->sensor_id + 1;
+}
+
+static void index_sensor(void *data, void *user_data)
+{
+	const knot_msg_schema *schema = data;
+	struct trust_sensor *sensor;
+	struct trust *trust = user_data;
+
+	/* Duplicated sensor ids: the first one is used */
+	sensor = &trust->sensors[schema->sensor_id];
+	if (sensor->schema)
+		return;
+
+	sensor->schema = schema;
+	sensor->value_type = schema->values.value_type;
+	sensor->valid = knot_schema_is_valid(schema->values.type_id,
+			schema->values.value_type, schema->values.unit) == 0;
+}
+
+/* Rebuilds the sensor table: called whenever 'schema' changes */
+static void trust_sensors_update(struct trust *trust)
+{
+	unsigned int nsensors = 0;
+
+	l_free(trust->sensors);
+	trust->sensors = NULL;
+	trust->schema_digest = schema_digest(trust->schema);
+
+	l_queue_foreach(trust->schema, max_sensor_id, &nsensors);
+	trust->nsensors = nsensors;
+	if (!nsensors)
+		return;
+
+	trust->sensors = l_new(struct trust_sensor, nsensors);
+	l_queue_foreach(trust->schema, index_sensor, trust);
+}
+
+static json_object **trust_list(struct trust *trust, const char *key)
+{
+	return strcmp(key, "get_data") == 0 ? &trust->get_data :
+							&trust->set_data;
+}
+
+static void trust_list_replace(struct trust *trust, const char *key,
+							json_object *jarray)
+{
+	json_object **jlist = trust_list(trust, key);
+
+	json_object_put(*jlist);
+	*jlist = jarray;
+}
+
+/* Refreshes the shadow lists from a device document of the cloud */
+static void trust_lists_update(struct trust *trust, json_object *device)
+{
+	static const char *keys[] = { "get_data", "set_data" };
+	json_object *jarray;
+	unsigned int i;
+
+	if (!device)
+		return;
+
+	/* Missing list: nothing pending */
+	for (i = 0; i < L_ARRAY_SIZE(keys); i++) {
+		if (json_object_object_get_ex(device, keys[i], &jarray) &&
+			json_object_get_type(jarray) == json_type_array)
+			jarray = json_object_get(jarray);
+		else
+			jarray = json_object_new_array();
+
+		trust_list_replace(trust, keys[i], jarray);
+	}
+}
+
+static struct trust *trust_create(int node_socket, int proto_socket,
+	char *uuid, char *token, uint64_t device_id, pid_t pid, bool rollback,
 	struct l_queue *schema, struct l_queue *config)
 {
 	struct trust *trust;
@@ -375,13 +760,15 @@ static void trust_create(int node_socket, int proto_socket, char *uuid,
 	trust->id = device_id;
 	trust->pid = pid;
 	trust->rollback = rollback;
+	trust->node_socket = node_socket;
 	trust->schema = schema;
+	trust_sensors_update(trust);
 	trust->config = config;
 	/*
 	 * TODO: find a better way to store a reference to the cloud as if it
 	 * disconnects we won't recover.
 	 */
-	trust->proto_io = l_io_new(proto_socket);
+	trust->proto_socket = proto_socket;
 
 	trust_map_replace(node_socket, trust);
 
@@ -390,6 +777,11 @@ static void trust_create(int node_socket, int proto_socket, char *uuid,
 
 	/* Add watch to device changes in the cloud */
 	trust->proto_watch = create_device_watch(trust, node_channel);
+
+	/* Data kept while the cloud was unreachable */
+	trust_replay(trust);
+
+	return trust;
 }
 
 static bool schema_sensor_id_cmp(const void *entry_data, const void *user_data)
@@ -400,18 +792,21 @@ static bool schema_sensor_id_cmp(const void *entry_data, const void *user_data)
 	return sensor_id == schema->sensor_id;
 }
 
-static knot_msg_schema *trust_get_sensor_schema(const struct trust *trust,
+static const struct trust_sensor *trust_get_sensor(const struct trust *trust,
 	unsigned int sensor_id)
 {
-	return l_queue_find(trust->schema,
-		schema_sensor_id_cmp,
-		L_UINT_TO_PTR(sensor_id));
+	if (sensor_id >= trust->nsensors ||
+				!trust->sensors[sensor_id].schema)
+		return NULL;
+
+	return &trust->sensors[sensor_id];
 }
 
 static void trust_sensor_schema_free(struct trust *trust)
 {
 	l_queue_destroy(trust->schema, l_free);
 	trust->schema = NULL;
+	trust_sensors_update(trust);
 }
 
 static knot_msg_schema *trust_get_sensor_schema_tmp(const struct trust *trust,
@@ -427,12 +822,17 @@ static void trust_sensor_schema_tmp_add(struct trust *trust,
 {
 	knot_msg_schema *schema_copy;
 
+	if (!trust->schema_tmp)
+		trust->schema_tmp = l_queue_new();
+
 	schema_copy = l_memdup(schema, sizeof(*schema));
 	l_queue_push_tail(trust->schema_tmp, schema_copy);
 }
 
 static void trust_sensor_schema_tmp_free(struct trust *trust)
 {
+	l_timeout_remove(trust->schema_timeout);
+	trust->schema_timeout = NULL;
 	l_queue_destroy(trust->schema_tmp, l_free);
 	trust->schema_tmp = NULL;
 }
@@ -442,6 +842,26 @@ static void trust_sensor_schema_complete(struct trust *trust)
 	trust_sensor_schema_free(trust);
 	trust->schema = trust->schema_tmp;
 	trust->schema_tmp = NULL;
+	trust_sensors_update(trust);
+}
+
+static void on_schema_timeout(struct l_timeout *timeout, void *user_data)
+{
+	struct trust *trust = user_data;
+
+	hal_log_info("Schema transfer timed out UUID: %s", trust->uuid);
+	schema_timeouts++;
+	trust_sensor_schema_tmp_free(trust);
+}
+
+/* Restarted by each fragment of the schema */
+static void trust_schema_timeout(struct trust *trust)
+{
+	if (trust->schema_timeout)
+		l_timeout_modify(trust->schema_timeout, SCHEMA_TIMEOUT);
+	else
+		trust->schema_timeout = l_timeout_create(SCHEMA_TIMEOUT,
+					on_schema_timeout, trust, NULL);
 }
 
 static void trust_config_update(struct trust *trust, struct l_queue *config)
@@ -468,60 +888,105 @@ static void trust_config_confirm(struct trust *trust, uint8_t sensor_id)
 		config_item->confirmed = true;
 }
 
+static void confirmed_config(void *data, void *user_data)
+{
+	struct config *config = data;
+	struct l_queue *list = user_data;
+
+	if (config->confirmed)
+		l_queue_push_tail(list, &config->kmcfg);
+}
+
+/* Keeps the cache in sync with the schema and the confirmed config */
+static void trust_cache_update(struct trust *trust)
+{
+	struct l_queue *config;
+
+	/* Not authenticated without schema */
+	if (l_queue_isempty(trust->schema)) {
+		cache_invalidate(trust->uuid);
+		return;
+	}
+
+	config = l_queue_new();
+	l_queue_foreach(trust->config, confirmed_config, config);
+	cache_store(trust->uuid, trust->token, trust->schema, config);
+	l_queue_destroy(config, NULL);
+}
+
+/* Credentials rejected by the cloud: the device must authenticate again */
+static void trust_revoke(struct trust *trust)
+{
+	int node_socket = trust->node_socket;
+
+	cache_invalidate(trust->uuid);
+
+	if (trust->proto_watch)
+		remove_device_watch(trust->proto_watch);
+
+	trust_map_remove(node_socket);
+
+	/* Requests of the node were accepted with the cached credentials */
+	if (close_node)
+		close_node(node_socket);
+}
+
 /*
  * TODO: consider making this part of proto-ws.c signin()
  */
-static int proto_rmnode(int proto_socket, const char *uuid, const char *token)
+static int proto_rmnode(struct msg_request *req, const char *uuid,
+	const char *token, proto_cb_t cb)
 {
-	int result, err;
-	json_raw_t response = { NULL, 0 };
+	int err;
 
-	err = proto->rmnode(proto_socket, uuid, token, &response);
+	err = proto->rmnode(req->proto_socket, uuid, token, cb, req);
 	if (err < 0) {
-		result = KNOT_CLOUD_FAILURE;
 		hal_log_error("rmnode() failed %s (%d)", strerror(-err), -err);
-		goto done;
+		return KNOT_CLOUD_FAILURE;
 	}
 
-	result = KNOT_SUCCESS;
-
-done:
-	if (response.data)
-		free(response.data);
-	return result;
+	return KNOT_SUCCESS;
 }
 
-static int8_t msg_unregister(int node_socket, int proto_socket)
+static void on_unregister_done(int err, const json_raw_t *json,
+							void *user_data)
 {
-	int8_t result;	
-	const struct trust *trust;
+	struct msg_request *req = user_data;
 
-	trust = trust_map_get(node_socket);
-	if (!trust) {
-		hal_log_info("Permission denied!");
-		result = KNOT_CREDENTIAL_UNAUTHORIZED;
-		goto done;
+	if (err < 0) {
+		hal_log_error("rmnode() failed %s (%d)", strerror(-err), -err);
+		hal_log_info("Unregister failed UUID: %s", req->trust->uuid);
+		msg_request_complete(req, KNOT_CLOUD_FAILURE);
+		return;
 	}
 
-	hal_log_info("rmnode: %.36s", trust->uuid);
-	result = proto_rmnode(proto_socket, trust->uuid, trust->token);
-	if (result != KNOT_SUCCESS)
-		goto done;
+	cache_invalidate(req->trust->uuid);
 
-	trust_map_remove(node_socket);
-	result = KNOT_SUCCESS;
+	/* Node socket may have been closed and reused meanwhile */
+	if (trust_map_get(req->node_socket) == req->trust)
+		trust_map_remove(req->node_socket);
 
-done:
-	return result;
+	msg_request_complete(req, KNOT_SUCCESS);
 }
 
-static char *checksum_config(json_object *jobjkey)
+static void msg_unregister(struct msg_request *req)
 {
-	const char *c;
+	int8_t result;
+	struct trust *trust;
 
-	c = json_object_to_json_string(jobjkey);
+	trust = trust_map_get(req->node_socket);
+	if (!trust) {
+		hal_log_info("Permission denied!");
+		msg_request_complete(req, KNOT_CREDENTIAL_UNAUTHORIZED);
+		return;
+	}
 
-	return compute_checksum_for_string(L_CHECKSUM_SHA1, c, strlen(c));
+	hal_log_info("rmnode: %.36s", trust->uuid);
+	req->trust = trust_ref(trust);
+	result = proto_rmnode(req, trust->uuid, trust->token,
+						on_unregister_done);
+	if (result != KNOT_SUCCESS)
+		msg_request_complete(req, result);
 }
 
 /*
@@ -670,15 +1135,14 @@ done:
 	return err;
 }
 
-static struct l_queue *parse_device_schema(const char *json_str)
+static struct l_queue *parse_device_schema(json_object *jobj)
 {
-	json_object *jobj, *jobjarray, *jobjentry, *jobjkey;
+	json_object *jobjarray, *jobjentry, *jobjkey;
 	struct l_queue *list = NULL;
 	knot_msg_schema *entry;
 	int sensor_id, value_type, unit, type_id, i;
 	const char *name;
 
-	jobj = json_tokener_parse(json_str);
 	if (!jobj)
 		return NULL;
 
@@ -769,8 +1233,6 @@ done:
 	 * TODO: should done label be used only for the error case
 	 * as in parse_device_config() and parse_device_setdata()?
 	 */
-	json_object_put(jobj);
-
 	if (l_queue_isempty(list)) {
 		l_queue_destroy(list, NULL);
 		list = NULL;
@@ -785,16 +1247,15 @@ done:
  * The mandatory fields "sensor_id" and "event_flags" are missing.
  * Any field that is sent has the wrong type.
  */
-static struct l_queue *parse_device_config(const char *json_str)
+static struct l_queue *parse_device_config(json_object *jobj)
 {
-	json_object *jobj, *jobjarray, *jobjentry, *jobjkey;
+	json_object *jobjarray, *jobjentry, *jobjkey;
 	struct l_queue *list = NULL;
 	struct config *entry;
 	int sensor_id, event_flags, time_sec, i;
 	knot_value_types lower_limit, upper_limit;
 	json_type jtype;
 
-	jobj = json_tokener_parse(json_str);
 	if (!jobj)
 		return NULL;
 
@@ -891,19 +1352,15 @@ static struct l_queue *parse_device_config(const char *json_str)
 						sizeof(knot_value_types));
 		memcpy(&(entry->kmcfg.values.upper_limit), &upper_limit,
 						sizeof(knot_value_types));
-		entry->hash = checksum_config(jobjentry);
 		entry->confirmed = false;
 
 		l_queue_push_tail(list, entry);
 	}
 
-	json_object_put(jobj);
-
 	return list;
 
 done:
 	l_queue_destroy(list, config_free);
-	json_object_put(jobj);
 
 	return NULL;
 }
@@ -915,16 +1372,15 @@ done:
  * When/if the user updates the data, the field is erased and the data is sent
  * again, regardless if the value is the same or not.
  */
-static struct l_queue *parse_device_setdata(const char *json_str)
+static struct l_queue *parse_device_setdata(json_object *jobj)
 {
-	json_object *jobj, *jobjarray, *jobjentry, *jobjkey;
+	json_object *jobjarray, *jobjentry, *jobjkey;
 	struct l_queue *list = NULL;
 	knot_msg_data *entry;
 	int sensor_id, i;
 	knot_data data;
 	json_type jtype;
 
-	jobj = json_tokener_parse(json_str);
 	if (!jobj)
 		return NULL;
 
@@ -981,13 +1437,11 @@ static struct l_queue *parse_device_setdata(const char *json_str)
 		memcpy(&(entry->payload), &data, sizeof(knot_data));
 		l_queue_push_tail(list, entry);
 	}
-	json_object_put(jobj);
 
 	return list;
 
 done:
 	l_queue_destroy(list, l_free);
-	json_object_put(jobj);
 
 	return NULL;
 }
@@ -995,14 +1449,13 @@ done:
 /*
  * Parses the json from the cloud with the get_data.
  */
-static struct l_queue *parse_device_getdata(const char *json_str)
+static struct l_queue *parse_device_getdata(json_object *jobj)
 {
-	json_object *jobj, *jobjarray, *jobjentry, *jobjkey;
+	json_object *jobjarray, *jobjentry, *jobjkey;
 	struct l_queue *list = NULL;
 	knot_msg_item *entry;
 	int sensor_id, i;
 
-	jobj = json_tokener_parse(json_str);
 	if (!jobj)
 		return NULL;
 
@@ -1045,13 +1498,11 @@ static struct l_queue *parse_device_getdata(const char *json_str)
 
 		l_queue_push_tail(list, entry);
 	}
-	json_object_put(jobj);
 
 	return list;
 
 done:
 	l_queue_destroy(list, l_free);
-	json_object_put(jobj);
 
 	return NULL;
 }
@@ -1067,7 +1518,7 @@ static void update_msg_item_header(void *entry_data, void *user_data)
  * Includes the proper header in the getdata messages and returns a list with
  * all the sensor from which the data is requested.
  */
-static struct l_queue *msg_getdata(int node_socket, json_raw_t device_message,
+static struct l_queue *msg_getdata(int node_socket, json_object *device,
 	ssize_t *result)
 {
 	struct trust *trust;
@@ -1081,7 +1532,7 @@ static struct l_queue *msg_getdata(int node_socket, json_raw_t device_message,
 	}
 	*result = KNOT_SUCCESS;
 
-	messages = parse_device_getdata(device_message.data);
+	messages = parse_device_getdata(device);
 	l_queue_foreach(messages, update_msg_item_header, NULL);
 
 	return messages;
@@ -1099,7 +1550,7 @@ static void update_msg_data_header(void *entry_data, void *user_data)
  * Includes the proper header in the setdata messages and returns a list with
  * all the sensor data that will be sent to the thing.
  */
-static struct l_queue *msg_setdata(int node_socket, json_raw_t device_message,
+static struct l_queue *msg_setdata(int node_socket, json_object *device,
 	ssize_t *result)
 {
 	struct trust *trust;
@@ -1113,7 +1564,7 @@ static struct l_queue *msg_setdata(int node_socket, json_raw_t device_message,
 	}
 	*result = KNOT_SUCCESS;
 
-	messages = parse_device_setdata(device_message.data);
+	messages = parse_device_setdata(device);
 	l_queue_foreach(messages, update_msg_data_header, NULL);
 
 	return messages;
@@ -1154,8 +1605,10 @@ static struct l_queue *config_to_msg_config_list(struct l_queue *config_list)
 
 static bool config_cmp(struct config *config1, struct config *config2)
 {
-	/* If hashes don't match, either changed or is a new config */
-	return !strcmp(config1->hash, config2->hash);
+	/* If values don't match, either changed or is a new config */
+	return config1->kmcfg.sensor_id == config2->kmcfg.sensor_id &&
+		!memcmp(&config1->kmcfg.values, &config2->kmcfg.values,
+					sizeof(config1->kmcfg.values));
 }
 
 static bool exists_and_confirmed(struct config *received,
@@ -1194,12 +1647,20 @@ static struct l_queue *get_changed_config(struct l_queue *current,
 	return changed_configs;
 }
 
+static void config_keep_confirmed(void *data, void *user_data)
+{
+	struct config *received = data;
+
+	if (exists_and_confirmed(received, user_data))
+		received->confirmed = true;
+}
+
 /*
  * Parses the JSON from cloud to get all the configs. If the config is valid,
  * checks if any changed, and put them in the list that will be sent to the
  * thing. Returns the list with the messages to be sent or NULL if any error.
  */
-static struct l_queue *msg_config(int node_socket, json_raw_t device_message,
+static struct l_queue *msg_config(int node_socket, json_object *device,
 	ssize_t *result)
 {
 	struct trust *trust;
@@ -1213,7 +1674,7 @@ static struct l_queue *msg_config(int node_socket, json_raw_t device_message,
 		return NULL;
 	}
 
-	config = parse_device_config(device_message.data);
+	config = parse_device_config(device);
 
 	/* config_is_valid() returns 0 if SUCCESS */
 	if (config_is_valid(config)) {
@@ -1228,6 +1689,8 @@ static struct l_queue *msg_config(int node_socket, json_raw_t device_message,
 	}
 
 	changed_config = get_changed_config(trust->config, config);
+	/* Unchanged config is not sent again: still confirmed */
+	l_queue_foreach(config, config_keep_confirmed, trust->config);
 	trust_config_update(trust, config);
 
 	*result = KNOT_SUCCESS;
@@ -1239,17 +1702,16 @@ static struct l_queue *msg_config(int node_socket, json_raw_t device_message,
  * Sends the messages to the THING. Expects a response from the gateway
  * acknowledging that the message was successfully received.
  */
+/* Queued by the session: several messages are sent together */
 static int fw_push(int sock, knot_msg *kmsg)
 {
-	ssize_t nbytes;
 	int err;
 
-	nbytes = write(sock, kmsg->buffer, kmsg->hdr.payload_len +
+	err = push(sock, kmsg->buffer, kmsg->hdr.payload_len +
 							sizeof(kmsg->hdr));
-	if (nbytes < 0) {
-		err = errno;
-		hal_log_error("node_ops: %s(%d)", strerror(err), err);
-		return -err;
+	if (err < 0) {
+		hal_log_error("node_ops: %s(%d)", strerror(-err), -err);
+		return err;
 	}
 
 	return 0;
@@ -1299,25 +1761,24 @@ static void msg_register_get_device_name(const knot_msg_register *kreq,
 	strncpy(device_name, kreq->devName, length);
 }
 
-static json_object *create_device_object(const char *device_name,
+static char *create_device_string(const char *device_name,
 	uint64_t device_id, const char *owner_uuid)
 {
-	json_object *device;
-	device = json_object_new_object();
-	if (!device) {
-		return NULL;
-	}
+	struct json_writer w;
 
-	json_object_object_add(device, "type",
-				json_object_new_string("KNOTDevice"));
-	json_object_object_add(device, "name",
-				json_object_new_string(device_name));
-	json_object_object_add(device, "id",
-				json_object_new_int64(device_id));
-	json_object_object_add(device, "owner",
-				json_object_new_string(owner_uuid));
+	json_writer_init_alloc(&w, DEVICE_JSON_LEN);
+	json_writer_begin_object(&w);
+	json_writer_key(&w, "type");
+	json_writer_string(&w, "KNOTDevice");
+	json_writer_key(&w, "name");
+	json_writer_string(&w, device_name);
+	json_writer_key(&w, "id");
+	json_writer_int(&w, device_id);
+	json_writer_key(&w, "owner");
+	json_writer_string(&w, owner_uuid);
+	json_writer_end_object(&w);
 
-	return device;
+	return json_writer_finish(&w);
 }
 
 static bool is_uuid_valid(const char *uuid)
@@ -1333,96 +1794,99 @@ static bool is_token_valid(const char *token)
 /*
  * TODO: consider making this part of proto-ws.c mknode()
  */
-static int proto_mknode(int proto_socket, const char *device_name,
-	uint64_t device_id, const char *owner_uuid, char **uuid, char **token)
+static int proto_mknode(struct msg_request *req, const char *device_name,
+	uint64_t device_id, const char *owner_uuid, proto_cb_t cb)
 {
-	int err, result;
-	json_object *device;
-	const char *device_as_string;
-	json_raw_t response;
+	int err;
+	char *device_as_string;
 
-	device = create_device_object(device_name, device_id,
+	device_as_string = create_device_string(device_name, device_id,
 		owner_uuid);
-	if (!device) {
+	if (!device_as_string) {
 		hal_log_error("JSON: no memory");
-		result = KNOT_ERROR_UNKNOWN;
-		goto fail_device;
+		return KNOT_ERROR_UNKNOWN;
 	}
 
-	device_as_string = json_object_to_json_string(device);
-	memset(&response, 0, sizeof(response));
-	err = proto->mknode(proto_socket, device_as_string, &response);
-	json_object_put(device);
+	err = proto->mknode(req->proto_socket, device_as_string, cb, req);
+	l_free(device_as_string);
 
 	if (err < 0) {
 		hal_log_error("manager mknode: %s(%d)", strerror(-err), -err);
-		result = KNOT_CLOUD_FAILURE;
-		goto fail_mknode;
+		return KNOT_CLOUD_FAILURE;
 	}
 
-	if (parse_device_info(response.data, uuid, token) < 0) {
+	return KNOT_SUCCESS;
+}
+
+/* Parses the response of a mknode operation */
+static int8_t mknode_result(int err, const json_raw_t *json,
+	char **uuid, char **token)
+{
+	if (err < 0) {
+		hal_log_error("manager mknode: %s(%d)", strerror(-err), -err);
+		return KNOT_CLOUD_FAILURE;
+	}
+
+	if (!json->data || parse_device_info(json->data, uuid, token) < 0) {
 		hal_log_error("Unexpected response!");
-		result = KNOT_CLOUD_FAILURE;
-		goto fail_parse;
+		return KNOT_CLOUD_FAILURE;
 	}
 
 	/* Parse function never returns NULL for 'uuid' or 'token' fields */
 	if (!is_uuid_valid(*uuid) || !is_token_valid(*token)) {
 		hal_log_error("Invalid UUID or token!");
-		result = KNOT_CLOUD_FAILURE;
-		goto fail_valid;
+		l_free(*uuid);
+		l_free(*token);
+		*uuid = NULL;
+		*token = NULL;
+		return KNOT_CLOUD_FAILURE;
 	}
 
-	result = KNOT_SUCCESS;
-	goto done;
-
-fail_valid:
-	l_free(*uuid);
-	l_free(*token);
-done:
-fail_parse:
-	free(response.data);
-fail_mknode:
-fail_device:
-	return result;
+	return KNOT_SUCCESS;
 }
 
 /*
  * TODO: consider making this part of proto-ws.c signin()
  */
-static int proto_signin(int proto_socket, const char *uuid, const char *token,
-	struct l_queue **schema, struct l_queue **config)
+static int proto_signin(struct msg_request *req, const char *uuid,
+	const char *token, proto_cb_t cb)
 {
-	int err, result;
-	json_raw_t response;
-
-	err = proto->signin(proto_socket, uuid, token, &response);
-
-	if (!response.data) {
-		result = KNOT_CLOUD_FAILURE;
-		goto fail_signin_no_data;
-	}
+	int err;
 
+	err = proto->signin(req->proto_socket, uuid, token, cb, req);
 	if (err < 0) {
 		hal_log_error("manager signin(): %s(%d)", strerror(-err), -err);
-		result = KNOT_CREDENTIAL_UNAUTHORIZED;
-		goto fail_signin;
+		return KNOT_CLOUD_FAILURE;
 	}
 
-	if (schema != NULL) {
-		*schema = parse_device_schema(response.data);
-	}
+	return KNOT_SUCCESS;
+}
+
+/* The cloud answered and refused the credentials */
+static bool signin_rejected(int err)
+{
+	return err == -EACCES || err == -EPERM || err == -ENOENT;
+}
 
-	if (config != NULL) {
-		*config = parse_device_config(response.data);
+/*
+ * Parses the response of a signin operation: the device document.
+ * Rejections may come without document, e.g. 401 with an empty body.
+ */
+static int8_t signin_result(int err, const json_raw_t *json,
+						json_object **device)
+{
+	if (err < 0) {
+		hal_log_error("manager signin(): %s(%d)", strerror(-err), -err);
+		return signin_rejected(err) ? KNOT_CREDENTIAL_UNAUTHORIZED :
+							KNOT_CLOUD_FAILURE;
 	}
 
-	result = KNOT_SUCCESS;
+	if (!json || !json->data)
+		return KNOT_CLOUD_FAILURE;
+
+	*device = json_tokener_parse(json->data);
 
-fail_signin:
-	free(response.data);
-fail_signin_no_data:
-	return result;
+	return KNOT_SUCCESS;
 }
 
 static void msg_credential_create(knot_msg_credential *message,
@@ -1435,21 +1899,209 @@ static void msg_credential_create(knot_msg_credential *message,
 	message->hdr.payload_len = sizeof(*message) - sizeof(knot_msg_header);
 }
 
-static int8_t msg_register(int node_socket, int proto_socket,
-				 const knot_msg_register *kreq, size_t ilen,
-				 knot_msg_credential *krsp)
+/* Completes 'req' and the requests that joined its operation */
+static void inflight_complete(struct l_queue *waiters,
+				struct msg_request *req, int8_t result)
 {
-	struct trust *trust;
-	char *uuid, *token;
+	struct msg_request *waiter;
+
+	while ((waiter = l_queue_pop_head(waiters)) != NULL)
+		msg_request_complete(waiter, result);
+
+	l_queue_destroy(waiters, NULL);
+	msg_request_complete(req, result);
+}
+
+static void register_fail(struct msg_request *req, int8_t result)
+{
+	char key[17];
+
+	device_id_key(req->device_id, key);
+	inflight_complete(inflight_leave(registers, key, req), req, result);
+}
+
+/*
+ * Registered: each request gets its own trust for the same device.
+ * Returns false if the node is gone: its socket may be another node's.
+ */
+static bool register_trust(struct msg_request *req, const char *uuid,
+				const char *token, json_object *device)
+{
+	struct trust *trust;
+
+	if (req->closed) {
+		msg_request_complete(req, KNOT_CLOUD_FAILURE);
+		return false;
+	}
+
+	msg_credential_create(&req->krsp.cred, uuid, token);
+
+	trust = trust_create(req->node_socket, req->proto_socket,
+		l_strdup(uuid), l_strdup(token), req->device_id,
+		(req->pid ? : INT32_MAX), true, NULL, NULL);
+	trust_lists_update(trust, device);
+
+	msg_request_complete(req, KNOT_SUCCESS);
+
+	return true;
+}
+
+/*
+ * Answers 'req' and the requests that joined it with the new device:
+ * returns false if none of their nodes is connected anymore.
+ */
+static bool register_complete(struct msg_request *req, json_object *device)
+{
+	struct msg_request *waiter;
+	struct l_queue *waiters;
+	char key[17];
+	bool bound = false;
+
+	device_id_key(req->device_id, key);
+	waiters = inflight_leave(registers, key, req);
+	while ((waiter = l_queue_pop_head(waiters)) != NULL) {
+		if (register_trust(waiter, req->uuid, req->token, device))
+			bound = true;
+	}
+	l_queue_destroy(waiters, NULL);
+
+	/* Zombie device, as if the node disconnected before completion */
+	if (!bound && req->closed) {
+		hal_log_info("Rollback UUID: %s", req->uuid);
+		reaper_add(req->uuid, req->token);
+	}
+
+	return register_trust(req, req->uuid, req->token, device) || bound;
+}
+
+static void on_register_signin_done(int err, const json_raw_t *json,
+							void *user_data)
+{
+	struct msg_request *req = user_data;
+	json_object *device;
+	int8_t result;
+
+	result = signin_result(err, json, &device);
+	if (result != KNOT_SUCCESS) {
+		register_fail(req, result);
+		return;
+	}
+
+	register_complete(req, device);
+	json_object_put(device);
+}
+
+static void on_claim_patched(int err, const json_raw_t *json,
+							void *user_data)
+{
+	struct msg_request *req = user_data;
+
+	if (err < 0) {
+		hal_log_error("Claimed UUID: %s not updated: %s(%d)",
+					req->uuid, strerror(-err), -err);
+		identity_unpatched++;
+	}
+
+	msg_request_free(req);
+}
+
+static void on_claim_signin_done(int err, const json_raw_t *json,
+							void *user_data)
+{
+	struct msg_request *req = user_data;
+	struct trust *trust;
+	json_object *device = NULL;
+	int8_t result;
+
+	result = signin_result(err, json, &device);
+	if (result != KNOT_SUCCESS) {
+		hal_log_error("Claimed UUID: %s not signed in", req->uuid);
+		identity_unpatched++;
+		msg_request_free(req);
+		return;
+	}
+
+	trust = req->closed ? NULL : trust_map_get(req->node_socket);
+	if (trust && !strcmp(trust->uuid, req->uuid))
+		trust_lists_update(trust, device);
+	json_object_put(device);
+
+	err = proto->setdata(req->proto_socket, req->uuid, req->token,
+					req->patch, on_claim_patched, req);
+	if (err < 0)
+		on_claim_patched(err, NULL, req);
+}
+
+/*
+ * Device created in advance: answered at once. The session signs in and
+ * sets the name and id of the device afterwards, as mknode would have.
+ */
+static void register_claimed(struct msg_request *req, const char *device_name)
+{
+	struct msg_request *patch;
+	int8_t result;
+
+	hal_log_info("UUID: %s (claimed)", req->uuid);
+
+	/* Nobody is waiting for the response */
+	patch = msg_request_new(req->node_socket, req->proto_socket,
+					RESPONSE_NONE, NULL, NULL);
+	patch->uuid = l_strdup(req->uuid);
+	patch->token = l_strdup(req->token);
+	patch->patch = create_device_string(device_name, req->device_id,
+								owner_uuid);
+
+	/* Removed by the reaper: nothing to set */
+	if (!register_complete(req, NULL)) {
+		msg_request_free(patch);
+		return;
+	}
+
+	if (!patch->patch) {
+		on_claim_patched(-ENOMEM, NULL, patch);
+		return;
+	}
+
+	result = proto_signin(patch, patch->uuid, patch->token,
+						on_claim_signin_done);
+	if (result != KNOT_SUCCESS)
+		on_claim_patched(-ECONNREFUSED, NULL, patch);
+}
+
+static void on_register_mknode_done(int err, const json_raw_t *json,
+							void *user_data)
+{
+	struct msg_request *req = user_data;
+	int8_t result;
+
+	result = mknode_result(err, json, &req->uuid, &req->token);
+	if (result != KNOT_SUCCESS) {
+		register_fail(req, result);
+		return;
+	}
+
+	hal_log_info("UUID: %s, TOKEN: %s", req->uuid, req->token);
+
+	result = proto_signin(req, req->uuid, req->token,
+						on_register_signin_done);
+	if (result != KNOT_SUCCESS)
+		register_fail(req, result);
+}
+
+static void msg_register(struct msg_request *req,
+	const knot_msg_register *kreq, size_t ilen)
+{
+	struct trust *trust;
 	int8_t result;
 	char device_name[KNOT_PROTOCOL_DEVICE_NAME_LEN];
 	struct ucred cred;
+	char key[17];
 
 	if (!msg_register_has_valid_length(kreq, ilen)
 		|| !msg_register_has_valid_device_name(kreq)) {
 		hal_log_error("Missing device name!");
-		result = KNOT_REGISTER_INVALID_DEVICENAME;
-		goto fail_length;
+		msg_request_complete(req, KNOT_REGISTER_INVALID_DEVICENAME);
+		return;
 	}
 
 	/*
@@ -1457,189 +2109,440 @@ static int8_t msg_register(int node_socket, int proto_socket,
 	 * only. For other socket types additional authentication mechanism
 	 * will be required.
 	 */
-	result = get_socket_credentials(node_socket, &cred);
+	result = get_socket_credentials(req->node_socket, &cred);
 	if (result != KNOT_SUCCESS)
-		hal_log_info("sock:%d, pid:%ld", node_socket, (long int) cred.pid);
+		hal_log_info("sock:%d, pid:%ld", req->node_socket,
+							(long int) cred.pid);
 
 	/*
 	 * Due to radio packet loss, peer may re-transmits register request
 	 * if response does not arrives in 20 seconds. If this device was
 	 * previously added we just send the uuid/token again.
 	 */
-	hal_log_info("Registering (id 0x%" PRIx64 ") fd:%d", kreq->id, node_socket);
-	trust = trust_map_get(node_socket);
+	hal_log_info("Registering (id 0x%" PRIx64 ") fd:%d", kreq->id,
+							req->node_socket);
+	trust = trust_map_get(req->node_socket);
 	if (trust && kreq->id == trust->id && trust->pid == cred.pid) {
 		hal_log_info("Register: trusted device");
-		msg_credential_create(krsp, trust->uuid, trust->token);
-		result = KNOT_SUCCESS;
-		goto done;
+		msg_credential_create(&req->krsp.cred, trust->uuid,
+							trust->token);
+		msg_request_complete(req, KNOT_SUCCESS);
+		return;
+	}
+
+	req->device_id = kreq->id;
+	req->pid = cred.pid;
+
+	/* Same device registering through another socket: one cloud device */
+	device_id_key(req->device_id, key);
+	if (inflight_join(registers, key, req)) {
+		hal_log_info("Register: joined (id 0x%" PRIx64 ")", kreq->id);
+		register_coalesced++;
+		return;
 	}
 
 	msg_register_get_device_name(kreq, device_name);
-	result = proto_mknode(proto_socket, device_name, kreq->id,
-		owner_uuid,	&uuid, &token);
-	if (result != KNOT_SUCCESS)
-		goto fail_create;
 
-	hal_log_info("UUID: %s, TOKEN: %s", uuid, token);
+	if (identity_claim(&req->uuid, &req->token)) {
+		register_claimed(req, device_name);
+		return;
+	}
 
-	result = proto_signin(proto_socket, uuid, token, NULL, NULL);
+	result = proto_mknode(req, device_name, kreq->id, owner_uuid,
+						on_register_mknode_done);
 	if (result != KNOT_SUCCESS)
-		goto fail_signin;
+		register_fail(req, result);
+}
+
+static void auth_trust(struct msg_request *req, json_object *device,
+			struct l_queue *schema, struct l_queue *config)
+{
+	struct trust *trust;
 
-	msg_credential_create(krsp, uuid, token);
+	/* Node gone: its socket may be another node's */
+	if (req->closed) {
+		l_queue_destroy(schema, l_free);
+		l_queue_destroy(config, config_free);
+		msg_request_complete(req, KNOT_CLOUD_FAILURE);
+		return;
+	}
 
-	trust_create(node_socket, proto_socket, uuid, token, kreq->id,
-		(cred.pid ? : INT32_MAX), true, NULL, NULL);
+	/* TODO: should we receive the ID? Should we get the socket PID? */
+	trust = trust_create(req->node_socket, req->proto_socket, req->uuid,
+		req->token, 0, 0, false, schema, config);
+	trust_lists_update(trust, device);
+	req->uuid = NULL;
+	req->token = NULL;
 
-	result = KNOT_SUCCESS;
-	goto done;
+	trust_cache_update(trust);
 
-fail_signin:
-	l_free(uuid);
-	l_free(token);
-done:
-fail_create:
-fail_length:
-	return result;
+	msg_request_complete(req, KNOT_SUCCESS);
 }
 
-static int8_t msg_auth(int node_socket, int proto_socket,
-				const knot_msg_authentication *kmauth)
+static void on_auth_signin_done(int err, const json_raw_t *json,
+							void *user_data)
 {
+	struct msg_request *req = user_data;
+	struct msg_request *waiter;
+	struct l_queue *schema, *config, *waiters;
+	json_object *device = NULL;
 	int8_t result;
-	struct l_queue *schema, *config;
-	char *uuid, *token;
 
-	if (trust_map_get(node_socket)) {
-		hal_log_info("Authenticated already");
-		result = KNOT_SUCCESS;
-		goto done;
-	}
+	waiters = inflight_leave(auths, req->uuid, req);
 
-	result = proto_signin(proto_socket, kmauth->uuid, kmauth->token,
-		&schema, &config);
-	if (result != KNOT_SUCCESS)
-		goto done;
+	result = signin_result(err, json, &device);
+	if (result != KNOT_SUCCESS) {
+		inflight_complete(waiters, req, result);
+		return;
+	}
 
+	schema = parse_device_schema(device);
 	if (schema == NULL) {
-		result = KNOT_SCHEMA_EMPTY;
-		goto fail_schema;
+		json_object_put(device);
+		inflight_complete(waiters, req, KNOT_SCHEMA_EMPTY);
+		return;
 	}
 
+	config = parse_device_config(device);
+
 	if (config_is_valid(config)) {
 		hal_log_error("Invalid config message");
 		l_queue_destroy(config, config_free);
 		config = NULL;
 	}
 
+	while ((waiter = l_queue_pop_head(waiters)) != NULL)
+		auth_trust(waiter, device,
+				queue_dup(schema, sizeof(knot_msg_schema)),
+				queue_dup(config, sizeof(struct config)));
+	l_queue_destroy(waiters, NULL);
+
+	auth_trust(req, device, schema, config);
+	json_object_put(device);
+}
+
+static bool schema_is_equal(const knot_msg_schema *a,
+					const knot_msg_schema *b)
+{
+	return a->sensor_id == b->sensor_id &&
+		a->values.value_type == b->values.value_type &&
+		a->values.unit == b->values.unit &&
+		a->values.type_id == b->values.type_id &&
+		!strncmp(a->values.name, b->values.name,
+					sizeof(a->values.name));
+}
+
+static bool schema_list_is_equal(struct l_queue *a, struct l_queue *b)
+{
+	const struct l_queue_entry *entry_a, *entry_b;
+
+	if (l_queue_length(a) != l_queue_length(b))
+		return false;
+
+	entry_a = l_queue_get_entries(a);
+	entry_b = l_queue_get_entries(b);
+	for (; entry_a; entry_a = entry_a->next, entry_b = entry_b->next) {
+		if (!schema_is_equal(entry_a->data, entry_b->data))
+			return false;
+	}
+
+	return true;
+}
+
+static void trust_revalidate(struct trust *trust);
+
+static void on_revalidate_timeout(struct l_timeout *timeout, void *user_data)
+{
+	struct trust *trust = user_data;
+
+	l_timeout_remove(trust->revalidate_timeout);
+	trust->revalidate_timeout = NULL;
+
+	/* Disconnected meanwhile */
+	if (trust_map_get(trust->node_socket) == trust)
+		trust_revalidate(trust);
+}
+
+/* The cloud is unreachable: cached credentials are trusted meanwhile */
+static void trust_revalidate_retry(struct trust *trust)
+{
+	if (trust->revalidate_timeout)
+		return;
+
+	trust->revalidate_timeout = l_timeout_create(REVALIDATE_RETRY,
+					on_revalidate_timeout, trust, NULL);
+}
+
+static void on_revalidate_done(int err, const json_raw_t *json,
+							void *user_data)
+{
+	struct msg_request *req = user_data;
+	struct trust *trust = req->trust;
+	struct l_queue *schema;
+	json_object *device = NULL;
+	int8_t result;
+
+	result = signin_result(err, json, &device);
+
+	/* Node socket may have been closed and reused meanwhile */
+	if (trust_map_get(req->node_socket) != trust)
+		goto done;
+
+	if (result == KNOT_CLOUD_FAILURE) {
+		trust_revalidate_retry(trust);
+		goto done;
+	}
+
+	/* Schema removed from the cloud: sent again after authentication */
+	schema = result == KNOT_SUCCESS ? parse_device_schema(device) : NULL;
+	if (!schema) {
+		hal_log_info("Revoked UUID: %s", trust->uuid);
+		auth_revoked++;
+		trust_revoke(trust);
+		goto done;
+	}
+
+	if (schema_list_is_equal(trust->schema, schema)) {
+		l_queue_destroy(schema, l_free);
+	} else {
+		trust_sensor_schema_free(trust);
+		trust->schema = schema;
+		trust_sensors_update(trust);
+	}
+
+	/* Config changed while the device was offline is sent now */
+	device_changed(trust, req->node_socket, device);
+
+	/* Signed in: data kept meanwhile can be sent */
+	trust_replay(trust);
+
+done:
+	json_object_put(device);
+	msg_request_free(req);
+}
+
+static void trust_revalidate(struct trust *trust)
+{
+	struct msg_request *req;
+	int8_t result;
+
+	/* Nobody is waiting for the response */
+	req = msg_request_new(trust->node_socket, trust->proto_socket,
+					RESPONSE_NONE, NULL, NULL);
+	req->trust = trust_ref(trust);
+
+	result = proto_signin(req, trust->uuid, trust->token,
+						on_revalidate_done);
+	if (result != KNOT_SUCCESS) {
+		msg_request_free(req);
+		trust_revalidate_retry(trust);
+	}
+}
+
+/* Known device: answered now and signed in to the cloud afterwards */
+static void msg_auth_cached(struct msg_request *req, struct l_queue *schema,
+						struct l_queue *cached)
+{
+	struct l_queue *config;
+	knot_msg_config *kmcfg;
+	struct config *cfg;
+	struct trust *trust;
+
+	/* Confirmed by the device before: not sent again if unchanged */
+	config = l_queue_new();
+	while ((kmcfg = l_queue_pop_head(cached)) != NULL) {
+		cfg = l_new(struct config, 1);
+		cfg->kmcfg = *kmcfg;
+		cfg->confirmed = true;
+		l_queue_push_tail(config, cfg);
+		l_free(kmcfg);
+	}
+	l_queue_destroy(cached, NULL);
+
+	trust = trust_create(req->node_socket, req->proto_socket, req->uuid,
+		req->token, 0, 0, false, schema, config);
+	req->uuid = NULL;
+	req->token = NULL;
+
+	msg_request_complete(req, KNOT_SUCCESS);
+
+	trust_revalidate(trust);
+}
+
+static void msg_auth(struct msg_request *req,
+				const knot_msg_authentication *kmauth)
+{
+	struct l_queue *schema, *config;
+	int8_t result;
+
+	if (trust_map_get(req->node_socket)) {
+		hal_log_info("Authenticated already");
+		msg_request_complete(req, KNOT_SUCCESS);
+		return;
+	}
+
 	/*
 	 * l_strndup returns a newly-allocated buffer n + 1 bytes
 	 * long which will always be nul-terminated.
 	 */
-	uuid = l_strndup(kmauth->uuid, sizeof(kmauth->uuid));
-	token = l_strndup(kmauth->token, sizeof(kmauth->token));
-	/* TODO: should we receive the ID? Should we get the socket PID? */
-	trust_create(node_socket, proto_socket, uuid, token, 0, 0, false,
-		schema, config);
+	req->uuid = l_strndup(kmauth->uuid, sizeof(kmauth->uuid));
+	req->token = l_strndup(kmauth->token, sizeof(kmauth->token));
+
+	if (cache_lookup(req->uuid, req->token, &schema, &config) == 0) {
+		msg_auth_cached(req, schema, config);
+		return;
+	}
 
-	result = KNOT_SUCCESS;
-	goto done;
+	/* Same device authenticating through another socket */
+	if (inflight_join(auths, req->uuid, req)) {
+		hal_log_info("Auth: joined UUID: %s", req->uuid);
+		auth_coalesced++;
+		return;
+	}
 
-fail_schema:
-	l_queue_destroy(config, config_free);
-done:
-	return result;
+	result = proto_signin(req, req->uuid, req->token,
+						on_auth_signin_done);
+	if (result != KNOT_SUCCESS)
+		inflight_complete(inflight_leave(auths, req->uuid, req),
+								req, result);
+}
+
+static void write_schema_object(void *data, void *user_data)
+{
+	const knot_msg_schema *schema = data;
+	struct json_writer *w = user_data;
+
+	json_writer_begin_object(w);
+	json_writer_key(w, "sensor_id");
+	json_writer_int(w, schema->sensor_id);
+	json_writer_key(w, "value_type");
+	json_writer_int(w, schema->values.value_type);
+	json_writer_key(w, "unit");
+	json_writer_int(w, schema->values.unit);
+	json_writer_key(w, "type_id");
+	json_writer_int(w, schema->values.type_id);
+	json_writer_key(w, "name");
+	json_writer_stringn(w, schema->values.name,
+					sizeof(schema->values.name));
+	json_writer_end_object(w);
 }
 
-static json_object *create_schema_object(uint8_t sensor_id, uint8_t value_type,
-	uint8_t unit, uint16_t type_id, const char *name)
+/* {"schema": [{"sensor_id": ..., "value_type": ..., ...}, ...]} */
+static char *create_schema_list_string(struct l_queue *schema_list)
 {
-	json_object *schema;
+	struct json_writer w;
 
-	schema = json_object_new_object();
-	json_object_object_add(schema, "sensor_id",
-		json_object_new_int(sensor_id));
-	json_object_object_add(schema, "value_type",
-		json_object_new_int(value_type));
-	json_object_object_add(schema, "unit",
-		json_object_new_int(unit));
-	json_object_object_add(schema, "type_id",
-		json_object_new_int(type_id));
-	json_object_object_add(schema, "name",
-		json_object_new_string(name));
+	json_writer_init_alloc(&w,
+			l_queue_length(schema_list) * SCHEMA_JSON_LEN);
+	json_writer_begin_object(&w);
+	json_writer_key(&w, "schema");
+	json_writer_begin_array(&w);
+	l_queue_foreach(schema_list, write_schema_object, &w);
+	json_writer_end_array(&w);
+	json_writer_end_object(&w);
 
-	return schema;
+	return json_writer_finish(&w);
 }
 
-static void create_and_append(knot_msg_schema *schema,
-	json_object *schema_list)
+static int schema_sensor_id_order(const void *a, const void *b,
+							void *user_data)
 {
-	json_object *item = create_schema_object(schema->sensor_id, schema->values.value_type,
-		schema->values.unit, schema->values.type_id, schema->values.name);
-	json_object_array_add(schema_list, item);
+	const knot_msg_schema *schema_a = a;
+	const knot_msg_schema *schema_b = b;
+
+	return schema_a->sensor_id - schema_b->sensor_id;
 }
 
-static json_object *create_schema_list_object(struct l_queue *schema_list)
+/*
+ * FNV-1a of the schema as uploaded, sorted by sensor_id: the same digest
+ * whatever the order the fragments arrive in. 0 for an empty schema.
+ */
+static uint64_t schema_digest(struct l_queue *schema)
 {
-	json_object *jschema, *jschema_list;
+	const struct l_queue_entry *entry;
+	struct l_queue *sorted;
+	uint64_t hash = 14695981039346656037ULL;
+	const char *byte;
+	char *jstr;
 
-	jschema = json_object_new_object();
-	jschema_list = json_object_new_array();
-	l_queue_foreach(schema_list,
-		(l_queue_foreach_func_t) create_and_append,
-		jschema_list);
-	json_object_object_add(jschema, "schema", jschema_list);
+	if (l_queue_isempty(schema))
+		return 0;
+
+	sorted = l_queue_new();
+	for (entry = l_queue_get_entries(schema); entry; entry = entry->next)
+		l_queue_insert(sorted, entry->data,
+					schema_sensor_id_order, NULL);
+
+	jstr = create_schema_list_string(sorted);
+	l_queue_destroy(sorted, NULL);
+	if (!jstr)
+		return 0;
 
-	return jschema;
+	for (byte = jstr; *byte; byte++) {
+		hash ^= (uint8_t) *byte;
+		hash *= 1099511628211ULL;
+	}
+
+	l_free(jstr);
+
+	return hash;
 }
 
 /*
  * TODO: consider making this part of proto-ws.c signin()
  */
-static int proto_schema(int proto_socket, const char *uuid, const char *token,
-	struct l_queue *schema_list)
+static int proto_schema(struct msg_request *req, const char *uuid,
+	const char *token, struct l_queue *schema_list, proto_cb_t cb)
 {
-	int result, err;
-	json_object *jschema_list;
-	const char *jschema_list_as_string;
-	json_raw_t response;
+	int err;
+	char *jschema_list_as_string;
 
-	jschema_list = create_schema_list_object(schema_list);
-	jschema_list_as_string = json_object_to_json_string(jschema_list);
+	jschema_list_as_string = create_schema_list_string(schema_list);
+	if (!jschema_list_as_string)
+		return KNOT_ERROR_UNKNOWN;
+
+	err = proto->schema(req->proto_socket, uuid, token,
+				jschema_list_as_string, cb, req);
 
-	memset(&response, 0, sizeof(response));
-	err = proto->schema(proto_socket, uuid, token, jschema_list_as_string,
-		&response);
+	l_free(jschema_list_as_string);
+
+	if (err < 0) {
+		hal_log_error("manager schema(): %s(%d)", strerror(-err), -err);
+		return KNOT_CLOUD_FAILURE;
+	}
 
-	if (response.data)
-		free(response.data);
+	return KNOT_SUCCESS;
+}
 
-	json_object_put(jschema_list);
+static void on_schema_done(int err, const json_raw_t *json, void *user_data)
+{
+	struct msg_request *req = user_data;
 
 	if (err < 0) {
 		hal_log_error("manager schema(): %s(%d)", strerror(-err), -err);
-		result = KNOT_CLOUD_FAILURE;
-		goto done;
+		trust_sensor_schema_tmp_free(req->trust);
+		msg_request_complete(req, KNOT_CLOUD_FAILURE);
+		return;
 	}
 
-	result = KNOT_SUCCESS;
+	/* If succeed: free old schema and use the new one */
+	trust_sensor_schema_complete(req->trust);
+	trust_cache_update(req->trust);
 
-done:
-	return result;
+	msg_request_complete(req, KNOT_SUCCESS);
 }
 
-static int8_t msg_schema(int node_socket, int proto_socket,
+static void msg_schema(struct msg_request *req,
 				const knot_msg_schema *schema, bool eof)
 {
 	int8_t result;
 	struct trust *trust;
 
-	trust = trust_map_get(node_socket);
+	trust = trust_map_get(req->node_socket);
 	if (!trust) {
 		hal_log_info("Permission denied!");
-		result = KNOT_CREDENTIAL_UNAUTHORIZED;
-		goto done;
+		msg_request_complete(req, KNOT_CREDENTIAL_UNAUTHORIZED);
+		return;
 	}
 
 	/*
@@ -1665,73 +2568,52 @@ static int8_t msg_schema(int node_socket, int proto_socket,
 	if (!trust_get_sensor_schema_tmp(trust, schema->sensor_id))
 		trust_sensor_schema_tmp_add(trust, schema);
 
-	 /* TODO: missing timer to wait for end of schema transfer */
-
 	if (!eof) {
-		result = KNOT_SUCCESS;
-		goto done;
+		trust_schema_timeout(trust);
+		msg_request_complete(req, KNOT_SUCCESS);
+		return;
 	}
 
-	result = proto_schema(proto_socket, trust->uuid, trust->token,
-		trust->schema_tmp);
-	if (result != KNOT_SUCCESS) {
+	l_timeout_remove(trust->schema_timeout);
+	trust->schema_timeout = NULL;
+
+	/*
+	 * Things send their schema whenever they boot: the cloud has it
+	 * already if it matches the one accepted (or cached) before. The
+	 * cloud replaces the whole schema: changes are sent in full.
+	 */
+	if (trust->schema_digest &&
+			schema_digest(trust->schema_tmp) == trust->schema_digest) {
+		schema_unchanged++;
 		trust_sensor_schema_tmp_free(trust);
-		goto done;
+		msg_request_complete(req, KNOT_SUCCESS);
+		return;
 	}
 
-	/* If succeed: free old schema and use the new one */
-	trust_sensor_schema_complete(trust);
-
-done:
-	return result;
+	req->trust = trust_ref(trust);
+	result = proto_schema(req, trust->uuid, trust->token,
+					trust->schema_tmp, on_schema_done);
+	if (result != KNOT_SUCCESS) {
+		trust_sensor_schema_tmp_free(trust);
+		msg_request_complete(req, result);
+	}
 }
 
 /*
- * Updates the 'devices' db, removing the sensor_id that just sent the data
+ * Copies 'jarray' without the entries of 'sensor_id'. Returns NULL if the
+ * sensor is not in the list.
  */
-static void update_device_getdata(int proto_sock, char *uuid, char *token,
-					uint8_t sensor_id)
+static json_object *list_remove_sensor(json_object *jarray, int sensor_id)
 {
-	json_object *jobj, *jobjarray, *jobjentry, *jobjkey;
-	json_object *ajobj, *setdatajobj;
-	json_raw_t json;
-	const char *jobjstr;
-	int i, err;
+	json_object *ajobj, *jobjentry, *jobjkey;
+	bool found = false;
+	int i;
 
-	memset(&json, 0, sizeof(json));
-	err = proto->fetch(proto_sock, uuid, token, &json);
-	if (err < 0) {
-		hal_log_error("signin(): %s(%d)", strerror(-err), -err);
-		goto done;
-	}
+	ajobj = json_object_new_array();
 
-	jobj = json_tokener_parse(json.data);
-	if (!jobj)
-		goto done;
-
-	ajobj = json_object_new_array();
-	setdatajobj = json_object_new_object();
-
-	/*
-	 * Getting 'get_data' from the device properties
-	 * {"devices":[{"uuid":
-	 *		"get_data" : [
-	 *			{"sensor_id": v
-	 *			}]
-	 *		}]
-	 * }
-	 */
+	for (i = 0; i < json_object_array_length(jarray); i++) {
 
-	/* 'get_data' is an array */
-	if (!json_object_object_get_ex(jobj, "get_data", &jobjarray))
-		goto done;
-
-	if (json_object_get_type(jobjarray) != json_type_array)
-		goto done;
-
-	for (i = 0; i < json_object_array_length(jobjarray); i++) {
-
-		jobjentry = json_object_array_get_idx(jobjarray, i);
+		jobjentry = json_object_array_get_idx(jarray, i);
 		if (!jobjentry)
 			break;
 
@@ -1741,7 +2623,7 @@ static void update_device_getdata(int proto_sock, char *uuid, char *token,
 			continue;
 
 		/*
-		 * Creates a list with all the sensor_id in the get_data list
+		 * Creates a list with all the sensor_id in the list
 		 * except for the one that was just received
 		 */
 		if (json_object_get_int(jobjkey) != sensor_id) {
@@ -1753,21 +2635,141 @@ static void update_device_getdata(int proto_sock, char *uuid, char *token,
 		 * TODO: if the value changed before it was updated, the entry
 		 * should not be erased
 		 */
+		found = true;
+	}
+
+	if (!found) {
+		json_object_put(ajobj);
+		return NULL;
+	}
+
+	return ajobj;
+}
+
+static bool list_has_sensor(json_object *jarray, int sensor_id)
+{
+	json_object *jobjentry, *jobjkey;
+	int i;
+
+	for (i = 0; i < json_object_array_length(jarray); i++) {
+		jobjentry = json_object_array_get_idx(jarray, i);
+		if (jobjentry && json_object_object_get_ex(jobjentry,
+						"sensor_id", &jobjkey) &&
+				json_object_get_int(jobjkey) == sensor_id)
+			return true;
+	}
+
+	return false;
+}
+
+static void on_update_setdata_done(int err, const json_raw_t *json,
+							void *user_data)
+{
+	struct msg_request *req = user_data;
+
+	if (err < 0) {
+		hal_log_error("setdata(): %s(%d)", strerror(-err), -err);
+	} else {
+		trust_list_replace(req->trust, req->list_key, req->list);
+		req->list = NULL;
+	}
+
+	req->list_updated(req);
+}
+
+/* Writes the list without the sensor: the shadow follows if accepted */
+static void update_list_write(struct msg_request *req, json_object *jarray)
+{
+	json_object *ajobj, *setdatajobj;
+	const char *jobjstr;
+	int err;
+
+	ajobj = list_remove_sensor(jarray, req->sensor_id);
+	if (!ajobj) {
+		/* Sensor not pending: nothing to be written */
+		req->list_updated(req);
+		return;
 	}
 
-	json_object_object_add(setdatajobj, "get_data", json_object_get(ajobj));
+	json_object_put(req->list);
+	req->list = json_object_get(ajobj);
+
+	setdatajobj = json_object_new_object();
+	json_object_object_add(setdatajobj, req->list_key, ajobj);
 	jobjstr = json_object_to_json_string(setdatajobj);
 
-	err = proto->setdata(proto_sock, uuid, token, jobjstr, &json);
+	err = proto->setdata(req->proto_socket, req->trust->uuid,
+		req->trust->token, jobjstr, on_update_setdata_done, req);
 
-done:
-	if (jobj)
-		json_object_put(jobj);
-	if (setdatajobj)
-		json_object_put(setdatajobj);
-	if (ajobj)
-		json_object_put(ajobj);
-	free(json.data);
+	json_object_put(setdatajobj);
+
+	if (err < 0) {
+		hal_log_error("setdata(): %s(%d)", strerror(-err), -err);
+		req->list_updated(req);
+	}
+}
+
+static void on_update_fetch_done(int err, const json_raw_t *json,
+							void *user_data)
+{
+	struct msg_request *req = user_data;
+	json_object *device;
+
+	if (err < 0) {
+		hal_log_error("signin(): %s(%d)", strerror(-err), -err);
+		req->list_updated(req);
+		return;
+	}
+
+	/*
+	 * Getting the list from the device properties
+	 * {"devices":[{"uuid":
+	 *		"get_data" : [
+	 *			{"sensor_id": v
+	 *			}]
+	 *		}]
+	 * }
+	 */
+	device = json->data ? json_tokener_parse(json->data) : NULL;
+	trust_lists_update(req->trust, device);
+	json_object_put(device);
+
+	if (!*trust_list(req->trust, req->list_key)) {
+		req->list_updated(req);
+		return;
+	}
+
+	update_list_write(req, *trust_list(req->trust, req->list_key));
+}
+
+/*
+ * Updates the 'devices' db, removing the sensor_id of the request from
+ * the list named 'key' ("get_data" or "set_data"). 'done' is called once
+ * the update finishes, regardless of its result. The device is only
+ * fetched if the list is not known yet, and only written if the sensor
+ * is in the list.
+ */
+static void update_device_list(struct msg_request *req, const char *key,
+	void (*done) (struct msg_request *req))
+{
+	json_object *jarray;
+	int err;
+
+	req->list_key = key;
+	req->list_updated = done;
+
+	jarray = *trust_list(req->trust, key);
+	if (jarray) {
+		update_list_write(req, jarray);
+		return;
+	}
+
+	err = proto->fetch(req->proto_socket, req->trust->uuid,
+		req->trust->token, on_update_fetch_done, req);
+	if (err < 0) {
+		hal_log_error("fetch(): %s(%d)", strerror(-err), -err);
+		done(req);
+	}
 }
 
 /*
@@ -1788,145 +2790,682 @@ static int knot_data_get_double_length(const knot_data *data)
 	return sprintf(buffer, "%d", data->values.val_f.value_dec);
 }
 
-/*
- * TODO: consider moving this to knot-protocol
- */
-static double knot_data_as_double(const knot_data *data)
+/*
+ * TODO: consider moving this to knot-protocol
+ */
+static double knot_data_as_double(const knot_data *data)
+{
+	int length = knot_data_get_double_length(data);
+	return data->values.val_f.multiplier *
+		(data->values.val_f.value_int +
+		(data->values.val_f.value_dec / pow(10, length)));
+}
+
+/*
+ * TODO: consider moving this to knot-protocol
+ */
+static bool knot_data_as_boolean(const knot_data *data)
+{
+	return data->values.val_b;
+}
+
+/* Members of a data object: false if the value type is unknown */
+static bool write_data_members(struct json_writer *w, uint8_t sensor_id,
+	uint8_t value_type, const knot_data *value)
+{
+	json_writer_key(w, "sensor_id");
+	json_writer_int(w, sensor_id);
+
+	switch (value_type) {
+	case KNOT_VALUE_TYPE_INT:
+		json_writer_key(w, "value");
+		json_writer_int(w, knot_data_as_int(value));
+		break;
+	case KNOT_VALUE_TYPE_FLOAT:
+		json_writer_key(w, "value");
+		json_writer_fixed(w, knot_data_as_double(value),
+				knot_data_get_double_length(value));
+		break;
+	case KNOT_VALUE_TYPE_BOOL:
+		json_writer_key(w, "value");
+		json_writer_bool(w, knot_data_as_boolean(value));
+		break;
+	case KNOT_VALUE_TYPE_RAW:
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * TODO: consider making this part of proto-ws.c signin()
+ */
+static int proto_data(struct msg_request *req, const char *uuid,
+	const char *token, uint8_t sensor_id, uint8_t value_type,
+	const knot_data *value, proto_cb_t cb)
+{
+	int err;
+	struct json_writer w;
+	char data_as_string[DATA_JSON_LEN];
+
+	json_writer_init(&w, data_as_string, sizeof(data_as_string));
+	json_writer_begin_object(&w);
+	if (!write_data_members(&w, sensor_id, value_type, value))
+		return KNOT_INVALID_DATA;
+	json_writer_end_object(&w);
+
+	if (!json_writer_finish(&w))
+		return KNOT_INVALID_DATA;
+
+	err = proto->data(req->proto_socket, uuid, token, data_as_string,
+								cb, req);
+
+	/* Kept for later only if the cloud may accept it then */
+	if (err < 0) {
+		hal_log_error("manager data(): %s(%d)", strerror(-err), -err);
+		return proto_is_upstream_failure(err) ? KNOT_CLOUD_FAILURE :
+							KNOT_GW_FAILURE;
+	}
+
+	return KNOT_SUCCESS;
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t epoch_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Data of the request, timestamped now */
+static void msg_request_sample(const struct msg_request *req,
+						struct store_sample *sample)
+{
+	sample->timestamp = epoch_ms();
+	sample->sensor_id = req->sensor_id;
+	sample->value_type = req->value_type;
+	memcpy(&sample->value, &req->value, sizeof(sample->value));
+}
+
+/* {"batch": [{"sensor_id": ..., "value": ..., "timestamp": ...}, ...]} */
+static char *create_batch_string(const struct store_sample *samples,
+							unsigned int count)
+{
+	struct json_writer w;
+	unsigned int i;
+
+	json_writer_init_alloc(&w, count * DATA_JSON_LEN);
+	json_writer_begin_object(&w);
+	json_writer_key(&w, "batch");
+	json_writer_begin_array(&w);
+
+	for (i = 0; i < count; i++) {
+		json_writer_begin_object(&w);
+		/* Unknown value types are not stored */
+		write_data_members(&w, samples[i].sensor_id,
+				samples[i].value_type, &samples[i].value);
+		json_writer_key(&w, "timestamp");
+		json_writer_int(&w, samples[i].timestamp);
+		json_writer_end_object(&w);
+	}
+
+	json_writer_end_array(&w);
+	json_writer_end_object(&w);
+
+	return json_writer_finish(&w);
+}
+
+/* Same document as a sample forwarded when received */
+static char *create_sample_string(const struct store_sample *sample)
+{
+	struct json_writer w;
+
+	json_writer_init_alloc(&w, DATA_JSON_LEN);
+	json_writer_begin_object(&w);
+	write_data_members(&w, sample->sensor_id, sample->value_type,
+							&sample->value);
+	json_writer_end_object(&w);
+
+	return json_writer_finish(&w);
+}
+
+static void batch_done(struct batch_flush *flush);
+
+static void on_sample_sent(int err, const json_raw_t *json, void *user_data)
+{
+	struct flush_sample *slot = user_data;
+	struct batch_flush *flush = slot->flush;
+
+	flush->errs[slot->index] = err;
+	if (--flush->pending == 0)
+		batch_done(flush);
+}
+
+/* Same data documents as samples forwarded when received, back to back */
+static void batch_send_samples(struct batch_flush *flush)
+{
+	struct trust *trust = flush->trust;
+	unsigned int i;
+	char *jstr;
+	int err;
+
+	flush->slots = l_new(struct flush_sample, flush->count);
+	flush->pending = flush->count;
+
+	for (i = 0; i < flush->count; i++) {
+		flush->slots[i].flush = flush;
+		flush->slots[i].index = i;
+
+		jstr = create_sample_string(&flush->samples[i]);
+		if (!jstr) {
+			err = -ENOMEM;
+		} else {
+			err = proto->data(trust->proto_socket, trust->uuid,
+					trust->token, jstr, on_sample_sent,
+					&flush->slots[i]);
+			l_free(jstr);
+		}
+
+		if (err < 0) {
+			flush->errs[i] = err;
+			flush->pending--;
+		}
+	}
+
+	/* Completions are called from the main loop only */
+	if (!flush->pending)
+		batch_done(flush);
+}
+
+static void on_batch_sent(int err, const json_raw_t *json, void *user_data)
+{
+	struct batch_flush *flush = user_data;
+	unsigned int i;
+
+	/*
+	 * Possibly a single sample the cloud can't accept: only this batch is
+	 * sent again, one sample per document, to find out which.
+	 */
+	if (err == -EBADMSG) {
+		hal_log_error("Batch document rejected: sent one by one");
+		batch_send_samples(flush);
+		return;
+	}
+
+	for (i = 0; i < flush->count; i++)
+		flush->errs[i] = err;
+
+	batch_done(flush);
+}
+
+static void batch_send(struct batch_flush *flush)
+{
+	struct trust *trust = flush->trust;
+	char *jstr;
+	int err;
+
+	flush->errs = l_new(int, flush->count);
+
+	if (!batch_document) {
+		batch_send_samples(flush);
+		return;
+	}
+
+	jstr = create_batch_string(flush->samples, flush->count);
+	if (!jstr) {
+		on_batch_sent(-ENOMEM, NULL, flush);
+		return;
+	}
+
+	err = proto->data(trust->proto_socket, trust->uuid, trust->token,
+					jstr, on_batch_sent, flush);
+	l_free(jstr);
+
+	if (err < 0)
+		on_batch_sent(err, NULL, flush);
+}
+
+/* Sends the oldest samples kept in the store, if not being sent yet */
+static void trust_replay(struct trust *trust)
+{
+	struct batch_flush *flush;
+
+	if (!store_pending(trust->uuid) ||
+				l_hashmap_lookup(replays, trust->uuid))
+		return;
+
+	flush = l_new(struct batch_flush, 1);
+	flush->trust = trust_ref(trust);
+	flush->samples = l_new(struct store_sample, REPLAY_BATCH);
+	flush->count = store_peek(trust->uuid, flush->samples, REPLAY_BATCH);
+	flush->since = now_ms();
+	flush->replay = true;
+
+	l_hashmap_insert(replays, trust->uuid, flush);
+	batch_send(flush);
+}
+
+static void on_replay_timeout(struct l_timeout *timeout, void *user_data)
+{
+	struct trust *trust = user_data;
+
+	l_timeout_remove(trust->replay_timeout);
+	trust->replay_timeout = NULL;
+
+	trust_replay(trust);
+}
+
+/* The cloud is unreachable: replay is attempted later */
+static void trust_replay_retry(struct trust *trust)
+{
+	if (trust->replay_timeout)
+		return;
+
+	trust->replay_timeout = l_timeout_create(REPLAY_RETRY,
+					on_replay_timeout, trust, NULL);
+}
+
+/* Keeps samples not sent to the cloud: returns how many were stored */
+static unsigned int trust_spool(struct trust *trust,
+		const struct store_sample *samples, unsigned int count)
+{
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < count; i++) {
+		err = store_append(trust->uuid, &samples[i]);
+		if (err < 0)
+			break;
+	}
+
+	if (i)
+		trust_replay_retry(trust);
+
+	return i;
+}
+
+/* Stored samples leave the store in order, up to the first unreachable one */
+static void replay_done(struct batch_flush *flush)
+{
+	struct trust *trust = flush->trust;
+	unsigned int sent, i;
+
+	l_hashmap_remove(replays, trust->uuid);
+
+	for (sent = 0; sent < flush->count; sent++) {
+		if (proto_is_upstream_failure(flush->errs[sent]))
+			break;
+		if (flush->errs[sent] < 0)
+			replay_dropped++;
+	}
+
+	if (sent)
+		trust->replay_attempts = 0;
+
+	/* Retried from the first one: samples accepted after it are resent */
+	if (sent < flush->count && ++trust->replay_attempts < REPLAY_ATTEMPTS) {
+		store_consume(trust->uuid, sent);
+		trust_replay_retry(trust);
+		return;
+	}
+
+	/* Never accepted: the next samples must not wait for them */
+	for (i = sent; i < flush->count; i++) {
+		if (flush->errs[i] < 0)
+			replay_dropped++;
+	}
+
+	if (sent < flush->count)
+		hal_log_error("THING %s stored samples dropped", trust->uuid);
+
+	trust->replay_attempts = 0;
+	store_consume(trust->uuid, flush->count);
+	trust_replay(trust);
+}
+
+static void batch_done(struct batch_flush *flush)
+{
+	struct trust *trust = flush->trust;
+	unsigned int failed = 0, spooled = 0, i;
+	int err = 0;
+
+	for (i = 0; i < flush->count; i++) {
+		if (flush->errs[i] == 0)
+			continue;
+
+		if (!failed++)
+			err = flush->errs[i];
+	}
+
+	if (failed)
+		hal_log_error("THING %s %u of %u samples not sent: %s(%d)",
+				trust->uuid, failed, flush->count,
+				strerror(-err), -err);
+
+	if (flush->replay) {
+		replay_done(flush);
+		goto done;
+	}
+
+	/* Kept for later only if the cloud may accept them then */
+	for (i = 0; i < flush->count; i++) {
+		if (flush->errs[i] == 0)
+			batch_flushed++;
+		else if (!proto_is_upstream_failure(flush->errs[i]))
+			data_rejected++;
+		else if (trust_spool(trust, &flush->samples[i], 1))
+			spooled++;
+		else
+			batch_dropped++;
+	}
+
+	if (failed < flush->count)
+		batch_latency += now_ms() - flush->since;
+
+	if (!spooled)
+		trust_replay(trust);
+
+done:
+	trust_unref(trust);
+	l_free(flush->slots);
+	l_free(flush->errs);
+	l_free(flush->samples);
+	l_free(flush);
+}
+
+/*
+ * Sends the pending samples as a batch. Samples are kept in the store
+ * instead if older ones are waiting to be sent.
+ */
+static void trust_batch_flush(struct trust *trust)
+{
+	struct data_batch *batch = &trust->batch;
+	struct batch_flush *flush;
+	unsigned int stored;
+
+	l_timeout_remove(batch->timeout);
+	batch->timeout = NULL;
+
+	if (!batch->count)
+		return;
+
+	flush = l_new(struct batch_flush, 1);
+	flush->trust = trust_ref(trust);
+	flush->samples = batch->samples;
+	flush->count = batch->count;
+	flush->since = batch->since;
+
+	batch->samples = NULL;
+	batch->count = 0;
+
+	if (store_pending(trust->uuid)) {
+		stored = trust_spool(trust, flush->samples, flush->count);
+		batch_dropped += flush->count - stored;
+		trust_replay(trust);
+		trust_unref(trust);
+		l_free(flush->samples);
+		l_free(flush);
+		return;
+	}
+
+	batch_flushes++;
+	batch_send(flush);
+}
+
+static void on_batch_timeout(struct l_timeout *timeout, void *user_data)
 {
-	int length = knot_data_get_double_length(data);
-	return data->values.val_f.multiplier *
-		(data->values.val_f.value_int +
-		(data->values.val_f.value_dec / pow(10, length)));
+	trust_batch_flush(user_data);
 }
 
-/*
- * TODO: consider moving this to knot-protocol
- */
-static bool knot_data_as_boolean(const knot_data *data)
+static void trust_batch_add(struct trust *trust,
+				const struct store_sample *sample)
 {
-	return data->values.val_b;
+	struct data_batch *batch = &trust->batch;
+
+	if (!batch->samples) {
+		batch->samples = l_new(struct store_sample, batch_samples);
+		batch->since = now_ms();
+		batch->timeout = l_timeout_create_ms(batch_interval,
+					on_batch_timeout, trust, NULL);
+	}
+
+	memcpy(&batch->samples[batch->count++], sample, sizeof(*sample));
+	if (batch->count >= batch_samples)
+		trust_batch_flush(trust);
 }
 
-static json_object *create_data_object(uint8_t sensor_id,
-	uint8_t value_type, const knot_data *value)
+static void on_data_sent(int err, const json_raw_t *json, void *user_data)
 {
-	json_object *data;
+	struct msg_request *req = user_data;
+	struct store_sample sample;
+	int8_t result = KNOT_SUCCESS;
 
-	data = json_object_new_object();
-	json_object_object_add(data, "sensor_id",
-						json_object_new_int(sensor_id));
+	if (err < 0) {
+		hal_log_error("manager data(): %s(%d)", strerror(-err), -err);
+		result = KNOT_CLOUD_FAILURE;
+
+		/* Acknowledged if it can be sent later */
+		msg_request_sample(req, &sample);
+		if (!proto_is_upstream_failure(err))
+			data_rejected++;
+		else if (trust_spool(req->trust, &sample, 1))
+			result = KNOT_SUCCESS;
+	} else {
+		trust_replay(req->trust);
+	}
+
+	msg_request_reply(req, result);
+
+	update_device_list(req, "get_data", msg_request_free);
+}
 
+static bool value_is_equal(uint8_t value_type, const knot_data *a,
+							const knot_data *b)
+{
 	switch (value_type) {
 	case KNOT_VALUE_TYPE_INT:
-		json_object_object_add(data, "value",
-				json_object_new_int(knot_data_as_int(value)));
-		break;
+		return a->values.val_i.value == b->values.val_i.value;
 	case KNOT_VALUE_TYPE_FLOAT:
-		json_object_object_add(data, "value",
-					json_object_new_double(knot_data_as_double(value)));
-		break;
+		return a->values.val_f.multiplier == b->values.val_f.multiplier &&
+			a->values.val_f.value_int == b->values.val_f.value_int &&
+			a->values.val_f.value_dec == b->values.val_f.value_dec;
 	case KNOT_VALUE_TYPE_BOOL:
-		json_object_object_add(data, "value",
-				json_object_new_boolean(knot_data_as_boolean(value)));
-		break;
-	case KNOT_VALUE_TYPE_RAW:
-		break;
+		return a->values.val_b == b->values.val_b;
 	default:
-		json_object_put(data);
-		return NULL;
+		return memcmp(a, b, sizeof(*a)) == 0;
 	}
+}
 
-	return data;
+static double value_as_double(uint8_t value_type, const knot_data *value)
+{
+	return value_type == KNOT_VALUE_TYPE_FLOAT ?
+		knot_data_as_double(value) : knot_data_as_int(value);
 }
 
-/*
- * TODO: consider making this part of proto-ws.c signin()
- */
-static int proto_data(int proto_socket, const char *uuid, const char *token,
-	uint8_t sensor_id, uint8_t value_type, const knot_data *value)
+/* Checks the events enabled by the config, as the thing should */
+static bool config_has_event(const knot_config *config,
+				const struct trust_sensor *sensor,
+				const knot_data *value, uint64_t now)
 {
-	int result, err;
-	struct json_object *data;
-	const char *data_as_string;
-	json_raw_t response;
+	knot_data limit;
+	double current;
 
-	data = create_data_object(sensor_id, value_type, value);
-	if (!data) {
-		result = KNOT_INVALID_DATA;
-		goto done;
-	}
+	if ((config->event_flags & KNOT_EVT_FLAG_TIME) &&
+			now - sensor->last_time >= config->time_sec * 1000ULL)
+		return true;
 
-	data_as_string = json_object_to_json_string(data);
+	if ((config->event_flags & KNOT_EVT_FLAG_CHANGE) &&
+			!value_is_equal(sensor->value_type, &sensor->last, value))
+		return true;
 
-	memset(&response, 0, sizeof(response));
-	err = proto->data(proto_socket, uuid, token, data_as_string, &response);
+	/* Limits apply to numeric values only */
+	if (sensor->value_type != KNOT_VALUE_TYPE_INT &&
+				sensor->value_type != KNOT_VALUE_TYPE_FLOAT)
+		return false;
 
-	if (response.data)
-		free(response.data);
+	current = value_as_double(sensor->value_type, value);
 
-	json_object_put(data);
+	if (config->event_flags & KNOT_EVT_FLAG_LOWER_THRESHOLD) {
+		memcpy(&limit.values, &config->lower_limit,
+						sizeof(limit.values));
+		if (current < value_as_double(sensor->value_type, &limit))
+			return true;
+	}
 
-	if (err < 0) {
-		hal_log_error("manager data(): %s(%d)", strerror(-err), -err);
-		result = KNOT_CLOUD_FAILURE;
-		goto done;
+	if (config->event_flags & KNOT_EVT_FLAG_UPPER_THRESHOLD) {
+		memcpy(&limit.values, &config->upper_limit,
+						sizeof(limit.values));
+		if (current > value_as_double(sensor->value_type, &limit))
+			return true;
 	}
 
-	result = KNOT_SUCCESS;
+	return false;
+}
 
-done:
-	return result;
+/*
+ * Drops the samples a thing ignoring its config should not have sent.
+ * The first sample and values requested by the cloud are forwarded.
+ */
+static bool trust_data_filter(struct trust *trust, uint8_t sensor_id,
+						const knot_data *value)
+{
+	struct trust_sensor *sensor = &trust->sensors[sensor_id];
+	const struct config *cfg;
+	uint64_t now = now_ms();
+
+	cfg = l_queue_find(trust->config, config_sensor_id_cmp,
+						L_UINT_TO_PTR(sensor_id));
+
+	if (cfg && sensor->cached &&
+		(cfg->kmcfg.values.event_flags & (KNOT_EVT_FLAG_TIME |
+					KNOT_EVT_FLAG_LOWER_THRESHOLD |
+					KNOT_EVT_FLAG_UPPER_THRESHOLD |
+					KNOT_EVT_FLAG_CHANGE)) &&
+		trust->get_data && !list_has_sensor(trust->get_data, sensor_id) &&
+		!config_has_event(&cfg->kmcfg.values, sensor, value, now)) {
+		data_suppressed++;
+		return false;
+	}
+
+	sensor->cached = true;
+	memcpy(&sensor->last, value, sizeof(sensor->last));
+	sensor->last_time = now;
+	data_forwarded++;
+
+	return true;
 }
 
-static int8_t msg_data(int node_socket, int proto_socket,
-					const knot_msg_data *kmdata)
+/*
+ * Gets the schema of the sensor referenced by the data PDU, checking if
+ * the data can be forwarded to the cloud.
+ */
+static int8_t trust_check_data(const struct trust *trust,
+	const knot_msg_data *kmdata, const struct trust_sensor **psensor)
 {
-	int8_t result;
-	int err;
 	uint8_t sensor_id;
-	const struct trust *trust;
-	const knot_msg_schema *schema;
-	/*
-	 * Pointer to KNOT data containing header, sensor id
-	 * and a primitive KNOT type
-	 */
-	const knot_data *kdata = &(kmdata->payload);
-
-	trust = trust_map_get(node_socket);
-	if (!trust) {
-		hal_log_info("Permission denied!");
-		result = KNOT_CREDENTIAL_UNAUTHORIZED;
-		goto done;
-	}
+	const struct trust_sensor *sensor;
 
 	sensor_id = kmdata->sensor_id;
-	schema = trust_get_sensor_schema(trust, sensor_id);
-	if (!schema) {
+	sensor = trust_get_sensor(trust, sensor_id);
+	if (!sensor) {
 		hal_log_info("sensor_id(0x%02x): data type mismatch!",
 								sensor_id);
-		result = KNOT_INVALID_DATA;
-		goto done;
+		return KNOT_INVALID_DATA;
 	}
 
-	err = knot_schema_is_valid(schema->values.type_id,
-				schema->values.value_type, schema->values.unit);
-	if (err) {
+	if (!sensor->valid) {
 		hal_log_info("sensor_id(0x%d), type_id(0x%04x): unit mismatch!",
-					sensor_id, schema->values.type_id);
-		result = KNOT_INVALID_DATA;
-		goto done;
+				sensor_id, sensor->schema->values.type_id);
+		return KNOT_INVALID_DATA;
 	}
 
 	hal_log_info("sensor:%d, unit:%d, value_type:%d", sensor_id,
-				schema->values.unit, schema->values.value_type);
+			sensor->schema->values.unit, sensor->value_type);
 
-	result = proto_data(proto_socket, trust->uuid, trust->token, sensor_id,
-		schema->values.value_type, kdata);
+	*psensor = sensor;
 
-	update_device_getdata(proto_socket, trust->uuid, trust->token, sensor_id);
+	return KNOT_SUCCESS;
+}
 
-done:
-	return result;
+static void msg_data(struct msg_request *req, const knot_msg_data *kmdata)
+{
+	int8_t result;
+	struct trust *trust;
+	const struct trust_sensor *sensor;
+	struct store_sample sample;
+
+	trust = trust_map_get(req->node_socket);
+	if (!trust) {
+		hal_log_info("Permission denied!");
+		msg_request_complete(req, KNOT_CREDENTIAL_UNAUTHORIZED);
+		return;
+	}
+
+	result = trust_check_data(trust, kmdata, &sensor);
+	if (result != KNOT_SUCCESS) {
+		msg_request_complete(req, result);
+		return;
+	}
+
+	/* Acknowledged, but not worth sending to the cloud */
+	if (!trust_data_filter(trust, kmdata->sensor_id, &kmdata->payload)) {
+		msg_request_complete(req, KNOT_SUCCESS);
+		return;
+	}
+
+	req->trust = trust_ref(trust);
+	req->sensor_id = kmdata->sensor_id;
+	req->value_type = sensor->value_type;
+	memcpy(&req->value, &kmdata->payload, sizeof(req->value));
+
+	/*
+	 * Batching or older samples waiting in the store: the node is
+	 * acknowledged before the sample reaches the cloud.
+	 */
+	if (batch_samples || store_pending(trust->uuid)) {
+		msg_request_sample(req, &sample);
+		if (batch_samples) {
+			trust_batch_add(trust, &sample);
+		} else if (!trust_spool(trust, &sample, 1)) {
+			msg_request_complete(req, KNOT_CLOUD_FAILURE);
+			return;
+		}
+
+		msg_request_reply(req, KNOT_SUCCESS);
+		update_device_list(req, "get_data", msg_request_free);
+		return;
+	}
+
+	/*
+	 * Pointer to KNOT data containing header, sensor id
+	 * and a primitive KNOT type
+	 */
+	result = proto_data(req, trust->uuid, trust->token, kmdata->sensor_id,
+		sensor->value_type, &kmdata->payload, on_data_sent);
+	if (result == KNOT_CLOUD_FAILURE) {
+		msg_request_sample(req, &sample);
+		if (trust_spool(trust, &sample, 1))
+			result = KNOT_SUCCESS;
+		msg_request_reply(req, result);
+		update_device_list(req, "get_data", msg_request_free);
+	} else if (result != KNOT_SUCCESS) {
+		if (result == KNOT_GW_FAILURE)
+			data_rejected++;
+		msg_request_complete(req, result);
+	}
 }
 
 static int8_t msg_config_resp(int node_socket, const knot_msg_item *response)
@@ -1942,6 +3481,7 @@ static int8_t msg_config_resp(int node_socket, const knot_msg_item *response)
 
 	sensor_id = response->sensor_id;
 	trust_config_confirm(trust, sensor_id);
+	trust_cache_update(trust);
 
 	hal_log_info("THING %s received config for sensor %d", trust->uuid,
 								sensor_id);
@@ -1949,170 +3489,122 @@ static int8_t msg_config_resp(int node_socket, const knot_msg_item *response)
 	return KNOT_SUCCESS;
 }
 
-/*
- * Updates de 'devices' db, removing the sensor_id that was acknowledged by the
- * THING.
- */
-static void update_device_setdata(int proto_sock, char *uuid, char *token,
-					uint8_t sensor_id)
+static void on_setdata_sent(int err, const json_raw_t *json, void *user_data)
 {
-	json_object *jobj, *jobjarray, *jobjentry, *jobjkey;
-	json_object *ajobj, *setdatajobj;
-	json_raw_t json;
-	const char *jobjstr;
-	int i, err;
-
-	memset(&json, 0, sizeof(json));
-	err = proto->fetch(proto_sock, uuid, token, &json);
-
-	if (err < 0) {
-		hal_log_error("signin(): %s(%d)", strerror(-err), -err);
-		goto done;
-	}
-
-	jobj = json_tokener_parse(json.data);
-	if (!jobj)
-		goto done;
-
-	ajobj = json_object_new_array();
-	setdatajobj = json_object_new_object();
-	/*
-	 * Getting 'set_data' from the device properties:
-	 * {"devices":[{"uuid":
-	 *		"set_data" : [
-	 *			{"sensor_id": v,
-	 *			"value": w}]
-	 * }
-	 */
-
-	/* 'set_data' is an array */
-	if (!json_object_object_get_ex(jobj, "set_data", &jobjarray))
-		goto done;
-
-	if (json_object_get_type(jobjarray) != json_type_array)
-		goto done;
-
-
-	for (i = 0; i < json_object_array_length(jobjarray); i++) {
-
-		jobjentry = json_object_array_get_idx(jobjarray, i);
-		if (!jobjentry)
-			break;
-
-		/* Getting 'sensor_id' */
-		if (!json_object_object_get_ex(jobjentry, "sensor_id",
-								&jobjkey))
-			continue;
+	struct msg_request *req = user_data;
 
-		if (json_object_get_int(jobjkey) != sensor_id) {
-			json_object_array_add(ajobj,
-						json_object_get(jobjentry));
-			continue;
-		}
-		/*
-		 * TODO: if the value changed before it was updated, the entry
-		 * should not be erased
-		 */
-	}
+	if (err < 0)
+		hal_log_error("manager data(): %s(%d)", strerror(-err), -err);
+	else
+		hal_log_info("THING %s updated data for sensor %d",
+					req->trust->uuid, req->sensor_id);
 
-	json_object_object_add(setdatajobj, "set_data", json_object_get(ajobj));
-	jobjstr = json_object_to_json_string(setdatajobj);
+	msg_request_free(req);
+}
 
-	err = proto->setdata(proto_sock, uuid, token, jobjstr, &json);
+static void on_setdata_list_updated(struct msg_request *req)
+{
+	int8_t result;
 
-done:
-	if (jobj)
-		json_object_put(jobj);
-	if (setdatajobj)
-		json_object_put(setdatajobj);
-	if (ajobj)
-		json_object_put(ajobj);
-	free(json.data);
+	result = proto_data(req, req->trust->uuid, req->trust->token,
+		req->sensor_id, req->value_type, &req->value, on_setdata_sent);
+	if (result != KNOT_SUCCESS)
+		msg_request_free(req);
 }
 
 /*
- * Works like msg_data() (copy & paste), but removes the received info from
- * the 'devices' database.
+ * Works like msg_data(), but removes the received info from the 'devices'
+ * database before sending the data.
  */
-static int8_t msg_setdata_resp(int node_socket, int proto_socket,
+static void msg_setdata_resp(struct msg_request *req,
 					const knot_msg_data *kmdata)
 {
 	int8_t result;
-	int err;
-	uint8_t sensor_id;
-	const struct trust *trust;
-	const knot_msg_schema *schema;
-	/*
-	 * Pointer to KNOT data containing header, sensor id
-	 * and a primitive KNOT type
-	 */
-	const knot_data *kdata = &(kmdata->payload);
+	struct trust *trust;
+	const struct trust_sensor *sensor;
 
-	trust = trust_map_get(node_socket);
+	trust = trust_map_get(req->node_socket);
 	if (!trust) {
 		hal_log_info("Permission denied!");
-		result = KNOT_CREDENTIAL_UNAUTHORIZED;
-		goto done;
+		msg_request_complete(req, KNOT_CREDENTIAL_UNAUTHORIZED);
+		return;
 	}
 
-	sensor_id = kmdata->sensor_id;
-	schema = trust_get_sensor_schema(trust, sensor_id);
-	if (!schema) {
-		hal_log_info("sensor_id(0x%02x): data type mismatch!",
-								sensor_id);
-		result = KNOT_INVALID_DATA;
-		goto done;
+	result = trust_check_data(trust, kmdata, &sensor);
+	if (result != KNOT_SUCCESS) {
+		msg_request_complete(req, result);
+		return;
 	}
 
-	err = knot_schema_is_valid(schema->values.type_id,
-				schema->values.value_type, schema->values.unit);
-	if (err) {
-		hal_log_info("sensor_id(0x%d), type_id(0x%04x): unit mismatch!",
-					sensor_id, schema->values.type_id);
-		result = KNOT_INVALID_DATA;
-		goto done;
-	}
+	req->trust = trust_ref(trust);
+	req->sensor_id = kmdata->sensor_id;
+	req->value_type = sensor->value_type;
+	memcpy(&req->value, &kmdata->payload, sizeof(req->value));
 
-	hal_log_info("sensor:%d, unit:%d, value_type:%d", sensor_id,
-				schema->values.unit, schema->values.value_type);
+	/* No octets to be transmitted: release the node right away */
+	msg_request_reply(req, KNOT_SUCCESS);
 
 	/* Fetches the 'devices' db */
-	update_device_setdata(proto_socket, trust->uuid, trust->token,
-								sensor_id);
+	update_device_list(req, "set_data", on_setdata_list_updated);
+}
 
-	result = proto_data(proto_socket, trust->uuid, trust->token, sensor_id,
-		schema->values.value_type, kdata);
-	if (result != KNOT_SUCCESS)
-		goto done;
+/* No connection to the cloud: requests fail, the node may send them again */
+static void msg_unavailable(int sock, const knot_msg *kreq,
+				msg_reply_cb reply_cb, void *user_data)
+{
+	struct msg_request *req;
+	uint8_t rtype;
 
-	hal_log_info("THING %s updated data for sensor %d", trust->uuid,
-								sensor_id);
-	result = KNOT_SUCCESS;
+	switch (kreq->hdr.type) {
+	case KNOT_MSG_REGISTER_REQ:
+		rtype = KNOT_MSG_REGISTER_RESP;
+		break;
+	case KNOT_MSG_UNREGISTER_REQ:
+		rtype = KNOT_MSG_UNREGISTER_RESP;
+		break;
+	case KNOT_MSG_DATA:
+		rtype = KNOT_MSG_DATA_RESP;
+		break;
+	case KNOT_MSG_AUTH_REQ:
+		rtype = KNOT_MSG_AUTH_RESP;
+		break;
+	case KNOT_MSG_SCHEMA:
+		rtype = KNOT_MSG_SCHEMA_RESP;
+		break;
+	case KNOT_MSG_SCHEMA_END:
+		rtype = KNOT_MSG_SCHEMA_END_RESP;
+		break;
+	default:
+		/* Not a request: no octets to be transmitted */
+		reply_cb(NULL, 0, user_data);
+		return;
+	}
 
-done:
-	return result;
+	req = msg_request_new(sock, -1, rtype, reply_cb, user_data);
+	msg_request_complete(req, KNOT_CLOUD_FAILURE);
+}
+
+static void mark_closed(void *data, void *user_data)
+{
+	struct msg_request *req = data;
+
+	if (req->node_socket == L_PTR_TO_INT(user_data))
+		req->closed = true;
 }
 
+void msg_node_closed(int sock)
+{
+	l_queue_foreach(requests, mark_closed, L_INT_TO_PTR(sock));
+}
 
-ssize_t msg_process(int sock, int proto_sock,
+int msg_process(int sock, int proto_sock,
 				const void *ipdu, size_t ilen,
-				void *opdu, size_t omtu)
+				msg_reply_cb reply_cb, void *user_data)
 {
 	const knot_msg *kreq = ipdu;
-	knot_msg *krsp = opdu;
-	uint8_t rtype;
-	int8_t result = KNOT_INVALID_DATA;
+	struct msg_request *req;
 	bool eof;
 
-	/* Verify if output PDU has a min length */
-	if (omtu < sizeof(knot_msg)) {
-		hal_log_error("Output PDU: invalid PDU length");
-		return -EINVAL;
-	}
-
-	/* Set a default payload length for error */
-	krsp->hdr.payload_len = sizeof(krsp->action.result);
-
 	/* At least header should be received */
 	if (ilen < sizeof(knot_msg_header)) {
 		hal_log_error("KNOT PDU: invalid minimum length");
@@ -2128,60 +3620,123 @@ ssize_t msg_process(int sock, int proto_sock,
 	hal_log_info("KNOT OP: 0x%02X LEN: %02x",
 				kreq->hdr.type, kreq->hdr.payload_len);
 
+	/* Config confirmations only update the local state */
+	if (proto_sock < 0 && kreq->hdr.type != KNOT_MSG_CONFIG_RESP) {
+		msg_unavailable(sock, kreq, reply_cb, user_data);
+		return 0;
+	}
+
 	switch (kreq->hdr.type) {
 	case KNOT_MSG_REGISTER_REQ:
-		/* Payload length is set by the caller */
-		result = msg_register(sock, proto_sock,
-							&kreq->reg, ilen, &krsp->cred);
-		rtype = KNOT_MSG_REGISTER_RESP;
+		req = msg_request_new(sock, proto_sock, KNOT_MSG_REGISTER_RESP,
+							reply_cb, user_data);
+		msg_register(req, &kreq->reg, ilen);
 		break;
 	case KNOT_MSG_UNREGISTER_REQ:
-		result = msg_unregister(sock, proto_sock);
-		rtype = KNOT_MSG_UNREGISTER_RESP;
+		req = msg_request_new(sock, proto_sock,
+				KNOT_MSG_UNREGISTER_RESP, reply_cb, user_data);
+		msg_unregister(req);
 		break;
 	case KNOT_MSG_DATA:
-		result = msg_data(sock, proto_sock, &kreq->data);
-		rtype = KNOT_MSG_DATA_RESP;
+		req = msg_request_new(sock, proto_sock, KNOT_MSG_DATA_RESP,
+							reply_cb, user_data);
+		msg_data(req, &kreq->data);
 		break;
 	case KNOT_MSG_AUTH_REQ:
-		result = msg_auth(sock, proto_sock, &kreq->auth);
-		rtype = KNOT_MSG_AUTH_RESP;
+		req = msg_request_new(sock, proto_sock, KNOT_MSG_AUTH_RESP,
+							reply_cb, user_data);
+		msg_auth(req, &kreq->auth);
 		break;
 	case KNOT_MSG_SCHEMA:
 	case KNOT_MSG_SCHEMA_END:
 		eof = kreq->hdr.type == KNOT_MSG_SCHEMA_END ? true : false;
-		result = msg_schema(sock, proto_sock, &kreq->schema, eof);
-		rtype = KNOT_MSG_SCHEMA_RESP;
-		if (eof)
-			rtype = KNOT_MSG_SCHEMA_END_RESP;
+		req = msg_request_new(sock, proto_sock,
+				eof ? KNOT_MSG_SCHEMA_END_RESP :
+				KNOT_MSG_SCHEMA_RESP, reply_cb, user_data);
+		msg_schema(req, &kreq->schema, eof);
 		break;
 	case KNOT_MSG_CONFIG_RESP:
-		result = msg_config_resp(sock, &kreq->item);
+		msg_config_resp(sock, &kreq->item);
 		/* No octets to be transmitted */
-		return 0;
+		reply_cb(NULL, 0, user_data);
+		break;
 	case KNOT_MSG_DATA_RESP:
-		result = msg_setdata_resp(sock, proto_sock, &kreq->data);
-		return 0;
+		/* No octets to be transmitted */
+		req = msg_request_new(sock, proto_sock, RESPONSE_NONE,
+							reply_cb, user_data);
+		msg_setdata_resp(req, &kreq->data);
+		break;
 	default:
 		/* TODO: reply unknown command */
+		reply_cb(NULL, 0, user_data);
 		break;
 	}
 
-	krsp->hdr.type = rtype;
-
-	krsp->action.result = result;
-
-	/* Return the actual amount of octets to be transmitted */
-	return (sizeof(knot_msg_header) + krsp->hdr.payload_len);
+	return 0;
 }
 
-int msg_start(const char *uuid, struct proto_ops *proto_ops)
+int msg_start(const struct settings *settings, struct proto_ops *proto_ops,
+				msg_push_cb push_cb, msg_close_cb close_cb)
 {
+	int err;
+
 	memset(owner_uuid, 0, sizeof(owner_uuid));
-	strncpy(owner_uuid, uuid, sizeof(owner_uuid));
+	strncpy(owner_uuid, settings->uuid, sizeof(owner_uuid));
 	proto = proto_ops;
+	push = push_cb;
+	close_node = close_cb;
+	batch_samples = settings->batch_samples;
+	batch_interval = settings->batch_interval;
+	batch_document = settings->batch_document;
 
 	trust_map_create();
+	requests = l_queue_new();
+	replays = l_hashmap_string_new();
+	auths = l_hashmap_string_new();
+	registers = l_hashmap_string_new();
+
+	/* Data is lost while the cloud is unreachable if it fails */
+	if (settings->spool_size && settings->spool_path[0]) {
+		err = store_open(settings->spool_path, settings->spool_size);
+		if (err < 0 && settings->spool_configured)
+			return err;
+		if (err < 0)
+			hal_log_error("Store-and-forward disabled");
+	}
+
+	if (settings->identity_pool) {
+		err = identity_start(settings, proto_ops);
+		if (err < 0)
+			return err;
+	}
+
+	err = reaper_start(settings, proto_ops);
+	if (err < 0)
+		return err;
+
+	/* Every authentication signs in to the cloud if it fails */
+	if (settings->cache_path[0]) {
+		err = cache_open(settings->cache_path);
+		if (err < 0 && settings->cache_configured)
+			return err;
+		if (err < 0)
+			hal_log_error("Credential cache disabled");
+	}
+
+	stats_register("auth.revoked", &auth_revoked);
+	stats_register("auth.coalesced", &auth_coalesced);
+	stats_register("register.coalesced", &register_coalesced);
+	stats_register("identity.unpatched", &identity_unpatched);
+	stats_register("schema.unchanged", &schema_unchanged);
+	stats_register("schema.timeouts", &schema_timeouts);
+	stats_register("data.forwarded", &data_forwarded);
+	stats_register("data.suppressed", &data_suppressed);
+	stats_register("data.rejected", &data_rejected);
+	stats_register("data.replay.dropped", &replay_dropped);
+	stats_register("data.batch.flushes", &batch_flushes);
+	stats_register("data.batch.samples", &batch_flushed);
+	stats_register("data.batch.dropped", &batch_dropped);
+	stats_register("data.batch.latency", &batch_latency);
 
 	return 0;
 }
@@ -2189,4 +3744,28 @@ int msg_start(const char *uuid, struct proto_ops *proto_ops)
 void msg_stop(void)
 {
 	trust_map_destroy();
+	l_hashmap_destroy(replays, NULL);
+	l_hashmap_destroy(auths, inflight_free);
+	l_hashmap_destroy(registers, inflight_free);
+	l_queue_destroy(requests, NULL);
+	requests = NULL;
+	store_close();
+	cache_close();
+	identity_stop();
+	reaper_stop();
+
+	stats_unregister(&auth_revoked);
+	stats_unregister(&auth_coalesced);
+	stats_unregister(&register_coalesced);
+	stats_unregister(&identity_unpatched);
+	stats_unregister(&schema_unchanged);
+	stats_unregister(&schema_timeouts);
+	stats_unregister(&data_forwarded);
+	stats_unregister(&data_suppressed);
+	stats_unregister(&data_rejected);
+	stats_unregister(&replay_dropped);
+	stats_unregister(&batch_flushes);
+	stats_unregister(&batch_flushed);
+	stats_unregister(&batch_dropped);
+	stats_unregister(&batch_latency);
 }
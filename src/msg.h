@@ -19,9 +19,35 @@
  *
  */
 
-int msg_start(const char *uuid, struct proto_ops *proto_ops);
+/* Sends a PDU not solicited by the node: returns 0 or a negative errno */
+typedef int (*msg_push_cb) (int sock, const void *pdu, size_t len);
+
+/* Disconnects the node, e.g. when its credentials are revoked */
+typedef void (*msg_close_cb) (int sock);
+
+int msg_start(const struct settings *settings, struct proto_ops *proto_ops,
+				msg_push_cb push_cb, msg_close_cb close_cb);
 void msg_stop(void);
 
-ssize_t msg_process(int sock, int proto_sock,
+/*
+ * Delivers the response PDU of a request. 'olen' is zero when there is
+ * nothing to be transmitted to the node.
+ */
+typedef void (*msg_reply_cb) (const void *opdu, size_t olen,
+							void *user_data);
+
+/*
+ * Returns 0 if the request was accepted: 'reply_cb' will be called exactly
+ * once, possibly before msg_process() returns. A negative errno is returned
+ * for malformed PDUs and 'reply_cb' is not called. Requests are answered
+ * with a cloud failure while 'proto_sock' is negative: cloud unreachable.
+ */
+int msg_process(int sock, int proto_sock,
 				const void *ipdu, size_t ilen,
-				void *opdu, size_t olen);
+				msg_reply_cb reply_cb, void *user_data);
+
+/*
+ * The node socket is closed and may be reused by another node: requests
+ * still waiting for the cloud complete without binding credentials to it.
+ */
+void msg_node_closed(int sock);
@@ -220,12 +220,24 @@ static int serial_accept(int srv_sockfd)
 
 static ssize_t serial_recv(int sockfd, void *buffer, size_t len)
 {
-	return read(sockfd, buffer, len);
+	return recv(sockfd, buffer, len, MSG_DONTWAIT);
 }
 
 static ssize_t serial_send(int sockfd, const void *buffer, size_t len)
 {
-	return write(sockfd, buffer, len);
+	return send(sockfd, buffer, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static int serial_recvmmsg(int sockfd, struct mmsghdr *msgs,
+							unsigned int vlen)
+{
+	return recvmmsg(sockfd, msgs, vlen, MSG_DONTWAIT, NULL);
+}
+
+static int serial_sendmmsg(int sockfd, struct mmsghdr *msgs,
+							unsigned int vlen)
+{
+	return sendmmsg(sockfd, msgs, vlen, MSG_DONTWAIT | MSG_NOSIGNAL);
 }
 
 struct node_ops serial_ops = {
@@ -236,7 +248,9 @@ struct node_ops serial_ops = {
 	.listen = serial_listen,
 	.accept = serial_accept,
 	.recv = serial_recv,
-	.send = serial_send
+	.send = serial_send,
+	.recvmmsg = serial_recvmmsg,
+	.sendmmsg = serial_sendmmsg
 };
 
 int serial_load_config(const char *tty)
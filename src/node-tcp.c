@@ -28,6 +28,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
@@ -106,12 +107,23 @@ static int tcp_accept(int srv_sockfd)
 
 static ssize_t tcp_recv(int sockfd, void *buffer, size_t len)
 {
-	return recv(sockfd, buffer, len, 0);
+	return recv(sockfd, buffer, len, MSG_DONTWAIT);
 }
 
 static ssize_t tcp_send(int sockfd, const void *buffer, size_t len)
 {
-	return send(sockfd, buffer, len, 0);
+	return send(sockfd, buffer, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static ssize_t tcp_sendv(int sockfd, const struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *) iov;
+	msg.msg_iovlen = iovcnt;
+
+	return sendmsg(sockfd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
 }
 
 struct node_ops tcp_ops = {
@@ -122,5 +134,7 @@ struct node_ops tcp_ops = {
 	.listen = tcp_listen,
 	.accept = tcp_accept,
 	.recv = tcp_recv,
-	.send = tcp_send
+	.send = tcp_send,
+	.stream = true,
+	.sendv = tcp_sendv
 };
@@ -28,6 +28,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
@@ -106,12 +107,23 @@ static int tcp6_accept(int srv_sockfd)
 
 static ssize_t tcp6_recv(int sockfd, void *buffer, size_t len)
 {
-	return recv(sockfd, buffer, len, 0);
+	return recv(sockfd, buffer, len, MSG_DONTWAIT);
 }
 
 static ssize_t tcp6_send(int sockfd, const void *buffer, size_t len)
 {
-	return send(sockfd, buffer, len, 0);
+	return send(sockfd, buffer, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static ssize_t tcp6_sendv(int sockfd, const struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *) iov;
+	msg.msg_iovlen = iovcnt;
+
+	return sendmsg(sockfd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
 }
 
 struct node_ops tcp6_ops = {
@@ -122,5 +134,7 @@ struct node_ops tcp6_ops = {
 	.listen = tcp6_listen,
 	.accept = tcp6_accept,
 	.recv = tcp6_recv,
-	.send = tcp6_send
+	.send = tcp6_send,
+	.stream = true,
+	.sendv = tcp6_sendv
 };
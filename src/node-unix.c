@@ -86,12 +86,22 @@ static int unix_accept(int srv_sockfd)
 
 static ssize_t unix_recv(int sockfd, void *buffer, size_t len)
 {
-	return recv(sockfd, buffer, len, 0);
+	return recv(sockfd, buffer, len, MSG_DONTWAIT);
 }
 
 static ssize_t unix_send(int sockfd, const void *buffer, size_t len)
 {
-	return send(sockfd, buffer, len, 0);
+	return send(sockfd, buffer, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static int unix_recvmmsg(int sockfd, struct mmsghdr *msgs, unsigned int vlen)
+{
+	return recvmmsg(sockfd, msgs, vlen, MSG_DONTWAIT, NULL);
+}
+
+static int unix_sendmmsg(int sockfd, struct mmsghdr *msgs, unsigned int vlen)
+{
+	return sendmmsg(sockfd, msgs, vlen, MSG_DONTWAIT | MSG_NOSIGNAL);
 }
 
 struct node_ops unix_ops = {
@@ -102,5 +112,7 @@ struct node_ops unix_ops = {
 	.listen = unix_listen,
 	.accept = unix_accept,
 	.recv = unix_recv,
-	.send = unix_send
+	.send = unix_send,
+	.recvmmsg = unix_recvmmsg,
+	.sendmmsg = unix_sendmmsg
 };
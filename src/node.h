@@ -22,6 +22,9 @@
 #include <stdbool.h>
 #include <unistd.h>
 
+struct iovec;
+struct mmsghdr;
+
 /*
  * This 'driver' intends to be an abstraction for Radio technologies or
  * proxy for other services using TCP or any socket based communication.
@@ -35,6 +38,17 @@ struct node_ops {
 	int (*accept) (int srv_sockfd); /* Returns a 'pollable' FD */
 	ssize_t (*recv) (int sockfd, void *buffer, size_t len);
 	ssize_t (*send) (int sockfd, const void *buffer, size_t len);
+
+	/*
+	 * Receive and send never block. Stream transports don't preserve the
+	 * PDU boundaries and may implement 'sendv' to write several PDUs at
+	 * once, otherwise 'recvmmsg' and 'sendmmsg' (optional) transfer
+	 * several PDUs in a single call.
+	 */
+	bool stream;
+	int (*recvmmsg) (int sockfd, struct mmsghdr *msgs, unsigned int vlen);
+	ssize_t (*sendv) (int sockfd, const struct iovec *iov, int iovcnt);
+	int (*sendmmsg) (int sockfd, struct mmsghdr *msgs, unsigned int vlen);
 };
 
 typedef bool (*on_accepted)(struct node_ops *node_ops, int client_socket);
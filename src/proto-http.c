@@ -25,15 +25,16 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <ctype.h>
 #include <errno.h>
 #include <string.h>
-#include <netdb.h>
 #include <stdlib.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
 #include <curl/curl.h>
 
 #include <ell/ell.h>
@@ -43,12 +44,24 @@
 #include <hal/linux_log.h>
 
 #include "settings.h"
+#include "stats.h"
 #include "proto.h"
 
 #define CURL_OP_TIMEOUT					30	/* 30 seconds */
 #define URL_SIZE					128
 #define REQUEST_SIZE					10
 #define EXPECTED_RESPONSE_ARRAY_LENGTH			1
+#define MAX_EVENTS					16
+
+/* Device polling: interval adapts to the change rate (seconds) */
+#define POLL_INTERVAL					10
+#define POLL_INTERVAL_MIN				5
+#define POLL_INTERVAL_MAX				160
+#define POLL_MAX_INFLIGHT				32
+#define ETAG_HEADER					"ETag:"
+#define IF_NONE_MATCH					"If-None-Match: "
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
 
 /* Credential registered on meshblu service */
 
@@ -64,44 +77,99 @@
 #define MESHBLU_AUTH_TOKEN			"meshblu_auth_token: "
 #define MESHBLU_AUTH_TOKEN_SIZE			sizeof(MESHBLU_AUTH_TOKEN)
 
-static struct in_addr host_addr;
-static unsigned int host_port;
 static char *host_uri;
 static char *device_uri;
 static char *data_uri;
-static struct l_hashmap *timeouts = NULL;
-static unsigned int next_timeout_id = 1;
+
+/*
+ * Polled devices: a single timer serves all the watches, sorted by the
+ * time of the next fetch.
+ */
+static struct l_hashmap *watches = NULL;
+static struct l_queue *poll_queue = NULL;
+static struct l_timeout *poll_timeout = NULL;
+static unsigned int next_watch_id = 1;
+static unsigned int poll_inflight = 0;
+
+/* Polls issued x polls answered with an unchanged device */
+static uint64_t poll_requests;
+static uint64_t poll_unchanged;
+
+/* Maps handles returned by http_connect() to its connection */
+static struct l_hashmap *conns = NULL;
+
+/* Opens connections in advance: its transfers have no callback */
+static struct http_conn *warm_conn = NULL;
+
+/* Headers of unauthenticated requests carrying a JSON body */
+static struct curl_slist *json_headers = NULL;
+
+/* Transfers that reused a cached connection x that opened a new one */
+static uint64_t conn_reused;
+static uint64_t conn_opened;
+
+/*
+ * All transfers run on a single multi handle, sharing its connection
+ * cache. curl sockets are added to a private epoll set: only this set
+ * and the curl timer are registered in the main loop.
+ */
+static CURLM *multi = NULL;
+static int multi_epfd = -1;
+static struct l_io *multi_io = NULL;
+static struct l_timeout *multi_timeout = NULL;
+
+/*
+ * Proto connection: requests issued on it run concurrently, each one on
+ * an easy handle taken from 'idle'. The upper layer sees one end of a
+ * socket pair: the driver closes its end when the connection is closed.
+ */
+struct http_conn {
+	int sock;
+	int peer;
+	struct l_queue *idle;			/* Easy handles not in use */
+	struct l_queue *requests;		/* Transfers in progress */
+	char uuid[MESHBLU_UUID_SIZE + 1];	/* Credentials in headers */
+	char token[MESHBLU_TOKEN_SIZE + 1];
+	struct curl_slist *auth_headers;	/* Authenticated requests */
+	struct curl_slist *auth_json_headers;	/* Plus JSON body */
+	struct l_queue *watches;		/* Polling timeout ids */
+};
+
+struct to_fetch;
+
+struct http_request {
+	struct http_conn *conn;
+	CURL *ch;
+	json_raw_t json;			/* Response body */
+	long status;				/* HTTP response code */
+	char *etag;				/* ETag response header */
+	struct curl_slist *headers;		/* Owned, if not shared */
+	bool check;				/* Expects a 'devices' array */
+	struct to_fetch *poll;			/* Device poll, no callback */
+	proto_cb_t cb;
+	void *user_data;
+};
 
 /* Struct used to fetch data from cloud and send to THING */
 struct to_fetch {
+	int refs;
+	unsigned int id;
+	bool busy;				/* Fetch in progress */
+	uint64_t due;				/* Next fetch: ms, monotonic */
+	unsigned int interval;			/* Seconds */
+	char *etag;				/* Last device ETag */
+	uint64_t hash;				/* Last device body hash */
 	int proto_sock;
 	char uuid[MESHBLU_UUID_SIZE+1];		/* UUID + '\0' */
 	char token[MESHBLU_TOKEN_SIZE+1];	/* TOKEN + '\0' */
-	void (*proto_watch_cb)(json_raw_t, void *);
+	void (*proto_watch_cb)(json_object *, void *);
 	void *user_data;
 	void (*proto_watch_destroy_cb) (void *);
 };
 
-/* Wrappers to ELL's timeout API that returns/removes a timeout by an ID */
-static unsigned int create_timeout(unsigned int seconds,
-	l_timeout_notify_cb_t callback, void *user_data,
-	l_timeout_destroy_cb_t destroy)
-{
-	unsigned int id = next_timeout_id++;
-	struct l_timeout *timeout = l_timeout_create(seconds, callback, user_data,
-		destroy);
-	l_hashmap_insert(timeouts, L_UINT_TO_PTR(id), timeout);
-
-	return id;
-}
-
-static void remove_timeout(unsigned int id)
-{
-	struct l_timeout *timeout = l_hashmap_remove(timeouts, L_UINT_TO_PTR(id));
-	if (!timeout)
-		return;
-	l_timeout_remove(timeout);
-}
+static void to_fetch_unref(struct to_fetch *data);
+static void poll_watch_remove(unsigned int id);
+static void poll_complete(struct http_request *req, int err);
 
 static int http2errno(long ehttp)
 {
@@ -116,26 +184,26 @@ static int http2errno(long ehttp)
 		return -ENOENT;
 	}
 
-	return -EIO;
-}
-
-static curl_socket_t opensocket(void *clientp, curlsocktype purpose,
-						struct curl_sockaddr *address)
-{
-	/* Socket is passed through CURLOPT_OPENSOCKETDATA option */
-	return *(curl_socket_t *) clientp;
-}
+	/* Other client errors: not accepted if sent again */
+	if (ehttp >= 400 && ehttp < 500)
+		return -EBADMSG;
 
-static int sockopt_callback(void *clientp, curl_socket_t curlfd,
-							curlsocktype purpose)
-{
-	/* This return code was added in libcurl 7.21.5 */
-	return CURL_SOCKOPT_ALREADY_CONNECTED;
+	return -EIO;
 }
 
-static int closesock_cb(void *clientp, curl_socket_t item)
+static int curl2errno(CURLcode result)
 {
-	return CURLE_OK;
+	switch (result) {
+	case CURLE_OPERATION_TIMEDOUT:
+		/* No answer within CURL_OP_TIMEOUT */
+		return -ETIMEDOUT;
+	case CURLE_COULDNT_RESOLVE_HOST:
+		return -EHOSTUNREACH;
+	case CURLE_COULDNT_CONNECT:
+		return -ECONNREFUSED;
+	default:
+		return -EIO;
+	}
 }
 
 static size_t write_cb(void *contents, size_t size, size_t nmemb,
@@ -159,24 +227,56 @@ static size_t write_cb(void *contents, size_t size, size_t nmemb,
 	return realsize;
 }
 
+/* Keeps the ETag of the response: used by device polling */
+static size_t header_cb(char *buffer, size_t size, size_t nitems,
+							void *user_data)
+{
+	struct http_request *req = user_data;
+	size_t realsize = size * nitems;
+	size_t start, end;
+
+	if (realsize <= sizeof(ETAG_HEADER) - 1 ||
+		strncasecmp(buffer, ETAG_HEADER, sizeof(ETAG_HEADER) - 1))
+		return realsize;
+
+	start = sizeof(ETAG_HEADER) - 1;
+	while (start < realsize && buffer[start] == ' ')
+		start++;
+
+	end = realsize;
+	while (end > start && (buffer[end - 1] == '\r' ||
+					buffer[end - 1] == '\n' ||
+					buffer[end - 1] == ' '))
+		end--;
+
+	l_free(req->etag);
+	req->etag = end > start ? l_strndup(buffer + start, end - start) :
+									NULL;
+
+	return realsize;
+}
+
 static int check_json(const char *json_str, json_raw_t *json)
 {
 	size_t realsize;
 	const char *jobjstr;
 	json_object *jobj, *jres, *jobjarray;
 
+	if (json_str == NULL)
+		return -1;
+
 	jobj = json_tokener_parse(json_str);
 
 	if (jobj == NULL)
 		return -1;
 
 	if (!json_object_object_get_ex(jobj, "devices", &jobjarray))
-		return -1;
+		goto fail;
 
 	if (json_object_get_type(jobjarray) != json_type_array ||
 			json_object_array_length(jobjarray) !=
 					EXPECTED_RESPONSE_ARRAY_LENGTH)
-		return -1;
+		goto fail;
 
 	jres = json_object_array_get_idx(jobjarray, 0);
 	jobjstr = json_object_to_json_string(jres);
@@ -186,6 +286,7 @@ static int check_json(const char *json_str, json_raw_t *json)
 	json->data = (char *) realloc(json->data, realsize);
 	if (json->data == NULL) {
 		hal_log_error("Not enough memory");
+		json_object_put(jobj);
 		return -ENOMEM;
 	}
 
@@ -195,77 +296,90 @@ static int check_json(const char *json_str, json_raw_t *json)
 	json_object_put(jobj);
 
 	return 0;
+
+fail:
+	json_object_put(jobj);
+	return -1;
 }
 
-/* Fetch and return url body via curl */
-static int fetch_url(int sockfd, const char *action, const char *json,
-			const char *uuid, const char *token,
-			json_raw_t *fetch, const char *request)
+static struct curl_slist *append_json_headers(struct curl_slist *headers)
+{
+	headers = curl_slist_append(headers, "Accept: application/json");
+	headers = curl_slist_append(headers, "Content-Type: application/json");
+	headers = curl_slist_append(headers, "charsets: utf-8");
+
+	return headers;
+}
+
+static struct curl_slist *create_auth_headers(const char *uuid,
+					const char *token, bool json)
 {
 	char token_hdr[MESHBLU_AUTH_TOKEN_SIZE + MESHBLU_TOKEN_SIZE];
 	char uuid_hdr[MESHBLU_AUTH_UUID_SIZE + MESHBLU_UUID_SIZE];
-	char upcase_request[REQUEST_SIZE + 1];
 	struct curl_slist *headers = NULL;
-	CURL *ch;
-	CURLcode rcode;
-	long ehttp;
-	size_t i;
 
-	if (!request || !fetch) {
-		hal_log_error("Invalid argument!");
-		return -EINVAL;
-	}
+	snprintf(uuid_hdr, sizeof(uuid_hdr), "%s%s", MESHBLU_AUTH_UUID, uuid);
+	snprintf(token_hdr, sizeof(token_hdr), "%s%s", MESHBLU_AUTH_TOKEN,
+									token);
 
-	hal_log_info("action: %s", action);
+	headers = curl_slist_append(headers, uuid_hdr);
+	headers = curl_slist_append(headers, token_hdr);
 
-	ch = curl_easy_init();
-	if (ch == NULL) {
-		hal_log_error("curl_easy_init(): init failed");
-		return -ENOMEM;
-	}
+	return json ? append_json_headers(headers) : headers;
+}
 
-	if (fetch->data)
-		free(fetch->data);
+/*
+ * Authentication headers are rebuilt only if the credentials change.
+ * Lists in use by transfers in progress can't be replaced: a private
+ * list is returned in 'owned' to be released by the request.
+ */
+static struct curl_slist *conn_get_auth_headers(struct http_conn *conn,
+	const char *uuid, const char *token, bool json,
+	struct curl_slist **owned)
+{
+	if (conn->auth_headers && !strcmp(conn->uuid, uuid) &&
+					!strcmp(conn->token, token))
+		goto done;
 
-	fetch->data = NULL;
-	fetch->size = 0;
+	if (!l_queue_isempty(conn->requests)) {
+		*owned = create_auth_headers(uuid, token, json);
+		return *owned;
+	}
 
-	strncpy(upcase_request, request, sizeof(upcase_request));
-	for (i = 0; i < strlen(upcase_request); i++)
-		upcase_request[i] = toupper(upcase_request[i]);
+	curl_slist_free_all(conn->auth_headers);
+	curl_slist_free_all(conn->auth_json_headers);
 
-	curl_easy_setopt(ch, CURLOPT_CUSTOMREQUEST, upcase_request);
+	strncpy(conn->uuid, uuid, MESHBLU_UUID_SIZE);
+	strncpy(conn->token, token, MESHBLU_TOKEN_SIZE);
 
-	curl_easy_setopt(ch, CURLOPT_URL, action);
+	conn->auth_headers = create_auth_headers(uuid, token, false);
+	conn->auth_json_headers = create_auth_headers(uuid, token, true);
 
-	hal_log_info("HTTP(%s): %s", upcase_request, action);
+done:
+	return json ? conn->auth_json_headers : conn->auth_headers;
+}
 
-	if (uuid && token) {
+static struct http_conn *conn_get(int sock)
+{
+	return l_hashmap_lookup(conns, L_INT_TO_PTR(sock));
+}
 
-		snprintf(uuid_hdr, sizeof(uuid_hdr), "%s%s",
-						MESHBLU_AUTH_UUID, uuid);
-		headers = curl_slist_append(headers, uuid_hdr);
-		snprintf(token_hdr, sizeof(token_hdr), "%s%s",
-					MESHBLU_AUTH_TOKEN, token);
-		headers = curl_slist_append(headers, token_hdr);
-		hal_log_info(" AUTH: %s\n       %s", uuid, token);
-	}
+static CURL *conn_get_handle(struct http_conn *conn)
+{
+	CURL *ch;
 
-	if (json) {
-		headers = curl_slist_append(headers,
-						"Accept: application/json");
-		headers = curl_slist_append(headers,
-					    "Content-Type: application/json");
-		headers = curl_slist_append(headers, "charsets: utf-8");
-		curl_easy_setopt(ch, CURLOPT_POSTFIELDS, json);
-		hal_log_info(" JSON TX: %s", json);
-	}
+	ch = l_queue_pop_head(conn->idle);
+	if (ch)
+		return ch;
 
-	if (headers)
-		curl_easy_setopt(ch, CURLOPT_HTTPHEADER, headers);
+	ch = curl_easy_init();
+	if (ch == NULL) {
+		hal_log_error("curl_easy_init(): init failed");
+		return NULL;
+	}
 
 	curl_easy_setopt(ch, CURLOPT_WRITEFUNCTION, write_cb);
-	curl_easy_setopt(ch, CURLOPT_WRITEDATA, fetch);
+	curl_easy_setopt(ch, CURLOPT_HEADERFUNCTION, header_cb);
 	curl_easy_setopt(ch, CURLOPT_USERAGENT, "libcurl-agent/1.0");
 
 	/* TODO: make sure that it is smaller than KNOT timeout */
@@ -273,94 +387,414 @@ static int fetch_url(int sockfd, const char *action, const char *json,
 	curl_easy_setopt(ch, CURLOPT_FOLLOWLOCATION, 1L);
 	curl_easy_setopt(ch, CURLOPT_MAXREDIRS, 1L);
 	curl_easy_setopt(ch, CURLOPT_NOPROGRESS, 1L);
+	curl_easy_setopt(ch, CURLOPT_TCP_KEEPALIVE, 1L);
 
-	if (sockfd > 0) {
-		curl_easy_setopt(ch, CURLOPT_OPENSOCKETFUNCTION, opensocket);
-		curl_easy_setopt(ch, CURLOPT_OPENSOCKETDATA, &sockfd);
-		curl_easy_setopt(ch, CURLOPT_SOCKOPTFUNCTION, sockopt_callback);
-		curl_easy_setopt(ch, CURLOPT_CLOSESOCKETFUNCTION, closesock_cb);
-		curl_easy_setopt(ch, CURLOPT_CLOSESOCKETDATA, &sockfd);
-	}
+	return ch;
+}
 
-	rcode = curl_easy_perform(ch);
+static void request_free(struct http_request *req)
+{
+	/* Easy handle goes back to the connection to be reused */
+	l_queue_push_tail(req->conn->idle, req->ch);
+	curl_slist_free_all(req->headers);
+	free(req->json.data);
+	l_free(req->etag);
 
-	curl_slist_free_all(headers);
+	if (req->poll)
+		to_fetch_unref(req->poll);
 
-	if (rcode != CURLE_OK) {
-		curl_easy_cleanup(ch);
-		hal_log_error("curl_easy_perform(): %s(%d)",
-					curl_easy_strerror(rcode), rcode);
-		return -EIO;
+	l_free(req);
+}
+
+static void request_complete(struct http_request *req, int err)
+{
+	int ret;
+
+	l_queue_remove(req->conn->requests, req);
+
+	if (err == 0 && req->check && check_json(req->json.data,
+							&req->json) < 0)
+		err = -EINVAL;
+
+	if (req->poll) {
+		poll_complete(req, err);
+		request_free(req);
+		return;
 	}
 
-	rcode = curl_easy_getinfo(ch, CURLINFO_RESPONSE_CODE, &ehttp);
+	if (!req->cb) {
+		request_free(req);
+		return;
+	}
+
+	/* Callback owns the response body */
+	ret = proto_complete(req->cb, req->user_data, err, &req->json);
+	if (ret < 0)
+		hal_log_error("HTTP completion: %s(%d)", strerror(-ret), -ret);
+
+	req->json.data = NULL;
+
+	request_free(req);
+}
+
+static void request_done(struct http_request *req, CURLcode result)
+{
+	CURLcode rcode;
+	long ehttp, nconnects;
+
+	if (result != CURLE_OK) {
+		hal_log_error("curl_multi: %s(%d)",
+					curl_easy_strerror(result), result);
+		request_complete(req, curl2errno(result));
+		return;
+	}
 
-	curl_easy_cleanup(ch);
+	/* New connections created to perform the transfer */
+	if (curl_easy_getinfo(req->ch, CURLINFO_NUM_CONNECTS,
+					&nconnects) == CURLE_OK) {
+		if (nconnects > 0)
+			conn_opened++;
+		else
+			conn_reused++;
+	}
 
+	rcode = curl_easy_getinfo(req->ch, CURLINFO_RESPONSE_CODE, &ehttp);
 	if (rcode != CURLE_OK) {
 		hal_log_error("curl_easy_getinfo(): %s(%d)",
 					curl_easy_strerror(rcode), rcode);
-		return -EIO;
+		request_complete(req, -EIO);
+		return;
 	}
 
-	if (fetch->data)
-		hal_log_info(" JSON RX: %s", fetch->data);
+	req->status = ehttp;
+
+	if (req->json.data)
+		hal_log_info(" JSON RX: %s", req->json.data);
 	else
 		hal_log_info(" JSON RX: Empty");
 
 	hal_log_info("HTTP: %ld", ehttp);
 
-	return http2errno(ehttp);
+	request_complete(req, http2errno(ehttp));
 }
 
-static int http_connect(void)
+static void check_multi_info(void)
 {
-	struct sockaddr_in server;
-	int sock, err;
+	struct http_request *req;
+	CURLMsg *msg;
+	CURL *ch;
+	int pending;
 
-	/*
-	 * TODO: At the moment connect is blocking. Does it make
-	 * sense to use asynchronous communication or use fork/pthread?
-	 */
-	sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (sock == -1) {
-		err = errno;
-		hal_log_error("Meshblu socket(): %s(%d)", strerror(err), err);
-		return -err;
+	while ((msg = curl_multi_info_read(multi, &pending))) {
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+
+		ch = msg->easy_handle;
+		curl_easy_getinfo(ch, CURLINFO_PRIVATE, (char **) &req);
+		curl_multi_remove_handle(multi, ch);
+
+		request_done(req, msg->data.result);
 	}
+}
 
-	memset(&server, 0, sizeof(server));
-	server.sin_family = AF_INET;
-	server.sin_addr.s_addr = host_addr.s_addr;
-	server.sin_port = htons(host_port);
+static bool on_multi_events(struct l_io *io, void *user_data)
+{
+	struct epoll_event events[MAX_EVENTS];
+	int i, n, running, flags;
+
+	n = epoll_wait(multi_epfd, events, MAX_EVENTS, 0);
+	for (i = 0; i < n; i++) {
+		flags = (events[i].events & EPOLLIN ? CURL_CSELECT_IN : 0) |
+			(events[i].events & EPOLLOUT ? CURL_CSELECT_OUT : 0) |
+			(events[i].events & (EPOLLERR | EPOLLHUP) ?
+						CURL_CSELECT_ERR : 0);
+		curl_multi_socket_action(multi, events[i].data.fd, flags,
+								&running);
+	}
 
-	if (connect(sock, (struct sockaddr *) &server, sizeof(server)) < 0) {
-		err = errno;
-		hal_log_error("Meshblu connect(): %s(%d)", strerror(err), err);
+	check_multi_info();
+
+	return true;
+}
+
+static void on_multi_timeout(struct l_timeout *timeout, void *user_data)
+{
+	int running;
+
+	curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &running);
+
+	check_multi_info();
+}
+
+/* CURLMOPT_SOCKETFUNCTION: mirror curl sockets into the epoll set */
+static int multi_socket_cb(CURL *ch, curl_socket_t s, int what,
+					void *userp, void *socketp)
+{
+	struct epoll_event ev;
+	int op;
+
+	if (what == CURL_POLL_REMOVE) {
+		epoll_ctl(multi_epfd, EPOLL_CTL_DEL, s, NULL);
+		return 0;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = s;
+	ev.events = (what & CURL_POLL_IN ? EPOLLIN : 0) |
+				(what & CURL_POLL_OUT ? EPOLLOUT : 0);
+
+	/* 'socketp' is set once the socket is part of the set */
+	op = socketp ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (epoll_ctl(multi_epfd, op, s, &ev) < 0) {
+		hal_log_error("epoll_ctl(): %s(%d)", strerror(errno), errno);
+		return -1;
+	}
+
+	curl_multi_assign(multi, s, L_INT_TO_PTR(1));
+
+	return 0;
+}
+
+/* CURLMOPT_TIMERFUNCTION: single timer required by the multi handle */
+static int multi_timer_cb(CURLM *cm, long timeout_ms, void *userp)
+{
+	if (timeout_ms < 0) {
+		l_timeout_remove(multi_timeout);
+		multi_timeout = NULL;
+		return 0;
+	}
+
+	/* Zero means now: run on the next loop iteration */
+	if (timeout_ms == 0)
+		timeout_ms = 1;
+
+	if (multi_timeout)
+		l_timeout_modify_ms(multi_timeout, timeout_ms);
+	else
+		multi_timeout = l_timeout_create_ms(timeout_ms,
+					on_multi_timeout, NULL, NULL);
+
+	return 0;
+}
+
+static struct http_request *request_new(struct http_conn *conn)
+{
+	struct http_request *req;
+	CURL *ch;
+
+	if (!conn)
+		return NULL;
+
+	ch = conn_get_handle(conn);
+	if (ch == NULL)
+		return NULL;
+
+	req = l_new(struct http_request, 1);
+	req->conn = conn;
+	req->ch = ch;
+
+	return req;
+}
+
+/*
+ * Starts a transfer and returns immediately: completion is reported from
+ * the main loop once the response arrives. 'req' is released on failure.
+ * Headers previously assigned to 'req' take precedence.
+ */
+static int request_start(struct http_request *req, const char *action,
+			const char *json, const char *uuid, const char *token,
+			const char *request)
+{
+	char upcase_request[REQUEST_SIZE + 1];
+	struct curl_slist *headers = NULL;
+	struct http_conn *conn = req->conn;
+	CURLMcode mcode;
+	CURL *ch = req->ch;
+	size_t i;
+
+	hal_log_info("action: %s", action);
 
-		close(sock);
+	strncpy(upcase_request, request, sizeof(upcase_request));
+	for (i = 0; i < strlen(upcase_request); i++)
+		upcase_request[i] = toupper(upcase_request[i]);
+
+	/* Handle is reused: reset body and method of the last request */
+	if (json) {
+		curl_easy_setopt(ch, CURLOPT_COPYPOSTFIELDS, json);
+		hal_log_info(" JSON TX: %s", json);
+	} else {
+		curl_easy_setopt(ch, CURLOPT_POSTFIELDS, NULL);
+		curl_easy_setopt(ch, CURLOPT_HTTPGET, 1L);
+	}
+
+	curl_easy_setopt(ch, CURLOPT_CUSTOMREQUEST, upcase_request);
+
+	curl_easy_setopt(ch, CURLOPT_URL, action);
+
+	hal_log_info("HTTP(%s): %s", upcase_request, action);
+
+	if (req->headers)
+		headers = req->headers;
+	else if (uuid && token)
+		headers = conn_get_auth_headers(conn, uuid, token,
+						json != NULL, &req->headers);
+	else if (json)
+		headers = json_headers;
+
+	if (uuid && token)
+		hal_log_info(" AUTH: %s\n       %s", uuid, token);
+
+	curl_easy_setopt(ch, CURLOPT_HTTPHEADER, headers);
+
+	curl_easy_setopt(ch, CURLOPT_WRITEDATA, &req->json);
+	curl_easy_setopt(ch, CURLOPT_HEADERDATA, req);
+	curl_easy_setopt(ch, CURLOPT_PRIVATE, req);
+
+	mcode = curl_multi_add_handle(multi, ch);
+	if (mcode != CURLM_OK) {
+		hal_log_error("curl_multi_add_handle(): %s(%d)",
+					curl_multi_strerror(mcode), mcode);
+		request_free(req);
+		return -EIO;
+	}
+
+	l_queue_push_tail(conn->requests, req);
+
+	return 0;
+}
+
+/*
+ * Starts a transfer and returns immediately: 'cb' is called from the
+ * main loop once the response arrives.
+ */
+static int fetch_url(int sock, const char *action, const char *json,
+			const char *uuid, const char *token,
+			const char *request, bool check,
+			proto_cb_t cb, void *user_data)
+{
+	struct http_request *req;
+
+	if (!request) {
+		hal_log_error("Invalid argument!");
+		return -EINVAL;
+	}
+
+	req = request_new(conn_get(sock));
+	if (!req)
+		return -EBADF;
+
+	req->check = check;
+	req->cb = cb;
+	req->user_data = user_data;
+
+	return request_start(req, action, json, uuid, token, request);
+}
+
+static void conn_free(struct http_conn *conn)
+{
+	struct http_request *req;
+	unsigned int timeout_id;
+
+	/* Polling watches don't outlive the connection */
+	while ((timeout_id = L_PTR_TO_UINT(l_queue_pop_head(conn->watches))))
+		poll_watch_remove(timeout_id);
+
+	l_queue_destroy(conn->watches, NULL);
+
+	/* Transfers in progress are aborted */
+	while ((req = l_queue_peek_head(conn->requests))) {
+		curl_multi_remove_handle(multi, req->ch);
+		request_complete(req, -ECONNRESET);
+	}
+
+	l_queue_destroy(conn->requests, NULL);
+	l_queue_destroy(conn->idle, (l_queue_destroy_func_t) curl_easy_cleanup);
+	curl_slist_free_all(conn->auth_headers);
+	curl_slist_free_all(conn->auth_json_headers);
+
+	/* Upper layer gets HUP and releases its end */
+	if (conn->peer >= 0)
+		close(conn->peer);
+
+	l_free(conn);
+}
+
+static struct http_conn *conn_new(int sock, int peer)
+{
+	struct http_conn *conn;
+
+	conn = l_new(struct http_conn, 1);
+	conn->sock = sock;
+	conn->peer = peer;
+	conn->idle = l_queue_new();
+	conn->requests = l_queue_new();
+	conn->watches = l_queue_new();
+
+	return conn;
+}
+
+/*
+ * Cloud status is requested in parallel: the connections are kept by
+ * curl and reused by the first sessions.
+ */
+static void warm_up(unsigned int count)
+{
+	char uri[strlen(host_uri) + sizeof("/status")];
+	struct http_request *req;
+	unsigned int i;
+
+	snprintf(uri, sizeof(uri), "%s/status", host_uri);
+
+	warm_conn = conn_new(-1, -1);
+
+	for (i = 0; i < count; i++) {
+		req = request_new(warm_conn);
+		if (!req)
+			break;
+
+		if (request_start(req, uri, NULL, NULL, NULL, "GET") < 0)
+			break;
+	}
+}
+
+/*
+ * No TCP connection is opened here: curl connects on the first request
+ * and keeps the connection alive to be reused by the next ones.
+ */
+static int http_connect(void)
+{
+	struct http_conn *conn;
+	int sv[2];
+	int err;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		err = errno;
+		hal_log_error("socketpair(): %s(%d)", strerror(err), err);
 		return -err;
 	}
 
-	return sock;
+	conn = conn_new(sv[0], sv[1]);
+
+	l_hashmap_insert(conns, L_INT_TO_PTR(conn->sock), conn);
+
+	return conn->sock;
 }
 
-static int http_mknode(int sock, const char *jreq, json_raw_t *json)
+static int http_mknode(int sock, const char *jreq,
+					proto_cb_t cb, void *user_data)
 {
 	/*
 	 * HTTP 201: Created
-	 * Return '0' if device has been created or a negative value
+	 * Completes with '0' if device has been created or a negative value
 	 * mapped to generic Linux -errno codes.
 	 */
-
-	return fetch_url(sock, device_uri, jreq, NULL, NULL, json, "POST");
-
+	return fetch_url(sock, device_uri, jreq, NULL, NULL, "POST", false,
+							cb, user_data);
 }
 
 static int http_signin(int sock, const char *uuid, const char *token,
-							json_raw_t *json)
+					proto_cb_t cb, void *user_data)
 {
-	int err;
 	/* Length: device_uri + '/' + UUID + '\0' */
 	char uri[strlen(device_uri) + 2 + MESHBLU_UUID_SIZE];
 
@@ -368,21 +802,15 @@ static int http_signin(int sock, const char *uuid, const char *token,
 
 	/*
 	 * HTTP 200: OK
-	 * Return '0' if signin not fails or a negative value
+	 * Completes with '0' if signin not fails or a negative value
 	 * mapped to generic Linux -errno codes.
 	 */
-	err = fetch_url(sock, uri, NULL, uuid, token, json, "GET");
-	if (err < 0)
-		return err;
-
-	if (check_json(json->data, json) < 0)
-		return -EINVAL;
-
-	return err;
+	return fetch_url(sock, uri, NULL, uuid, token, "GET", true,
+							cb, user_data);
 }
 
 static int http_rmnode(int sock, const char *uuid, const char *token,
-							json_raw_t *jbuf)
+					proto_cb_t cb, void *user_data)
 {
 	/* Length: device_uri + '/' + UUID + '\0' */
 	char uri[strlen(device_uri) + 2 + MESHBLU_UUID_SIZE];
@@ -391,15 +819,15 @@ static int http_rmnode(int sock, const char *uuid, const char *token,
 
 	/*
 	 * HTTP 200: OK
-	 * Return '0' if rmnode not fails or a negative value
+	 * Completes with '0' if rmnode not fails or a negative value
 	 * mapped to generic Linux -errno codes.
 	 */
-
-	return fetch_url(sock, uri, NULL, uuid, token, jbuf, "DELETE");
+	return fetch_url(sock, uri, NULL, uuid, token, "DELETE", false,
+							cb, user_data);
 }
 
 static int http_schema(int sock, const char *uuid, const char *token,
-					const char *jreq, json_raw_t *json)
+		const char *jreq, proto_cb_t cb, void *user_data)
 {
 	/* Length: device_uri + '/' + UUID + '\0' */
 	char uri[strlen(device_uri) + 2 + MESHBLU_UUID_SIZE];
@@ -408,15 +836,15 @@ static int http_schema(int sock, const char *uuid, const char *token,
 
 	/*
 	 * HTTP 200: OK
-	 * Return '0' if schema not fails or a negative value
+	 * Completes with '0' if schema not fails or a negative value
 	 * mapped to generic Linux -errno codes.
 	 */
-
-	return fetch_url(sock, uri, jreq, uuid, token, json, "PUT");
+	return fetch_url(sock, uri, jreq, uuid, token, "PUT", false,
+							cb, user_data);
 }
 
 static int http_data(int sock, const char *uuid, const char *token,
-					     const char *jreq, json_raw_t *json)
+		const char *jreq, proto_cb_t cb, void *user_data)
 {
 	/* Length: data_uri + '/' + UUID + '\0' */
 	char uri[strlen(data_uri) + 2 + MESHBLU_UUID_SIZE];
@@ -425,72 +853,131 @@ static int http_data(int sock, const char *uuid, const char *token,
 
 	/*
 	 * HTTP 200: OK
-	 * Return '0' if data not fails or a negative value
+	 * Completes with '0' if data not fails or a negative value
 	 * mapped to generic Linux -errno codes.
 	 */
-
-	return fetch_url(sock, uri, jreq, uuid, token, json, "POST");
+	return fetch_url(sock, uri, jreq, uuid, token, "POST", false,
+							cb, user_data);
 }
 
 static void http_close(int sock)
 {
+	struct http_conn *conn;
+
+	conn = l_hashmap_remove(conns, L_INT_TO_PTR(sock));
+	if (!conn)
+		return;
+
+	conn_free(conn);
 }
 
-static int http_probe(const char *host, unsigned int port)
+static int http_probe(const char *host, unsigned int port,
+					const struct proto_pool *pool)
 {
-	struct hostent *hostent;
 	int err;
 
-	/* TODO: connect and track TCP socket */
-
 	/* TODO: Add timer if it fails? */
 
+	multi_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (multi_epfd < 0) {
+		err = errno;
+		hal_log_error("epoll_create1(): %s(%d)", strerror(err), err);
+		return -err;
+	}
+
+	multi = curl_multi_init();
+	if (multi == NULL) {
+		hal_log_error("curl_multi_init(): init failed");
+		close(multi_epfd);
+		multi_epfd = -1;
+		return -ENOMEM;
+	}
+
+	curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, multi_socket_cb);
+	curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, multi_timer_cb);
+
+	/*
+	 * Transfers of all sessions share the connections of the multi
+	 * handle and carry the device credentials in the headers. Pooled:
+	 * transfers wait for a free connection instead of opening a new one.
+	 * Connections are picked by curl, the policy doesn't apply here.
+	 */
+	if (pool->size) {
+		curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+							(long) pool->size);
+		curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+							(long) pool->size);
+	}
+
+	multi_io = l_io_new(multi_epfd);
+	l_io_set_close_on_destroy(multi_io, true);
+	l_io_set_read_handler(multi_io, on_multi_events, NULL, NULL);
+
 	if (host)
 		host_uri = l_strdup_printf("%s:%u", host, port);
 	else
 		host_uri = l_strdup_printf("%s:%u", DEFAULT_SERVER_URI, port);
 
-	host_port = port;
 	device_uri = l_strdup_printf("%s/devices", host_uri);
 	data_uri = l_strdup_printf("%s/data", host_uri);
 
-	/*
-	 * TODO: gethostbyname() is obslote. Need to change it.
-	 * From man gethostbyname :
-	 * DESCRIPTION
-	 * The gethostbyname*(), gethostbyaddr*(), herror(), and hstrerror()
-	 * functions are obsolete.  Applications should  use  getaddrinfo(3),
-	 * getnameinfo(3), and gai_strerror(3) instead.
-	 */
-	hostent = gethostbyname(host);
-	if  (hostent == NULL) {
-		err = h_errno;
-		hal_log_error("gethostbyname(%s): %s (%d)", host_uri,
-						       strerror(err), err);
-		return -err;
-	}
+	json_headers = append_json_headers(NULL);
 
-	host_addr.s_addr = *((unsigned long *) hostent->h_addr_list[0]);
+	watches = l_hashmap_new();
+	poll_queue = l_queue_new();
+	conns = l_hashmap_new();
 
-	hal_log_info("Meshblu IP: %s", inet_ntoa(host_addr));
+	stats_register("http.connections.opened", &conn_opened);
+	stats_register("http.connections.reused", &conn_reused);
+	stats_register("http.poll.requests", &poll_requests);
+	stats_register("http.poll.unchanged", &poll_unchanged);
 
-	timeouts = l_hashmap_new();
+	warm_up(pool->size ? MIN(pool->idle, pool->size) : pool->idle);
 
 	return 0;
 }
 
 static void http_remove(void)
 {
-	if (timeouts)
-		l_hashmap_destroy(timeouts,
-			(l_hashmap_destroy_func_t) l_timeout_remove);
+	stats_unregister(&conn_opened);
+	stats_unregister(&conn_reused);
+	stats_unregister(&poll_requests);
+	stats_unregister(&poll_unchanged);
+
+	if (warm_conn) {
+		conn_free(warm_conn);
+		warm_conn = NULL;
+	}
+
+	/* Watches are removed along with its connection */
+	if (conns)
+		l_hashmap_destroy(conns, (l_hashmap_destroy_func_t) conn_free);
+
+	l_hashmap_destroy(watches, NULL);
+	watches = NULL;
+	l_queue_destroy(poll_queue, NULL);
+	poll_queue = NULL;
+	l_timeout_remove(poll_timeout);
+	poll_timeout = NULL;
+
+	curl_multi_cleanup(multi);
+	multi = NULL;
+
+	l_timeout_remove(multi_timeout);
+	multi_timeout = NULL;
+
+	l_io_destroy(multi_io);
+	multi_io = NULL;
+	multi_epfd = -1;
+
+	curl_slist_free_all(json_headers);
 	l_free(host_uri);
 	l_free(device_uri);
 	l_free(data_uri);
 }
 
 static int http_setdata(int sock, const char *uuid, const char *token,
-					const char *jreq, json_raw_t *json)
+		const char *jreq, proto_cb_t cb, void *user_data)
 {
 	/* Length: device_uri + '/' + UUID + '\0' */
 	char uri[strlen(device_uri) + 2 + MESHBLU_UUID_SIZE];
@@ -499,18 +986,17 @@ static int http_setdata(int sock, const char *uuid, const char *token,
 
 	/*
 	 * HTTP 200: OK
-	 * Return '0' if schema not fails or a negative value
+	 * Completes with '0' if schema not fails or a negative value
 	 * mapped to generic Linux -errno codes.
 	 */
-
-	return fetch_url(sock, uri, jreq, uuid, token, json, "PUT");
+	return fetch_url(sock, uri, jreq, uuid, token, "PUT", false,
+							cb, user_data);
 }
 
 /* Gets all the data from the device with the given uuid and token */
 static int http_fetch(int sock, const char *uuid, const char *token,
-							json_raw_t *json)
+					proto_cb_t cb, void *user_data)
 {
-	int err;
 	/* Length: device_uri + '/' + UUID + '\0' */
 	char uri[strlen(device_uri) + 2 + MESHBLU_UUID_SIZE];
 
@@ -518,73 +1004,253 @@ static int http_fetch(int sock, const char *uuid, const char *token,
 
 	/*
 	* HTTP 200: OK
-	* Return '0' if config not fails or a negative value
+	* Completes with '0' if config not fails or a negative value
 	* mapped to generic Linux -errno codes.
 	*/
-	err = fetch_url(sock, uri, NULL, uuid, token, json, "GET");
-	if (err < 0)
-		return err;
+	return fetch_url(sock, uri, NULL, uuid, token, "GET", true,
+							cb, user_data);
+}
 
-	if (check_json(json->data, json) < 0)
-		return -EINVAL;
+static struct to_fetch *to_fetch_ref(struct to_fetch *data)
+{
+	data->refs++;
 
-	return err;
+	return data;
 }
 
-/*
- * Gets the data from the device with the passed uuid and token and sends it to
- * msg.c to parse and then send to the THING if necessary
- */
-static void proto_poll(struct l_timeout *timeout, void *user_data)
+static void to_fetch_unref(struct to_fetch *data)
 {
-	struct to_fetch *data = user_data;
-	int result;
-	json_raw_t json;
+	if (--data->refs > 0)
+		return;
 
-	memset(&json, 0, sizeof(json_raw_t));
-	result = http_fetch(data->proto_sock, data->uuid,
-						data->token, &json);
-	/*
-	 * TODO: Remove all HTTP specific headers from JSON before sending to
-	 * msg.c.
-	 */
-	if (result) {
-		hal_log_error("signin(): %s(%d)", strerror(-result), -result);
+	l_free(data->etag);
+	l_free(data);
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* FNV-1a: detects unchanged bodies when the cloud doesn't send ETags */
+static uint64_t body_hash(const char *body)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (; *body; body++) {
+		hash ^= (uint8_t) *body;
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+static int due_cmp(const void *a, const void *b, void *user_data)
+{
+	const struct to_fetch *data_a = a;
+	const struct to_fetch *data_b = b;
+
+	if (data_a->due == data_b->due)
+		return 0;
+
+	return data_a->due < data_b->due ? -1 : 1;
+}
+
+static void on_poll_timeout(struct l_timeout *timeout, void *user_data);
+
+/* Arms the timer to the first due watch */
+static void poll_timer_update(void)
+{
+	const struct to_fetch *data;
+	uint64_t now, ms;
+
+	data = l_queue_peek_head(poll_queue);
+	if (!data || poll_inflight >= POLL_MAX_INFLIGHT) {
+		l_timeout_remove(poll_timeout);
+		poll_timeout = NULL;
 		return;
 	}
 
-	data->proto_watch_cb(json, data->user_data);
+	now = now_ms();
+	ms = data->due > now ? data->due - now : 1;
+
+	if (poll_timeout)
+		l_timeout_modify_ms(poll_timeout, ms);
+	else
+		poll_timeout = l_timeout_create_ms(ms, on_poll_timeout,
+								NULL, NULL);
+}
+
+static void poll_schedule(struct to_fetch *data)
+{
+	data->due = now_ms() + data->interval * 1000;
+	l_queue_insert(poll_queue, data, due_cmp, NULL);
+}
+
+static int poll_start(struct to_fetch *data)
+{
+	char header[sizeof(IF_NONE_MATCH) +
+				(data->etag ? strlen(data->etag) : 0)];
+	char uri[strlen(device_uri) + 2 + MESHBLU_UUID_SIZE];
+	struct http_request *req;
+
+	req = request_new(conn_get(data->proto_sock));
+	if (!req)
+		return -EBADF;
+
+	/* Conditional request: 304 if the device didn't change */
+	req->headers = create_auth_headers(data->uuid, data->token, false);
+	if (data->etag) {
+		snprintf(header, sizeof(header), "%s%s", IF_NONE_MATCH,
+								data->etag);
+		req->headers = curl_slist_append(req->headers, header);
+	}
+
+	req->check = true;
+	req->poll = to_fetch_ref(data);
+
+	snprintf(uri, sizeof(uri), "%s/%s", device_uri, data->uuid);
+
+	return request_start(req, uri, NULL, data->uuid, data->token, "GET");
+}
+
+/*
+ * Gets the data from the due devices and sends it to msg.c to parse and
+ * then send to the THING if necessary
+ */
+static void on_poll_timeout(struct l_timeout *timeout, void *user_data)
+{
+	struct to_fetch *data;
+	uint64_t now = now_ms();
+	int err;
+
+	while (poll_inflight < POLL_MAX_INFLIGHT) {
+		data = l_queue_peek_head(poll_queue);
+		if (!data || data->due > now)
+			break;
+
+		l_queue_pop_head(poll_queue);
+
+		err = poll_start(data);
+		if (err < 0) {
+			hal_log_error("poll(): %s(%d)", strerror(-err), -err);
+			poll_schedule(data);
+			continue;
+		}
+
+		data->busy = true;
+		poll_inflight++;
+		poll_requests++;
+	}
 
-	free(json.data);
+	poll_timer_update();
 }
 
-static void on_proto_poll_destroyed(void *user_data)
+/*
+ * Idle devices are polled less often: the interval doubles each time the
+ * device is found unchanged and goes back to the minimum after a change.
+ */
+static void poll_complete(struct http_request *req, int err)
 {
-	struct to_fetch *fetch_data = user_data;
+	struct to_fetch *data = req->poll;
+	bool changed = false;
+	json_object *device;
+	uint64_t hash;
+
+	req->poll = NULL;
+	data->busy = false;
+	poll_inflight--;
+
+	/* Watch removed while fetching */
+	if (!data->proto_watch_cb)
+		goto done;
+
+	if (req->status == 304) {
+		poll_unchanged++;
+	} else if (err < 0) {
+		hal_log_error("poll(): %s(%d)", strerror(-err), -err);
+	} else {
+		if (req->etag) {
+			l_free(data->etag);
+			data->etag = l_strdup(req->etag);
+		}
+
+		/*
+		 * TODO: Remove all HTTP specific headers from JSON before
+		 * sending to msg.c.
+		 */
+		hash = body_hash(req->json.data);
+		if (hash != data->hash) {
+			data->hash = hash;
+			changed = true;
+
+			/* Parsed once for all the views of msg.c */
+			device = json_tokener_parse(req->json.data);
+			if (device) {
+				data->proto_watch_cb(device, data->user_data);
+				json_object_put(device);
+			}
+		} else
+			poll_unchanged++;
+	}
+
+	if (changed)
+		data->interval = POLL_INTERVAL_MIN;
+	else
+		data->interval = MIN(data->interval * 2, POLL_INTERVAL_MAX);
+
+	poll_schedule(data);
 
-	if (fetch_data->proto_watch_destroy_cb)
-		fetch_data->proto_watch_destroy_cb(fetch_data->user_data);
-	l_free(fetch_data);
+done:
+	to_fetch_unref(data);
+	poll_timer_update();
 }
 
-static void on_proto_destroyed(void *user_data)
+static void poll_watch_remove(unsigned int id)
 {
-	unsigned int timeout_watch_id = L_PTR_TO_UINT(user_data);
-	remove_timeout(timeout_watch_id);
+	struct to_fetch *data;
+
+	data = l_hashmap_remove(watches, L_UINT_TO_PTR(id));
+	if (!data)
+		return;
+
+	l_queue_remove(poll_queue, data);
+	poll_timer_update();
+
+	if (data->proto_watch_destroy_cb)
+		data->proto_watch_destroy_cb(data->user_data);
+
+	/* A fetch in progress may still reference it */
+	data->proto_watch_cb = NULL;
+	to_fetch_unref(data);
 }
 
 /*
  * Watch or poll the cloud to changes in the device.
+ *
+ * Meshblu authenticates each request with the credentials of a single
+ * device, so devices can't be fetched in batch: polls are conditional
+ * and adaptive instead.
  */
 static unsigned int http_async(int proto_sock, const char *uuid,
-	const char *token, void (*proto_watch_cb)	(json_raw_t, void *),
+	const char *token, void (*proto_watch_cb) (json_object *, void *),
 	void *user_data, void (*proto_watch_destroy_cb) (void *))
 {
-	unsigned int timeout_id;
 	struct to_fetch *fetch_data;
-	struct l_io *proto_io;
+	struct http_conn *conn;
+
+	conn = conn_get(proto_sock);
+	if (!conn)
+		return 0;
 
 	fetch_data = l_new(struct to_fetch, 1);
+	fetch_data->refs = 1;
+	fetch_data->id = next_watch_id++;
+	fetch_data->interval = POLL_INTERVAL;
 	memcpy(fetch_data->uuid, uuid, MESHBLU_UUID_SIZE+1);
 	memcpy(fetch_data->token, token, MESHBLU_TOKEN_SIZE+1);
 	fetch_data->proto_sock = proto_sock;
@@ -592,20 +1258,24 @@ static unsigned int http_async(int proto_sock, const char *uuid,
 	fetch_data->user_data = user_data;
 	fetch_data->proto_watch_destroy_cb = proto_watch_destroy_cb;
 
-	timeout_id = create_timeout(10, proto_poll, fetch_data,
-		on_proto_poll_destroyed);
+	l_hashmap_insert(watches, L_UINT_TO_PTR(fetch_data->id), fetch_data);
+	l_queue_push_tail(conn->watches, L_UINT_TO_PTR(fetch_data->id));
 
-	proto_io = l_io_new(fetch_data->proto_sock);
-	l_io_set_disconnect_handler(proto_io, NULL,
-		L_UINT_TO_PTR(timeout_id), on_proto_destroyed);
+	poll_schedule(fetch_data);
+	poll_timer_update();
 
-	return L_PTR_TO_UINT(proto_io);
+	return fetch_data->id;
 }
 
 static void http_async_stop(int sock, unsigned int watch_id)
 {
-	struct l_io *proto_io = L_UINT_TO_PTR(watch_id);
-	l_io_destroy(proto_io);
+	struct http_conn *conn;
+
+	conn = conn_get(sock);
+	if (conn)
+		l_queue_remove(conn->watches, L_UINT_TO_PTR(watch_id));
+
+	poll_watch_remove(watch_id);
 }
 
 struct proto_ops proto_http = {
@@ -24,10 +24,14 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 
 #include <libwebsockets.h>
 
@@ -39,9 +43,16 @@
 
 #include "settings.h"
 #include "proto.h"
+#include "stats.h"
+#include "json-writer.h"
 
 #define MAX_PAYLOAD		4096
-#define SERVICE_TIMEOUT		100
+#define REQUEST_LEN		128	/* Initial size of credential events */
+#define MAX_EVENTS		16
+#define MAX_ACK_PENDING		32	/* Pipelined requests per connection */
+#define PING_INTERVAL		25000	/* ms: Engine.IO default */
+#define IDLE_RETRY		5	/* s: reconnects idle links */
+#define REQUEST_TIMEOUT		30	/* s: answer of a request */
 #define IDENTIFY_REQUEST	"[\"identify\"]"
 #define READY_RESPONSE		"[\"ready\""
 #define NOT_READY_RESPONSE	"[\"notReady\""
@@ -52,41 +63,105 @@
 #define CLOUD_PATH		"/socket.io/?EIO=4&transport=websocket"
 #define DEFAULT_CLOUD_HOST	"localhost"
 #define DEVICE_INDEX		0
-#define OPERATION_PREFIX	420
-#define MESSAGE_PREFIX		42
+#define WS_PROTOCOL		"http-only"
+#define EVENT_PREFIX		"42"	/* Engine.IO message, Socket.IO event */
+#define SIO_EVENT		'2'
+#define SIO_ACK			'3'
 
 static struct lws_context *context;
-static struct l_timeout *timeout = NULL;
 static struct l_hashmap *wstable = NULL;
-static bool got_response = false;
-static bool connection_error = false;
-static bool connected = false;
-static bool client_connection_error = false;
-static bool ready = false;
 static char *host_address = "localhost";
 static int host_port = 3000;
-static struct l_queue *wsis = NULL;
-static int conn_index = 0;
+
+/*
+ * Upstream connections. Pooled: at most 'pool.size' links are shared by
+ * all the sessions, otherwise each session has a link of its own.
+ */
+static struct proto_pool pool;
+static struct l_queue *links = NULL;
+
+/*
+ * Not pooled: links connected in advance, waiting for a session. Sessions
+ * created when none is available wait for the cloud connection.
+ */
+static struct l_queue *idle_links = NULL;
+static struct l_timeout *idle_timeout = NULL;
+static uint64_t connect_warm;
+static uint64_t connect_cold;
+
+/*
+ * libwebsockets sockets are not watched individually: they are added to
+ * a private epoll set and only this set is registered in the main loop.
+ */
+static int lws_epfd = -1;
+static struct l_io *lws_io = NULL;
+
+/* Services lws internal timeouts while connections are being established */
+static struct l_timeout *lws_timeout = NULL;
+static int connecting = 0;
 
 /* Struct used to fetch data from cloud and send to THING */
 struct to_fetch {
-	int sock;
+	unsigned int id;
 	void *user_data;
-	void (*watch_cb)(json_raw_t, void *);
+	void (*watch_cb)(json_object *, void *);
 	void (*watch_destroy_cb) (void *);
 };
 
-struct per_session_data_ws {
-	int index;
+/* Expected answer for a message sent to the cloud */
+enum ws_reply {
+	WS_REPLY_NONE,		/* Complete once written */
+	WS_REPLY_READY,		/* "ready" or "notReady" */
+	WS_REPLY_JSON,		/* Acknowledgement carrying a JSON */
+};
+
+struct ws_conn;
+
+struct ws_request {
+	struct ws_conn *conn;	/* Issuer: NULL if already gone */
+	char *msg;		/* Socket.IO event arguments */
+	size_t len;
+	enum ws_reply reply;
+	unsigned int ack;	/* Socket.IO ack id: WS_REPLY_JSON only */
+	char *uuid;		/* Fetch the device once ready */
+	proto_cb_t cb;		/* NULL: nobody waits for the answer */
+	void *user_data;
+	struct l_timeout *deadline;	/* Armed while 'cb' is set */
+};
+
+/* Socket.IO connection to the cloud */
+struct ws_link {
+	struct lws *wsi;
+	bool shared;			/* Pooled: devices identified per request */
+	bool identified;		/* "identify" received: ready for TX */
+	bool closing;
+	unsigned int detaching;		/* Sessions closed in a batch */
+	bool ping;			/* EIO_PING waiting to be written */
+	unsigned int ping_interval;	/* ms */
+	struct l_timeout *ping_timeout;
+	struct l_queue *conns;		/* Sessions using this link */
+	struct l_queue *tx;		/* Requests waiting to be written */
+	struct l_queue *acks;		/* Written, waiting for the ack */
+	struct ws_request *identity;	/* Waiting for "ready" */
+	unsigned int next_ack;
 	/*
 	 * This buffer MUST have LWS_PRE bytes valid BEFORE the pointer. this
 	 * is defined in the lws documentation,
 	 */
 	unsigned char buffer[LWS_PRE + MAX_PAYLOAD];
-	unsigned int len;
-	char *json;
+};
+
+/*
+ * The upper layer sees one end of a socket pair: the driver closes its
+ * end when the cloud connection goes down, notifying the disconnection.
+ */
+struct ws_conn {
+	int sock;			/* Handle returned by ws_connect() */
+	int peer;			/* Driver end of the handle */
+	struct ws_link *link;
+	char *uuid;			/* Shared link: subscribed device */
+	char *token;
 	struct to_fetch data;
-	struct timeval interval;
 };
 
 /*
@@ -103,80 +178,342 @@ enum packet_type {
 	EIO_NOOP
 };
 
-struct handshake_data {
-	const char *sid;
-	int pingInterval;
-	int pingTimeout;
-};
+static unsigned int next_watch_id = 1;
 
-static struct handshake_data *h_data = NULL;
-static struct per_session_data_ws *psd;
+static void ws_request_free(struct ws_request *req)
+{
+	l_timeout_remove(req->deadline);
+	l_free(req->msg);
+	l_free(req->uuid);
+	l_free(req);
+}
 
-static void *queue_at(struct l_queue *queue, unsigned int index)
+/* Callback is called from the main loop, after the request is released */
+static void ws_request_complete(struct ws_request *req, int err,
+							json_raw_t *json)
 {
-	unsigned int i = 0;
-	const struct l_queue_entry *current = l_queue_get_entries(queue);
-	while (current && i < index) {
-		current = current->next;
-		i++;
+	int ret;
+
+	if (!req->cb)
+		goto done;
+
+	ret = proto_complete(req->cb, req->user_data, err, json);
+	if (ret < 0)
+		hal_log_error("WS completion: %s(%d)", strerror(-ret), -ret);
+
+done:
+	ws_request_free(req);
+}
+
+/* The request stays queued to match a late answer, which is discarded */
+static void ws_request_abandon(struct ws_request *req, int err)
+{
+	int ret;
+
+	ret = proto_complete(req->cb, req->user_data, err, NULL);
+	if (ret < 0)
+		hal_log_error("WS completion: %s(%d)", strerror(-ret), -ret);
+
+	l_timeout_remove(req->deadline);
+	req->deadline = NULL;
+	req->cb = NULL;
+}
+
+static void link_kick(struct ws_link *link);
+
+static void on_request_deadline(struct l_timeout *timeout, void *user_data)
+{
+	struct ws_request *req = user_data;
+	struct ws_link *link = req->conn->link;
+
+	hal_log_error("WS: request timed out");
+
+	/* Releases its slot: a late ack is discarded as unexpected */
+	if (l_queue_remove(link->acks, req) || l_queue_remove(link->tx, req)) {
+		ws_request_complete(req, -ETIMEDOUT, NULL);
+		link_kick(link);
+		return;
 	}
 
-	return current ? current->data : NULL;
+	/* Identity: "ready" is still matched to it */
+	ws_request_abandon(req, -ETIMEDOUT);
 }
 
-static bool queue_cmp_direct(const void *a, const void *b)
+static void on_lws_timeout(struct l_timeout *timeout, void *user_data)
+{
+	/* Handles connection and handshake timeouts */
+	lws_service_fd(context, NULL);
+
+	l_timeout_modify(timeout, 1);
+}
+
+static void connecting_inc(void)
+{
+	if (connecting++ == 0)
+		lws_timeout = l_timeout_create(1, on_lws_timeout, NULL, NULL);
+}
+
+static void connecting_dec(void)
+{
+	if (--connecting > 0)
+		return;
+
+	l_timeout_remove(lws_timeout);
+	lws_timeout = NULL;
+}
+
+static void on_ping_timeout(struct l_timeout *timeout, void *user_data)
+{
+	struct ws_link *link = user_data;
+
+	/* Send EIO_PING and expects EIO_PONG */
+	link->ping = true;
+	lws_callback_on_writable(link->wsi);
+
+	lws_service_fd(context, NULL);
+
+	l_timeout_modify_ms(timeout, link->ping_interval);
+}
+
+static void on_watch_destroyed(struct to_fetch *data)
+{
+	if (data->watch_destroy_cb)
+		data->watch_destroy_cb(data->user_data);
+
+	data->id = 0;
+	data->watch_cb = NULL;
+	data->user_data = NULL;
+	data->watch_destroy_cb = NULL;
+}
+
+static void conn_free(struct ws_conn *conn)
+{
+	l_hashmap_remove(wstable, L_INT_TO_PTR(conn->sock));
+
+	on_watch_destroyed(&conn->data);
+
+	/* Upper layer gets HUP and releases its end */
+	close(conn->peer);
+
+	l_free(conn->uuid);
+	l_free(conn->token);
+	l_free(conn);
+}
+
+static bool link_match(const void *a, const void *b)
 {
 	return a == b;
 }
 
-static bool queue_remove(struct l_queue *queue, void *data)
+/*
+ * Releases the link: pending requests are completed with 'err' and the
+ * sessions using it are disconnected.
+ */
+static void on_idle_timeout(struct l_timeout *timeout, void *user_data);
+
+static void link_destroy(struct ws_link *link, int err)
+{
+	struct ws_request *req;
+
+	l_queue_remove(links, link);
+
+	/* Cloud unavailable or idle link closed: retry later */
+	if (l_queue_remove(idle_links, link) && !idle_timeout)
+		idle_timeout = l_timeout_create(IDLE_RETRY, on_idle_timeout,
+								NULL, NULL);
+
+	if (!link->identified)
+		connecting_dec();
+
+	l_timeout_remove(link->ping_timeout);
+
+	if (link->identity)
+		ws_request_complete(link->identity, err, NULL);
+
+	while ((req = l_queue_pop_head(link->acks)))
+		ws_request_complete(req, err, NULL);
+
+	while ((req = l_queue_pop_head(link->tx)))
+		ws_request_complete(req, err, NULL);
+
+	l_queue_destroy(link->acks, NULL);
+	l_queue_destroy(link->tx, NULL);
+	l_queue_destroy(link->conns, (l_queue_destroy_func_t) conn_free);
+
+	l_free(link);
+}
+
+/*
+ * Connection is asynchronous: requests are queued and written once the
+ * cloud identifies the link.
+ */
+static struct ws_link *link_new(bool shared)
 {
+	struct lws_client_connect_info info;
+	struct ws_link *link;
+	bool use_ssl = false; /* wss */
+
+	hal_log_info("Connecting to %s:%u...", host_address, host_port);
+
+	link = l_new(struct ws_link, 1);
+	link->shared = shared;
+	link->ping_interval = PING_INTERVAL;
+	link->conns = l_queue_new();
+	link->tx = l_queue_new();
+	link->acks = l_queue_new();
+
+	memset(&info, 0, sizeof(info));
+	info.context = context;
+	info.ssl_connection = use_ssl;
+	info.address = host_address;
+	info.port = host_port;
+	info.path = CLOUD_PATH;
+	info.host = info.address;
+	info.origin = info.address;
+	info.ietf_version_or_minus_one = -1;
+	info.protocol = WS_PROTOCOL;
+	/* Session data is owned by the driver */
+	info.userdata = link;
+
+	l_queue_push_tail(links, link);
+	connecting_inc();
+
 	/*
-	 * Don't actually remove so that the entry count doesn't change and
-	 * it is possible to access an element by index (see queue_at())
+	 * Connect via info is a non blocking method, it returns a websocket
+	 * instance that becomes usable once the cloud sends "identify".
 	 */
-	return l_queue_find(queue, queue_cmp_direct, data) != NULL;
+	link->wsi = lws_client_connect_via_info(&info);
+	if (!link->wsi) {
+		/* Connection error callback may have released it already */
+		if (l_queue_find(links, link_match, link))
+			link_destroy(link, -ECONNREFUSED);
+
+		return NULL;
+	}
+
+	return link;
+}
+
+/* Connects links until there are 'pool.idle' of them waiting */
+static void idle_refill(void)
+{
+	struct ws_link *link;
+
+	while (l_queue_length(idle_links) < pool.idle) {
+		link = link_new(false);
+		if (!link) {
+			if (!idle_timeout)
+				idle_timeout = l_timeout_create(IDLE_RETRY,
+						on_idle_timeout, NULL, NULL);
+			break;
+		}
+
+		l_queue_push_tail(idle_links, link);
+	}
 }
 
-static void send_ping(const void *key, void *value, void *user_data)
+static void on_idle_timeout(struct l_timeout *timeout, void *user_data)
 {
-	struct timeval *timenow = user_data;
-	struct per_session_data_ws *p;
-	struct lws *ws;
+	l_timeout_remove(idle_timeout);
+	idle_timeout = NULL;
+
+	idle_refill();
+}
 
-	p = (struct per_session_data_ws *) value;
-	if (timenow->tv_sec - p->interval.tv_sec > 10) {
-		gettimeofday(&p->interval, NULL);
+static void count_conns(void *data, void *user_data)
+{
+	struct ws_link *link = data;
+	struct ws_link **least = user_data;
 
-		/* Send EIO_PING and expects EIO_PONG */
-		p->len = snprintf((char *) p->buffer + LWS_PRE,
-						MAX_PAYLOAD, "%d", EIO_PING);
+	if (!link->closing && (*least == NULL ||
+		l_queue_length(link->conns) < l_queue_length((*least)->conns)))
+		*least = link;
+}
+
+/* Picks a link of the pool according to the policy, opening it if needed */
+static struct ws_link *link_get(void)
+{
+	struct ws_link *link = NULL;
 
-		ws = queue_at(wsis, p->index);
+	if (!pool.size) {
+		link = l_queue_pop_head(idle_links);
+		if (link)
+			connect_warm++;
+		else
+			connect_cold++;
 
-		lws_callback_on_writable(ws);
-		lws_service(context, SERVICE_TIMEOUT);
+		/* Replaces the taken link: done before the cold connection */
+		if (!idle_timeout)
+			idle_refill();
+
+		if (!link)
+			link = link_new(false);
+
+		return link;
 	}
+
+	if (l_queue_length(links) < pool.size) {
+		if (pool.policy == PROTO_POOL_ROUND_ROBIN)
+			return link_new(true);
+
+		/* Least loaded: open a new link instead of sharing one */
+		l_queue_foreach(links, count_conns, &link);
+		if (!link || l_queue_length(link->conns) > 0)
+			return link_new(true);
+
+		return link;
+	}
+
+	if (pool.policy == PROTO_POOL_LEAST_LOADED) {
+		l_queue_foreach(links, count_conns, &link);
+		return link;
+	}
+
+	/* Round robin: the head goes to the end of the queue */
+	link = l_queue_pop_head(links);
+	l_queue_push_tail(links, link);
+
+	return link;
+}
+
+/* Checks if the next queued request can be written */
+static bool link_can_write(struct ws_link *link)
+{
+	const struct ws_request *req;
+
+	req = l_queue_peek_head(link->tx);
+	if (!req)
+		return false;
+
+	/* Identity is answered by an event: one at a time */
+	if (req->reply == WS_REPLY_READY)
+		return link->identity == NULL;
+
+	if (req->reply == WS_REPLY_JSON)
+		return l_queue_length(link->acks) < MAX_ACK_PENDING;
+
+	return true;
 }
 
-static void timeout_ws(struct l_timeout *timeout, void *user_data)
+static void link_kick(struct ws_link *link)
 {
-	struct timeval timenow;
+	if (!link->wsi || !link->identified)
+		return;
+
+	if (!link_can_write(link))
+		return;
 
-	gettimeofday(&timenow, NULL);
-	lws_service(context, SERVICE_TIMEOUT);
-	/* check if some socket needs to send ping */
-	l_hashmap_foreach(wstable, send_ping, &timenow);
+	lws_callback_on_writable(link->wsi);
 }
 
-static int handle_response(json_raw_t *json)
+static int handle_response(const char *resp, json_raw_t *json)
 {
 	size_t realsize;
 	json_object *jobj, *jres, *jprop, *jschema, *jschema_val;
 	int has_schema;
 	const char *jobjstringres;
 
-	jres = json_tokener_parse(psd->json);
+	jres = json_tokener_parse(resp);
 	if (jres == NULL)
 		return -EINVAL;
 
@@ -201,6 +538,7 @@ static int handle_response(json_raw_t *json)
 	json->data = (char *) realloc(json->data, json->size + realsize);
 	if (json->data == NULL) {
 		hal_log_error("Not enough memory");
+		json_object_put(jres);
 		return -ENOMEM;
 	}
 
@@ -212,443 +550,526 @@ static int handle_response(json_raw_t *json)
 	return 0;
 }
 
-static void parse_handshake_data(const char *json_str)
+static void parse_handshake_data(struct ws_link *link, const char *json_str)
 {
-	json_object *jobj, *jsid, *jtimeout, *jinterval;
+	json_object *jobj, *jinterval;
 
 	jobj = json_tokener_parse(json_str);
+	if (!jobj)
+		return;
+
 	/*
 	 * During connection establishment a JSON is received with a socket id
 	 * (sid), pingInterval - frequency the client should ping the server and
 	 * pingTimeout - time to disconnect after not receiving a pong
 	 */
-	if (!json_object_object_get_ex(jobj, "sid", &jsid))
-		goto done;
-	if (!json_object_object_get_ex(jobj, "pingInterval", &jinterval))
-		goto done;
-	if (!json_object_object_get_ex(jobj, "pingTimeout", &jtimeout))
-		goto done;
-
-	h_data = l_new(struct handshake_data, 1);
-
-	h_data->sid = json_object_get_string(jsid);
-	h_data->pingInterval = json_object_get_int(jinterval);
-	h_data->pingTimeout = json_object_get_int(jtimeout);
+	if (json_object_object_get_ex(jobj, "pingInterval", &jinterval) &&
+					json_object_get_int(jinterval) > 0)
+		link->ping_interval = json_object_get_int(jinterval);
 
-	/* TODO: Send ping every h_data.pingInterval; */
-done:
-	if (h_data) {
-		l_free(h_data);
-		h_data = NULL;
-	}
 	json_object_put(jobj);
 }
 
-static void ws_close(int sock)
+static struct ws_request *ws_request_new(const char *jstr,
+	enum ws_reply reply, proto_cb_t cb, void *user_data)
 {
-	struct lws *ws;
+	struct ws_request *req;
 
-	/*
-	 * When a thing disconnects the close callback is called. Then we
-	 * find its alloted resources at the 'wstable' and 'wsis' list
-	 * and free them.
-	 */
-	psd = l_hashmap_lookup(wstable, L_INT_TO_PTR(sock));
-	if (!psd)
-		return;
+	req = l_new(struct ws_request, 1);
+	req->msg = l_strdup(jstr);
+	req->len = strlen(req->msg);
+	req->reply = reply;
+	req->cb = cb;
+	req->user_data = user_data;
 
-	ws = queue_at(wsis, psd->index);
-	lws_callback_on_writable(ws);
-	lws_service(context, SERVICE_TIMEOUT);
+	/* Unanswered requests don't hold their callers forever */
+	if (cb)
+		req->deadline = l_timeout_create(REQUEST_TIMEOUT,
+					on_request_deadline, req, NULL);
 
-	if (!queue_remove(wsis, ws))
-		hal_log_error("Removing wsi: no wsi found for sock %d", sock);
-
-	if (!l_hashmap_remove(wstable, L_INT_TO_PTR(sock))) {
-		hal_log_error("Removing key: sock %d not found!", sock);
-		return;
-	}
-	l_free(psd->json);
-	l_free(psd);
+	return req;
 }
 
-static int ws_mknode(int sock, const char *device_json, json_raw_t *json)
+/*
+ * Queues a Socket.IO event to the cloud. Events are written as soon as the
+ * socket becomes writable, without waiting for the previous answers: acks
+ * are matched to the requests by id and 'cb' is called when it arrives.
+ */
+static int link_submit(struct ws_link *link, struct ws_conn *conn,
+		const char *jstr, enum ws_reply reply, const char *uuid,
+		proto_cb_t cb, void *user_data)
 {
-	int err;
-	json_object *jobj, *jarray;
-	const char *jobjstring;
-	struct lws *ws;
+	struct ws_request *req;
 
-	psd = l_hashmap_lookup(wstable, L_INT_TO_PTR(sock));
-	if (!psd)
+	if (link->closing)
 		return -EINVAL;
 
-	jobj = json_tokener_parse(device_json);
-	if (jobj == NULL)
-		return -EINVAL;
-
-	jarray = json_object_new_array();
-	json_object_array_add(jarray, json_object_new_string("register"));
-	json_object_array_add(jarray, jobj);
-	jobjstring = json_object_to_json_string(jarray);
-
-	ws = queue_at(wsis, psd->index);
-	if (ws == NULL) {
-		err = -EBADF;
-		hal_log_error("Not found");
-		goto done;
-	}
-	/*
-	 * Since the size of psd->buffer is LWS_PRE + MAX_PAYLOAD bytes and the
-	 * buffer is offset by LWS_PRE, this means there are only MAX_PAYLOAD
-	 * bytes left to write.
-	 */
-	psd->len = snprintf((char *) psd->buffer + LWS_PRE, MAX_PAYLOAD,
-					"%d%s", OPERATION_PREFIX, jobjstring);
+	req = ws_request_new(jstr, reply, cb, user_data);
 	/*
-	 * lws_callback_on_writable tells libwebsockets there is data to be sent
-	 * As soon as possible LWS_CALLBACK_CLIENT_WRITEABLE will be triggered
-	 * and psd->buffer will be written. Meanwhile, lws_service keeps the
-	 * context 'alive' until server responds or an error occurs. Since knotd
-	 * wasn't designed to be completely asynchronous, the operations on
-	 * msg.c expects a blocking behavior, so this while forces it. Every
-	 * message received will trigger a LWS_CALLBACK_CLIENT_RECEIVE. Once
-	 * the server responds, the got_response flag will be set to true and
-	 * we leave the loop. Since all messages are serialized by the unix
-	 * socket between radio daemon (eg: nrfd, lorad) and knotd, there is no
-	 * problem in using a global 'per session data (psd)' and flags, they
-	 * won't be overwritten.
+	 * Since the size of link->buffer is LWS_PRE + MAX_PAYLOAD bytes and
+	 * the buffer is offset by LWS_PRE, this means there are only
+	 * MAX_PAYLOAD bytes left to write: prefix and ack id included.
 	 */
-	lws_callback_on_writable(ws);
-	hal_log_info("WS JSON TX: %s", jobjstring);
-	while (!got_response && !connection_error)
-		lws_service(context, SERVICE_TIMEOUT);
+	if (req->len + sizeof(EVENT_PREFIX) + 10 > MAX_PAYLOAD) {
+		ws_request_free(req);
+		return -EMSGSIZE;
+	}
 
-	if (connection_error)
-		err = -ECONNRESET;
+	req->conn = conn;
+	req->uuid = l_strdup(uuid);
 
-	err = handle_response(json);
-	if (err < 0)
-		goto done;
-done:
-	connection_error = false;
-	got_response = false;
+	hal_log_info("WS JSON TX: %s", jstr);
 
-	json_object_put(jarray);
+	l_queue_push_tail(link->tx, req);
+	link_kick(link);
 
-	return err;
+	return 0;
 }
 
-static int ws_device(int sock, const char *uuid,
-					const char *token, json_raw_t *json)
+static int ws_submit(int sock, const char *jstr, enum ws_reply reply,
+		const char *uuid, proto_cb_t cb, void *user_data)
 {
-	int err;
-	const char *jobjstring;
-	json_object *jobj, *jarray;
-	struct lws *ws;
+	struct ws_conn *conn;
 
-	psd = l_hashmap_lookup(wstable, L_INT_TO_PTR(sock));
-	if (!psd)
+	conn = l_hashmap_lookup(wstable, L_INT_TO_PTR(sock));
+	if (!conn)
 		return -EINVAL;
 
-	jobj = json_object_new_object();
-	jarray = json_object_new_array();
+	return link_submit(conn->link, conn, jstr, reply, uuid,
+							cb, user_data);
+}
 
-	if (!jobj || !jarray) {
-		hal_log_error("JSON: no memory");
-		err = -ENOMEM;
-		return err;
-	}
+static bool is_shared(int sock)
+{
+	struct ws_conn *conn;
 
-	json_object_object_add(jobj, "uuid", json_object_new_string(uuid));
+	conn = l_hashmap_lookup(wstable, L_INT_TO_PTR(sock));
 
-	json_object_array_add(jarray,
-	json_object_new_string("device"));
-	json_object_array_add(jarray, jobj);
+	return conn && conn->link->shared;
+}
 
-	jobjstring = json_object_to_json_string(jarray);
+/* ["event", {"uuid": ..., "token": ...}]: 'token' is optional */
+static char *credentials_request(const char *event, const char *uuid,
+							const char *token)
+{
+	struct json_writer w;
+	char *jstr;
+
+	json_writer_init_alloc(&w, REQUEST_LEN);
+	json_writer_begin_array(&w);
+	json_writer_string(&w, event);
+	json_writer_begin_object(&w);
+	json_writer_key(&w, "uuid");
+	json_writer_string(&w, uuid);
+	if (token) {
+		json_writer_key(&w, "token");
+		json_writer_string(&w, token);
+	}
+	json_writer_end_object(&w);
+	json_writer_end_array(&w);
 
-	hal_log_info("WS JSON TX %s", jobjstring);
+	jstr = json_writer_finish(&w);
+	if (!jstr)
+		hal_log_error("JSON: %s", strerror(-w.err));
 
-	ws = queue_at(wsis, psd->index);
-	if (ws == NULL) {
-		hal_log_error("Not found");
-		err = -EBADF;
-		goto done;
-	}
+	return jstr;
+}
 
-	psd->len = snprintf((char *)&psd->buffer + LWS_PRE, MAX_PAYLOAD, "%d%s",
-						OPERATION_PREFIX, jobjstring);
-	lws_callback_on_writable(ws);
+static void conn_unsubscribe(struct ws_conn *conn)
+{
+	char *jstr;
 
-	while (!got_response && !connection_error)
-		lws_service(context, SERVICE_TIMEOUT);
+	if (!conn->uuid)
+		return;
 
-	if (connection_error) {
-		err = -ECONNREFUSED;
-		goto done;
-	}
+	jstr = credentials_request("unsubscribe", conn->uuid, conn->token);
+	if (jstr)
+		link_submit(conn->link, NULL, jstr, WS_REPLY_NONE, NULL,
+								NULL, NULL);
+	l_free(jstr);
 
-	err = handle_response(json);
+	l_free(conn->uuid);
+	l_free(conn->token);
+	conn->uuid = NULL;
+	conn->token = NULL;
+}
 
-done:
-	got_response = false;
-	connection_error = false;
+static bool request_of(const void *data, const void *user_data)
+{
+	const struct ws_request *req = data;
 
-	json_object_put(jarray);
+	return req->conn == user_data;
+}
 
-	return err;
+static void abort_request(void *data, void *user_data)
+{
+	struct ws_request *req = data;
+
+	if (req->conn != user_data || !req->cb)
+		return;
+
+	ws_request_abandon(req, -ECONNRESET);
+	req->conn = NULL;
 }
 
-static int ws_signin(int sock, const char *uuid, const char *token,
-							json_raw_t *json)
+/* Removes a session from a shared link, which remains connected */
+static void conn_detach(struct ws_conn *conn)
 {
-	int err;
-	const char *jobjstring;
-	json_object *jobj, *jarray;
-	struct lws *ws;
+	struct ws_link *link = conn->link;
+	struct ws_request *req;
 
-	psd = l_hashmap_lookup(wstable, L_INT_TO_PTR(sock));
-	if (!psd)
-		return -EINVAL;
+	while ((req = l_queue_remove_if(link->tx, request_of, conn)))
+		ws_request_complete(req, -ECONNRESET, NULL);
 
-	jobj = json_object_new_object();
-	jarray = json_object_new_array();
+	l_queue_foreach(link->acks, abort_request, conn);
 
-	if (!jobj || !jarray) {
-		hal_log_error("JSON: no memory");
-		err = -ENOMEM;
-		return err;
-	}
+	conn_unsubscribe(conn);
 
-	json_object_object_add(jobj, "uuid", json_object_new_string(uuid));
-	json_object_object_add(jobj, "token", json_object_new_string(token));
+	l_queue_remove(link->conns, conn);
+	conn_free(conn);
+}
 
-	json_object_array_add(jarray,
-	json_object_new_string("identity"));
-	json_object_array_add(jarray, jobj);
+/* Sessions using the link are released once libwebsockets closes it */
+static void link_close(struct ws_link *link)
+{
+	/* Not given to new sessions meanwhile */
+	l_queue_remove(links, link);
 
-	jobjstring = json_object_to_json_string(jarray);
+	link->closing = true;
 
-	hal_log_info("WS TX JSON %s", jobjstring);
+	if (link->wsi)
+		lws_callback_on_writable(link->wsi);
+	else
+		link_destroy(link, -ECONNRESET);
+}
 
-	ws = queue_at(wsis, psd->index);
+static void ws_close(int sock)
+{
+	struct ws_conn *conn;
+	struct ws_link *link;
 
-	if (ws == NULL) {
-		hal_log_error("Not found");
-		err = -EBADF;
-		goto done;
+	/*
+	 * When a thing disconnects the close callback is called. Then we
+	 * find its alloted resources at the 'wstable' and free them once
+	 * libwebsockets closes the connection.
+	 */
+	conn = l_hashmap_lookup(wstable, L_INT_TO_PTR(sock));
+	if (!conn)
+		return;
+
+	link = conn->link;
+	if (link->shared) {
+		conn_detach(conn);
+		return;
 	}
 
-	psd->len = snprintf((char *)&psd->buffer + LWS_PRE, MAX_PAYLOAD, "%d%s",
-					OPERATION_PREFIX, jobjstring);
-	lws_callback_on_writable(ws);
+	link_close(link);
+}
 
-	/* Keep serving context until server responds or an error occurs */
-	while (!ready && !connection_error)
-		lws_service(context, SERVICE_TIMEOUT);
+/*
+ * Sessions closed together: a shared link left without sessions is closed
+ * once, its subscriptions going with it, instead of unsubscribing each of
+ * its devices.
+ */
+static void ws_close_batch(const int *socks, unsigned int count)
+{
+	struct ws_conn *conn;
+	struct ws_link *link;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		conn = l_hashmap_lookup(wstable, L_INT_TO_PTR(socks[i]));
+		if (conn)
+			conn->link->detaching++;
+	}
 
+	for (i = 0; i < count; i++) {
+		/* Released already if its link was destroyed */
+		conn = l_hashmap_lookup(wstable, L_INT_TO_PTR(socks[i]));
+		if (!conn)
+			continue;
+
+		link = conn->link;
+		if (link->closing)
+			continue;
+
+		if (link->shared &&
+				link->detaching < l_queue_length(link->conns)) {
+			link->detaching--;
+			conn_detach(conn);
+			continue;
+		}
 
-	if (connection_error) {
-		err = -ECONNREFUSED;
-		goto done;
+		link->detaching = 0;
+		link_close(link);
 	}
+}
 
-	err = ws_device(sock, uuid, token, json);
+static int ws_mknode(int sock, const char *device_json,
+					proto_cb_t cb, void *user_data)
+{
+	struct json_writer w;
+	char jstr[MAX_PAYLOAD];
 
-done:
-	ready = false;
-	connection_error = false;
+	json_writer_init(&w, jstr, sizeof(jstr));
+	json_writer_begin_array(&w);
+	json_writer_string(&w, "register");
+	json_writer_raw(&w, device_json);
+	json_writer_end_array(&w);
 
-	json_object_put(jarray);
+	if (!json_writer_finish(&w))
+		return w.err;
 
-	return err;
+	return ws_submit(sock, jstr, WS_REPLY_JSON, NULL, cb, user_data);
 }
 
-static int ws_rmnode(int sock, const char *uuid, const char *token,
-							json_raw_t *json)
+static int ws_device(int sock, const char *uuid, const char *token,
+					proto_cb_t cb, void *user_data)
 {
+	char *jstr;
 	int err;
-	const char *jobjstring;
-	json_object *jobj, *jarray;
-	struct lws *ws;
 
-	psd = l_hashmap_lookup(wstable, L_INT_TO_PTR(sock));
-	if (!psd)
-		return -EINVAL;
-
-	jobj = json_object_new_object();
-	jarray = json_object_new_array();
-
-	if (!jobj || !jarray) {
-		hal_log_error("JSON: no memory");
+	if (is_shared(sock))
+		jstr = credentials_request("device", uuid, token);
+	else
+		jstr = credentials_request("device", uuid, NULL);
+	if (!jstr)
 		return -ENOMEM;
-	}
 
-	json_object_object_add(jobj, "uuid", json_object_new_string(uuid));
-	json_object_object_add(jobj, "token", json_object_new_string(token));
+	err = ws_submit(sock, jstr, WS_REPLY_JSON, NULL,
+							cb, user_data);
+	l_free(jstr);
 
-	jobjstring = json_object_to_json_string(jobj);
+	return err;
+}
 
-	json_object_array_add(jarray, json_object_new_string("unregister"));
-	json_object_array_add(jarray, jobj);
+/*
+ * Identity is sent first and, once the cloud answers "ready", the device
+ * is fetched: 'cb' gets the device JSON.
+ */
+static int ws_signin(int sock, const char *uuid, const char *token,
+					proto_cb_t cb, void *user_data)
+{
+	int err;
+	char *jstr;
 
-	jobjstring = json_object_to_json_string(jarray);
+	/*
+	 * Identity binds the whole link to a device: on shared links the
+	 * credentials go in the request and the device is fetched directly.
+	 */
+	if (is_shared(sock)) {
+		jstr = credentials_request("device", uuid, token);
+		if (!jstr)
+			return -ENOMEM;
 
-	hal_log_info("WS JSON TX %s", jobjstring);
+		err = ws_submit(sock, jstr, WS_REPLY_JSON, NULL,
+							cb, user_data);
+		l_free(jstr);
 
-	ws = queue_at(wsis, psd->index);
-	if (ws == NULL) {
-		hal_log_error("Not found");
-		err = -EBADF;
-		goto done;
+		return err;
 	}
 
-	psd->len = snprintf((char *) psd->buffer + LWS_PRE, MAX_PAYLOAD,
-					"%d%s", OPERATION_PREFIX, jobjstring);
-	lws_callback_on_writable(ws);
+	jstr = credentials_request("identity", uuid, token);
+	if (!jstr)
+		return -ENOMEM;
 
-	/*
-	 * Execution is blocked until server responds or and error occurs
-	 * lws_service makes sure libwebsockets keeps doing its job.
-	 */
-	while (!got_response && !connection_error)
-		lws_service(context, SERVICE_TIMEOUT);
+	err = ws_submit(sock, jstr, WS_REPLY_READY, uuid, cb, user_data);
+	l_free(jstr);
 
-	if (connection_error)
-		err = -ECONNRESET;
+	return err;
+}
 
-	err = handle_response(json);
+static int ws_rmnode(int sock, const char *uuid, const char *token,
+					proto_cb_t cb, void *user_data)
+{
+	char *jstr;
+	int err;
 
-	if (err < 0)
-		goto done;
-done:
-	got_response = false;
-	connection_error = false;
+	jstr = credentials_request("unregister", uuid, token);
+	if (!jstr)
+		return -ENOMEM;
 
-	json_object_put(jarray);
+	err = ws_submit(sock, jstr, WS_REPLY_JSON, NULL, cb, user_data);
+	l_free(jstr);
 
 	return err;
 }
 
+/* ["event", {"uuid": ..., "token": ..., <members of 'jreq'>}] */
+static int write_request(char *jstr, size_t size, const char *event,
+		const char *uuid, const char *token, const char *jreq)
+{
+	struct json_writer w;
+
+	json_writer_init(&w, jstr, size);
+	json_writer_begin_array(&w);
+	json_writer_string(&w, event);
+	json_writer_begin_object(&w);
+	json_writer_key(&w, "uuid");
+	json_writer_string(&w, uuid);
+	if (token) {
+		json_writer_key(&w, "token");
+		json_writer_string(&w, token);
+	}
+	json_writer_merge(&w, jreq);
+	json_writer_end_object(&w);
+	json_writer_end_array(&w);
+
+	if (!json_writer_finish(&w))
+		return w.err;
+
+	return 0;
+}
+
 static int ws_update(int sock, const char *uuid, const char *token,
-					const char *jreq, json_raw_t *json)
+		const char *jreq, proto_cb_t cb, void *user_data)
 {
+	char jstr[MAX_PAYLOAD];
 	int err;
-	struct json_object *jobj, *jarray;
-	const char *jobjstr;
-	struct lws *ws;
 
-	psd = l_hashmap_lookup(wstable, L_INT_TO_PTR(sock));
-	if (!psd)
-		return -EINVAL;
+	err = write_request(jstr, sizeof(jstr), "update", uuid,
+				is_shared(sock) ? token : NULL, jreq);
+	if (err < 0)
+		return err;
 
-	jobj = json_tokener_parse(jreq);
-	if (jobj == NULL)
-		return -EINVAL;
+	/* Update is not acknowledged: completes once written */
+	return ws_submit(sock, jstr, WS_REPLY_NONE, NULL, cb, user_data);
+}
 
-	jarray = json_object_new_array();
+static int ws_data(int sock, const char *uuid, const char *token,
+		const char *jreq, proto_cb_t cb, void *user_data)
+{
+	char jstr[MAX_PAYLOAD];
+	int err;
 
-	json_object_array_add(jarray, json_object_new_string("update"));
-	json_object_object_add(jobj, "uuid", json_object_new_string(uuid));
+	err = write_request(jstr, sizeof(jstr), "data", uuid, token, jreq);
+	if (err < 0)
+		return err;
 
-	json_object_array_add(jarray, jobj);
-	jobjstr = json_object_to_json_string(jarray);
+	return ws_submit(sock, jstr, WS_REPLY_JSON, NULL, cb, user_data);
+}
 
-	ws = queue_at(wsis, psd->index);
-	if (ws == NULL) {
-		hal_log_error("Not found");
-		err = -EBADF;
-		goto done;
+static void handle_ready(struct ws_link *link, bool ready)
+{
+	struct ws_request *req = link->identity;
+
+	if (!req) {
+		hal_log_error("WS: unexpected ready message");
+		return;
 	}
-	psd->len = snprintf((char *)&psd->buffer + LWS_PRE, MAX_PAYLOAD, "%d%s",
-						MESSAGE_PREFIX, jobjstr);
-	lws_callback_on_writable(ws);
 
-	hal_log_info("WS JSON TX: %s", jobjstr);
+	link->identity = NULL;
 
-	lws_service(context, SERVICE_TIMEOUT);
+	if (!ready) {
+		ws_request_complete(req, -EACCES, NULL);
+		return;
+	}
 
-	if (connection_error) {
-		err = -ECONNREFUSED;
-		goto done;
+	if (!req->uuid) {
+		ws_request_complete(req, 0, NULL);
+		return;
 	}
 
-	err = 0;
+	/* Signed in: the same request fetches the device */
+	l_free(req->msg);
+	req->msg = credentials_request("device", req->uuid, NULL);
+	if (!req->msg) {
+		ws_request_complete(req, -ENOMEM, NULL);
+		return;
+	}
 
-done:
-	got_response = false;
-	connection_error = false;
-	json_object_put(jarray);
+	req->len = strlen(req->msg);
+	req->reply = WS_REPLY_JSON;
 
-	return err;
+	l_queue_push_head(link->tx, req);
 }
 
-static int ws_data(int sock, const char *uuid, const char *token,
-					const char *jreq, json_raw_t *json)
+static bool ack_cmp(const void *entry_data, const void *user_data)
 {
-	int err;
-	struct json_object *jobj, *jmsg;
-	const char *jobjstr;
-	struct lws *ws;
+	const struct ws_request *req = entry_data;
 
-	psd = l_hashmap_lookup(wstable, L_INT_TO_PTR(sock));
-	if (!psd)
-		return -EINVAL;
+	return req->ack == L_PTR_TO_UINT(user_data);
+}
 
-	jobj = json_tokener_parse(jreq);
-	if (jobj == NULL)
-		return -EINVAL;
+static void handle_ack(struct ws_link *link, unsigned int ack,
+							const char *resp)
+{
+	struct ws_request *req;
+	json_raw_t json = { NULL, 0 };
+	int err;
 
-	jmsg = json_object_new_array();
-	json_object_array_add(jmsg, json_object_new_string("data"));
-	json_object_object_add(jobj, "uuid", json_object_new_string(uuid));
-	json_object_object_add(jobj, "token", json_object_new_string(token));
-	json_object_array_add(jmsg, jobj);
-	jobjstr = json_object_to_json_string(jmsg);
-
-	ws = queue_at(wsis, psd->index);
-	if (ws == NULL) {
-		hal_log_error("Not found");
-		err = -EBADF;
-		goto done;
+	req = l_queue_remove_if(link->acks, ack_cmp, L_UINT_TO_PTR(ack));
+	if (!req) {
+		hal_log_error("WS: unexpected ack %u", ack);
+		return;
 	}
-	psd->len = snprintf((char *)&psd->buffer + LWS_PRE, MAX_PAYLOAD, "%d%s",
-						OPERATION_PREFIX, jobjstr);
-	lws_callback_on_writable(ws);
-	err = 0;
 
-	while (!got_response && !connection_error)
-		lws_service(context, SERVICE_TIMEOUT);
+	err = handle_response(resp, &json);
 
-done:
-	got_response = false;
-	connection_error = false;
+	ws_request_complete(req, err, &json);
+}
 
-	json_object_put(jmsg);
+static bool conn_match_uuid(const void *data, const void *user_data)
+{
+	const struct ws_conn *conn = data;
 
-	return err;
+	return conn->uuid && !strcmp(conn->uuid, user_data);
 }
 
-static void handle_cloud_response(const char *resp, struct lws *wsi)
+static void handle_config(struct ws_link *link, const char *resp)
+{
+	json_object *jobj, *jres, *juuid;
+	struct ws_conn *conn;
+
+	jres = json_tokener_parse(resp);
+	if (jres == NULL)
+		return;
+
+	jobj = json_object_array_get_idx(jres, 1);
+
+	/* Shared links receive the config of all the subscribed devices */
+	if (!link->shared)
+		conn = l_queue_peek_head(link->conns);
+	else if (json_object_object_get_ex(jobj, "uuid", &juuid))
+		conn = l_queue_find(link->conns, conn_match_uuid,
+					json_object_get_string(juuid));
+	else
+		conn = NULL;
+
+	if (!conn || !conn->data.watch_cb) {
+		json_object_put(jres);
+		return;
+	}
+
+	conn->data.watch_cb(jobj, conn->data.user_data);
+
+	json_object_put(jres);
+}
+
+static void handle_cloud_response(struct ws_link *link, const char *resp)
 {
 	int packet_type, offset = 0, len = strlen(resp);
-	json_raw_t json;
-	size_t realsize;
-	json_object *jobj, *jres;
-	const char *jobjstringres;
-	struct per_session_data_ws *session_data;
+	unsigned long ack = 0;
+	char sio_type = 0;
+	char *end;
 
 	/* Find message type */
 	if (sscanf(resp, "%1d", &packet_type) < 0)
 		return;
 	/*
 	 * Skip packet type, if packet type is EIO_OPEN, resp is like 0{...}
-	 * otherwise resp is packet_type[...]
+	 * otherwise resp is packet_type[...]. Socket.IO messages carry its
+	 * own type and, for acks, the id: 43<id>[...]
 	 */
 	if (packet_type == EIO_OPEN)
 		resp += 1;
 	else {
+		if (packet_type == EIO_MSG && len > 1) {
+			sio_type = resp[1];
+			if (sio_type == SIO_ACK)
+				ack = strtoul(resp + 2, &end, 10);
+		}
+
 		while (offset < len && resp[offset] != '[')
 			offset++;
 		resp += offset;
@@ -656,21 +1077,31 @@ static void handle_cloud_response(const char *resp, struct lws *wsi)
 
 	switch (packet_type) {
 	case EIO_OPEN:
-		parse_handshake_data(resp);
+		parse_handshake_data(link, resp);
 		break;
 	case EIO_PONG:
 		/* TODO */
 		break;
 	case EIO_MSG:
 		hal_log_info("WS JSON_RX %d = %s", packet_type, resp);
-		if (!strcmp(resp, IDENTIFY_REQUEST))
-			connected = true;
-		else if (!strncmp(resp, READY_RESPONSE, READY_RESPONSE_LEN))
-			ready = true;
+		if (sio_type == SIO_ACK)
+			handle_ack(link, ack, resp);
+		else if (sio_type != SIO_EVENT)
+			break;
+		else if (!strcmp(resp, IDENTIFY_REQUEST)) {
+			if (link->identified)
+				break;
+
+			link->identified = true;
+			connecting_dec();
+			link->ping_timeout = l_timeout_create_ms(
+				link->ping_interval, on_ping_timeout,
+				link, NULL);
+		} else if (!strncmp(resp, READY_RESPONSE, READY_RESPONSE_LEN))
+			handle_ready(link, true);
 		else if (!strncmp(resp, NOT_READY_RESPONSE,
-						NOT_READY_RESPONSE_LEN)) {
-			connection_error = true;
-			client_connection_error = true;
+						NOT_READY_RESPONSE_LEN))
+			handle_ready(link, false);
 		/*
 		 * Every time a device is updated a CONFIG_MSG is sent to all
 		 * devices that subscribed for the updated device's uuid
@@ -679,48 +1110,113 @@ static void handle_cloud_response(const char *resp, struct lws *wsi)
 		 * call the watch_cb that will be responsible of forwarding
 		 * the message to the thing.
 		 */
-		} else if (!strncmp(resp, CONFIG_MSG, CONFIG_MSG_LEN)) {
-			session_data = l_hashmap_lookup(wstable,
-				L_INT_TO_PTR(lws_get_socket_fd(wsi)));
+		else if (!strncmp(resp, CONFIG_MSG, CONFIG_MSG_LEN))
+			handle_config(link, resp);
+		else
+			hal_log_error("WS: unexpected event");
 
-			if (!session_data)
-				break;
+		link_kick(link);
+		break;
+	default:
+		break;
+	}
+}
 
-			memset(&json, 0, sizeof(json_raw_t));
+/* Writes one message: libwebsockets allows a single write per callback */
+static int handle_writeable(struct ws_link *link, struct lws *wsi)
+{
+	struct ws_request *req;
+	int l;
+
+	if (link->closing)
+		return -1;
+
+	if (link->ping) {
+		link->ping = false;
+		l = snprintf((char *) link->buffer + LWS_PRE, MAX_PAYLOAD,
+							"%d", EIO_PING);
+		if (lws_write(wsi, &link->buffer[LWS_PRE], l,
+							LWS_WRITE_TEXT) < 0)
+			return -1;
 
-			jres = json_tokener_parse(resp);
-			if (jres == NULL)
-				break;
+		link_kick(link);
+		return 0;
+	}
 
-			jobj = json_object_array_get_idx(jres, 1);
+	if (!link->identified || !link_can_write(link))
+		return 0;
 
-			jobjstringres = json_object_to_json_string(jobj);
+	req = l_queue_pop_head(link->tx);
 
-			realsize = strlen(jobjstringres) + 1;
+	/* Only requests expecting an answer get an ack id */
+	if (req->reply == WS_REPLY_JSON) {
+		req->ack = link->next_ack++;
+		l = snprintf((char *) link->buffer + LWS_PRE, MAX_PAYLOAD,
+				"%s%u%s", EVENT_PREFIX, req->ack, req->msg);
+	} else
+		l = snprintf((char *) link->buffer + LWS_PRE, MAX_PAYLOAD,
+				"%s%s", EVENT_PREFIX, req->msg);
 
-			json.data = (char *) realloc(json.data,
-							json.size + realsize);
-			if (json.data == NULL) {
-				hal_log_error("Not enough memory");
-				break;
-			}
-
-			memcpy(json.data + json.size, jobjstringres, realsize);
-			json.size += realsize;
-			json.data[json.size - 1] = 0;
-
-			if (session_data->data.watch_cb)
-				session_data->data.watch_cb(json,
-						session_data->data.user_data);
-
-			json_object_put(jres);
-			free(json.data);
-		} else {
-			if (psd->json)
-				l_free(psd->json);
-			psd->json = l_strdup(resp);
-			got_response = true;
-		}
+	l = lws_write(wsi, &link->buffer[LWS_PRE], l, LWS_WRITE_TEXT);
+	if (l < 0) {
+		ws_request_complete(req, -EIO, NULL);
+		return -1;
+	}
+
+	hal_log_info("WS TX%d bytes", l);
+
+	if (req->reply == WS_REPLY_JSON)
+		l_queue_push_tail(link->acks, req);
+	else if (req->reply == WS_REPLY_READY)
+		link->identity = req;
+	else
+		ws_request_complete(req, 0, NULL);
+
+	link_kick(link);
+
+	return 0;
+}
+
+static bool on_lws_events(struct l_io *io, void *user_data)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct lws_pollfd pfd;
+	int i, n;
+
+	n = epoll_wait(lws_epfd, events, MAX_EVENTS, 0);
+	for (i = 0; i < n; i++) {
+		pfd.fd = events[i].data.fd;
+		pfd.events = events[i].events & (POLLIN | POLLOUT);
+		pfd.revents = events[i].events & (POLLIN | POLLOUT |
+							POLLERR | POLLHUP);
+		lws_service_fd(context, &pfd);
+	}
+
+	return true;
+}
+
+/* External poll: mirror libwebsockets fds into the private epoll set */
+static void handle_pollfd(enum lws_callback_reasons reason,
+					const struct lws_pollargs *pa)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = pa->fd;
+	ev.events = (pa->events & POLLIN ? EPOLLIN : 0) |
+				(pa->events & POLLOUT ? EPOLLOUT : 0);
+
+	switch (reason) {
+	case LWS_CALLBACK_ADD_POLL_FD:
+		if (epoll_ctl(lws_epfd, EPOLL_CTL_ADD, pa->fd, &ev) < 0)
+			hal_log_error("epoll_ctl(ADD): %s(%d)",
+						strerror(errno), errno);
+		break;
+	case LWS_CALLBACK_DEL_POLL_FD:
+		epoll_ctl(lws_epfd, EPOLL_CTL_DEL, pa->fd, NULL);
+		break;
+	case LWS_CALLBACK_CHANGE_MODE_POLL_FD:
+		epoll_ctl(lws_epfd, EPOLL_CTL_MOD, pa->fd, &ev);
 		break;
 	default:
 		break;
@@ -732,13 +1228,19 @@ static int callback_lws_http(struct lws *wsi,
 					void *user_data, void *in, size_t len)
 
 {
+	struct ws_link *link = user_data;
+
 	switch (reason) {
 	case LWS_CALLBACK_ESTABLISHED:
 		hal_log_info("LWS_CALLBACK_ESTABLISHED");
 		break;
 	case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
 		hal_log_info("LWS_CALLBACK_CLIENT_CONNECTION_ERROR");
-		client_connection_error = true;
+		if (!link)
+			break;
+
+		link->wsi = NULL;
+		link_destroy(link, -ECONNREFUSED);
 		break;
 	case LWS_CALLBACK_CLIENT_FILTER_PRE_ESTABLISH:
 		break;
@@ -747,43 +1249,30 @@ static int callback_lws_http(struct lws *wsi,
 		break;
 	case LWS_CALLBACK_CLOSED:
 		hal_log_info("LWS_CALLBACK_CLOSED FOR WSI %p", wsi);
-		wsi = NULL;
-		/* FIXME: Needed? connection_error = true; */
+		if (!link)
+			break;
+
+		link->wsi = NULL;
+		link_destroy(link, -ECONNRESET);
 		break;
 	case LWS_CALLBACK_CLOSED_HTTP:
 		break;
 	case LWS_CALLBACK_RECEIVE:
 		break;
 	case LWS_CALLBACK_CLIENT_RECEIVE:
-		handle_cloud_response((char *) in, wsi);
+		if (link)
+			handle_cloud_response(link, (char *) in);
 		break;
 	case LWS_CALLBACK_CLIENT_RECEIVE_PONG:
 		break;
 	case LWS_CALLBACK_CLIENT_WRITEABLE:
-		{
-		int l;
-
-		gettimeofday(&psd->interval, NULL);
-
-		psd = l_hashmap_lookup(wstable,
-				L_INT_TO_PTR(lws_get_socket_fd(wsi)));
-
-		l = lws_write(wsi, &psd->buffer[LWS_PRE], psd->len,
-								LWS_WRITE_TEXT);
-		/*
-		 * Since pings are sent continuously, ignore them to have
-		 * a cleaner log.
-		 */
-		if (l > 1)
-			hal_log_info("WS TX%d bytes", l);
-
-		/* Enable RX when after message is successfully sent */
-		if (l < 0) {
-			connection_error = true;
-			return -1;
-		}
-			lws_rx_flow_control(wsi, 1);
-		}
+		if (link)
+			return handle_writeable(link, wsi);
+		break;
+	case LWS_CALLBACK_ADD_POLL_FD:
+	case LWS_CALLBACK_DEL_POLL_FD:
+	case LWS_CALLBACK_CHANGE_MODE_POLL_FD:
+		handle_pollfd(reason, in);
 		break;
 	case LWS_CALLBACK_SERVER_WRITEABLE:
 	case LWS_CALLBACK_HTTP:
@@ -805,9 +1294,6 @@ static int callback_lws_http(struct lws *wsi,
 	case LWS_CALLBACK_WSI_CREATE: // always protocol[0]
 	case LWS_CALLBACK_WSI_DESTROY: // always protocol[0]
 	case LWS_CALLBACK_GET_THREAD_ID:
-	case LWS_CALLBACK_ADD_POLL_FD:
-	case LWS_CALLBACK_DEL_POLL_FD:
-	case LWS_CALLBACK_CHANGE_MODE_POLL_FD:
 	case LWS_CALLBACK_LOCK_POLL:
 	case LWS_CALLBACK_UNLOCK_POLL:
 	case LWS_CALLBACK_OPENSSL_CONTEXT_REQUIRES_PRIVATE_KEY:
@@ -844,7 +1330,7 @@ static int callback_lws_http(struct lws *wsi,
 
 static struct lws_protocols protocols[] = {
 	{
-		"http-only",
+		WS_PROTOCOL,
 		callback_lws_http,
 		0, 65536, 0, NULL
 	},
@@ -853,84 +1339,60 @@ static struct lws_protocols protocols[] = {
 	}
 };
 
+/*
+ * Connection is asynchronous: the returned handle can be used right away,
+ * requests are written once the cloud identifies the link.
+ */
 static int ws_connect(void)
 {
-	struct lws_client_connect_info info;
-	struct lws *ws;
-	int sock;
-	static char ads_port[300];
-	bool use_ssl = false; /* wss */
-
-	memset(&info, 0, sizeof(info));
-	snprintf(ads_port, sizeof(ads_port) - 1, "%s:%u", host_address,
-								host_port);
-
-	hal_log_info("Connecting to %s...", ads_port);
-
-	psd = l_new(struct per_session_data_ws, 1);
-
-	info.context = context;
-	info.ssl_connection = use_ssl;
-	info.address = host_address;
-	info.port = host_port;
-	info.path = CLOUD_PATH;
-	info.host = info.address;
-	info.origin = info.address;
-	info.ietf_version_or_minus_one = -1;
-	info.protocol = protocols[0].name;
-
-	connected = false;
-	client_connection_error = false;
-	connection_error = false;
-	got_response = false;
-
-	/*
-	 * Every new connection is stored in the 'wsis' list. The client only
-	 * sees a fd which is the key for its respective per session data (psd).
-	 * In this struct we store an index that is related to the position of
-	 * the websocket instance (wsi) in the 'wsis' list. The relationships
-	 * are: fd <-> psd->index <-> wsi (wsis at psd->index)
-	 */
-	ws = lws_client_connect_via_info(&info);
-
-	psd->index = conn_index++;
+	struct ws_link *link;
+	struct ws_conn *conn;
+	int sv[2];
+	int err;
 
-	/*
-	 * Connect via info is a non blocking method, it returns a websocket
-	 * instance but it may not be writable yet, so here we keep serving the
-	 * context until the connection is actually established. When the
-	 * LWS_CALLBACK_CLIENT_ESTABLISHED is triggered.
-	 */
-	while (!connected && !client_connection_error)
-		lws_service(context, SERVICE_TIMEOUT);
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		err = errno;
+		hal_log_error("socketpair(): %s(%d)", strerror(err), err);
+		return -err;
+	}
 
-	if (client_connection_error) {
-		l_free(psd);
-		/* TODO: ws leaking */
+	link = link_get();
+	if (!link) {
+		close(sv[0]);
+		close(sv[1]);
 		return -ECONNREFUSED;
 	}
 
-	l_queue_push_tail(wsis, ws);
+	conn = l_new(struct ws_conn, 1);
+	conn->sock = sv[0];
+	conn->peer = sv[1];
+	conn->link = link;
 
-	/* Map ws to a unique int */
-	sock = lws_get_socket_fd((struct lws *) ws);
-	gettimeofday(&psd->interval, NULL);
-	l_hashmap_insert(wstable, L_INT_TO_PTR(sock), psd);
+	l_queue_push_tail(link->conns, conn);
+	l_hashmap_insert(wstable, L_INT_TO_PTR(conn->sock), conn);
 
-	connected = false;
-	client_connection_error = false;
-	connection_error = false;
-	got_response = false;
-
-	return sock;
+	return conn->sock;
 }
 
-static int ws_probe(const char *host, unsigned int port)
+static int ws_probe(const char *host, unsigned int port,
+					const struct proto_pool *proto_pool)
 {
 	struct lws_context_creation_info i;
+	int err;
 
 	memset(&i, 0, sizeof(i));
 
+	lws_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (lws_epfd < 0) {
+		err = errno;
+		hal_log_error("epoll_create1(): %s(%d)", strerror(err), err);
+		return -err;
+	}
+
+	lws_io = l_io_new(lws_epfd);
+	l_io_set_close_on_destroy(lws_io, true);
+	l_io_set_read_handler(lws_io, on_lws_events, NULL, NULL);
+
 	host_address = l_strdup(host);
 	host_port = port;
 
@@ -940,80 +1402,107 @@ static int ws_probe(const char *host, unsigned int port)
 	i.protocols = protocols;
 	context = lws_create_context(&i);
 
-	wsis = l_queue_new();
 	wstable = l_hashmap_new();
+	links = l_queue_new();
+	idle_links = l_queue_new();
+	pool = *proto_pool;
 
-	/* FIXME: Investigate alternatives for libwebsocket_service() */
-	timeout = l_timeout_create(1, timeout_ws, NULL, NULL);
+	stats_register("ws.connect.warm", &connect_warm);
+	stats_register("ws.connect.cold", &connect_cold);
 
-	return 0;
-}
+	/* Shared links are opened in advance, otherwise the idle ones */
+	if (pool.size) {
+		while (l_queue_length(links) < pool.size && link_new(true))
+			;
+	} else
+		idle_refill();
 
-static void session_data_free(struct per_session_data_ws *psd)
-{
-	l_free(psd->json);
-	l_free(psd);
+	return 0;
 }
 
 static void ws_remove(void)
 {
-	if (timeout) {
-		l_timeout_remove(timeout);
-		timeout = NULL;
-	}
-	l_queue_destroy(wsis, NULL);
-	l_hashmap_destroy(wstable, (l_hashmap_destroy_func_t) session_data_free);
+	stats_unregister(&connect_warm);
+	stats_unregister(&connect_cold);
+
+	/* Idle links are not replaced while being released */
+	l_queue_destroy(idle_links, NULL);
+	idle_links = NULL;
+	l_timeout_remove(idle_timeout);
+	idle_timeout = NULL;
+
+	/* Open connections are closed and released from the callbacks */
 	lws_context_destroy(context);
-	l_free(host_address);
-}
+	l_hashmap_destroy(wstable, NULL);
+	l_queue_destroy(links, NULL);
+	links = NULL;
 
-static void on_proto_destroyed(void *user_data)
-{
-	struct to_fetch *data = user_data;
+	l_timeout_remove(lws_timeout);
+	lws_timeout = NULL;
 
-	if (data->watch_destroy_cb)
-		data->watch_destroy_cb(data->user_data);
+	l_io_destroy(lws_io);
+	lws_io = NULL;
+	lws_epfd = -1;
 
-	data->watch_cb = NULL;
-	data->user_data = NULL;
-	data->watch_destroy_cb = NULL;
+	l_free(host_address);
 }
 
 /*
  * Watch or poll the cloud to changes in the device.  uuid/token are used
  * by the http protocol in order to constantly fetch specific device data
  * since websockets uses a 'subscription' mechanism there is no need to
- * store these values.
+ * store these values, unless the link is shared: config messages are
+ * routed to the session by the device uuid.
  */
 static unsigned int ws_async(int sock, const char *uuid,
-	const char *token, void (*proto_watch_cb)	(json_raw_t, void *),
+	const char *token, void (*proto_watch_cb) (json_object *, void *),
 	void *user_data, void (*proto_watch_destroy_cb) (void *))
 {
 	struct to_fetch *data;
-	struct per_session_data_ws *value;
-	struct l_io *proto_io;
+	struct ws_conn *conn;
+	char *jstr;
 
-	value = l_hashmap_lookup(wstable, L_INT_TO_PTR(sock));
-	if (!value)
-		return -EINVAL;
+	conn = l_hashmap_lookup(wstable, L_INT_TO_PTR(sock));
+	if (!conn)
+		return 0;
+
+	data = &conn->data;
+	on_watch_destroyed(data);
+
+	if (conn->link->shared) {
+		conn_unsubscribe(conn);
 
-	data = &value->data;
+		jstr = credentials_request("subscribe", uuid, token);
+		if (!jstr ||
+			link_submit(conn->link, NULL, jstr, WS_REPLY_NONE,
+						NULL, NULL, NULL) < 0) {
+			l_free(jstr);
+			return 0;
+		}
+
+		l_free(jstr);
+		conn->uuid = l_strdup(uuid);
+		conn->token = l_strdup(token);
+	}
+
+	data->id = next_watch_id++;
 	data->watch_cb = proto_watch_cb;
 	data->user_data = user_data;
 	data->watch_destroy_cb = proto_watch_destroy_cb;
 
-	proto_io = l_io_new(sock);
-	l_io_set_disconnect_handler(proto_io, NULL, data, on_proto_destroyed);
-
-	l_hashmap_insert(wstable, L_INT_TO_PTR(sock), value);
-
-	return L_PTR_TO_UINT(proto_io);
+	return data->id;
 }
 
 static void ws_async_stop(int sock, unsigned int watch_id)
 {
-	struct l_io *proto_io = L_UINT_TO_PTR(watch_id);
-	l_io_destroy(proto_io);
+	struct ws_conn *conn;
+
+	conn = l_hashmap_lookup(wstable, L_INT_TO_PTR(sock));
+	if (!conn || conn->data.id != watch_id)
+		return;
+
+	on_watch_destroyed(&conn->data);
+	conn_unsubscribe(conn);
 }
 
 struct proto_ops proto_ws = {
@@ -1022,6 +1511,7 @@ struct proto_ops proto_ws = {
 	.remove = ws_remove,
 	.connect = ws_connect,
 	.close = ws_close,
+	.close_batch = ws_close_batch,
 	.mknode = ws_mknode,
 	.signin = ws_signin,
 	.rmnode = ws_rmnode,
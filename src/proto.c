@@ -24,11 +24,19 @@
 #endif
 
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <ell/ell.h>
 
 #include <hal/linux_log.h>
 
 #include "settings.h"
+#include "stats.h"
+#include "breaker.h"
 #include "proto.h"
 
 extern struct proto_ops proto_http;
@@ -45,6 +53,67 @@ static struct proto_ops *proto_ops[] = {
 };
 
 static struct proto_ops *proto = NULL; /* Selected protocol */
+static struct proto_ops *selected = NULL; /* Guarded by the breaker */
+
+/* Operation issued through the breaker */
+struct breaker_call {
+	proto_cb_t cb;
+	void *user_data;
+	uint64_t start;
+	bool probe;
+	bool recorded;			/* Too slow: failed already */
+	struct l_timeout *deadline;	/* 'breaker_latency' */
+};
+
+/* Cloud operations of the driver, issued by guarded_call() */
+enum guarded_op {
+	GUARDED_MKNODE,
+	GUARDED_SIGNIN,
+	GUARDED_RMNODE,
+	GUARDED_SCHEMA,
+	GUARDED_DATA,
+	GUARDED_FETCH,
+	GUARDED_SETDATA,
+};
+
+struct guarded_args {
+	int sock;
+	const char *uuid;
+	const char *token;
+	const char *jreq;
+};
+
+static struct breaker breaker;
+static unsigned int breaker_latency;	/* Slower ones count as failed, in ms */
+static struct proto_ops guarded;
+
+/* Items of a batch in flight at once */
+#define BATCH_WINDOW		32
+
+struct proto_batch {
+	int sock;
+	enum proto_batch_op op;
+	struct proto_batch_item *items;
+	unsigned int count;
+	unsigned int next;		/* Next item to be issued */
+	unsigned int pending;		/* Issued, not completed */
+	proto_batch_cb_t cb;
+	void *user_data;
+};
+
+/* Item issued: the batch is released once all items are completed */
+struct batch_slot {
+	struct proto_batch *batch;
+	unsigned int index;
+};
+
+/* Result of a cloud operation waiting to be delivered to its caller */
+struct proto_completion {
+	proto_cb_t cb;
+	void *user_data;
+	int err;
+	json_raw_t json;
+};
 
 static struct proto_ops *get_proto_ops(const char *protocol_name)
 {
@@ -61,6 +130,235 @@ static struct proto_ops *get_proto_ops(const char *protocol_name)
 	return selected_protocol;
 }
 
+static int get_pool_policy(const char *name, enum proto_pool_policy *policy)
+{
+	if (name == NULL || strcmp(name, "round-robin") == 0)
+		*policy = PROTO_POOL_ROUND_ROBIN;
+	else if (strcmp(name, "least-loaded") == 0)
+		*policy = PROTO_POOL_LEAST_LOADED;
+	else
+		return -EINVAL;
+
+	return 0;
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void breaker_call_record(struct breaker_call *call, int err)
+{
+	uint64_t now = now_ms();
+	bool failed;
+
+	failed = proto_is_upstream_failure(err) ||
+				now - call->start > breaker_latency;
+
+	breaker_record(&breaker, now, call->probe, failed);
+}
+
+static void on_breaker_call_done(int err, const json_raw_t *json,
+							void *user_data)
+{
+	struct breaker_call *call = user_data;
+
+	if (!call->recorded)
+		breaker_call_record(call, err);
+
+	call->cb(err, json, call->user_data);
+
+	l_timeout_remove(call->deadline);
+	l_free(call);
+}
+
+/*
+ * Slow operations count as failed once 'breaker_latency' elapsed, so
+ * that the breaker may open while they are pending. Their caller still
+ * waits for the result of the driver.
+ */
+static void on_breaker_deadline(struct l_timeout *timeout, void *user_data)
+{
+	struct breaker_call *call = user_data;
+
+	l_timeout_remove(call->deadline);
+	call->deadline = NULL;
+	call->recorded = true;
+
+	breaker_call_record(call, -ETIMEDOUT);
+}
+
+static int proto_issue(enum guarded_op op, const struct guarded_args *args,
+					proto_cb_t cb, void *user_data)
+{
+	switch (op) {
+	case GUARDED_MKNODE:
+		return proto->mknode(args->sock, args->jreq, cb, user_data);
+	case GUARDED_SIGNIN:
+		return proto->signin(args->sock, args->uuid, args->token,
+							cb, user_data);
+	case GUARDED_RMNODE:
+		return proto->rmnode(args->sock, args->uuid, args->token,
+							cb, user_data);
+	case GUARDED_SCHEMA:
+		return proto->schema(args->sock, args->uuid, args->token,
+					args->jreq, cb, user_data);
+	case GUARDED_DATA:
+		return proto->data(args->sock, args->uuid, args->token,
+					args->jreq, cb, user_data);
+	case GUARDED_FETCH:
+		return proto->fetch(args->sock, args->uuid, args->token,
+							cb, user_data);
+	case GUARDED_SETDATA:
+		return proto->setdata(args->sock, args->uuid, args->token,
+					args->jreq, cb, user_data);
+	}
+
+	return -EINVAL;
+}
+
+/* Fails fast while the breaker is open, times the operation otherwise */
+static int guarded_call(enum guarded_op op, const struct guarded_args *args,
+					proto_cb_t cb, void *user_data)
+{
+	struct breaker_call *call;
+	uint64_t now = now_ms();
+	bool probe;
+	int err;
+
+	if (!breaker_allow(&breaker, now, &probe))
+		return -ECONNREFUSED;
+
+	call = l_new(struct breaker_call, 1);
+	call->cb = cb;
+	call->user_data = user_data;
+	call->start = now;
+	call->probe = probe;
+	call->deadline = l_timeout_create_ms(breaker_latency,
+					on_breaker_deadline, call, NULL);
+
+	err = proto_issue(op, args, on_breaker_call_done, call);
+	if (err >= 0)
+		return 0;
+
+	/* Probe not issued: the breaker opens again */
+	if (probe)
+		breaker_record(&breaker, now_ms(), true, true);
+
+	l_timeout_remove(call->deadline);
+	l_free(call);
+
+	return err;
+}
+
+static int guarded_mknode(int sock, const char *jreq,
+					proto_cb_t cb, void *user_data)
+{
+	struct guarded_args args = { .sock = sock, .jreq = jreq };
+
+	return guarded_call(GUARDED_MKNODE, &args, cb, user_data);
+}
+
+static int guarded_signin(int sock, const char *uuid, const char *token,
+					proto_cb_t cb, void *user_data)
+{
+	struct guarded_args args = { .sock = sock, .uuid = uuid,
+							.token = token };
+
+	return guarded_call(GUARDED_SIGNIN, &args, cb, user_data);
+}
+
+static int guarded_rmnode(int sock, const char *uuid, const char *token,
+					proto_cb_t cb, void *user_data)
+{
+	struct guarded_args args = { .sock = sock, .uuid = uuid,
+							.token = token };
+
+	return guarded_call(GUARDED_RMNODE, &args, cb, user_data);
+}
+
+static int guarded_schema(int sock, const char *uuid, const char *token,
+		const char *jreq, proto_cb_t cb, void *user_data)
+{
+	struct guarded_args args = { .sock = sock, .uuid = uuid,
+					.token = token, .jreq = jreq };
+
+	return guarded_call(GUARDED_SCHEMA, &args, cb, user_data);
+}
+
+static int guarded_data(int sock, const char *uuid, const char *token,
+		const char *jreq, proto_cb_t cb, void *user_data)
+{
+	struct guarded_args args = { .sock = sock, .uuid = uuid,
+					.token = token, .jreq = jreq };
+
+	return guarded_call(GUARDED_DATA, &args, cb, user_data);
+}
+
+static int guarded_fetch(int sock, const char *uuid, const char *token,
+					proto_cb_t cb, void *user_data)
+{
+	struct guarded_args args = { .sock = sock, .uuid = uuid,
+							.token = token };
+
+	return guarded_call(GUARDED_FETCH, &args, cb, user_data);
+}
+
+static int guarded_setdata(int sock, const char *uuid, const char *token,
+		const char *jreq, proto_cb_t cb, void *user_data)
+{
+	struct guarded_args args = { .sock = sock, .uuid = uuid,
+					.token = token, .jreq = jreq };
+
+	return guarded_call(GUARDED_SETDATA, &args, cb, user_data);
+}
+
+/*
+ * Connections fail fast as well while the breaker is open, instead of
+ * dialing the upstream again for each PDU.
+ */
+static int guarded_connect(void)
+{
+	int proto_socket;
+
+	if (!breaker_allow_connect(&breaker, now_ms()))
+		return -ECONNREFUSED;
+
+	proto_socket = proto->connect();
+	if (proto_socket < 0 && proto_is_upstream_failure(proto_socket))
+		breaker_record(&breaker, now_ms(), false, true);
+
+	return proto_socket;
+}
+
+/* Cloud operations and connections of the driver go through the breaker */
+static struct proto_ops *breaker_guard(const struct settings *settings)
+{
+	breaker_init(&breaker, settings->breaker_errors,
+				settings->breaker_open * 1000, now_ms());
+	breaker_latency = settings->breaker_latency;
+
+	guarded = *proto;
+	guarded.connect = guarded_connect;
+	guarded.mknode = guarded_mknode;
+	guarded.signin = guarded_signin;
+	guarded.rmnode = guarded_rmnode;
+	guarded.schema = guarded_schema;
+	guarded.data = guarded_data;
+	guarded.fetch = guarded_fetch;
+	guarded.setdata = guarded_setdata;
+
+	stats_register("breaker.opened", &breaker.opens);
+	stats_register("breaker.rejected", &breaker.rejected);
+	stats_register("breaker.probes", &breaker.probes);
+
+	return &guarded;
+}
+
 int proto_start(const struct settings *settings, struct proto_ops **proto_ops)
 {
 	/*
@@ -70,24 +368,199 @@ int proto_start(const struct settings *settings, struct proto_ops **proto_ops)
 	 * TODO: later support dynamic protocol selection.
 	 */
 
+	struct proto_pool pool;
+
 	proto = get_proto_ops(settings->proto);
 	if (proto == NULL)
 		return -EINVAL;
 
-	if (proto->probe(settings->host, settings->port) < 0)
+	pool.size = settings->pool_size;
+	pool.idle = settings->pool_idle;
+	if (get_pool_policy(settings->pool_policy, &pool.policy) < 0) {
+		hal_log_error("Invalid pool policy: %s", settings->pool_policy);
+		proto = NULL;
+		return -EINVAL;
+	}
+
+	if (proto->probe(settings->host, settings->port, &pool) < 0)
 		return -EIO;
 
-	hal_log_info("proto_ops: %s", proto->name);
+	hal_log_info("proto_ops: %s pool: %u", proto->name, pool.size);
+
+	/* Operations wait for the driver timeouts if disabled */
+	selected = settings->breaker_errors ? breaker_guard(settings) : proto;
 
-	*proto_ops = proto;
+	*proto_ops = selected;
 
 	return 0;
 }
 
 void proto_stop()
 {
+	if (selected == &guarded) {
+		stats_unregister(&breaker.opens);
+		stats_unregister(&breaker.rejected);
+		stats_unregister(&breaker.probes);
+	}
+
+	selected = NULL;
+
 	if (proto != NULL) {
 		proto->remove();
 		proto = NULL;
 	}
 }
+
+static void on_completion_idle(void *user_data)
+{
+	struct proto_completion *completion = user_data;
+
+	completion->cb(completion->err, &completion->json,
+						completion->user_data);
+}
+
+static void completion_free(void *user_data)
+{
+	struct proto_completion *completion = user_data;
+
+	free(completion->json.data);
+	l_free(completion);
+}
+
+/*
+ * Helper for the drivers: schedules the completion of a cloud operation
+ * on the main loop. Ownership of 'json' data is transferred to the
+ * completion. Returns 0 or a negative errno value if the completion
+ * could not be scheduled, in which case 'cb' will never be called.
+ */
+int proto_complete(proto_cb_t cb, void *user_data, int err, json_raw_t *json)
+{
+	struct proto_completion *completion;
+
+	completion = l_new(struct proto_completion, 1);
+	completion->cb = cb;
+	completion->user_data = user_data;
+	completion->err = err;
+	if (json) {
+		completion->json = *json;
+		json->data = NULL;
+		json->size = 0;
+	}
+
+	if (!l_idle_oneshot(on_completion_idle, completion,
+							completion_free)) {
+		completion_free(completion);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void batch_free(struct proto_batch *batch)
+{
+	unsigned int i;
+
+	for (i = 0; i < batch->count; i++) {
+		l_free((char *) batch->items[i].jreq);
+		l_free((char *) batch->items[i].uuid);
+		l_free((char *) batch->items[i].token);
+	}
+
+	l_free(batch->items);
+	l_free(batch);
+}
+
+static void batch_issue(struct proto_batch *batch);
+
+static void on_batch_item(int err, const json_raw_t *json, void *user_data)
+{
+	struct batch_slot *slot = user_data;
+	struct proto_batch *batch = slot->batch;
+
+	batch->pending--;
+	batch->cb(slot->index, err, json, batch->user_data);
+	l_free(slot);
+
+	batch_issue(batch);
+}
+
+static void batch_issue(struct proto_batch *batch)
+{
+	const struct proto_batch_item *item;
+	struct batch_slot *slot;
+	int err;
+
+	while (batch->pending < BATCH_WINDOW && batch->next < batch->count) {
+		slot = l_new(struct batch_slot, 1);
+		slot->batch = batch;
+		slot->index = batch->next++;
+		item = &batch->items[slot->index];
+
+		if (batch->op == PROTO_BATCH_MKNODE)
+			err = selected->mknode(batch->sock, item->jreq,
+							on_batch_item, slot);
+		else
+			err = selected->rmnode(batch->sock, item->uuid,
+					item->token, on_batch_item, slot);
+
+		/* Failed items complete from the main loop as well */
+		if (err < 0 && proto_complete(on_batch_item, slot,
+							err, NULL) < 0) {
+			l_free(slot);
+			batch->cb(batch->next - 1, err, NULL, batch->user_data);
+			continue;
+		}
+
+		batch->pending++;
+	}
+
+	if (!batch->pending && batch->next == batch->count)
+		batch_free(batch);
+}
+
+int proto_batch(int sock, enum proto_batch_op op,
+		const struct proto_batch_item *items, unsigned int count,
+		proto_batch_cb_t cb, void *user_data)
+{
+	struct proto_batch *batch;
+	unsigned int i;
+
+	if (!selected)
+		return -ENOTCONN;
+
+	if (!count)
+		return -EINVAL;
+
+	batch = l_new(struct proto_batch, 1);
+	batch->sock = sock;
+	batch->op = op;
+	batch->cb = cb;
+	batch->user_data = user_data;
+	batch->count = count;
+	batch->items = l_new(struct proto_batch_item, count);
+
+	for (i = 0; i < count; i++) {
+		batch->items[i].jreq = l_strdup(items[i].jreq);
+		batch->items[i].uuid = l_strdup(items[i].uuid);
+		batch->items[i].token = l_strdup(items[i].token);
+	}
+
+	batch_issue(batch);
+
+	return 0;
+}
+
+bool proto_is_upstream_failure(int err)
+{
+	switch (err) {
+	case -EIO:
+	case -ECONNRESET:
+	case -ECONNREFUSED:
+	case -ETIMEDOUT:
+	case -EHOSTUNREACH:
+	case -ENETUNREACH:
+		return true;
+	default:
+		return false;
+	}
+}
@@ -19,46 +19,117 @@
  *
  */
 
+#include <stdbool.h>
+
 typedef struct {
 	char *data;
 	size_t size;
 } json_raw_t;
 
+struct json_object;
+
+/*
+ * Completion callback of the cloud operations. 'err' is 0 on success or a
+ * negative errno value, 'json' holds the cloud response (if any) and is
+ * only valid during the callback.
+ */
+typedef void (*proto_cb_t) (int err, const json_raw_t *json, void *user_data);
+
+/* How sessions are assigned to the upstream connections of the pool */
+enum proto_pool_policy {
+	PROTO_POOL_ROUND_ROBIN,
+	PROTO_POOL_LEAST_LOADED,
+};
+
+/*
+ * Upstream connections shared by the sessions: size 0 disables pooling.
+ * 'idle' connections are kept established in advance, ready to be used.
+ */
+struct proto_pool {
+	unsigned int size;
+	enum proto_pool_policy policy;
+	unsigned int idle;
+};
+
 /* Node operations */
 struct proto_ops {
 	const char *name;
 	unsigned int source_id;
-	int (*probe) (const char *host, unsigned int port);
+	int (*probe) (const char *host, unsigned int port,
+					const struct proto_pool *pool);
 	void (*remove) (void);
 
 	/* Abstraction for connect & close/sign-off */
 	int (*connect) (void);
 	void (*close) (int sock);
+	/* Optional: same as close() of each socket, done at once */
+	void (*close_batch) (const int *socks, unsigned int count);
+
+	/*
+	 * Cloud operations are asynchronous: they return 0 if the request
+	 * has been issued or a negative errno value otherwise. On success,
+	 * 'cb' is called exactly once from the main loop, never before the
+	 * operation returns.
+	 */
 
 	/* Abstraction for session establishment or registration */
-	int (*mknode) (int sock, const char *owner_uuid, json_raw_t *json);
+	int (*mknode) (int sock, const char *jreq,
+					proto_cb_t cb, void *user_data);
 	int (*signin) (int sock, const char *uuid, const char *token,
-							json_raw_t *json);
+					proto_cb_t cb, void *user_data);
 	int (*rmnode)(int sock, const char *uuid, const char *token,
-							json_raw_t *jbuf);
+					proto_cb_t cb, void *user_data);
 	/* Abstraction for device data */
 	int (*schema) (int sock, const char *uuid, const char *token,
-					const char *jreq, json_raw_t *json);
+		const char *jreq, proto_cb_t cb, void *user_data);
 	int (*data) (int sock, const char *uuid, const char *token,
-					const char *jreq, json_raw_t *jbuf);
+		const char *jreq, proto_cb_t cb, void *user_data);
 	int (*fetch) (int sock, const char *uuid, const char *token,
-							json_raw_t *json);
+					proto_cb_t cb, void *user_data);
 	int (*setdata) (int sock, const char *uuid, const char *token,
-					const char *jreq, json_raw_t *json);
+		const char *jreq, proto_cb_t cb, void *user_data);
 	/*
 	 * Watch that polls or monitors the cloud to check if "CONFIG" changed
-	 * or "SET DATA" or "GET DATA".
+	 * or "SET DATA" or "GET DATA". The device document is parsed once by
+	 * the driver and only valid during the callback.
 	 */
 	unsigned int (*async) (int sock, const char *uuid, const char *token,
-		void (*proto_watch_cb) (json_raw_t, void *), void *user_data,
+		void (*proto_watch_cb) (struct json_object *, void *),
+		void *user_data,
 		void (*proto_watch_destroy_cb) (void *));
 	void (*async_stop) (int sock, unsigned int watch_id);
 };
 
 int proto_start(const struct settings *settings, struct proto_ops **proto_ops);
 void proto_stop(void);
+
+/* Batched variants of mknode and rmnode */
+enum proto_batch_op {
+	PROTO_BATCH_MKNODE,		/* 'jreq' of each item */
+	PROTO_BATCH_RMNODE,		/* 'uuid' and 'token' of each item */
+};
+
+struct proto_batch_item {
+	const char *jreq;
+	const char *uuid;
+	const char *token;
+};
+
+/* Completion of the item 'index' of a batch */
+typedef void (*proto_batch_cb_t) (unsigned int index, int err,
+				const json_raw_t *json, void *user_data);
+
+/*
+ * Issues the items back to back on 'sock', without waiting for the
+ * previous answers, a bounded number in flight. Items are copied. 'cb' is
+ * called once per item, in any order, from the main loop unless the
+ * failure of an item can't be deferred.
+ */
+int proto_batch(int sock, enum proto_batch_op op,
+		const struct proto_batch_item *items, unsigned int count,
+		proto_batch_cb_t cb, void *user_data);
+
+int proto_complete(proto_cb_t cb, void *user_data, int err, json_raw_t *json);
+
+/* The upstream didn't answer, as opposed to rejecting the request */
+bool proto_is_upstream_failure(int err);
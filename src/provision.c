@@ -0,0 +1,296 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+
+#include <ell/ell.h>
+#include <json-c/json.h>
+
+#include <knot_protocol.h>
+#include <hal/linux_log.h>
+
+#include "settings.h"
+#include "proto.h"
+#include "stats.h"
+#include "json-writer.h"
+#include "cache.h"
+#include "provision.h"
+
+/* Progress is reported every PROGRESS_STEP devices and at the end */
+#define PROGRESS_STEP		50
+#define DEVICE_JSON_LEN		256
+
+struct operation {
+	bool reg;			/* Register or unregister */
+	bool stopped;			/* Nobody is waiting for the result */
+	struct provision_device *devices;
+	unsigned int count;
+	unsigned int done;
+	int proto_socket;
+	provision_progress_cb progress_cb;
+	provision_done_cb done_cb;
+	void *user_data;
+};
+
+static struct proto_ops *proto;
+static char *owner_uuid;
+static struct operation *current;
+
+static uint64_t registered;
+static uint64_t unregistered;
+static uint64_t failed;
+
+static char *create_device_string(const struct provision_device *device)
+{
+	struct json_writer w;
+
+	json_writer_init_alloc(&w, DEVICE_JSON_LEN);
+	json_writer_begin_object(&w);
+	json_writer_key(&w, "type");
+	json_writer_string(&w, "KNOTDevice");
+	json_writer_key(&w, "name");
+	json_writer_string(&w, device->name);
+	json_writer_key(&w, "id");
+	json_writer_int(&w, device->id);
+	json_writer_key(&w, "owner");
+	json_writer_string(&w, owner_uuid);
+	json_writer_end_object(&w);
+
+	return json_writer_finish(&w);
+}
+
+/* {"uuid": ..., "token": ...} of the device created */
+static int parse_credentials(const char *json_str,
+					struct provision_device *device)
+{
+	json_object *jobj, *juuid, *jtoken;
+	const char *uuid, *token;
+	int err = -EPROTO;
+
+	jobj = json_tokener_parse(json_str);
+	if (!jobj)
+		return -EPROTO;
+
+	if (!json_object_object_get_ex(jobj, "uuid", &juuid) ||
+			!json_object_object_get_ex(jobj, "token", &jtoken))
+		goto done;
+
+	uuid = json_object_get_string(juuid);
+	token = json_object_get_string(jtoken);
+	if (!uuid || !token || strlen(uuid) != KNOT_PROTOCOL_UUID_LEN ||
+			strlen(token) != KNOT_PROTOCOL_TOKEN_LEN)
+		goto done;
+
+	device->uuid = l_strdup(uuid);
+	device->token = l_strdup(token);
+	err = 0;
+
+done:
+	json_object_put(jobj);
+
+	return err;
+}
+
+static void operation_free(struct operation *op)
+{
+	if (op->proto_socket >= 0)
+		proto->close(op->proto_socket);
+
+	if (op->stopped)
+		provision_devices_free(op->devices, op->count);
+
+	l_free(op);
+}
+
+static void on_item_done(unsigned int index, int err,
+				const json_raw_t *json, void *user_data)
+{
+	struct operation *op = user_data;
+	struct provision_device *device = &op->devices[index];
+
+	if (err == 0 && op->reg)
+		err = json && json->data ?
+			parse_credentials(json->data, device) : -EPROTO;
+
+	device->err = err;
+	op->done++;
+
+	if (err < 0)
+		failed++;
+	else if (op->reg)
+		registered++;
+	else
+		unregistered++;
+
+	/* Authenticated from the cache otherwise */
+	if (err == 0 && !op->reg)
+		cache_invalidate(device->uuid);
+
+	if (op->stopped) {
+		if (op->done == op->count)
+			operation_free(op);
+		return;
+	}
+
+	if (op->done % PROGRESS_STEP == 0 || op->done == op->count)
+		op->progress_cb(op->done, op->count, op->user_data);
+
+	if (op->done < op->count)
+		return;
+
+	current = NULL;
+	op->done_cb(op->devices, op->count, op->user_data);
+	operation_free(op);
+}
+
+static int operation_start(bool reg, struct provision_device *devices,
+		unsigned int count, provision_progress_cb progress_cb,
+		provision_done_cb done_cb, void *user_data)
+{
+	struct proto_batch_item *items;
+	struct operation *op;
+	unsigned int i;
+	int err;
+
+	if (current)
+		return -EBUSY;
+
+	if (!count)
+		return -EINVAL;
+
+	op = l_new(struct operation, 1);
+	op->reg = reg;
+	op->devices = devices;
+	op->count = count;
+	op->progress_cb = progress_cb;
+	op->done_cb = done_cb;
+	op->user_data = user_data;
+
+	/* Own connection: node sessions are not delayed by the batch */
+	op->proto_socket = proto->connect();
+	if (op->proto_socket < 0) {
+		err = op->proto_socket;
+		l_free(op);
+		return err;
+	}
+
+	items = l_new(struct proto_batch_item, count);
+	for (i = 0; i < count; i++) {
+		if (reg) {
+			items[i].jreq = create_device_string(&devices[i]);
+		} else {
+			items[i].uuid = devices[i].uuid;
+			items[i].token = devices[i].token;
+		}
+	}
+
+	hal_log_info("provision: %s %u devices",
+				reg ? "registering" : "unregistering", count);
+
+	/* Items failing to be issued may complete right away */
+	current = op;
+
+	err = proto_batch(op->proto_socket,
+			reg ? PROTO_BATCH_MKNODE : PROTO_BATCH_RMNODE,
+			items, count, on_item_done, op);
+
+	if (reg) {
+		for (i = 0; i < count; i++)
+			l_free((char *) items[i].jreq);
+	}
+	l_free(items);
+
+	if (err < 0) {
+		current = NULL;
+		proto->close(op->proto_socket);
+		l_free(op);
+		return err;
+	}
+
+	return 0;
+}
+
+int provision_register(struct provision_device *devices, unsigned int count,
+		provision_progress_cb progress_cb, provision_done_cb done_cb,
+		void *user_data)
+{
+	return operation_start(true, devices, count, progress_cb, done_cb,
+								user_data);
+}
+
+int provision_unregister(struct provision_device *devices,
+		unsigned int count, provision_progress_cb progress_cb,
+		provision_done_cb done_cb, void *user_data)
+{
+	return operation_start(false, devices, count, progress_cb, done_cb,
+								user_data);
+}
+
+void provision_devices_free(struct provision_device *devices,
+							unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		l_free(devices[i].name);
+		l_free(devices[i].uuid);
+		l_free(devices[i].token);
+	}
+
+	l_free(devices);
+}
+
+int provision_start(const struct settings *settings,
+					struct proto_ops *proto_ops)
+{
+	proto = proto_ops;
+	owner_uuid = l_strdup(settings->uuid);
+
+	stats_register("provision.registered", &registered);
+	stats_register("provision.unregistered", &unregistered);
+	stats_register("provision.failed", &failed);
+
+	return 0;
+}
+
+void provision_stop(void)
+{
+	stats_unregister(&registered);
+	stats_unregister(&unregistered);
+	stats_unregister(&failed);
+
+	/* Released once the pending items complete */
+	if (current) {
+		current->stopped = true;
+		current = NULL;
+	}
+
+	l_free(owner_uuid);
+	owner_uuid = NULL;
+}
@@ -0,0 +1,55 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Bulk registration and removal of cloud devices, for commissioning and
+ * decommissioning whole sites: one operation at a time.
+ */
+struct provision_device {
+	uint64_t id;
+	char *name;
+	char *uuid;			/* Set by register */
+	char *token;
+	int err;			/* 0 or a negative errno */
+};
+
+typedef void (*provision_progress_cb) (unsigned int done,
+				unsigned int total, void *user_data);
+typedef void (*provision_done_cb) (struct provision_device *devices,
+				unsigned int count, void *user_data);
+
+int provision_start(const struct settings *settings,
+					struct proto_ops *proto_ops);
+void provision_stop(void);
+
+/*
+ * 'devices' is owned by the operation until 'done_cb' returns. Returns
+ * -EBUSY while another operation is in progress.
+ */
+int provision_register(struct provision_device *devices, unsigned int count,
+		provision_progress_cb progress_cb, provision_done_cb done_cb,
+		void *user_data);
+int provision_unregister(struct provision_device *devices,
+		unsigned int count, provision_progress_cb progress_cb,
+		provision_done_cb done_cb, void *user_data);
+
+void provision_devices_free(struct provision_device *devices,
+							unsigned int count);
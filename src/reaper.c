@@ -0,0 +1,407 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ell/ell.h>
+
+#include <knot_protocol.h>
+#include <hal/linux_log.h>
+
+#include "settings.h"
+#include "proto.h"
+#include "stats.h"
+#include "cache.h"
+#include "credfile.h"
+#include "reaper.h"
+
+#define REAP_INTERVAL		1	/* Seconds */
+#define REAP_ATTEMPTS		5	/* Dropped afterwards */
+
+struct removal {
+	char *uuid;
+	char *token;
+	unsigned int attempts;
+};
+
+/* Removals issued in the same tick */
+struct reap_batch {
+	struct removal **removals;
+	unsigned int count;
+	unsigned int done;
+	unsigned int failed;
+	bool stopped;
+};
+
+static struct proto_ops *proto;
+static int proto_socket = -1;		/* Own connection to the cloud */
+static char *queue_path;		/* NULL: not kept on disk */
+static unsigned int rate;		/* Removals per tick */
+static struct l_queue *pending;		/* Oldest first */
+static struct reap_batch *current;
+static struct l_timeout *tick;
+static bool save_scheduled;
+
+static uint64_t queued;
+static uint64_t removed;
+static uint64_t failed;
+static uint64_t dropped;
+
+static void removal_free(void *data)
+{
+	struct removal *removal = data;
+
+	l_free(removal->uuid);
+	l_free(removal->token);
+	l_free(removal);
+}
+
+static void batch_free(struct reap_batch *batch)
+{
+	unsigned int i;
+
+	for (i = 0; i < batch->count; i++) {
+		if (batch->removals[i])
+			removal_free(batch->removals[i]);
+	}
+
+	l_free(batch->removals);
+	l_free(batch);
+}
+
+static void write_removal(void *data, void *user_data)
+{
+	struct removal *removal = data;
+	FILE *fp = user_data;
+
+	credfile_write(fp, removal->uuid, removal->token);
+}
+
+static void write_queue(FILE *fp, void *user_data)
+{
+	unsigned int i;
+
+	for (i = 0; current && i < current->count; i++) {
+		if (current->removals[i])
+			write_removal(current->removals[i], fp);
+	}
+
+	l_queue_foreach(pending, write_removal, fp);
+}
+
+/* One removal per line, in flight included: replaced as a whole */
+static int save(void)
+{
+	int err;
+
+	if (!queue_path)
+		return 0;
+
+	err = credfile_save(queue_path, write_queue, NULL);
+	if (err < 0)
+		hal_log_error("reaper %s: %s(%d)", queue_path,
+						strerror(-err), -err);
+
+	return err;
+}
+
+static void on_save_idle(void *user_data)
+{
+	save_scheduled = false;
+
+	/* Stopped meanwhile: saved by reaper_stop() */
+	if (!pending)
+		return;
+
+	save();
+}
+
+/* Many devices disconnecting at once are saved together */
+static void schedule_save(void)
+{
+	if (save_scheduled)
+		return;
+
+	save_scheduled = l_idle_oneshot(on_save_idle, NULL, NULL);
+	if (!save_scheduled)
+		save();
+}
+
+static void read_removal(const char *uuid, const char *token,
+							void *user_data)
+{
+	struct removal *removal;
+
+	removal = l_new(struct removal, 1);
+	removal->uuid = l_strdup(uuid);
+	removal->token = l_strdup(token);
+	l_queue_push_tail(pending, removal);
+}
+
+static int load(void)
+{
+	int err;
+
+	err = credfile_load(queue_path, read_removal, NULL);
+	if (err < 0) {
+		hal_log_error("reaper %s: %s(%d)", queue_path,
+						strerror(-err), -err);
+		return err;
+	}
+
+	hal_log_info("reaper: %u pending removals", l_queue_length(pending));
+
+	return 0;
+}
+
+static void on_reaped(unsigned int index, int err, const json_raw_t *json,
+							void *user_data)
+{
+	struct reap_batch *batch = user_data;
+	struct removal *removal = batch->removals[index];
+
+	batch->done++;
+
+	if (batch->stopped) {
+		if (batch->done == batch->count)
+			batch_free(batch);
+		return;
+	}
+
+	batch->removals[index] = NULL;
+
+	/* Unknown device: removed already, e.g. before a restart */
+	if (err == 0 || err == -ENOENT) {
+		hal_log_info("Rollback done UUID: %s", removal->uuid);
+		cache_invalidate(removal->uuid);
+		removal_free(removal);
+		removed++;
+	} else if (++removal->attempts >= REAP_ATTEMPTS) {
+		hal_log_error("Rollback dropped UUID: %s", removal->uuid);
+		removal_free(removal);
+		batch->failed++;
+		failed++;
+		dropped++;
+	} else {
+		/* Retried after the others pending */
+		l_queue_push_tail(pending, removal);
+		batch->failed++;
+		failed++;
+	}
+
+	if (batch->done < batch->count)
+		return;
+
+	/* The connection is dropped: a new one is used by the next tick */
+	if (batch->failed && proto_socket >= 0) {
+		proto->close(proto_socket);
+		proto_socket = -1;
+	}
+
+	current = NULL;
+	batch_free(batch);
+	schedule_save();
+}
+
+static void reap(void)
+{
+	struct proto_batch_item *items;
+	struct reap_batch *batch;
+	struct removal *removal;
+	unsigned int i, count;
+	int err;
+
+	count = l_queue_length(pending);
+	if (count > rate)
+		count = rate;
+
+	if (proto_socket < 0) {
+		proto_socket = proto->connect();
+		if (proto_socket < 0)
+			return;
+	}
+
+	batch = l_new(struct reap_batch, 1);
+	batch->removals = l_new(struct removal *, count);
+	batch->count = count;
+	items = l_new(struct proto_batch_item, count);
+
+	for (i = 0; i < count; i++) {
+		removal = l_queue_pop_head(pending);
+		batch->removals[i] = removal;
+		items[i].uuid = removal->uuid;
+		items[i].token = removal->token;
+	}
+
+	current = batch;
+
+	err = proto_batch(proto_socket, PROTO_BATCH_RMNODE, items, count,
+							on_reaped, batch);
+	l_free(items);
+
+	if (err < 0) {
+		hal_log_error("reaper rmnode: %s(%d)", strerror(-err), -err);
+		current = NULL;
+
+		/* Back to the head, in the same order */
+		for (i = count; i > 0; i--) {
+			l_queue_push_head(pending, batch->removals[i - 1]);
+			batch->removals[i - 1] = NULL;
+		}
+
+		batch_free(batch);
+	}
+}
+
+static void on_tick(struct l_timeout *timeout, void *user_data)
+{
+	/* Idle until the next removal is queued */
+	if (l_queue_isempty(pending) && !current) {
+		l_timeout_remove(tick);
+		tick = NULL;
+		return;
+	}
+
+	/* Previous batch not completed: the cloud is slower than the rate */
+	if (!current && !l_queue_isempty(pending))
+		reap();
+
+	l_timeout_modify(tick, REAP_INTERVAL);
+}
+
+static void schedule_reap(void)
+{
+	if (!tick)
+		tick = l_timeout_create(REAP_INTERVAL, on_tick, NULL, NULL);
+}
+
+static bool match_uuid(const void *data, const void *user_data)
+{
+	const struct removal *removal = data;
+
+	return !strcmp(removal->uuid, user_data);
+}
+
+void reaper_add(const char *uuid, const char *token)
+{
+	struct removal *removal;
+
+	if (!pending)
+		return;
+
+	if (l_queue_find(pending, match_uuid, uuid))
+		return;
+
+	removal = l_new(struct removal, 1);
+	removal->uuid = l_strdup(uuid);
+	removal->token = l_strdup(token);
+	l_queue_push_tail(pending, removal);
+	queued++;
+
+	schedule_save();
+	schedule_reap();
+}
+
+int reaper_start(const struct settings *settings,
+					struct proto_ops *proto_ops)
+{
+	int err = 0;
+
+	proto = proto_ops;
+	rate = settings->reaper_rate;
+	pending = l_queue_new();
+
+	/* Written back at once: unusable files are found at startup */
+	if (settings->reaper_path[0]) {
+		queue_path = l_strdup(settings->reaper_path);
+		err = load();
+		if (!err)
+			err = save();
+	}
+
+	if (err < 0 && settings->reaper_configured) {
+		l_queue_destroy(pending, removal_free);
+		pending = NULL;
+		l_free(queue_path);
+		queue_path = NULL;
+		return err;
+	}
+
+	/* Removals left are lost on restart */
+	if (err < 0) {
+		l_free(queue_path);
+		queue_path = NULL;
+	}
+
+	stats_register("reaper.queued", &queued);
+	stats_register("reaper.removed", &removed);
+	stats_register("reaper.failed", &failed);
+	stats_register("reaper.dropped", &dropped);
+
+	/* Left behind before a restart */
+	if (!l_queue_isempty(pending))
+		schedule_reap();
+
+	return 0;
+}
+
+void reaper_stop(void)
+{
+	if (!pending)
+		return;
+
+	stats_unregister(&queued);
+	stats_unregister(&removed);
+	stats_unregister(&failed);
+	stats_unregister(&dropped);
+
+	l_timeout_remove(tick);
+	tick = NULL;
+
+	/* Kept on disk: removed after a restart */
+	save();
+
+	/* Released once the pending items complete */
+	if (current) {
+		current->stopped = true;
+		current = NULL;
+	}
+
+	if (proto_socket >= 0) {
+		proto->close(proto_socket);
+		proto_socket = -1;
+	}
+
+	l_queue_destroy(pending, removal_free);
+	pending = NULL;
+	l_free(queue_path);
+	queue_path = NULL;
+}
@@ -19,12 +19,21 @@
  *
  */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdatomic.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <ell/ell.h>
 
+#include <knot_protocol.h>
 #include <hal/linux_log.h>
 
 #include "settings.h"
@@ -32,6 +41,12 @@
 #include "proto.h"
 #include "session.h"
 
+/* Largest PDU: the header carries an 8-bit payload length */
+#define PDU_MAX_LEN		(sizeof(knot_msg_header) + UINT8_MAX)
+#define RX_BATCH		16	/* Datagrams per receive call */
+#define TX_BATCH		16	/* PDUs per send call */
+#define TX_QUEUE_MAX		256	/* PDUs waiting to be sent */
+
 /*
  * Device session storing the connected
  * device context: 'drivers' and file descriptors
@@ -40,15 +55,41 @@ struct session {
 	struct node_ops *node_ops;
 	struct proto_ops *proto_ops;
 
+	int node_socket;
 	struct l_io *node_channel;	/* Radio event source */
 	struct l_io *proto_channel;	/* Cloud event source */
 
 	on_data on_data;
+	on_close on_close;
+	bool pending;			/* Waiting for the response */
+	bool paused;			/* Node reading stopped */
+	bool dispatching;
+	bool dead;			/* Waiting for the teardown */
+
+	/* Received PDUs, possibly partial: from 'rxstart' to 'rxend' */
+	uint8_t *rxbuf;
+	size_t rxsize;
+	size_t rxstart;
+	size_t rxend;
+
+	/* PDUs to the node, sent when the socket is writable */
+	struct l_queue *txq;
+	size_t txoff;			/* Stream: sent bytes of the head */
+	bool writing;			/* Waiting for POLLOUT */
 
 	atomic_int refs;
 };
 
+/* Outbound PDU */
+struct session_pdu {
+	size_t len;
+	uint8_t data[];
+};
+
 static struct l_queue *session_list = NULL;
+static struct l_hashmap *session_map = NULL;	/* By node socket */
+static struct l_queue *dead_list = NULL;	/* Destroyed together */
+static bool teardown_scheduled = false;
 
 static int connect_proto(struct session *session);
 static void disconnect_proto(struct session *session);
@@ -59,11 +100,14 @@ static struct session *session_new()
 	struct session *session;
 	session = l_new(struct session, 1);
 	session->refs = 1;
+	session->txq = l_queue_new();
 	return session;
 }
 
 static void session_free(struct session *session)
 {
+	l_queue_destroy(session->txq, l_free);
+	l_free(session->rxbuf);
 	l_free(session);
 }
 
@@ -107,6 +151,8 @@ static struct l_io *create_proto_channel(int proto_socket,
 	struct l_io *channel;
 
 	channel = l_io_new(proto_socket);
+	/* Cloud handle is owned by the session once connected */
+	l_io_set_close_on_destroy(channel, true);
 	l_io_set_disconnect_handler(channel, on_proto_channel_disconnected,
 		session, on_proto_channel_destroyed);
 	session_ref(session);
@@ -118,7 +164,9 @@ static void on_node_channel_disconnected(struct l_io *channel, void *user_data)
 {
 	struct session *session = user_data;
 
-	disconnect_proto(session);
+	/* Dead sessions: closed by the teardown, with the others */
+	if (!session->dead)
+		disconnect_proto(session);
 
 	session->node_channel = NULL;
 }
@@ -127,86 +175,500 @@ static void on_node_channel_destroyed(void *user_data)
 {
 	struct session *session = user_data;
 
+	l_hashmap_remove(session_map, L_INT_TO_PTR(session->node_socket));
+	session->node_channel = NULL;
+
+	/* Closed with the channel: the next node may get the same socket */
+	if (session->on_close)
+		session->on_close(session->node_socket);
+
 	l_queue_remove(session_list, session);
 	session_unref(session);
 }
 
-static void on_node_channel_destroy_timeout(struct l_timeout *timeout,
-	void *user_data)
+static void destroy_dead_node(void *data, void *user_data)
 {
-	struct l_io *channel = user_data;
-	destroy_node_channel(channel);
+	struct session *session = data;
+
+	destroy_node_channel(session->node_channel);
 }
 
-static void on_node_channel_data_error(struct l_io *channel)
+/* Cloud connections of the dead sessions, closed at once */
+struct dead_protos {
+	struct proto_ops *proto_ops;
+	int *socks;
+	unsigned int count;
+};
+
+static void collect_dead_proto(void *data, void *user_data)
 {
-	static bool destroying = false;
+	struct session *session = data;
+	struct dead_protos *protos = user_data;
 
-	if (destroying)
+	if (!session->proto_channel)
 		return;
 
-	destroying = true;
+	/* Channel cleanup will be held at disconnect callback */
+	protos->proto_ops = session->proto_ops;
+	protos->socks[protos->count++] =
+				l_io_get_fd(session->proto_channel);
+}
 
-	l_timeout_create(1,
-		on_node_channel_destroy_timeout,
-		channel,
-		NULL);
+static void close_dead_protos(struct dead_protos *protos)
+{
+	unsigned int i;
+
+	if (!protos->count)
+		return;
+
+	if (protos->proto_ops->close_batch) {
+		protos->proto_ops->close_batch(protos->socks, protos->count);
+		return;
+	}
+
+	for (i = 0; i < protos->count; i++)
+		protos->proto_ops->close(protos->socks[i]);
 }
 
-static bool on_node_channel_data(struct l_io *channel, void * user_data)
+static void dead_unref(void *data)
 {
-	int err;
-	int node_socket, proto_socket;
-	struct session *session = user_data;
-	struct node_ops *node_ops = session->node_ops;
-	uint8_t ipdu[512], opdu[512]; /* FIXME: */
-	ssize_t recvbytes, sentbytes, olen;
+	session_unref(data);
+}
 
-	node_socket = l_io_get_fd(channel);
+/*
+ * Destroys the sessions marked as dead: radio sockets first, then the
+ * cloud connections in a single call to the driver.
+ */
+static void session_teardown(void)
+{
+	struct l_queue *dead = dead_list;
+	struct dead_protos protos;
+
+	dead_list = NULL;
+
+	l_queue_foreach(dead, destroy_dead_node, NULL);
+
+	memset(&protos, 0, sizeof(protos));
+	protos.socks = l_new(int, l_queue_length(dead));
+	l_queue_foreach(dead, collect_dead_proto, &protos);
+	close_dead_protos(&protos);
+	l_free(protos.socks);
+
+	l_queue_destroy(dead, dead_unref);
+}
+
+static void on_teardown_idle(void *user_data)
+{
+	teardown_scheduled = false;
+
+	session_teardown();
+}
+
+/*
+ * Not destroyed from the channel callbacks: sessions failing in the same
+ * main loop iteration, e.g. after a radio reset, are destroyed together
+ * in the next one.
+ */
+static void on_node_channel_data_error(struct session *session)
+{
+	if (session->dead || !session->node_channel)
+		return;
+
+	session->dead = true;
+
+	/* Released by the teardown */
+	session_ref(session);
+
+	if (!dead_list)
+		dead_list = l_queue_new();
+	l_queue_push_tail(dead_list, session);
 
-	recvbytes = node_ops->recv(node_socket, ipdu, sizeof(ipdu));
-	if (recvbytes <= 0) {
-		err = errno;
-		hal_log_error("readv(): %s(%d)", strerror(err), err);
-		on_node_channel_data_error(channel);
-		return false;
+	if (teardown_scheduled)
+		return;
+
+	teardown_scheduled = l_idle_oneshot(on_teardown_idle, NULL, NULL);
+	if (!teardown_scheduled)
+		hal_log_error("session: teardown not scheduled");
+}
+
+static bool on_node_channel_data(struct l_io *channel, void *user_data);
+static void on_node_reply(const void *opdu, size_t olen, void *user_data);
+
+/* Writes as many queued PDUs as possible in a single call */
+static ssize_t flush_stream(struct session *session, int node_socket)
+{
+	struct iovec iov[TX_BATCH];
+	const struct l_queue_entry *entry;
+	struct session_pdu *pdu;
+	size_t off = session->txoff;
+	ssize_t sent;
+	int n = 0;
+
+	entry = l_queue_get_entries(session->txq);
+	for (; entry && n < TX_BATCH; entry = entry->next, n++) {
+		pdu = entry->data;
+		iov[n].iov_base = pdu->data + off;
+		iov[n].iov_len = pdu->len - off;
+		off = 0;
 	}
 
-	if (!session->proto_channel) {
-		err = connect_proto(session);
-		if (err) {
-			/* TODO:  missing reply an error */
-			hal_log_error("Can't connect to cloud service!");
-			on_node_channel_data_error(channel);
-			return false;
+	sent = session->node_ops->sendv(node_socket, iov, n);
+	if (sent < 0)
+		return -errno;
+
+	/* The head may be partially written */
+	off = sent;
+	while ((pdu = l_queue_peek_head(session->txq))) {
+		if (session->txoff + off < pdu->len) {
+			session->txoff += off;
+			break;
 		}
 
-		hal_log_info("Reconnected to cloud service");
+		off -= pdu->len - session->txoff;
+		session->txoff = 0;
+		l_free(l_queue_pop_head(session->txq));
 	}
 
-	proto_socket = l_io_get_fd(session->proto_channel);
+	return sent;
+}
+
+static ssize_t flush_datagrams(struct session *session, int node_socket)
+{
+	struct mmsghdr msgs[TX_BATCH];
+	struct iovec iov[TX_BATCH];
+	const struct l_queue_entry *entry;
+	struct session_pdu *pdu;
+	int i, n = 0;
+
+	memset(msgs, 0, sizeof(msgs));
+	entry = l_queue_get_entries(session->txq);
+	for (; entry && n < TX_BATCH; entry = entry->next, n++) {
+		pdu = entry->data;
+		iov[n].iov_base = pdu->data;
+		iov[n].iov_len = pdu->len;
+		msgs[n].msg_hdr.msg_iov = &iov[n];
+		msgs[n].msg_hdr.msg_iovlen = 1;
+	}
+
+	n = session->node_ops->sendmmsg(node_socket, msgs, n);
+	if (n < 0)
+		return -errno;
+
+	for (i = 0; i < n; i++)
+		l_free(l_queue_pop_head(session->txq));
+
+	return n;
+}
 
-	olen = session->on_data(node_socket, proto_socket,
-		ipdu, recvbytes,
-		opdu, sizeof(opdu));
-	/* olen: output length or -errno */
-	if (olen < 0) {
-		/* Server didn't reply any error */
-		hal_log_error("KNOT IoT proto error: %s(%zd)",
-						strerror(-olen), -olen);
-		on_node_channel_data_error(channel);
-		return false;
+static ssize_t flush_one(struct session *session, int node_socket)
+{
+	struct session_pdu *pdu = l_queue_peek_head(session->txq);
+	ssize_t sent;
+
+	sent = session->node_ops->send(node_socket, pdu->data, pdu->len);
+	if (sent < 0)
+		return -errno;
+
+	l_free(l_queue_pop_head(session->txq));
+
+	return sent;
+}
+
+/* Returns true while there are PDUs waiting for the socket */
+static bool on_node_channel_writable(struct l_io *channel, void *user_data)
+{
+	struct session *session = user_data;
+	struct node_ops *node_ops = session->node_ops;
+	int node_socket = l_io_get_fd(channel);
+	ssize_t err = 0;
+
+	while (!l_queue_isempty(session->txq)) {
+		if (node_ops->stream && node_ops->sendv)
+			err = flush_stream(session, node_socket);
+		else if (!node_ops->stream && node_ops->sendmmsg)
+			err = flush_datagrams(session, node_socket);
+		else
+			err = flush_one(session, node_socket);
+
+		if (err < 0)
+			break;
 	}
 
-	/* If there are no octets to be sent */
-	if (!olen)
+	if (err == -EAGAIN || err == -EWOULDBLOCK)
 		return true;
 
+	if (err < 0) {
+		hal_log_error("node_ops: %s(%zd)", strerror(-err), -err);
+		l_queue_clear(session->txq, l_free);
+		session->txoff = 0;
+	}
+
+	session->writing = false;
+
+	return false;
+}
+
+/*
+ * PDUs are queued and written once the socket is writable: several PDUs
+ * queued in the same main loop iteration are sent together.
+ */
+static int session_queue(struct session *session, const void *pdu,
+								size_t len)
+{
+	struct session_pdu *entry;
+
+	if (!session->node_channel)
+		return -ENOTCONN;
+
+	if (l_queue_length(session->txq) >= TX_QUEUE_MAX) {
+		hal_log_error("node: output queue full");
+		return -ENOBUFS;
+	}
+
+	entry = l_malloc(sizeof(*entry) + len);
+	entry->len = len;
+	memcpy(entry->data, pdu, len);
+	l_queue_push_tail(session->txq, entry);
+
+	if (!session->writing) {
+		session->writing = true;
+		l_io_set_write_handler(session->node_channel,
+				on_node_channel_writable, session, NULL);
+	}
+
+	return 0;
+}
+
+/* Datagrams are received in place, one PDU each */
+static ssize_t receive_datagrams(struct session *session, int node_socket)
+{
+	struct mmsghdr msgs[RX_BATCH];
+	struct iovec iov[RX_BATCH];
+	const knot_msg_header *hdr;
+	size_t slots, len, total = 0;
+	int i, n;
+
+	slots = (session->rxsize - session->rxend) / PDU_MAX_LEN;
+	if (slots == 0)
+		return 0;
+
+	if (slots > RX_BATCH)
+		slots = RX_BATCH;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < (int) slots; i++) {
+		iov[i].iov_base = session->rxbuf + session->rxend +
+							i * PDU_MAX_LEN;
+		iov[i].iov_len = PDU_MAX_LEN;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	n = session->node_ops->recvmmsg(node_socket, msgs, slots);
+	if (n < 0)
+		return errno == EAGAIN ? 0 : -errno;
+
+	/* Packed one after the other: framed by the header as streams */
+	for (i = 0; i < n; i++) {
+		len = msgs[i].msg_len;
+		if (len == 0)
+			return total ? (ssize_t) total : -ECONNRESET;
+
+		hdr = iov[i].iov_base;
+		if (len < sizeof(*hdr) || len != sizeof(*hdr) +
+							hdr->payload_len)
+			return -EBADMSG;
+
+		memmove(session->rxbuf + session->rxend, iov[i].iov_base,
+									len);
+		session->rxend += len;
+		total += len;
+	}
+
+	return total;
+}
+
+/*
+ * Reads everything available until the buffer is full. Returns the
+ * number of bytes received, 0 if there is nothing to read or a negative
+ * errno value if the node disconnected.
+ */
+static ssize_t session_receive(struct session *session, int node_socket)
+{
+	struct node_ops *node_ops = session->node_ops;
+	ssize_t recvbytes, total = 0;
+
+	if (!node_ops->stream && node_ops->recvmmsg)
+		return receive_datagrams(session, node_socket);
+
+	while (session->rxend < session->rxsize) {
+		recvbytes = node_ops->recv(node_socket,
+					session->rxbuf + session->rxend,
+					session->rxsize - session->rxend);
+		if (recvbytes < 0)
+			return errno == EAGAIN || total ? total : -errno;
+
+		if (recvbytes == 0)
+			return total ? total : -ECONNRESET;
+
+		session->rxend += recvbytes;
+		total += recvbytes;
+
+		/* One PDU per read: the next one may block */
+		if (!node_ops->stream)
+			break;
+	}
+
+	return total;
+}
+
+/*
+ * Sends the complete PDUs to the upper layer, in order: stops while the
+ * response of a request is pending.
+ */
+static int session_dispatch(struct session *session)
+{
+	const knot_msg_header *hdr;
+	int node_socket, proto_socket;
+	size_t len;
+	int err = 0;
+
+	if (session->dispatching || session->dead || !session->node_channel)
+		return 0;
+
+	session->dispatching = true;
+	node_socket = l_io_get_fd(session->node_channel);
+
+	while (!session->pending) {
+		len = session->rxend - session->rxstart;
+		if (len < sizeof(*hdr))
+			break;
+
+		hdr = (const void *) (session->rxbuf + session->rxstart);
+		if (len < sizeof(*hdr) + hdr->payload_len)
+			break;
+
+		len = sizeof(*hdr) + hdr->payload_len;
+
+		/*
+		 * Bound to the cloud on the first PDU, or if disconnected. The
+		 * node is kept if it fails: the PDU is answered with an error
+		 * and the next one tries again.
+		 */
+		if (!session->proto_channel) {
+			if (connect_proto(session) < 0)
+				hal_log_error("Can't connect to cloud service!");
+			else
+				hal_log_info("Connected to cloud service");
+		}
+
+		proto_socket = session->proto_channel ?
+				l_io_get_fd(session->proto_channel) : -1;
+
+		/* Released when the response is delivered */
+		session_ref(session);
+		session->pending = true;
+
+		err = session->on_data(node_socket, proto_socket,
+			session->rxbuf + session->rxstart, len,
+			on_node_reply, session);
+
+		session->rxstart += len;
+
+		if (err < 0) {
+			/* Server didn't reply any error */
+			hal_log_error("KNOT IoT proto error: %s(%d)",
+							strerror(-err), -err);
+			session->pending = false;
+			session_unref(session);
+			break;
+		}
+	}
+
+	/* Partial PDU is moved to the beginning of the buffer */
+	if (session->rxstart > 0) {
+		memmove(session->rxbuf, session->rxbuf + session->rxstart,
+				session->rxend - session->rxstart);
+		session->rxend -= session->rxstart;
+		session->rxstart = 0;
+	}
+
+	session->dispatching = false;
+
+	return err;
+}
+
+/*
+ * Called once per request, when the response is ready. Buffered PDUs
+ * are processed and reading from the node is resumed if it was paused
+ * waiting for the cloud.
+ */
+static void on_node_reply(const void *opdu, size_t olen, void *user_data)
+{
+	struct session *session = user_data;
+
+	session->pending = false;
+
+	/* Node disconnected while the request was in progress */
+	if (!session->node_channel || session->dead)
+		goto done;
+
 	/* Response from the gateway: error or response for the given command */
-	sentbytes = node_ops->send(node_socket, opdu, olen);
-	if (sentbytes < 0)
-		hal_log_error("node_ops: %s(%zd)",
-					strerror(-sentbytes), -sentbytes);
+	if (olen)
+		session_queue(session, opdu, olen);
+
+	if (!session->paused)
+		goto done;
+
+	if (session_dispatch(session) < 0) {
+		on_node_channel_data_error(session);
+		goto done;
+	}
+
+	if (!session->pending) {
+		session->paused = false;
+		l_io_set_read_handler(session->node_channel,
+					on_node_channel_data, session, NULL);
+	}
+
+done:
+	session_unref(session);
+}
+
+/* Drains the node socket: partial PDUs wait in the buffer */
+static bool on_node_channel_data(struct l_io *channel, void *user_data)
+{
+	struct session *session = user_data;
+	ssize_t recvbytes;
+	int node_socket;
+	int err;
+
+	node_socket = l_io_get_fd(channel);
+
+	do {
+		recvbytes = session_receive(session, node_socket);
+		if (recvbytes < 0) {
+			hal_log_error("recv(): %s(%zd)",
+					strerror(-recvbytes), -recvbytes);
+			on_node_channel_data_error(session);
+			return false;
+		}
+
+		err = session_dispatch(session);
+		if (err < 0) {
+			on_node_channel_data_error(session);
+			return false;
+		}
+
+		/*
+		 * Requests from the same node are processed in order: stop
+		 * reading until the cloud completes the current one.
+		 */
+		if (session->pending) {
+			session->paused = true;
+			return false;
+		}
+	} while (recvbytes > 0);
 
 	return true;
 }
@@ -264,22 +726,22 @@ static void disconnect_proto(struct session *session)
 }
 
 int session_create(struct node_ops *node_ops, struct proto_ops *proto_ops,
-	int client_socket, on_data on_data)
+	int client_socket, size_t rx_size, on_data on_data, on_close on_close)
 {
 	struct session *session;
-	int err;
 
+	/* Cloud connection is established when the node sends data */
 	session = session_new();
 	session->node_ops = node_ops;
 	session->proto_ops = proto_ops;
 	session->on_data = on_data;
+	session->on_close = on_close;
 
-	err = connect_proto(session);
-	if (err < 0) {
-		session_unref(session);
-		return err;
-	}
+	/* Holds at least one PDU of the maximum length */
+	session->rxsize = rx_size > PDU_MAX_LEN ? rx_size : PDU_MAX_LEN;
+	session->rxbuf = l_malloc(session->rxsize);
 
+	session->node_socket = client_socket;
 	session->node_channel = create_node_channel(client_socket, session);
 
 	hal_log_info("node:%p proto:%p",
@@ -289,6 +751,10 @@ int session_create(struct node_ops *node_ops, struct proto_ops *proto_ops,
 		session_list = l_queue_new();
 	l_queue_push_tail(session_list, session);
 
+	if (!session_map)
+		session_map = l_hashmap_new();
+	l_hashmap_insert(session_map, L_INT_TO_PTR(client_socket), session);
+
 	return 0;
 }
 
@@ -303,6 +769,9 @@ static void session_destroy(struct session *session, void *user_data)
 
 void session_destroy_all(void)
 {
+	/* Dead sessions waiting for the next main loop iteration */
+	session_teardown();
+
 	/*
 	 * session_destroy() will remove the entries from session_list.
 	 * Wait it clear the list beforing freeing it.
@@ -312,4 +781,29 @@ void session_destroy_all(void)
 		NULL);
 	l_queue_destroy(session_list, NULL);
 	session_list = NULL;
+	l_hashmap_destroy(session_map, NULL);
+	session_map = NULL;
+}
+
+/* Sends a PDU to the node without blocking: it is queued if needed */
+int session_send(int node_socket, const void *pdu, size_t len)
+{
+	struct session *session;
+
+	session = l_hashmap_lookup(session_map, L_INT_TO_PTR(node_socket));
+	if (!session)
+		return -ENOTCONN;
+
+	return session_queue(session, pdu, len);
+}
+
+void session_close(int node_socket)
+{
+	struct session *session;
+
+	session = l_hashmap_lookup(session_map, L_INT_TO_PTR(node_socket));
+	if (!session)
+		return;
+
+	on_node_channel_data_error(session);
 }
@@ -19,11 +19,21 @@
  *
  */
 
-typedef ssize_t (*on_data)(int node_socket, int proto_socket,
+typedef void (*on_reply)(const void *opdu, size_t opdulen, void *user_data);
+
+typedef int (*on_data)(int node_socket, int proto_socket,
 	const void *ipdu, size_t ipdulen,
-	void *opdu, size_t opdulen);
+	on_reply reply_cb, void *user_data);
+
+/* Node socket closed: requests in progress must not be bound to it */
+typedef void (*on_close)(int node_socket);
 
 int session_create(struct node_ops *node_ops, struct proto_ops *proto_ops,
-	int client_socket, on_data on_data);
+	int client_socket, size_t rx_size, on_data on_data, on_close on_close);
 
 void session_destroy_all(void);
+
+int session_send(int node_socket, const void *pdu, size_t len);
+
+/* Destroyed in the next main loop iteration */
+void session_close(int node_socket);
@@ -33,9 +33,23 @@ static char *host = NULL;
 static unsigned int port = 0;
 static const char *proto = "ws";
 static const char *tty = NULL;
+static unsigned int rx_buffer_size = 4096;
 static gboolean detach = TRUE;
 static gboolean run_as_nobody = TRUE;
 
+#define DEFAULT_POOL_IDLE	2
+#define DEFAULT_BATCH_INTERVAL	500
+#define STATE_DIR		"/var/lib/knot"
+#define DEFAULT_SPOOL_PATH	STATE_DIR "/spool"
+#define DEFAULT_SPOOL_SIZE	(4 * 1024 * 1024)
+#define DEFAULT_CACHE_PATH	STATE_DIR "/cache"
+#define DEFAULT_IDENTITY_PATH	STATE_DIR "/identities"
+#define DEFAULT_REAPER_PATH	STATE_DIR "/rollback"
+#define DEFAULT_REAPER_RATE	10
+#define DEFAULT_BREAKER_ERRORS	0
+#define DEFAULT_BREAKER_LATENCY	5000
+#define DEFAULT_BREAKER_OPEN	10
+
 static GOptionEntry options_spec[] = {
 	{ "ell", 'e', 0, G_OPTION_ARG_NONE, &use_ell,
 					"Use ELL instead of glib" },
@@ -50,6 +64,9 @@ static GOptionEntry options_spec[] = {
 					"proto" },
 	{ "tty", 't', 0, G_OPTION_ARG_STRING, &tty,
 					"TTY device path, e.g. /dev/ttyUSB0", "tty" },
+	{ "rx-buffer", 'r', 0, G_OPTION_ARG_INT, &rx_buffer_size,
+					"Receive buffer of each node, in bytes",
+					"size" },
 	{ "nodetach", 'n', G_OPTION_FLAG_REVERSE,
 					G_OPTION_ARG_NONE, &detach,
 					"Disable running in background" },
@@ -79,8 +96,10 @@ static int parse_args(int argc, char *argv[], struct settings *settings)
 	settings->port = port;
 	settings->proto = proto;
 	settings->tty = tty;
+	settings->rx_buffer_size = rx_buffer_size;
 	settings->detach = detach;
 	settings->run_as_nobody = run_as_nobody;
+	settings->state_dir = STATE_DIR;
 
 	err = 0;
 
@@ -118,10 +137,23 @@ static bool get_as_int(json_object *root, char *name, int *value)
 	return true;
 }
 
+static bool get_as_bool(json_object *root, char *name, bool *value)
+{
+	json_object *obj;
+
+	if (!json_object_object_get_ex(root, name, &obj))
+		return false;
+
+	*value = json_object_get_boolean(obj);
+
+	return true;
+}
+
 static int parse_config_file(const char *config_path, struct settings *settings)
 {
 	int err = -EINVAL;
 	const char *obj_value;
+	bool obj_bool;
 	json_object *root, *cloud;
 
 	/* Load data from config file */
@@ -157,6 +189,91 @@ static int parse_config_file(const char *config_path, struct settings *settings)
 			goto fail_get_port;
 	}
 
+	/* Connection pool is optional: one connection per session if absent */
+	if (!get_as_int(cloud, "poolSize", (int *)&settings->pool_size) ||
+					(int) settings->pool_size < 0)
+		settings->pool_size = 0;
+
+	if (get_as_string(cloud, "poolPolicy", &obj_value) && obj_value)
+		settings->pool_policy = g_strdup(obj_value);
+
+	if (!get_as_int(cloud, "poolIdle", (int *)&settings->pool_idle) ||
+					(int) settings->pool_idle < 0)
+		settings->pool_idle = DEFAULT_POOL_IDLE;
+
+	/* Data is forwarded sample by sample if batching is absent */
+	if (!get_as_int(cloud, "batchSamples",
+				(int *)&settings->batch_samples) ||
+				(int) settings->batch_samples < 0)
+		settings->batch_samples = 0;
+
+	if (!get_as_int(cloud, "batchInterval",
+				(int *)&settings->batch_interval) ||
+				(int) settings->batch_interval <= 0)
+		settings->batch_interval = DEFAULT_BATCH_INTERVAL;
+
+	/* Format understood by the cloud: one data document per sample */
+	settings->batch_document = get_as_bool(cloud, "batchDocument",
+						&obj_bool) && obj_bool;
+
+	if (get_as_string(cloud, "spoolPath", &obj_value) && obj_value) {
+		settings->spool_path = g_strdup(obj_value);
+		settings->spool_configured = 1;
+	} else {
+		settings->spool_path = g_strdup(DEFAULT_SPOOL_PATH);
+	}
+
+	if (!get_as_int(cloud, "spoolSize", (int *)&settings->spool_size) ||
+					(int) settings->spool_size < 0)
+		settings->spool_size = DEFAULT_SPOOL_SIZE;
+
+	if (get_as_string(cloud, "cachePath", &obj_value) && obj_value) {
+		settings->cache_path = g_strdup(obj_value);
+		settings->cache_configured = 1;
+	} else {
+		settings->cache_path = g_strdup(DEFAULT_CACHE_PATH);
+	}
+
+	/* Registration creates the cloud device if the pool is absent */
+	if (!get_as_int(cloud, "identityPool",
+				(int *)&settings->identity_pool) ||
+				(int) settings->identity_pool < 0)
+		settings->identity_pool = 0;
+
+	if (get_as_string(cloud, "identityPath", &obj_value) && obj_value) {
+		settings->identity_path = g_strdup(obj_value);
+		settings->identity_configured = 1;
+	} else {
+		settings->identity_path = g_strdup(DEFAULT_IDENTITY_PATH);
+	}
+
+	if (get_as_string(cloud, "reaperPath", &obj_value) && obj_value) {
+		settings->reaper_path = g_strdup(obj_value);
+		settings->reaper_configured = 1;
+	} else {
+		settings->reaper_path = g_strdup(DEFAULT_REAPER_PATH);
+	}
+
+	if (!get_as_int(cloud, "reaperRate", (int *)&settings->reaper_rate) ||
+					(int) settings->reaper_rate <= 0)
+		settings->reaper_rate = DEFAULT_REAPER_RATE;
+
+	if (!get_as_int(cloud, "breakerErrors",
+				(int *)&settings->breaker_errors) ||
+				(int) settings->breaker_errors < 0 ||
+				settings->breaker_errors > 100)
+		settings->breaker_errors = DEFAULT_BREAKER_ERRORS;
+
+	if (!get_as_int(cloud, "breakerLatency",
+				(int *)&settings->breaker_latency) ||
+				(int) settings->breaker_latency <= 0)
+		settings->breaker_latency = DEFAULT_BREAKER_LATENCY;
+
+	if (!get_as_int(cloud, "breakerOpen",
+				(int *)&settings->breaker_open) ||
+				(int) settings->breaker_open <= 0)
+		settings->breaker_open = DEFAULT_BREAKER_OPEN;
+
 	err = 0;
 	goto done;
 
@@ -208,5 +325,10 @@ void settings_free(struct settings *settings)
 {
 	g_free(settings->host);
 	g_free(settings->uuid);
+	g_free(settings->pool_policy);
+	g_free(settings->spool_path);
+	g_free(settings->cache_path);
+	g_free(settings->identity_path);
+	g_free(settings->reaper_path);
 	g_free(settings);
 }
@@ -28,6 +28,48 @@ struct settings {
 	const char *proto;
 	char *uuid;
 	const char *tty;
+	unsigned int rx_buffer_size;	/* Per node session, in bytes */
+
+	/* Upstream connections shared by the sessions: 0 is one per session */
+	unsigned int pool_size;
+	char *pool_policy;
+	unsigned int pool_idle;		/* Connected in advance */
+
+	/* Telemetry batching: 0 samples is disabled */
+	unsigned int batch_samples;
+	unsigned int batch_interval;	/* Milliseconds */
+	int batch_document;		/* One document: cloud must support it */
+
+	/*
+	 * Files kept on disk. The default paths are in 'state_dir', created
+	 * before the privileges are dropped: if unusable, the feature is
+	 * disabled. Configured paths ('*_configured') must be usable.
+	 */
+	const char *state_dir;
+
+	/* Data kept while the cloud is unreachable: 0 bytes is disabled */
+	char *spool_path;
+	int spool_configured;
+	unsigned int spool_size;
+
+	/* Credentials of the devices kept on disk: empty path is disabled */
+	char *cache_path;
+	int cache_configured;
+
+	/* Cloud devices created in advance: 0 is disabled */
+	unsigned int identity_pool;
+	char *identity_path;
+	int identity_configured;
+
+	/* Cloud devices of incomplete registrations removed in background */
+	char *reaper_path;		/* Empty is not kept on disk */
+	int reaper_configured;
+	unsigned int reaper_rate;	/* Removals per second */
+
+	/* Cloud operations fail fast while the upstream fails: 0 disabled */
+	unsigned int breaker_errors;	/* Failed operations, in percent */
+	unsigned int breaker_latency;	/* Milliseconds */
+	unsigned int breaker_open;	/* Seconds */
 
 	int detach;
 	int run_as_nobody;
@@ -0,0 +1,96 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <ell/ell.h>
+
+#include "stats.h"
+
+struct stats_entry {
+	char *name;
+	const uint64_t *counter;
+};
+
+static struct l_queue *stats_list = NULL;
+
+static void stats_entry_free(void *data)
+{
+	struct stats_entry *entry = data;
+
+	l_free(entry->name);
+	l_free(entry);
+}
+
+static bool counter_cmp(const void *entry_data, const void *user_data)
+{
+	const struct stats_entry *entry = entry_data;
+
+	return entry->counter == user_data;
+}
+
+void stats_register(const char *name, const uint64_t *counter)
+{
+	struct stats_entry *entry;
+
+	if (!stats_list)
+		stats_list = l_queue_new();
+
+	entry = l_new(struct stats_entry, 1);
+	entry->name = l_strdup(name);
+	entry->counter = counter;
+
+	l_queue_push_tail(stats_list, entry);
+}
+
+void stats_unregister(const uint64_t *counter)
+{
+	struct stats_entry *entry;
+
+	entry = l_queue_remove_if(stats_list, counter_cmp, counter);
+	if (!entry)
+		return;
+
+	stats_entry_free(entry);
+
+	if (!l_queue_isempty(stats_list))
+		return;
+
+	l_queue_destroy(stats_list, NULL);
+	stats_list = NULL;
+}
+
+void stats_foreach(stats_foreach_func_t func, void *user_data)
+{
+	const struct l_queue_entry *entry;
+	const struct stats_entry *stat;
+
+	for (entry = l_queue_get_entries(stats_list); entry;
+						entry = entry->next) {
+		stat = entry->data;
+		func(stat->name, *stat->counter, user_data);
+	}
+}
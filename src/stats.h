@@ -0,0 +1,31 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Named counters exposed through the Statistics property of the manager
+ * object. Modules own the counters: only a pointer is kept here.
+ */
+typedef void (*stats_foreach_func_t) (const char *name, uint64_t value,
+							void *user_data);
+
+void stats_register(const char *name, const uint64_t *counter);
+void stats_unregister(const uint64_t *counter);
+void stats_foreach(stats_foreach_func_t func, void *user_data);
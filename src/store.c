@@ -0,0 +1,556 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ell/ell.h>
+
+#include <knot_types.h>
+#include <knot_protocol.h>
+#include <hal/linux_log.h>
+
+#include "stats.h"
+#include "store.h"
+
+/*
+ * The log is a sequence of fixed size segment files, named by their
+ * sequence number and mapped in memory. Records are appended to the
+ * newest segment only; a segment is removed once all its records are
+ * consumed, or evicted (oldest first) when the log reaches its size.
+ */
+#define SEGMENT_MAGIC		"KNOTLOG1"
+#define SEGMENT_RECORDS		1024
+#define SEGMENT_SIZE		(sizeof(struct store_header) + \
+			SEGMENT_RECORDS * sizeof(struct store_record))
+#define MIN_SEGMENTS		2
+
+#define RECORD_FREE		0x00	/* End of the segment */
+#define RECORD_PENDING		0x01
+#define RECORD_DONE		0x02
+
+struct store_header {
+	char magic[8];
+	uint32_t seq;
+	uint32_t records;
+} __attribute__((packed));
+
+struct store_record {
+	uint32_t check;			/* FNV-1a of the fields after 'state' */
+	uint8_t state;			/* Written after the other fields */
+	uint8_t sensor_id;
+	uint8_t value_type;
+	uint8_t reserved;
+	uint64_t timestamp;
+	char uuid[KNOT_PROTOCOL_UUID_LEN];
+	knot_data value;
+} __attribute__((packed));
+
+struct segment {
+	uint32_t seq;
+	void *map;
+	struct store_record *records;
+	unsigned int used;		/* Records written */
+	unsigned int pending;		/* Records not consumed */
+};
+
+/* Pending record, queued in the log of its device */
+struct store_entry {
+	struct segment *segment;
+	struct store_record *record;
+};
+
+static char *store_path;
+static unsigned int max_segments;
+static long page_size;
+static struct l_queue *segments;	/* Oldest first: tail is appended */
+static struct l_hashmap *devices;	/* UUID: queue of store_entry */
+
+static uint64_t appended;
+static uint64_t consumed;
+static uint64_t evicted;
+static uint64_t discarded;		/* Damaged records found at startup */
+
+static uint32_t record_check(const struct store_record *record)
+{
+	const uint8_t *byte = &record->sensor_id;
+	const uint8_t *end = (const uint8_t *) (record + 1);
+	uint32_t hash = 2166136261U;
+
+	for (; byte < end; byte++) {
+		hash ^= *byte;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static void record_uuid(const struct store_record *record, char *uuid)
+{
+	memcpy(uuid, record->uuid, KNOT_PROTOCOL_UUID_LEN);
+	uuid[KNOT_PROTOCOL_UUID_LEN] = '\0';
+}
+
+static char *segment_name(uint32_t seq)
+{
+	return l_strdup_printf("%s/%08x.seg", store_path, seq);
+}
+
+static void segment_free(void *data)
+{
+	struct segment *seg = data;
+
+	munmap(seg->map, SEGMENT_SIZE);
+	l_free(seg);
+}
+
+static void segment_remove(struct segment *seg)
+{
+	char *name = segment_name(seg->seq);
+
+	if (unlink(name) < 0)
+		hal_log_error("unlink(%s): %s(%d)", name, strerror(errno),
+									errno);
+	l_free(name);
+
+	l_queue_remove(segments, seg);
+	segment_free(seg);
+}
+
+static int segment_map(uint32_t seq, bool create, struct segment **pseg)
+{
+	struct store_header *hdr;
+	struct segment *seg;
+	struct stat st;
+	char *name;
+	void *map;
+	int fd, err;
+
+	name = segment_name(seq);
+	fd = open(name, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0),
+									0600);
+	if (fd < 0) {
+		err = -errno;
+		goto fail_open;
+	}
+
+	if (create && ftruncate(fd, SEGMENT_SIZE) < 0) {
+		err = -errno;
+		goto fail_map;
+	}
+
+	if (!create && (fstat(fd, &st) < 0 ||
+				(size_t) st.st_size != SEGMENT_SIZE)) {
+		err = -EBADMSG;
+		goto fail_map;
+	}
+
+	map = mmap(NULL, SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+									fd, 0);
+	if (map == MAP_FAILED) {
+		err = -errno;
+		goto fail_map;
+	}
+
+	hdr = map;
+	if (create) {
+		memcpy(hdr->magic, SEGMENT_MAGIC, sizeof(hdr->magic));
+		hdr->seq = seq;
+		hdr->records = SEGMENT_RECORDS;
+	} else if (memcmp(hdr->magic, SEGMENT_MAGIC, sizeof(hdr->magic)) ||
+			hdr->seq != seq || hdr->records != SEGMENT_RECORDS) {
+		munmap(map, SEGMENT_SIZE);
+		err = -EBADMSG;
+		goto fail_map;
+	}
+
+	close(fd);
+	l_free(name);
+
+	seg = l_new(struct segment, 1);
+	seg->seq = seq;
+	seg->map = map;
+	seg->records = (struct store_record *) (hdr + 1);
+	*pseg = seg;
+
+	return 0;
+
+fail_map:
+	close(fd);
+	if (create || err == -EBADMSG)
+		unlink(name);
+fail_open:
+	hal_log_error("store %s: %s(%d)", name, strerror(-err), -err);
+	l_free(name);
+
+	return err;
+}
+
+static void device_log_free(void *data)
+{
+	l_queue_destroy(data, l_free);
+}
+
+static void device_log_push(struct segment *seg, struct store_record *record)
+{
+	char uuid[KNOT_PROTOCOL_UUID_LEN + 1];
+	struct store_entry *entry;
+	struct l_queue *log;
+
+	record_uuid(record, uuid);
+	log = l_hashmap_lookup(devices, uuid);
+	if (!log) {
+		log = l_queue_new();
+		l_hashmap_insert(devices, uuid, log);
+	}
+
+	entry = l_new(struct store_entry, 1);
+	entry->segment = seg;
+	entry->record = record;
+	l_queue_push_tail(log, entry);
+	seg->pending++;
+}
+
+/* Removes the oldest entry of a device: its record is not pending anymore */
+static void device_log_pop(const char *uuid, struct l_queue *log)
+{
+	l_free(l_queue_pop_head(log));
+
+	if (l_queue_isempty(log)) {
+		l_hashmap_remove(devices, uuid);
+		l_queue_destroy(log, NULL);
+	}
+}
+
+/* Indexes the pending records of a segment found at startup */
+static void segment_recover(struct segment *seg)
+{
+	struct store_record *record;
+	unsigned int i;
+
+	for (i = 0; i < SEGMENT_RECORDS; i++) {
+		record = &seg->records[i];
+		if (record->state == RECORD_FREE)
+			break;
+
+		/* Interrupted write: nothing is appended after it */
+		if ((record->state != RECORD_PENDING &&
+				record->state != RECORD_DONE) ||
+				record->check != record_check(record)) {
+			discarded++;
+			memset(record, 0,
+				(SEGMENT_RECORDS - i) * sizeof(*record));
+			break;
+		}
+
+		if (record->state == RECORD_PENDING)
+			device_log_push(seg, record);
+	}
+
+	seg->used = i;
+}
+
+/* Drops the oldest segment: its pending records are lost */
+static void segment_evict(struct segment *seg)
+{
+	char uuid[KNOT_PROTOCOL_UUID_LEN + 1];
+	struct store_record *record;
+	struct l_queue *log;
+	unsigned int i;
+
+	for (i = 0; i < seg->used; i++) {
+		record = &seg->records[i];
+		if (record->state != RECORD_PENDING)
+			continue;
+
+		record_uuid(record, uuid);
+		log = l_hashmap_lookup(devices, uuid);
+		if (log)
+			device_log_pop(uuid, log);
+		evicted++;
+	}
+
+	hal_log_info("store: segment %08x evicted (%u samples)", seg->seq,
+								seg->pending);
+	segment_remove(seg);
+}
+
+/* Starts a new segment, evicting the oldest one if the log is full */
+static int segment_next(struct segment **pseg)
+{
+	struct segment *last;
+	uint32_t seq;
+	int err;
+
+	last = l_queue_peek_tail(segments);
+	seq = last ? last->seq + 1 : 0;
+
+	while (l_queue_length(segments) >= max_segments)
+		segment_evict(l_queue_peek_head(segments));
+
+	err = segment_map(seq, true, pseg);
+	if (err < 0)
+		return err;
+
+	l_queue_push_tail(segments, *pseg);
+
+	/* Consumed while it was being appended */
+	if (last && !last->pending)
+		segment_remove(last);
+
+	return 0;
+}
+
+static int seq_cmp(const void *a, const void *b, void *user_data)
+{
+	uint32_t seq_a = L_PTR_TO_UINT(a);
+	uint32_t seq_b = L_PTR_TO_UINT(b);
+
+	return seq_a < seq_b ? -1 : seq_a > seq_b;
+}
+
+static struct l_queue *list_segments(void)
+{
+	struct l_queue *seqs;
+	struct dirent *entry;
+	unsigned int seq;
+	char tail;
+	DIR *dir;
+
+	dir = opendir(store_path);
+	if (!dir)
+		return NULL;
+
+	seqs = l_queue_new();
+	while ((entry = readdir(dir)) != NULL) {
+		if (sscanf(entry->d_name, "%8x.se%c", &seq, &tail) != 2 ||
+				strlen(entry->d_name) != 12 || tail != 'g')
+			continue;
+
+		l_queue_insert(seqs, L_UINT_TO_PTR(seq), seq_cmp, NULL);
+	}
+
+	closedir(dir);
+
+	return seqs;
+}
+
+static void recover(void)
+{
+	struct l_queue *seqs;
+	struct segment *seg;
+	uint32_t seq;
+
+	seqs = list_segments();
+	if (!seqs)
+		return;
+
+	/* Segment 0 is queued as NULL */
+	while (!l_queue_isempty(seqs)) {
+		seq = L_PTR_TO_UINT(l_queue_pop_head(seqs));
+		if (segment_map(seq, false, &seg) < 0)
+			continue;
+
+		l_queue_push_tail(segments, seg);
+		segment_recover(seg);
+	}
+
+	l_queue_destroy(seqs, NULL);
+
+	while (l_queue_length(segments) > max_segments)
+		segment_evict(l_queue_peek_head(segments));
+
+	/* Only the newest segment may be appended */
+	while ((seg = l_queue_peek_head(segments)) != NULL &&
+			seg != l_queue_peek_tail(segments) && !seg->pending)
+		segment_remove(seg);
+
+	hal_log_info("store: %u segments, %u devices pending",
+			l_queue_length(segments), l_hashmap_size(devices));
+}
+
+int store_open(const char *path, size_t max_size)
+{
+	int err;
+
+	if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+		err = -errno;
+		hal_log_error("store %s: %s(%d)", path, strerror(-err), -err);
+		return err;
+	}
+
+	store_path = l_strdup(path);
+	max_segments = max_size / SEGMENT_SIZE;
+	if (max_segments < MIN_SEGMENTS)
+		max_segments = MIN_SEGMENTS;
+	page_size = sysconf(_SC_PAGESIZE);
+
+	segments = l_queue_new();
+	devices = l_hashmap_string_new();
+
+	recover();
+
+	stats_register("store.appended", &appended);
+	stats_register("store.consumed", &consumed);
+	stats_register("store.evicted", &evicted);
+	stats_register("store.discarded", &discarded);
+
+	return 0;
+}
+
+void store_close(void)
+{
+	if (!segments)
+		return;
+
+	stats_unregister(&appended);
+	stats_unregister(&consumed);
+	stats_unregister(&evicted);
+	stats_unregister(&discarded);
+
+	l_hashmap_destroy(devices, device_log_free);
+	devices = NULL;
+	l_queue_destroy(segments, segment_free);
+	segments = NULL;
+	l_free(store_path);
+	store_path = NULL;
+}
+
+int store_append(const char *uuid, const struct store_sample *sample)
+{
+	struct store_record *record;
+	struct segment *seg;
+	uintptr_t start;
+	int err;
+
+	if (!segments)
+		return -ENOENT;
+
+	seg = l_queue_peek_tail(segments);
+	if (!seg || seg->used == SEGMENT_RECORDS) {
+		err = segment_next(&seg);
+		if (err < 0)
+			return err;
+	}
+
+	record = &seg->records[seg->used];
+	record->sensor_id = sample->sensor_id;
+	record->value_type = sample->value_type;
+	record->timestamp = sample->timestamp;
+	strncpy(record->uuid, uuid, sizeof(record->uuid));
+	memcpy(&record->value, &sample->value, sizeof(record->value));
+	record->check = record_check(record);
+	record->state = RECORD_PENDING;
+
+	/* Written back by the kernel even if knotd is killed */
+	start = (uintptr_t) record & ~((uintptr_t) page_size - 1);
+	msync((void *) start, (uintptr_t) (record + 1) - start, MS_ASYNC);
+
+	seg->used++;
+	device_log_push(seg, record);
+	appended++;
+
+	return 0;
+}
+
+unsigned int store_pending(const char *uuid)
+{
+	struct l_queue *log;
+
+	if (!devices)
+		return 0;
+
+	log = l_hashmap_lookup(devices, uuid);
+
+	return log ? l_queue_length(log) : 0;
+}
+
+/* Copies the oldest pending samples of a device, without consuming them */
+unsigned int store_peek(const char *uuid, struct store_sample *samples,
+							unsigned int max)
+{
+	const struct l_queue_entry *entry;
+	const struct store_entry *sentry;
+	struct l_queue *log;
+	unsigned int count = 0;
+
+	if (!devices)
+		return 0;
+
+	log = l_hashmap_lookup(devices, uuid);
+	if (!log)
+		return 0;
+
+	for (entry = l_queue_get_entries(log); entry && count < max;
+						entry = entry->next, count++) {
+		sentry = entry->data;
+		samples[count].timestamp = sentry->record->timestamp;
+		samples[count].sensor_id = sentry->record->sensor_id;
+		samples[count].value_type = sentry->record->value_type;
+		memcpy(&samples[count].value, &sentry->record->value,
+						sizeof(samples[count].value));
+	}
+
+	return count;
+}
+
+void store_consume(const char *uuid, unsigned int count)
+{
+	struct store_entry *entry;
+	struct segment *seg;
+	struct l_queue *log;
+	bool last;
+
+	if (!devices)
+		return;
+
+	log = l_hashmap_lookup(devices, uuid);
+
+	while (log && count--) {
+		entry = l_queue_peek_head(log);
+		entry->record->state = RECORD_DONE;
+		seg = entry->segment;
+		seg->pending--;
+		consumed++;
+
+		/* 'log' is destroyed with its last entry */
+		last = l_queue_length(log) == 1;
+		device_log_pop(uuid, log);
+		if (last)
+			log = NULL;
+
+		if (!seg->pending && seg != l_queue_peek_tail(segments))
+			segment_remove(seg);
+	}
+}
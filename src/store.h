@@ -0,0 +1,41 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Store-and-forward log of device data: samples that could not be sent
+ * to the cloud are kept on disk, per device and in order, until they are
+ * consumed. Requires knot_protocol.h.
+ */
+struct store_sample {
+	uint64_t timestamp;		/* Milliseconds since the epoch */
+	uint8_t sensor_id;
+	uint8_t value_type;
+	knot_data value;
+};
+
+int store_open(const char *path, size_t max_size);
+void store_close(void);
+
+int store_append(const char *uuid, const struct store_sample *sample);
+unsigned int store_pending(const char *uuid);
+unsigned int store_peek(const char *uuid, struct store_sample *samples,
+							unsigned int max);
+void store_consume(const char *uuid, unsigned int count);
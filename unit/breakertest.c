@@ -0,0 +1,162 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Circuit breaker of the upstream: opening on the error rate, probe once
+ * the open time elapsed and closing. Times are given by the test.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <glib.h>
+
+#include "src/breaker.h"
+
+#define THRESHOLD		50	/* Percent */
+#define OPEN_TIME		1000
+
+static struct breaker breaker;
+
+/* Breaker opened at 'now' by failing half of the operations */
+static void open_breaker(uint64_t now)
+{
+	bool probe;
+	int i;
+
+	breaker_init(&breaker, THRESHOLD, OPEN_TIME, now);
+
+	for (i = 0; i < BREAKER_MIN_CALLS; i++) {
+		g_assert_true(breaker_allow(&breaker, now, &probe));
+		g_assert_false(probe);
+		breaker_record(&breaker, now, false, i % 2);
+	}
+
+	g_assert_cmpint(breaker.state, ==, BREAKER_OPEN);
+	g_assert_cmpuint(breaker.opens, ==, 1);
+}
+
+static void open_test(void)
+{
+	bool probe;
+	int i;
+
+	breaker_init(&breaker, THRESHOLD, OPEN_TIME, 0);
+
+	/* Too few operations to tell */
+	for (i = 0; i < BREAKER_MIN_CALLS - 1; i++)
+		breaker_record(&breaker, 0, false, true);
+	g_assert_cmpint(breaker.state, ==, BREAKER_CLOSED);
+
+	/* Failures of a previous window are forgotten */
+	for (i = 0; i < BREAKER_MIN_CALLS; i++)
+		breaker_record(&breaker, BREAKER_WINDOW, false, i == 0);
+	g_assert_cmpint(breaker.state, ==, BREAKER_CLOSED);
+	g_assert_true(breaker_allow(&breaker, BREAKER_WINDOW, &probe));
+
+	open_breaker(0);
+	g_assert_cmpuint(breaker.opened, ==, 0);
+
+	/* Fail fast, connections as well */
+	g_assert_false(breaker_allow(&breaker, OPEN_TIME - 1, &probe));
+	g_assert_false(breaker_allow_connect(&breaker, OPEN_TIME - 1));
+	g_assert_cmpuint(breaker.rejected, ==, 2);
+
+	/* Late results are not accounted */
+	breaker_record(&breaker, 1, false, false);
+	g_assert_cmpint(breaker.state, ==, BREAKER_OPEN);
+	g_assert_cmpuint(breaker.opened, ==, 0);
+}
+
+static void probe_test(void)
+{
+	bool probe;
+
+	open_breaker(0);
+
+	/* Connecting doesn't take the place of the probe */
+	g_assert_true(breaker_allow_connect(&breaker, OPEN_TIME));
+	g_assert_cmpint(breaker.state, ==, BREAKER_OPEN);
+
+	g_assert_true(breaker_allow(&breaker, OPEN_TIME, &probe));
+	g_assert_true(probe);
+	g_assert_cmpint(breaker.state, ==, BREAKER_HALF_OPEN);
+	g_assert_cmpuint(breaker.probes, ==, 1);
+
+	/* A single probe at once */
+	g_assert_false(breaker_allow(&breaker, OPEN_TIME, &probe));
+	g_assert_false(breaker_allow_connect(&breaker, OPEN_TIME));
+
+	/* Failed: open again for a whole open time */
+	breaker_record(&breaker, OPEN_TIME + 10, true, true);
+	g_assert_cmpint(breaker.state, ==, BREAKER_OPEN);
+	g_assert_cmpuint(breaker.opened, ==, OPEN_TIME + 10);
+	g_assert_cmpuint(breaker.opens, ==, 1);
+	g_assert_false(breaker_allow(&breaker, 2 * OPEN_TIME, &probe));
+
+	g_assert_true(breaker_allow(&breaker, 2 * OPEN_TIME + 10, &probe));
+	g_assert_true(probe);
+	g_assert_cmpuint(breaker.probes, ==, 2);
+}
+
+static void close_test(void)
+{
+	bool probe;
+	int i;
+
+	open_breaker(0);
+
+	g_assert_true(breaker_allow(&breaker, OPEN_TIME, &probe));
+	g_assert_true(probe);
+	breaker_record(&breaker, OPEN_TIME, true, false);
+
+	g_assert_cmpint(breaker.state, ==, BREAKER_CLOSED);
+	g_assert_cmpuint(breaker.calls, ==, 0);
+	g_assert_cmpuint(breaker.failures, ==, 0);
+
+	g_assert_true(breaker_allow(&breaker, OPEN_TIME, &probe));
+	g_assert_false(probe);
+	g_assert_true(breaker_allow_connect(&breaker, OPEN_TIME));
+
+	/* Measured again from the close */
+	for (i = 0; i < BREAKER_MIN_CALLS - 1; i++)
+		breaker_record(&breaker, OPEN_TIME, false, true);
+	g_assert_cmpint(breaker.state, ==, BREAKER_CLOSED);
+
+	breaker_record(&breaker, OPEN_TIME, false, true);
+	g_assert_cmpint(breaker.state, ==, BREAKER_OPEN);
+	g_assert_cmpuint(breaker.opens, ==, 2);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/breaker/open", open_test);
+	g_test_add_func("/breaker/probe", probe_test);
+	g_test_add_func("/breaker/close", close_test);
+
+	return g_test_run();
+}
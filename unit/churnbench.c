@@ -0,0 +1,234 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Mass disconnection of node sessions, as after a radio reset: every node
+ * sends a PDU rejected by the upper layer at once, then the time until all
+ * sessions and their cloud connections are released is measured.
+ * Usage: churnbench [sessions] [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <ell/ell.h>
+
+#include <knot_protocol.h>
+
+#include "src/settings.h"
+#include "src/node.h"
+#include "src/proto.h"
+#include "src/session.h"
+
+#define DEFAULT_SESSIONS	512
+#define DEFAULT_ROUNDS		10
+#define RX_BUFFER_SIZE		4096
+#define ITERATIONS_MAX		1000	/* Main loop iterations per round */
+
+static unsigned int connected;
+static unsigned int closed;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static ssize_t node_recv(int sockfd, void *buffer, size_t len)
+{
+	return recv(sockfd, buffer, len, MSG_DONTWAIT);
+}
+
+static ssize_t node_send(int sockfd, const void *buffer, size_t len)
+{
+	return send(sockfd, buffer, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static struct node_ops node_ops = {
+	.name = "churnbench",
+	.recv = node_recv,
+	.send = node_send,
+	.stream = true,
+};
+
+/* Cloud connection: the peer end is closed by close() as drivers do */
+static int *peers;
+static int peers_len;
+
+static int proto_connect(void)
+{
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+								0, sv) < 0)
+		return -errno;
+
+	if (sv[0] >= peers_len) {
+		peers = realloc(peers, (sv[0] + 1) * sizeof(int));
+		memset(peers + peers_len, -1,
+				(sv[0] + 1 - peers_len) * sizeof(int));
+		peers_len = sv[0] + 1;
+	}
+
+	peers[sv[0]] = sv[1];
+	connected++;
+
+	return sv[0];
+}
+
+static void proto_close(int sock)
+{
+	if (sock >= peers_len || peers[sock] < 0)
+		return;
+
+	close(peers[sock]);
+	peers[sock] = -1;
+	closed++;
+}
+
+static struct proto_ops proto_ops = {
+	.name = "churnbench",
+	.connect = proto_connect,
+	.close = proto_close,
+};
+
+/* Every PDU is rejected: the session is torn down */
+static int reject_pdu(int node_socket, int proto_socket,
+		const void *ipdu, size_t ipdulen, on_reply reply_cb,
+		void *user_data)
+{
+	return -EPROTO;
+}
+
+static int round_run(unsigned int sessions, uint64_t *elapsed)
+{
+	knot_msg_header hdr = { .type = KNOT_MSG_DATA, .payload_len = 0 };
+	unsigned int i, iterations, expected;
+	uint64_t start;
+	int *nodes;
+	int sv[2];
+	int err = 0;
+
+	nodes = calloc(sessions, sizeof(int));
+	if (!nodes)
+		return -ENOMEM;
+
+	for (i = 0; i < sessions; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+						SOCK_CLOEXEC, 0, sv) < 0) {
+			err = -errno;
+			sessions = i;
+			goto done;
+		}
+
+		session_create(&node_ops, &proto_ops, sv[0], RX_BUFFER_SIZE,
+						reject_pdu, NULL);
+		nodes[i] = sv[1];
+	}
+
+	expected = closed + sessions;
+
+	/* All nodes fail in the same main loop iteration */
+	for (i = 0; i < sessions; i++) {
+		if (write(nodes[i], &hdr, sizeof(hdr)) != sizeof(hdr)) {
+			err = -errno;
+			goto done;
+		}
+	}
+
+	start = now_ns();
+
+	for (iterations = 0; closed < expected &&
+				iterations < ITERATIONS_MAX; iterations++)
+		l_main_iterate(100);
+
+	*elapsed = now_ns() - start;
+
+	if (closed < expected)
+		err = -ETIMEDOUT;
+
+done:
+	for (i = 0; i < sessions; i++)
+		close(nodes[i]);
+
+	free(nodes);
+
+	return err;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int sessions = DEFAULT_SESSIONS;
+	unsigned int rounds = DEFAULT_ROUNDS;
+	uint64_t elapsed, total = 0;
+	unsigned int i;
+	int err = 0;
+
+	if (argc > 1)
+		sessions = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		rounds = strtoul(argv[2], NULL, 10);
+
+	if (!sessions || !rounds) {
+		fprintf(stderr, "Usage: %s [sessions] [rounds]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (!l_main_init())
+		return EXIT_FAILURE;
+
+	for (i = 0; i < rounds; i++) {
+		err = round_run(sessions, &elapsed);
+		if (err < 0) {
+			fprintf(stderr, "round %u: %s(%d)\n", i,
+							strerror(-err), -err);
+			break;
+		}
+
+		total += elapsed;
+		printf("round %u: %u sessions torn down in %.3f ms\n", i,
+					sessions, elapsed / 1000000.0);
+	}
+
+	if (!err)
+		printf("%u sessions x %u rounds: %.1f us per session, "
+				"%u cloud connections closed of %u\n",
+				sessions, rounds,
+				total / 1000.0 / ((double) sessions * rounds),
+				closed, connected);
+
+	session_destroy_all();
+	free(peers);
+	l_main_exit();
+
+	return err < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,148 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Serialization of the WebSocket data event: json-c tree against the
+ * append-only writer. Usage: jsonbench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include <ell/ell.h>
+#include <json-c/json.h>
+
+#include "src/json-writer.h"
+
+#define DEFAULT_ITERATIONS	1000000
+#define PAYLOAD_LEN		4096
+
+#define BENCH_UUID		"c1a3bd5a-ffa2-4a68-9b3c-1e26a1a1a5c0"
+#define BENCH_TOKEN		"5b67ce6bef21701331152d6297e1bd2b22f91787"
+
+static volatile size_t sink;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* What msg.c and proto-ws.c did before: tree, string, copy */
+static char *data_jsonc(int sensor_id, double value)
+{
+	json_object *jmsg, *jobj;
+	char *jstr;
+
+	jobj = json_object_new_object();
+	json_object_object_add(jobj, "sensor_id",
+				json_object_new_int(sensor_id));
+	json_object_object_add(jobj, "value",
+				json_object_new_double(value));
+	json_object_object_add(jobj, "uuid",
+				json_object_new_string(BENCH_UUID));
+	json_object_object_add(jobj, "token",
+				json_object_new_string(BENCH_TOKEN));
+
+	jmsg = json_object_new_array();
+	json_object_array_add(jmsg, json_object_new_string("data"));
+	json_object_array_add(jmsg, jobj);
+
+	jstr = l_strdup(json_object_to_json_string(jmsg));
+	json_object_put(jmsg);
+
+	return jstr;
+}
+
+static char *data_writer(char *buf, size_t size, int sensor_id,
+								double value)
+{
+	struct json_writer w;
+
+	json_writer_init(&w, buf, size);
+	json_writer_begin_array(&w);
+	json_writer_string(&w, "data");
+	json_writer_begin_object(&w);
+	json_writer_key(&w, "uuid");
+	json_writer_string(&w, BENCH_UUID);
+	json_writer_key(&w, "token");
+	json_writer_string(&w, BENCH_TOKEN);
+	json_writer_key(&w, "sensor_id");
+	json_writer_int(&w, sensor_id);
+	json_writer_key(&w, "value");
+	json_writer_fixed(&w, value, 3);
+	json_writer_end_object(&w);
+	json_writer_end_array(&w);
+
+	return json_writer_finish(&w);
+}
+
+int main(int argc, char *argv[])
+{
+	char buf[PAYLOAD_LEN];
+	unsigned long i, iterations = DEFAULT_ITERATIONS;
+	uint64_t start, jsonc_ns, writer_ns;
+	char *jstr;
+
+	if (argc > 1)
+		iterations = strtoul(argv[1], NULL, 10);
+	if (!iterations)
+		iterations = 1;
+
+	jstr = data_jsonc(1, 23.125);
+	printf("json-c: %s\n", jstr);
+	l_free(jstr);
+
+	jstr = data_writer(buf, sizeof(buf), 1, 23.125);
+	if (!jstr) {
+		fprintf(stderr, "writer: failed\n");
+		return EXIT_FAILURE;
+	}
+	printf("writer: %s\n", jstr);
+
+	start = now_ns();
+	for (i = 0; i < iterations; i++) {
+		jstr = data_jsonc(i & 0xff, i * 0.125);
+		sink += strlen(jstr);
+		l_free(jstr);
+	}
+	jsonc_ns = now_ns() - start;
+
+	start = now_ns();
+	for (i = 0; i < iterations; i++) {
+		jstr = data_writer(buf, sizeof(buf), i & 0xff, i * 0.125);
+		sink += strlen(jstr);
+	}
+	writer_ns = now_ns() - start;
+
+	printf("%lu iterations\n", iterations);
+	printf("json-c: %8.1f ns/op\n", (double) jsonc_ns / iterations);
+	printf("writer: %8.1f ns/op\n", (double) writer_ns / iterations);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,272 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Append-only JSON writer: escaping, number formatting, buffer limits,
+ * merged members and misuse reported by json_writer_finish().
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include <glib.h>
+#include <ell/ell.h>
+
+#include "src/json-writer.h"
+
+#define BUFFER_LEN		256
+
+static char buf[BUFFER_LEN];
+
+static void escape_test(void)
+{
+	struct json_writer w;
+
+	json_writer_init(&w, buf, sizeof(buf));
+	json_writer_begin_object(&w);
+	json_writer_key(&w, "k\"ey");
+	json_writer_string(&w, "a\"b\\c/\b\f\n\r\t\x01\x1f\x7f");
+	json_writer_key(&w, "name");
+	/* Fixed size field: stops at 'len' or at the NUL */
+	json_writer_stringn(&w, "abcdef", 3);
+	json_writer_key(&w, "short");
+	json_writer_stringn(&w, "ab\0cd", 5);
+	json_writer_end_object(&w);
+
+	g_assert_cmpstr(json_writer_finish(&w), ==,
+		"{\"k\\\"ey\":\"a\\\"b\\\\c/\\b\\f\\n\\r\\t\\u0001\\u001f\x7f\","
+		"\"name\":\"abc\",\"short\":\"ab\"}");
+}
+
+static void fixed_test(void)
+{
+	struct json_writer w;
+	char *jstr;
+
+	json_writer_init(&w, buf, sizeof(buf));
+	json_writer_begin_array(&w);
+	json_writer_fixed(&w, 23.125, 3);
+	json_writer_fixed(&w, 23.125, 1);
+	json_writer_fixed(&w, -1.5, 2);
+	json_writer_fixed(&w, 7, 0);
+	json_writer_fixed(&w, 0.000001, 6);
+	/* At most 17 digits after the point */
+	json_writer_fixed(&w, 1, 30);
+	json_writer_end_array(&w);
+
+	g_assert_cmpstr(json_writer_finish(&w), ==,
+		"[23.125,23.1,-1.50,7,0.000001,1.00000000000000000]");
+
+	/* Longer than the number buffer: formatted in place */
+	json_writer_init(&w, buf, sizeof(buf));
+	json_writer_fixed(&w, -1e40, 2);
+	jstr = json_writer_finish(&w);
+	g_assert_nonnull(jstr);
+	g_assert_cmpuint(strlen(jstr), ==, strlen("-1") + 40 + strlen(".00"));
+	g_assert_true(strtod(jstr, NULL) == -1e40);
+	g_assert_cmpstr(jstr + strlen(jstr) - 3, ==, ".00");
+}
+
+static void nonfinite_test(void)
+{
+	struct json_writer w;
+
+	json_writer_init(&w, buf, sizeof(buf));
+	json_writer_begin_object(&w);
+	json_writer_key(&w, "nan");
+	json_writer_fixed(&w, NAN, 2);
+	json_writer_key(&w, "inf");
+	json_writer_fixed(&w, INFINITY, 2);
+	json_writer_key(&w, "-inf");
+	json_writer_fixed(&w, -INFINITY, 2);
+	json_writer_end_object(&w);
+
+	g_assert_cmpstr(json_writer_finish(&w), ==,
+				"{\"nan\":null,\"inf\":null,\"-inf\":null}");
+}
+
+static void write_member(struct json_writer *w)
+{
+	json_writer_begin_object(w);
+	json_writer_key(w, "key");
+	json_writer_string(w, "value");
+	json_writer_end_object(w);
+}
+
+static void msgsize_test(void)
+{
+	const char *expected = "{\"key\":\"value\"}";
+	size_t len = strlen(expected);
+	struct json_writer w;
+
+	/* Room for the document and its NUL */
+	json_writer_init(&w, buf, len + 1);
+	write_member(&w);
+	g_assert_cmpstr(json_writer_finish(&w), ==, expected);
+
+	json_writer_init(&w, buf, len);
+	write_member(&w);
+	g_assert_null(json_writer_finish(&w));
+	g_assert_cmpint(w.err, ==, -EMSGSIZE);
+
+	/* Sticky: later calls don't clear it */
+	json_writer_init(&w, buf, 4);
+	json_writer_begin_array(&w);
+	json_writer_string(&w, "too long");
+	json_writer_int(&w, 1);
+	json_writer_end_array(&w);
+	g_assert_null(json_writer_finish(&w));
+	g_assert_cmpint(w.err, ==, -EMSGSIZE);
+
+	/* Number formatted in place */
+	json_writer_init(&w, buf, 16);
+	json_writer_fixed(&w, 1e40, 0);
+	g_assert_null(json_writer_finish(&w));
+	g_assert_cmpint(w.err, ==, -EMSGSIZE);
+}
+
+static void merge_test(void)
+{
+	struct json_writer w;
+
+	json_writer_init(&w, buf, sizeof(buf));
+	json_writer_begin_object(&w);
+	json_writer_merge(&w, "{}");
+	json_writer_merge(&w, " \t{ \n }\n");
+	json_writer_key(&w, "a");
+	json_writer_int(&w, 1);
+	json_writer_merge(&w, "{}");
+	json_writer_merge(&w, "  { \"b\": 2, \"c\": [3] }  ");
+	json_writer_key(&w, "d");
+	json_writer_bool(&w, true);
+	json_writer_end_object(&w);
+
+	g_assert_cmpstr(json_writer_finish(&w), ==,
+			"{\"a\":1,\"b\": 2, \"c\": [3],\"d\":true}");
+
+	/* First members of the object: no separator */
+	json_writer_init(&w, buf, sizeof(buf));
+	json_writer_begin_object(&w);
+	json_writer_merge(&w, "{\"b\":2}");
+	json_writer_end_object(&w);
+	g_assert_cmpstr(json_writer_finish(&w), ==, "{\"b\":2}");
+
+	/* Objects only, into an object being written */
+	json_writer_init(&w, buf, sizeof(buf));
+	json_writer_begin_object(&w);
+	json_writer_merge(&w, "[1]");
+	json_writer_end_object(&w);
+	g_assert_null(json_writer_finish(&w));
+	g_assert_cmpint(w.err, ==, -EINVAL);
+
+	json_writer_init(&w, buf, sizeof(buf));
+	json_writer_begin_object(&w);
+	json_writer_merge(&w, " { ");
+	json_writer_end_object(&w);
+	g_assert_null(json_writer_finish(&w));
+	g_assert_cmpint(w.err, ==, -EINVAL);
+
+	json_writer_init(&w, buf, sizeof(buf));
+	json_writer_merge(&w, "{}");
+	g_assert_null(json_writer_finish(&w));
+	g_assert_cmpint(w.err, ==, -EINVAL);
+}
+
+static void structure_test(void)
+{
+	struct json_writer w;
+	char *jstr;
+	int i;
+
+	/* Left open */
+	json_writer_init(&w, buf, sizeof(buf));
+	json_writer_begin_object(&w);
+	g_assert_null(json_writer_finish(&w));
+	g_assert_cmpint(w.err, ==, -EINVAL);
+
+	/* Key without value */
+	json_writer_init(&w, buf, sizeof(buf));
+	json_writer_begin_object(&w);
+	json_writer_key(&w, "a");
+	json_writer_end_object(&w);
+	g_assert_null(json_writer_finish(&w));
+	g_assert_cmpint(w.err, ==, -EINVAL);
+
+	/* Closed once too often */
+	json_writer_init(&w, buf, sizeof(buf));
+	json_writer_begin_array(&w);
+	json_writer_end_array(&w);
+	json_writer_end_array(&w);
+	g_assert_null(json_writer_finish(&w));
+	g_assert_cmpint(w.err, ==, -EINVAL);
+
+	/* Nested containers and separators */
+	json_writer_init(&w, buf, sizeof(buf));
+	json_writer_begin_array(&w);
+	json_writer_string(&w, "data");
+	json_writer_begin_object(&w);
+	json_writer_key(&w, "list");
+	json_writer_begin_array(&w);
+	json_writer_end_array(&w);
+	json_writer_key(&w, "raw");
+	json_writer_raw(&w, "{\"x\":1}");
+	json_writer_end_object(&w);
+	json_writer_int(&w, INT64_MIN);
+	json_writer_end_array(&w);
+	g_assert_cmpstr(json_writer_finish(&w), ==,
+		"[\"data\",{\"list\":[],\"raw\":{\"x\":1}},"
+		"-9223372036854775808]");
+
+	/* Growing buffer */
+	json_writer_init_alloc(&w, 0);
+	json_writer_begin_array(&w);
+	for (i = 0; i < 1000; i++)
+		json_writer_int(&w, 7);
+	json_writer_end_array(&w);
+	jstr = json_writer_finish(&w);
+	g_assert_nonnull(jstr);
+	g_assert_cmpuint(strlen(jstr), ==, 2 + 1000 + 999);
+	l_free(jstr);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/json/escape", escape_test);
+	g_test_add_func("/json/fixed", fixed_test);
+	g_test_add_func("/json/nonfinite", nonfinite_test);
+	g_test_add_func("/json/msgsize", msgsize_test);
+	g_test_add_func("/json/merge", merge_test);
+	g_test_add_func("/json/structure", structure_test);
+
+	return g_test_run();
+}
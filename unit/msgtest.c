@@ -0,0 +1,312 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Revalidation of devices authenticated from the credential cache, against
+ * a fake cloud driver: credentials rejected by the cloud are revoked, an
+ * unreachable cloud keeps them.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+#include <ell/ell.h>
+
+#include <knot_protocol.h>
+
+#include "src/settings.h"
+#include "src/proto.h"
+#include "src/cache.h"
+#include "src/msg.h"
+
+#define TEST_GATEWAY		"0b4a2f1c-77d0-4bd4-9a3e-0e3c9c3f1d20"
+#define TEST_TOKEN		"5b67ce6bef21701331152d6297e1bd2b22f91787"
+#define ITERATIONS_MAX		100
+
+struct watch {
+	void (*destroy_cb) (void *);
+	void *user_data;
+};
+
+static int signin_err;			/* Answer of the fake cloud */
+static unsigned int signins;
+static int closed_socket = -1;
+static int8_t auth_result = -1;
+static struct l_hashmap *watches;
+static unsigned int next_watch = 1;
+static char cache_dir[] = "/tmp/msgtest-XXXXXX";
+
+static int fake_probe(const char *host, unsigned int port,
+					const struct proto_pool *pool)
+{
+	return 0;
+}
+
+static void fake_remove(void)
+{
+}
+
+static int fake_signin(int sock, const char *uuid, const char *token,
+					proto_cb_t cb, void *user_data)
+{
+	signins++;
+
+	/* Rejections may come without document */
+	return proto_complete(cb, user_data, signin_err, NULL);
+}
+
+static unsigned int fake_async(int sock, const char *uuid, const char *token,
+		void (*watch_cb) (struct json_object *, void *),
+		void *user_data, void (*destroy_cb) (void *))
+{
+	struct watch *watch;
+
+	watch = l_new(struct watch, 1);
+	watch->destroy_cb = destroy_cb;
+	watch->user_data = user_data;
+	l_hashmap_insert(watches, L_UINT_TO_PTR(next_watch), watch);
+
+	return next_watch++;
+}
+
+static void fake_async_stop(int sock, unsigned int watch_id)
+{
+	struct watch *watch;
+
+	watch = l_hashmap_remove(watches, L_UINT_TO_PTR(watch_id));
+	if (!watch)
+		return;
+
+	if (watch->destroy_cb)
+		watch->destroy_cb(watch->user_data);
+
+	l_free(watch);
+}
+
+/* Selected by proto_start() as the "http" driver */
+struct proto_ops proto_http = {
+	.name = "http",
+	.probe = fake_probe,
+	.remove = fake_remove,
+	.signin = fake_signin,
+	.async = fake_async,
+	.async_stop = fake_async_stop,
+};
+
+#ifdef HAVE_WEBSOCKETS
+struct proto_ops proto_ws = {
+	.name = "ws",
+	.probe = fake_probe,
+	.remove = fake_remove,
+};
+#endif
+
+static int push(int sock, const void *pdu, size_t len)
+{
+	return 0;
+}
+
+static void close_node(int sock)
+{
+	closed_socket = sock;
+}
+
+static void on_reply(const void *opdu, size_t olen, void *user_data)
+{
+	const knot_msg_result *rsp = opdu;
+
+	if (olen >= sizeof(*rsp))
+		auth_result = rsp->result;
+}
+
+static void cache_add(const char *uuid)
+{
+	struct l_queue *schema, *config;
+	knot_msg_schema *kmsch;
+
+	kmsch = l_new(knot_msg_schema, 1);
+	kmsch->sensor_id = 1;
+	kmsch->values.value_type = KNOT_VALUE_TYPE_INT;
+	strcpy(kmsch->values.name, "Temperature");
+
+	schema = l_queue_new();
+	l_queue_push_tail(schema, kmsch);
+	config = l_queue_new();
+
+	g_assert_cmpint(cache_store(uuid, TEST_TOKEN, schema, config), ==, 0);
+
+	l_queue_destroy(schema, l_free);
+	l_queue_destroy(config, NULL);
+}
+
+static bool cache_has(const char *uuid)
+{
+	struct l_queue *schema, *config;
+
+	if (cache_lookup(uuid, TEST_TOKEN, &schema, &config) < 0)
+		return false;
+
+	l_queue_destroy(schema, l_free);
+	l_queue_destroy(config, l_free);
+
+	return true;
+}
+
+/* Authenticates 'uuid' through a new node socket: returns it */
+static int authenticate(const char *uuid)
+{
+	knot_msg_authentication kmauth;
+	unsigned int i;
+	int sv[2];
+
+	g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0,
+								sv), ==, 0);
+
+	memset(&kmauth, 0, sizeof(kmauth));
+	kmauth.hdr.type = KNOT_MSG_AUTH_REQ;
+	kmauth.hdr.payload_len = sizeof(kmauth) - sizeof(kmauth.hdr);
+	memcpy(kmauth.uuid, uuid, sizeof(kmauth.uuid));
+	memcpy(kmauth.token, TEST_TOKEN, sizeof(kmauth.token));
+
+	auth_result = -1;
+	closed_socket = -1;
+	signins = 0;
+
+	g_assert_cmpint(msg_process(sv[0], -1, &kmauth, sizeof(kmauth),
+						on_reply, NULL), ==, 0);
+
+	/* Revalidation is completed from the main loop */
+	for (i = 0; i < ITERATIONS_MAX && closed_socket < 0; i++)
+		l_main_iterate(0);
+
+	close(sv[1]);
+
+	return sv[0];
+}
+
+static void revoked_test(void)
+{
+	const char *uuid = "7c1b2bd7-3aa8-4e51-a1f4-3e2ab8f8e9a1";
+	int sock;
+
+	cache_add(uuid);
+	signin_err = -EACCES;
+
+	sock = authenticate(uuid);
+
+	/* Answered from the cache, then rejected by the cloud */
+	g_assert_cmpint(auth_result, ==, KNOT_SUCCESS);
+	g_assert_cmpuint(signins, ==, 1);
+	g_assert_cmpint(closed_socket, ==, sock);
+	g_assert_false(cache_has(uuid));
+
+	close(sock);
+}
+
+static void unreachable_test(void)
+{
+	const char *uuid = "d2e4f5a6-1b2c-4d3e-8f90-a1b2c3d4e5f6";
+
+	cache_add(uuid);
+	signin_err = -ECONNRESET;
+
+	/* Node socket released with the trust by msg_stop() */
+	authenticate(uuid);
+
+	/* Trusted until the cloud answers */
+	g_assert_cmpint(auth_result, ==, KNOT_SUCCESS);
+	g_assert_cmpuint(signins, ==, 1);
+	g_assert_cmpint(closed_socket, ==, -1);
+	g_assert_true(cache_has(uuid));
+}
+
+static void remove_dir(const char *path)
+{
+	struct dirent *entry;
+	char *name;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (!dir)
+		return;
+
+	while ((entry = readdir(dir))) {
+		if (entry->d_name[0] == '.')
+			continue;
+
+		name = l_strdup_printf("%s/%s", path, entry->d_name);
+		unlink(name);
+		l_free(name);
+	}
+
+	closedir(dir);
+	rmdir(path);
+}
+
+int main(int argc, char *argv[])
+{
+	struct settings settings;
+	struct proto_ops *proto_ops;
+	int ret;
+
+	g_test_init(&argc, &argv, NULL);
+
+	g_assert_nonnull(mkdtemp(cache_dir));
+	g_assert_true(l_main_init());
+	watches = l_hashmap_new();
+
+	memset(&settings, 0, sizeof(settings));
+	settings.proto = "http";
+	settings.uuid = TEST_GATEWAY;
+	settings.cache_path = cache_dir;
+	settings.reaper_path = "";
+	settings.reaper_rate = 1;
+
+	g_assert_cmpint(proto_start(&settings, &proto_ops), ==, 0);
+	g_assert_cmpint(msg_start(&settings, proto_ops, push, close_node),
+								==, 0);
+
+	g_test_add_func("/msg/revalidate/revoked", revoked_test);
+	g_test_add_func("/msg/revalidate/unreachable", unreachable_test);
+
+	ret = g_test_run();
+
+	msg_stop();
+	proto_stop();
+	l_hashmap_destroy(watches, l_free);
+	l_main_exit();
+	remove_dir(cache_dir);
+
+	return ret;
+}
@@ -0,0 +1,294 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2018, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Store-and-forward log: samples survive a restart, damaged records are
+ * discarded, the oldest segment is evicted when the log is full, and
+ * samples are peeked and consumed in order across segments.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <ell/ell.h>
+
+#include <knot_types.h>
+#include <knot_protocol.h>
+
+#include "src/store.h"
+
+#define DEVICE_A		"3b1d8c2e-9f4a-4c6b-8e2d-1a5f7c9e0b3d"
+#define DEVICE_B		"7e4f2a1c-0d3b-4e5a-9c8f-6b2d1e0a4f7c"
+#define SEGMENT_RECORDS		1024	/* As in store.c */
+#define HEADER_SIZE		16
+#define SPOOL_SIZE		(1024 * 1024)
+
+static char *spool_dir;
+
+static void sample_init(struct store_sample *sample, unsigned int i)
+{
+	memset(sample, 0, sizeof(*sample));
+	sample->timestamp = 1000 + i;
+	sample->sensor_id = i % 8;
+	sample->value_type = KNOT_VALUE_TYPE_INT;
+	sample->value.values.val_i.value = i;
+}
+
+static void append_samples(const char *uuid, unsigned int first,
+							unsigned int count)
+{
+	struct store_sample sample;
+	unsigned int i;
+
+	for (i = first; i < first + count; i++) {
+		sample_init(&sample, i);
+		g_assert_cmpint(store_append(uuid, &sample), ==, 0);
+	}
+}
+
+/* The oldest samples of 'uuid' are 'first', 'first' + 1, ... */
+static void check_samples(const char *uuid, unsigned int first,
+							unsigned int count)
+{
+	struct store_sample *samples;
+	unsigned int i;
+
+	samples = l_new(struct store_sample, count);
+	g_assert_cmpuint(store_peek(uuid, samples, count), ==, count);
+
+	for (i = 0; i < count; i++) {
+		g_assert_cmpuint(samples[i].timestamp, ==, 1000 + first + i);
+		g_assert_cmpuint(samples[i].sensor_id, ==, (first + i) % 8);
+		g_assert_cmpuint(samples[i].value_type, ==,
+							KNOT_VALUE_TYPE_INT);
+		g_assert_cmpint(samples[i].value.values.val_i.value, ==,
+								first + i);
+	}
+
+	l_free(samples);
+}
+
+static bool segment_exists(uint32_t seq)
+{
+	struct stat st;
+	char *name;
+	bool found;
+
+	name = l_strdup_printf("%s/%08x.seg", spool_dir, seq);
+	found = stat(name, &st) == 0;
+	l_free(name);
+
+	return found;
+}
+
+static void remove_dir(const char *path)
+{
+	struct dirent *entry;
+	char *name;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (!dir)
+		return;
+
+	while ((entry = readdir(dir))) {
+		if (entry->d_name[0] == '.')
+			continue;
+
+		name = l_strdup_printf("%s/%s", path, entry->d_name);
+		unlink(name);
+		l_free(name);
+	}
+
+	closedir(dir);
+	rmdir(path);
+}
+
+static void spool_setup(size_t max_size)
+{
+	spool_dir = l_strdup("/tmp/storetest-XXXXXX");
+	g_assert_nonnull(mkdtemp(spool_dir));
+	g_assert_cmpint(store_open(spool_dir, max_size), ==, 0);
+}
+
+static void spool_teardown(void)
+{
+	store_close();
+	remove_dir(spool_dir);
+	l_free(spool_dir);
+	spool_dir = NULL;
+}
+
+static void reopen_test(void)
+{
+	unsigned int i;
+
+	spool_setup(SPOOL_SIZE);
+
+	for (i = 0; i < 10; i++) {
+		append_samples(DEVICE_A, i, 1);
+		if (i % 2)
+			append_samples(DEVICE_B, i / 2, 1);
+	}
+
+	store_close();
+	g_assert_cmpuint(store_pending(DEVICE_A), ==, 0);
+	g_assert_cmpint(store_open(spool_dir, SPOOL_SIZE), ==, 0);
+
+	g_assert_cmpuint(store_pending(DEVICE_A), ==, 10);
+	g_assert_cmpuint(store_pending(DEVICE_B), ==, 5);
+	check_samples(DEVICE_A, 0, 10);
+	check_samples(DEVICE_B, 0, 5);
+
+	spool_teardown();
+}
+
+/* Flips a byte of the value of a record, as a torn write would */
+static void corrupt_record(unsigned int index)
+{
+	size_t record_size;
+	struct stat st;
+	char *name;
+	uint8_t byte;
+	off_t offset;
+	int fd;
+
+	name = l_strdup_printf("%s/%08x.seg", spool_dir, 0);
+	fd = open(name, O_RDWR);
+	g_assert_cmpint(fd, >=, 0);
+	g_assert_cmpint(fstat(fd, &st), ==, 0);
+
+	record_size = (st.st_size - HEADER_SIZE) / SEGMENT_RECORDS;
+	offset = HEADER_SIZE + (index + 1) * record_size - 1;
+
+	g_assert_cmpint(pread(fd, &byte, 1, offset), ==, 1);
+	byte ^= 0xff;
+	g_assert_cmpint(pwrite(fd, &byte, 1, offset), ==, 1);
+
+	close(fd);
+	l_free(name);
+}
+
+static void recover_test(void)
+{
+	spool_setup(SPOOL_SIZE);
+
+	append_samples(DEVICE_A, 0, 3);
+	store_close();
+
+	/* Nothing after a damaged record is trusted */
+	corrupt_record(1);
+	g_assert_cmpint(store_open(spool_dir, SPOOL_SIZE), ==, 0);
+	g_assert_cmpuint(store_pending(DEVICE_A), ==, 1);
+	check_samples(DEVICE_A, 0, 1);
+
+	/* Appended over the discarded records */
+	append_samples(DEVICE_A, 1, 1);
+	store_close();
+	g_assert_cmpint(store_open(spool_dir, SPOOL_SIZE), ==, 0);
+	g_assert_cmpuint(store_pending(DEVICE_A), ==, 2);
+	check_samples(DEVICE_A, 0, 2);
+
+	spool_teardown();
+}
+
+static void evict_test(void)
+{
+	/* Smallest log: two segments */
+	spool_setup(0);
+
+	append_samples(DEVICE_A, 0, 2 * SEGMENT_RECORDS);
+	g_assert_true(segment_exists(0));
+	g_assert_cmpuint(store_pending(DEVICE_A), ==, 2 * SEGMENT_RECORDS);
+
+	/* A third segment evicts the oldest one */
+	append_samples(DEVICE_A, 2 * SEGMENT_RECORDS, 1);
+	g_assert_false(segment_exists(0));
+	g_assert_true(segment_exists(1));
+	g_assert_true(segment_exists(2));
+	g_assert_cmpuint(store_pending(DEVICE_A), ==, SEGMENT_RECORDS + 1);
+	check_samples(DEVICE_A, SEGMENT_RECORDS, SEGMENT_RECORDS + 1);
+
+	spool_teardown();
+}
+
+static void consume_test(void)
+{
+	unsigned int total = SEGMENT_RECORDS + SEGMENT_RECORDS / 2;
+	unsigned int next = 0;
+	unsigned int count;
+
+	spool_setup(SPOOL_SIZE);
+
+	/* Keeps the first segment while the other device is consumed */
+	append_samples(DEVICE_B, 0, 1);
+	append_samples(DEVICE_A, 0, total);
+
+	while (next < total) {
+		count = store_pending(DEVICE_A) < 100 ?
+					store_pending(DEVICE_A) : 100;
+		check_samples(DEVICE_A, next, count);
+		store_consume(DEVICE_A, count);
+		next += count;
+	}
+
+	g_assert_cmpuint(store_pending(DEVICE_A), ==, 0);
+	g_assert_true(segment_exists(0));
+
+	/* Consumed segments are removed, except the one being appended */
+	check_samples(DEVICE_B, 0, 1);
+	store_consume(DEVICE_B, 1);
+	g_assert_false(segment_exists(0));
+	g_assert_true(segment_exists(1));
+
+	/* Consumed records are not replayed after a restart */
+	store_close();
+	g_assert_cmpint(store_open(spool_dir, SPOOL_SIZE), ==, 0);
+	g_assert_cmpuint(store_pending(DEVICE_A), ==, 0);
+	g_assert_cmpuint(store_pending(DEVICE_B), ==, 0);
+
+	spool_teardown();
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/store/reopen", reopen_test);
+	g_test_add_func("/store/recover", recover_test);
+	g_test_add_func("/store/evict", evict_test);
+	g_test_add_func("/store/consume", consume_test);
+
+	return g_test_run();
+}